@@ -0,0 +1,340 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+// Headless benchmark of the server's game simulation.
+//
+// Generates a map with ServerMap::GenerateRandomMap() for the given seed, spawns an army
+// for each player, and then advances the simulation as fast as possible, without any
+// client connections. Scripted players keep their villagers busy gathering resources,
+// keep their town centers producing villagers, and periodically send their armies against
+// the next player's town center. Since the map generation and the scripts are deterministic,
+// runs with the same arguments simulate the same game.
+//
+// Alternatively, a replay that was recorded by the server (with --record-replays) can be
+// played back instead of running the scripts. The recorded game then gets simulated as fast
+// as possible, which allows to profile real games and to investigate issues that occurred in them.
+//
+// At the end, the per-game-step time percentiles and the per-subsystem breakdown
+// recorded with the Timing facility are printed.
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <QCoreApplication>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/game_data.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/timing.hpp"
+#include "FreeAge/common/util.hpp"
+#include "FreeAge/server/building.hpp"
+#include "FreeAge/server/game.hpp"
+#include "FreeAge/server/replay.hpp"
+#include "FreeAge/server/settings.hpp"
+#include "FreeAge/server/unit.hpp"
+
+/// Number of militia that get spawned for each player at the start.
+constexpr int kArmySize = 30;
+
+/// The scripted players issue new commands in this interval.
+constexpr int kCommandIntervalSteps = 30;
+
+/// The scripted players send their armies to attack in this interval.
+constexpr int kAttackIntervalSteps = 10 * kCommandIntervalSteps;
+
+static ServerBuilding* FindTownCenter(ServerMap* map, int playerIndex, u32* id) {
+  const ServerObjectStore& objects = map->GetObjects();
+  for (usize i = 0; i < objects.GetBuildings().size(); ++ i) {
+    ServerBuilding* building = objects.GetBuildings()[i];
+    if (building->GetPlayerIndex() == playerIndex &&
+        building->GetType() == BuildingType::TownCenter) {
+      *id = objects.GetBuildingIds()[i];
+      return building;
+    }
+  }
+  return nullptr;
+}
+
+/// Lets the player's idle villagers gather from the closest resource,
+/// and keeps the player's town center producing villagers.
+static void RunEconomyScript(Game* game, PlayerInGame* player) {
+  ServerMap* map = game->GetMap();
+  const ServerObjectStore& objects = map->GetObjects();
+  
+  for (usize unitIndex = 0; unitIndex < objects.GetUnits().size(); ++ unitIndex) {
+    ServerUnit* villager = objects.GetUnits()[unitIndex];
+    if (villager->GetPlayerIndex() != player->index ||
+        !IsVillager(villager->GetType()) ||
+        villager->GetTargetObjectId() != kInvalidObjectId ||
+        villager->HasMoveToTarget()) {
+      continue;
+    }
+    
+    Fixed bestSquaredDistance = Fixed::Max();
+    u32 bestResourceId = kInvalidObjectId;
+    for (usize buildingIndex = 0; buildingIndex < objects.GetBuildings().size(); ++ buildingIndex) {
+      ServerBuilding* resource = objects.GetBuildings()[buildingIndex];
+      if (resource->GetPlayerIndex() != kGaiaPlayerIndex) {
+        continue;
+      }
+      InteractionType interaction = GetInteractionType(villager, resource);
+      if (interaction != InteractionType::CollectBerries &&
+          interaction != InteractionType::CollectWood &&
+          interaction != InteractionType::CollectGold &&
+          interaction != InteractionType::CollectStone) {
+        continue;
+      }
+      
+      Fixed squaredDistance = SquaredDistance(FixedPoint(resource->GetBaseTile().x(), resource->GetBaseTile().y()), villager->GetMapCoord());
+      if (squaredDistance < bestSquaredDistance) {
+        bestSquaredDistance = squaredDistance;
+        bestResourceId = objects.GetBuildingIds()[buildingIndex];
+      }
+    }
+    
+    if (bestResourceId != kInvalidObjectId) {
+      game->HandleHeadlessClientMessages(player, CreateSetTargetMessage({objects.GetUnitIds()[unitIndex]}, bestResourceId));
+    }
+  }
+  
+  u32 townCenterId;
+  ServerBuilding* townCenter = FindTownCenter(map, player->index, &townCenterId);
+  if (townCenter && townCenter->GetProductionQueue().size() < 2) {
+    game->HandleHeadlessClientMessages(player, CreateProduceUnitMessage(townCenterId, static_cast<u16>(UnitType::MaleVillager)));
+  }
+}
+
+/// Sends the player's military units to attack the next player's town center.
+static void RunArmyScript(Game* game, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
+  ServerMap* map = game->GetMap();
+  const ServerObjectStore& objects = map->GetObjects();
+  
+  u32 targetId = kInvalidObjectId;
+  for (usize offset = 1; offset < players.size(); ++ offset) {
+    const auto& enemy = players[(player->index + offset) % players.size()];
+    if (enemy->isConnected && FindTownCenter(map, enemy->index, &targetId)) {
+      break;
+    }
+    targetId = kInvalidObjectId;
+  }
+  if (targetId == kInvalidObjectId) {
+    return;
+  }
+  
+  std::vector<u32> armyIds;
+  for (usize unitIndex = 0; unitIndex < objects.GetUnits().size(); ++ unitIndex) {
+    ServerUnit* unit = objects.GetUnits()[unitIndex];
+    if (unit->GetPlayerIndex() == player->index &&
+        !IsVillager(unit->GetType())) {
+      armyIds.push_back(objects.GetUnitIds()[unitIndex]);
+    }
+  }
+  if (!armyIds.empty()) {
+    game->HandleHeadlessClientMessages(player, CreateSetTargetMessage(armyIds, targetId));
+  }
+}
+
+static double GetPercentile(const std::vector<double>& sortedValues, double percentile) {
+  if (sortedValues.empty()) {
+    return 0;
+  }
+  usize index = std::min<usize>(sortedValues.size() - 1, static_cast<usize>(percentile / 100. * sortedValues.size()));
+  return sortedValues[index];
+}
+
+int main(int argc, char** argv) {
+  // Initialize loguru.
+  loguru::g_preamble_date = false;
+  loguru::g_preamble_thread = false;
+  loguru::g_preamble_uptime = false;
+  loguru::g_stderr_verbosity = loguru::Verbosity_WARNING;
+  if (argc > 0) {
+    loguru::init(argc, argv, /*verbosity_flag*/ nullptr);
+  }
+  
+  QCoreApplication qapp(argc, argv);
+  
+  // Parse command line arguments.
+  if (argc < 2 || argc > 5) {
+    LOG(ERROR) << "Usage: FreeAgeServerBenchmark <game_data_path> [<player_count> [<game_step_count> [<map_seed>]]]";
+    LOG(ERROR) << "       FreeAgeServerBenchmark <game_data_path> --replay <replay_path>";
+    return 1;
+  }
+  bool playReplay = argc == 4 && argv[2] == std::string("--replay");
+  ReplayReader replay;
+  int playerCount;
+  int gameStepCount;
+  int mapSeed;
+  if (playReplay) {
+    if (!replay.Open(argv[3])) {
+      return 1;
+    }
+    playerCount = replay.GetHeader().players.size();
+    gameStepCount = std::numeric_limits<int>::max();  // the replay's GameEnd record determines the end
+    mapSeed = replay.GetHeader().mapSeed;
+  } else {
+    playerCount = (argc > 2) ? std::stoi(argv[2]) : 4;
+    gameStepCount = (argc > 3) ? std::stoi(argv[3]) : 3000;
+    mapSeed = (argc > 4) ? std::stoi(argv[4]) : 0;
+    if (playerCount < 2 || playerCount > 8 || gameStepCount < 1) {
+      LOG(ERROR) << "The player count must be in [2, 8] and the game step count must be positive.";
+      return 1;
+    }
+  }
+  
+  if (!GameData::initialize(argv[1])) {
+    LOG(ERROR) << "Failed to load the game data from: " << argv[1];
+    return 1;
+  }
+  
+  // Set up the players. They do not have connections.
+  ServerSettings settings;
+  settings.serverStartTime = Clock::now();
+  if (playReplay) {
+    settings.mapSize = replay.GetHeader().mapSize;
+  }
+  
+  std::vector<std::shared_ptr<PlayerInGame>> playersInGame;
+  for (int playerIndex = 0; playerIndex < playerCount; ++ playerIndex) {
+    std::shared_ptr<PlayerInGame> newPlayer(new PlayerInGame());
+    
+    newPlayer->index = playerIndex;
+    newPlayer->socket = nullptr;
+    newPlayer->name = QString("Benchmark player %1").arg(playerIndex);
+    newPlayer->playerColorIndex = playerIndex;
+    newPlayer->lastPingTime = Clock::now();
+    newPlayer->finishedLoading = true;
+    
+    if (playReplay) {
+      const ReplayHeader::Player& replayPlayer = replay.GetHeader().players[playerIndex];
+      newPlayer->name = replayPlayer.name;
+      newPlayer->playerColorIndex = replayPlayer.playerColorIndex;
+      newPlayer->resources = replayPlayer.initialResources;
+    } else {
+      newPlayer->resources.wood() = 100000;
+      newPlayer->resources.food() = 100000;
+      newPlayer->resources.gold() = 100000;
+      newPlayer->resources.stone() = 100000;
+    }
+    newPlayer->lastResources = newPlayer->resources;
+    
+    playersInGame.emplace_back(newPlayer);
+  }
+  
+  Game game(&settings);
+  game.StartHeadlessGame(&playersInGame, mapSeed, playReplay ? replay.GetHeader().gameBeginServerTime : 0);
+  
+  // Spawn the armies (unless playing back a replay, which starts with the normal map content).
+  if (!playReplay) {
+    for (const auto& player : playersInGame) {
+      u32 townCenterId;
+      if (FindTownCenter(game.GetMap(), player->index, &townCenterId)) {
+        for (int i = 0; i < kArmySize; ++ i) {
+          game.SpawnUnit(townCenterId, UnitType::Militia);
+        }
+      }
+    }
+  }
+  
+  // Only measure the simulation itself, not the setup above.
+  Timing::reset();
+  
+  std::vector<double> gameStepSeconds;
+  gameStepSeconds.reserve(gameStepCount);
+  usize maxObjectCount = 0;
+  
+  ReplayRecord nextRecord;
+  bool haveNextRecord = playReplay && replay.ReadRecord(&nextRecord);
+  int checksumsVerified = 0;
+  int checksumMismatches = 0;
+  
+  for (int step = 0; step < gameStepCount && !game.ShouldExit(); ++ step) {
+    if (playReplay) {
+      // Apply the recorded player commands for this game step. If the replay is
+      // incomplete (for example, because the server crashed), stop after its last record.
+      while (haveNextRecord &&
+             nextRecord.type != ReplayRecordType::GameEnd &&
+             nextRecord.gameStep <= static_cast<u32>(step)) {
+        if (nextRecord.type == ReplayRecordType::StateChecksum) {
+          // Verify that the playback did not diverge from the recorded game.
+          if (game.GetStateChecksum() == nextRecord.stateChecksum) {
+            ++ checksumsVerified;
+          } else {
+            if (checksumMismatches == 0) {
+              LOG(ERROR) << "The state checksum differs from the recorded one before game step " << step << " (desync)";
+            }
+            ++ checksumMismatches;
+          }
+        } else if (nextRecord.playerIndex >= playersInGame.size()) {
+          LOG(ERROR) << "Invalid player index in replay record: " << static_cast<int>(nextRecord.playerIndex);
+        } else if (nextRecord.type == ReplayRecordType::ClientMessage) {
+          game.HandleHeadlessClientMessages(playersInGame[nextRecord.playerIndex].get(), nextRecord.message);
+        } else if (nextRecord.type == ReplayRecordType::PlayerExit) {
+          game.HandleHeadlessPlayerExit(playersInGame[nextRecord.playerIndex].get(), nextRecord.exitReason);
+        }
+        haveNextRecord = replay.ReadRecord(&nextRecord);
+      }
+      if (!haveNextRecord ||
+          (nextRecord.type == ReplayRecordType::GameEnd && nextRecord.gameStep <= static_cast<u32>(step))) {
+        break;
+      }
+    }
+    
+    // Run the player scripts.
+    if (!playReplay && step % kCommandIntervalSteps == 0) {
+      for (const auto& player : playersInGame) {
+        if (player->isConnected) {
+          RunEconomyScript(&game, player.get());
+        }
+      }
+    }
+    if (!playReplay && step % kAttackIntervalSteps == 0) {
+      for (const auto& player : playersInGame) {
+        if (player->isConnected) {
+          RunArmyScript(&game, player.get(), playersInGame);
+        }
+      }
+    }
+    
+    // Simulate the game step.
+    Timer gameStepTimer("SimulateGameStep()");
+    game.SimulateHeadlessGameStep();
+    gameStepSeconds.push_back(gameStepTimer.Stop());
+    
+    maxObjectCount = std::max(maxObjectCount, game.GetMap()->GetObjects().size());
+  }
+  
+  // Report the results.
+  std::vector<double> sortedGameStepSeconds = gameStepSeconds;
+  std::sort(sortedGameStepSeconds.begin(), sortedGameStepSeconds.end());
+  double totalSeconds = 0;
+  for (double seconds : gameStepSeconds) {
+    totalSeconds += seconds;
+  }
+  
+  if (playReplay) {
+    std::cout << "Played back replay: " << argv[3] << " (state checksums verified: " << checksumsVerified
+              << ", mismatches: " << checksumMismatches << ")" << std::endl;
+  }
+  std::cout << "Simulated game steps: " << gameStepSeconds.size()
+            << " (players: " << playerCount << ", map seed: " << mapSeed
+            << ", map size: " << settings.mapSize << ", max objects: " << maxObjectCount << ")" << std::endl;
+  std::cout << "Total simulation time: " << Timing::secondsToTimeString(totalSeconds) << std::endl;
+  std::cout << "Game step time percentiles (milliseconds):" << std::endl;
+  for (double percentile : {50., 90., 99., 99.9, 100.}) {
+    std::cout << "  p" << percentile << ": " << (1000 * GetPercentile(sortedGameStepSeconds, percentile)) << std::endl;
+  }
+  std::cout << "Budget per game step (milliseconds): " << (1000 * Game::kSimulationTimeInterval) << std::endl;
+  std::cout << "Message bytes that would have been sent: " << game.GetHeadlessMessageBytes() << std::endl;
+  std::cout << "Final state checksum: " << std::hex << game.GetStateChecksum() << std::dec << std::endl;
+  std::cout << std::endl;
+  Timing::print(std::cout, kSortByTotal);
+  
+  return 0;
+}
@@ -0,0 +1,607 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/bot/bot_client.hpp"
+
+#include <limits>
+
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/object_types.hpp"
+#include "FreeAge/common/util.hpp"
+
+#include <mango/core/endian.hpp>
+
+/// The bot sends pings in this interval (in milliseconds), like the FreeAge client.
+constexpr int kPingIntervalMilliseconds = 500;
+
+/// Villagers that were sent to construct a building do not get new economic commands for this time (in seconds).
+constexpr double kBuilderBusySeconds = 30;
+
+/// If the bot is housed, it attempts to place a house in this interval (in seconds).
+constexpr double kHouseIntervalSeconds = 20;
+
+/// The bot keeps this many items in the production queues of its buildings.
+constexpr int kProductionQueueTarget = 2;
+
+/// Costs of the things that the bot produces. The bot does not load the game data, so these
+/// are only used to avoid sending commands that the server would reject anyway.
+static const ResourceAmount kVillagerCost(0, 50, 0, 0);
+static const ResourceAmount kMilitiaCost(0, 60, 20, 0);
+static const ResourceAmount kHouseCost(25, 0, 0, 0);
+static const ResourceAmount kBarracksCost(175, 0, 0, 0);
+
+/// Resource types that the bot's villagers gather, assigned in turn to the villagers.
+static const ResourceType kGatherOrder[] = {
+  ResourceType::Food,
+  ResourceType::Wood,
+  ResourceType::Wood,
+  ResourceType::Gold,
+  ResourceType::Food,
+  ResourceType::Stone,
+};
+
+/// Returns whether the given building type is a resource of the given type.
+/// This does not use the game data (in contrast to IsTree()), since the bot does not load it.
+static bool IsResourceOfType(BuildingType buildingType, ResourceType resourceType) {
+  switch (resourceType) {
+  case ResourceType::Wood:
+    return buildingType >= BuildingType::FirstTree && buildingType <= BuildingType::LastTree;
+  case ResourceType::Food:
+    return buildingType == BuildingType::ForageBush;
+  case ResourceType::Gold:
+    return buildingType == BuildingType::GoldMine;
+  case ResourceType::Stone:
+    return buildingType == BuildingType::StoneMine;
+  default:
+    return false;
+  }
+}
+
+static TimePoint AddSeconds(const TimePoint& timePoint, double seconds) {
+  return timePoint + std::chrono::duration_cast<Clock::duration>(SecondsDuration(seconds));
+}
+
+
+void BotStatistics::Add(const BotStatistics& other) {
+  pingMilliseconds.insert(pingMilliseconds.end(), other.pingMilliseconds.begin(), other.pingMilliseconds.end());
+  messageLatencyMilliseconds.insert(messageLatencyMilliseconds.end(), other.messageLatencyMilliseconds.begin(), other.messageLatencyMilliseconds.end());
+  bytesReceived += other.bytesReceived;
+  commandsSent += other.commandsSent;
+}
+
+void BotStatistics::Clear() {
+  pingMilliseconds.clear();
+  messageLatencyMilliseconds.clear();
+  bytesReceived = 0;
+  commandsSent = 0;
+}
+
+
+BotClient::BotClient(const QString& name, const QByteArray& matchToken, bool isHost, int playerCount, const BotBehavior& behavior, u32 randomSeed)
+    : name(name),
+      matchToken(matchToken),
+      isHost(isHost),
+      playerCount(playerCount),
+      behavior(behavior),
+      creationTime(Clock::now()),
+      randomEngine(randomSeed) {}
+
+BotClient::~BotClient() {
+  delete socket;
+}
+
+void BotClient::Connect(const QString& serverAddress) {
+  socket = new QTcpSocket();
+  socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+  socket->connectToHost(serverAddress, serverPort, QIODevice::ReadWrite, QAbstractSocket::IPv4Protocol);
+  state = State::Connecting;
+}
+
+void BotClient::Update() {
+  if (state == State::Finished || !socket) {
+    return;
+  }
+  
+  if (socket->state() != QAbstractSocket::ConnectedState) {
+    if (state != State::Connecting || socket->state() == QAbstractSocket::UnconnectedState) {
+      LOG(WARNING) << "Bot " << name.toStdString() << ": The connection was lost";
+      state = State::Finished;
+    }
+    return;
+  }
+  
+  TimePoint now = Clock::now();
+  
+  if (!sentConnectMessage) {
+    socket->write(isHost ? CreateHostConnectMessage(matchToken, name) : CreateConnectMessage(matchToken, name));
+    sentConnectMessage = true;
+    lastPingTime = now;
+  }
+  
+  // Handle the received messages.
+  QByteArray data = socket->readAll();
+  statistics.bytesReceived += data.size();
+  unparsedBuffer.Append(data);
+  QByteArray msg;
+  while (state != State::Finished && unparsedBuffer.TakeMessage(&msg)) {
+    HandleMessage(msg);
+  }
+  if (state == State::Finished) {
+    return;
+  }
+  
+  // Send a ping if it is due.
+  if (MillisecondsDuration(now - lastPingTime).count() >= kPingIntervalMilliseconds) {
+    sentPingTimes[nextPingNumber] = GetLocalTime();
+    socket->write(CreatePingMessage(nextPingNumber));
+    ++ nextPingNumber;
+    lastPingTime = now;
+  }
+  
+  // Issue the in-game commands that are due.
+  if (state == State::Playing) {
+    if (now >= nextEconomyTime) {
+      RunEconomyCommands();
+      nextEconomyTime = AddSeconds(now, behavior.economyIntervalSeconds);
+    }
+    if (now >= nextMilitaryTime) {
+      RunMilitaryCommands();
+      nextMilitaryTime = AddSeconds(now, behavior.militaryIntervalSeconds);
+    }
+  }
+  
+  socket->flush();
+}
+
+void BotClient::Leave() {
+  if (state == State::Finished) {
+    return;
+  }
+  if (socket) {
+    if (socket->state() == QAbstractSocket::ConnectedState) {
+      socket->write(CreateLeaveMessage());
+      socket->waitForBytesWritten(200);
+    }
+    socket->disconnectFromHost();
+  }
+  state = State::Finished;
+}
+
+void BotClient::HandleMessage(const QByteArray& msg) {
+  ServerToClientMessage msgType = static_cast<ServerToClientMessage>(msg.at(0));
+  const char* data = msg.data();
+  
+  switch (msgType) {
+  case ServerToClientMessage::Welcome:
+    HandleWelcomeMessage(msg);
+    break;
+  case ServerToClientMessage::GameAborted:
+    LOG(WARNING) << "Bot " << name.toStdString() << ": The game was aborted";
+    state = State::Finished;
+    break;
+  case ServerToClientMessage::PlayerList:
+    HandlePlayerListMessage(msg);
+    break;
+  case ServerToClientMessage::PingResponse:
+    HandlePingResponseMessage(msg);
+    break;
+  case ServerToClientMessage::StartGameBroadcast:
+    // The bot does not need to load anything.
+    socket->write(CreateLoadingProgressMessage(100));
+    socket->write(CreateLoadingFinishedMessage());
+    state = State::Loading;
+    break;
+  case ServerToClientMessage::GameBegin:
+    HandleGameBeginMessage(msg);
+    break;
+  case ServerToClientMessage::AddObject:
+    HandleAddObjectMessage(msg);
+    break;
+  case ServerToClientMessage::GameStepTime:
+    HandleGameStepTimeMessage(msg);
+    break;
+  case ServerToClientMessage::ResourcesUpdate:
+    if (msg.size() >= 3 + 16) {
+      resources = ResourceAmount(mango::uload32(data + 3), mango::uload32(data + 7), mango::uload32(data + 11), mango::uload32(data + 15));
+    }
+    break;
+  case ServerToClientMessage::ChangeUnitType:
+    if (msg.size() >= 3 + 6) {
+      auto it = objects.find(mango::uload32(data + 3));
+      if (it != objects.end()) {
+        it->second.type = mango::uload16(data + 7);
+      }
+    }
+    break;
+  case ServerToClientMessage::ObjectStateDelta:
+    HandleObjectStateDeltaMessage(msg);
+    break;
+  case ServerToClientMessage::ObjectDeath:
+  case ServerToClientMessage::ObjectLeftView:
+    if (msg.size() >= 3 + 4) {
+      u32 objectId = mango::uload32(data + 3);
+      objects.erase(objectId);
+      productionQueueSizes.erase(objectId);
+      villagerTargets.erase(objectId);
+      builderBusyUntil.erase(objectId);
+    }
+    break;
+  case ServerToClientMessage::PlayerLeaveBroadcast:
+    HandlePlayerLeaveBroadcastMessage(msg);
+    break;
+  case ServerToClientMessage::QueueUnit:
+    if (msg.size() >= 3 + 6) {
+      ++ productionQueueSizes[mango::uload32(data + 3)];
+    }
+    break;
+  case ServerToClientMessage::RemoveFromProductionQueue:
+    if (msg.size() >= 3 + 5) {
+      int& queueSize = productionQueueSizes[mango::uload32(data + 3)];
+      queueSize = std::max(0, queueSize - 1);
+    }
+    break;
+  case ServerToClientMessage::SetHoused:
+    if (msg.size() >= 3 + 1) {
+      isHoused = data[3] > 0;
+    }
+    break;
+  case ServerToClientMessage::GameResync:
+    objects.clear();
+    productionQueueSizes.clear();
+    break;
+  default:
+    // The remaining messages (chat, map content, production progress, etc.) are not relevant for the bot.
+    break;
+  }
+}
+
+void BotClient::HandleWelcomeMessage(const QByteArray& msg) {
+  state = State::InLobby;
+  
+  if (msg.size() >= 3 + 4) {
+    u32 serverProtocolVersion = mango::uload32(msg.data() + 3);
+    if (serverProtocolVersion != networkProtocolVersion) {
+      LOG(ERROR) << "Bot " << name.toStdString() << ": The server uses a different network protocol version (" << serverProtocolVersion << ") than the bot (" << networkProtocolVersion << ")";
+    }
+  }
+  
+  if (isHost) {
+    if (behavior.mapSize > 0) {
+      socket->write(CreateSettingsUpdateMessage(/*allowMorePlayersToJoin*/ true, behavior.mapSize, /*isBroadcast*/ false));
+    }
+  } else {
+    socket->write(CreateReadyUpMessage(true));
+  }
+}
+
+void BotClient::HandlePlayerListMessage(const QByteArray& msg) {
+  if (msg.size() < 4) {
+    return;
+  }
+  playerIndex = static_cast<u8>(msg.data()[3]);
+  
+  // Parse the player entries (u16 name length, name, u16 color index, u8 ready state).
+  int joinedPlayerCount = 0;
+  bool allOtherPlayersReady = true;
+  int offset = 4;
+  while (offset + 2 <= msg.size()) {
+    int nameLength = mango::uload16(msg.data() + offset);
+    offset += 2 + nameLength + 2;
+    if (offset + 1 > msg.size()) {
+      break;
+    }
+    bool isReady = msg.data()[offset] > 0;
+    offset += 1;
+    
+    if (joinedPlayerCount != playerIndex && !isReady) {
+      allOtherPlayersReady = false;
+    }
+    ++ joinedPlayerCount;
+  }
+  
+  // As host, start the game once all expected players joined and readied up.
+  if (isHost && !sentStartGame && joinedPlayerCount >= playerCount && allOtherPlayersReady) {
+    socket->write(CreateReadyUpMessage(true));
+    socket->write(CreateStartGameMessage());
+    sentStartGame = true;
+  }
+}
+
+void BotClient::HandlePingResponseMessage(const QByteArray& msg) {
+  if (msg.size() < 3 + 16) {
+    return;
+  }
+  double receiveTime = GetLocalTime();
+  u64 number = mango::uload64(msg.data() + 3);
+  double serverTime;
+  memcpy(&serverTime, msg.data() + 3 + 8, 8);
+  
+  auto it = sentPingTimes.find(number);
+  if (it == sentPingTimes.end()) {
+    return;
+  }
+  double sendTime = it->second;
+  sentPingTimes.erase(it);
+  
+  double pingSeconds = receiveTime - sendTime;
+  statistics.pingMilliseconds.push_back(1000 * pingSeconds);
+  
+  // Assuming that the response was sent halfway through the round trip, the ping with the
+  // lowest round-trip time gives the most accurate estimate of the server time offset.
+  if (lowestPingSeconds < 0 || pingSeconds < lowestPingSeconds) {
+    lowestPingSeconds = pingSeconds;
+    serverTimeOffset = serverTime - 0.5 * (sendTime + receiveTime);
+  }
+}
+
+void BotClient::HandleGameBeginMessage(const QByteArray& msg) {
+  if (msg.size() < 3 + 36) {
+    LOG(ERROR) << "Bot " << name.toStdString() << ": Received a too short GameBegin message";
+    return;
+  }
+  const char* data = msg.data();
+  resources = ResourceAmount(mango::uload32(data + 19), mango::uload32(data + 23), mango::uload32(data + 27), mango::uload32(data + 31));
+  mapWidth = mango::uload16(data + 35);
+  mapHeight = mango::uload16(data + 37);
+  
+  // Spread the first military commands of the bots over the military interval.
+  TimePoint now = Clock::now();
+  nextEconomyTime = now;
+  nextMilitaryTime = AddSeconds(now, std::uniform_real_distribution<double>(0, behavior.militaryIntervalSeconds)(randomEngine));
+  nextHouseTime = now;
+  state = State::Playing;
+}
+
+void BotClient::HandleGameStepTimeMessage(const QByteArray& msg) {
+  if (msg.size() < 3 + 8 || lowestPingSeconds < 0) {
+    return;
+  }
+  double gameStepServerTime;
+  memcpy(&gameStepServerTime, msg.data() + 3, 8);
+  
+  double serverTimeNow = GetLocalTime() + serverTimeOffset;
+  statistics.messageLatencyMilliseconds.push_back(1000 * (serverTimeNow - gameStepServerTime));
+}
+
+void BotClient::HandleAddObjectMessage(const QByteArray& msg) {
+  if (msg.size() < 23) {
+    return;
+  }
+  const char* data = msg.data();
+  
+  KnownObject object;
+  object.isBuilding = static_cast<ObjectType>(data[3]) == ObjectType::Building;
+  u32 objectId = mango::uload32(data + 4);
+  object.playerIndex = static_cast<u8>(data[8]);
+  object.type = mango::uload16(data + 13);
+  if (object.isBuilding) {
+    object.position = QPointF(mango::uload16(data + 15), mango::uload16(data + 17));
+    memcpy(&object.buildPercentage, data + 19, 4);
+  } else {
+    float x;
+    float y;
+    memcpy(&x, data + 15, 4);
+    memcpy(&y, data + 19, 4);
+    object.position = QPointF(x, y);
+    object.buildPercentage = 100;
+  }
+  objects[objectId] = object;
+}
+
+void BotClient::HandleObjectStateDeltaMessage(const QByteArray& msg) {
+  const char* cursor = msg.data() + 3;
+  const char* end = msg.data() + msg.size();
+  u32 objectId = 0;
+  while (cursor < end) {
+    u32 objectIdDifference;
+    ObjectStateDelta delta;
+    if (!ReadObjectStateDeltaEntry(&cursor, end, &objectIdDifference, &delta)) {
+      LOG(ERROR) << "Bot " << name.toStdString() << ": Received an invalid ObjectStateDelta message";
+      return;
+    }
+    objectId += objectIdDifference;
+    
+    auto it = objects.find(objectId);
+    if (it == objects.end()) {
+      continue;
+    }
+    if (delta.fields & kObjectStateMovement) {
+      it->second.position = delta.GetStartPoint();
+    }
+    if (delta.fields & kObjectStateBuildPercentage) {
+      it->second.buildPercentage = delta.GetBuildPercentage();
+    }
+  }
+}
+
+void BotClient::HandlePlayerLeaveBroadcastMessage(const QByteArray& msg) {
+  if (msg.size() < 3 + 2) {
+    return;
+  }
+  int leavingPlayerIndex = static_cast<u8>(msg.data()[3]);
+  if (leavingPlayerIndex == playerIndex) {
+    LOG(INFO) << "Bot " << name.toStdString() << ": Left the game (reason: " << static_cast<int>(msg.data()[4]) << ")";
+    state = State::Finished;
+  }
+}
+
+void BotClient::RunEconomyCommands() {
+  TimePoint now = Clock::now();
+  
+  u32 idleVillagerId = kInvalidObjectId;
+  int villagerIndex = 0;
+  for (const auto& item : objects) {
+    u32 objectId = item.first;
+    const KnownObject& object = item.second;
+    if (object.playerIndex != playerIndex) {
+      continue;
+    }
+    
+    if (object.isBuilding) {
+      // Keep the town center producing villagers.
+      if (static_cast<BuildingType>(object.type) == BuildingType::TownCenter &&
+          object.buildPercentage >= 100 &&
+          productionQueueSizes[objectId] < kProductionQueueTarget &&
+          resources.CanAfford(kVillagerCost)) {
+        SendCommand(CreateProduceUnitMessage(objectId, static_cast<u16>(UnitType::MaleVillager)));
+      }
+      continue;
+    }
+    
+    if (!IsVillager(static_cast<UnitType>(object.type))) {
+      continue;
+    }
+    ++ villagerIndex;
+    
+    auto builderIt = builderBusyUntil.find(objectId);
+    if (builderIt != builderBusyUntil.end()) {
+      if (now < builderIt->second) {
+        continue;
+      }
+      builderBusyUntil.erase(builderIt);
+    }
+    idleVillagerId = objectId;
+    
+    // Let the villager gather if it does not have a resource that still exists.
+    auto targetIt = villagerTargets.find(objectId);
+    if (targetIt != villagerTargets.end() && objects.count(targetIt->second) > 0) {
+      continue;
+    }
+    ResourceType resourceType = kGatherOrder[villagerIndex % (sizeof(kGatherOrder) / sizeof(kGatherOrder[0]))];
+    u32 resourceId = FindClosestResource(resourceType, object.position);
+    if (resourceId == kInvalidObjectId) {
+      resourceId = FindClosestResource(ResourceType::Wood, object.position);
+    }
+    if (resourceId != kInvalidObjectId) {
+      SendCommand(CreateSetTargetMessage({objectId}, resourceId));
+      villagerTargets[objectId] = resourceId;
+    }
+  }
+  
+  // Build a house if the bot is housed.
+  if (isHoused && now >= nextHouseTime && idleVillagerId != kInvalidObjectId && resources.CanAfford(kHouseCost)) {
+    PlaceBuildingNearTownCenter(BuildingType::House, idleVillagerId);
+    nextHouseTime = AddSeconds(now, kHouseIntervalSeconds);
+  }
+}
+
+void BotClient::RunMilitaryCommands() {
+  std::vector<u32> armyIds;
+  QPointF armyCenter(0, 0);
+  bool haveBarracks = false;
+  u32 builderId = kInvalidObjectId;
+  
+  for (const auto& item : objects) {
+    u32 objectId = item.first;
+    const KnownObject& object = item.second;
+    if (object.playerIndex != playerIndex) {
+      continue;
+    }
+    
+    if (object.isBuilding) {
+      if (static_cast<BuildingType>(object.type) == BuildingType::Barracks) {
+        haveBarracks = true;
+        
+        // Keep the barracks producing militia.
+        if (object.buildPercentage >= 100 &&
+            productionQueueSizes[objectId] < kProductionQueueTarget &&
+            resources.CanAfford(kMilitiaCost)) {
+          SendCommand(CreateProduceUnitMessage(objectId, static_cast<u16>(UnitType::Militia)));
+        }
+      }
+    } else if (IsVillager(static_cast<UnitType>(object.type))) {
+      if (builderBusyUntil.count(objectId) == 0) {
+        builderId = objectId;
+      }
+    } else {
+      armyIds.push_back(objectId);
+      armyCenter += object.position;
+    }
+  }
+  
+  if (!haveBarracks && builderId != kInvalidObjectId && resources.CanAfford(kBarracksCost)) {
+    PlaceBuildingNearTownCenter(BuildingType::Barracks, builderId);
+  }
+  
+  if (armyIds.empty()) {
+    return;
+  }
+  armyCenter /= armyIds.size();
+  
+  // Attack the closest enemy object, or explore a random location if no enemy is known.
+  u32 targetId = kInvalidObjectId;
+  float targetSquaredDistance = std::numeric_limits<float>::infinity();
+  for (const auto& item : objects) {
+    const KnownObject& object = item.second;
+    if (object.playerIndex == playerIndex || object.playerIndex == kGaiaPlayerIndex) {
+      continue;
+    }
+    float squaredDistance = SquaredDistance(object.position, armyCenter);
+    if (squaredDistance < targetSquaredDistance) {
+      targetSquaredDistance = squaredDistance;
+      targetId = item.first;
+    }
+  }
+  
+  if (targetId != kInvalidObjectId) {
+    SendCommand(CreateSetTargetMessage(armyIds, targetId));
+  } else if (mapWidth > 0 && mapHeight > 0) {
+    QPointF exploreTarget(
+        std::uniform_real_distribution<float>(0, mapWidth)(randomEngine),
+        std::uniform_real_distribution<float>(0, mapHeight)(randomEngine));
+    SendCommand(CreateMoveToMapCoordMessage(armyIds, exploreTarget));
+  }
+}
+
+u32 BotClient::FindClosestResource(ResourceType type, const QPointF& position) {
+  u32 closestId = kInvalidObjectId;
+  float closestSquaredDistance = std::numeric_limits<float>::infinity();
+  for (const auto& item : objects) {
+    const KnownObject& object = item.second;
+    if (object.playerIndex != kGaiaPlayerIndex ||
+        !object.isBuilding ||
+        !IsResourceOfType(static_cast<BuildingType>(object.type), type)) {
+      continue;
+    }
+    float squaredDistance = SquaredDistance(object.position, position);
+    if (squaredDistance < closestSquaredDistance) {
+      closestSquaredDistance = squaredDistance;
+      closestId = item.first;
+    }
+  }
+  return closestId;
+}
+
+void BotClient::PlaceBuildingNearTownCenter(BuildingType type, u32 villagerId) {
+  const KnownObject* townCenter = nullptr;
+  for (const auto& item : objects) {
+    if (item.second.playerIndex == playerIndex &&
+        item.second.isBuilding &&
+        static_cast<BuildingType>(item.second.type) == BuildingType::TownCenter) {
+      townCenter = &item.second;
+      break;
+    }
+  }
+  if (!townCenter) {
+    return;
+  }
+  
+  // Choose a random location in a ring around the town center. The server checks whether
+  // the location is free. If it is not, the bot simply tries again later.
+  float angle = std::uniform_real_distribution<float>(0, 2 * M_PI)(randomEngine);
+  float radius = std::uniform_real_distribution<float>(6, 12)(randomEngine);
+  QPoint baseTile(
+      std::max(0, std::min(mapWidth - 4, static_cast<int>(townCenter->position.x() + 2 + radius * cos(angle)))),
+      std::max(0, std::min(mapHeight - 4, static_cast<int>(townCenter->position.y() + 2 + radius * sin(angle)))));
+  
+  SendCommand(CreatePlaceBuildingFoundationMessage(type, baseTile, {villagerId}));
+  villagerTargets.erase(villagerId);
+  builderBusyUntil[villagerId] = AddSeconds(Clock::now(), kBuilderBusySeconds);
+}
+
+void BotClient::SendCommand(const QByteArray& msg) {
+  socket->write(msg);
+  ++ statistics.commandsSent;
+}
@@ -0,0 +1,210 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <QByteArray>
+#include <QPointF>
+#include <QString>
+#include <QTcpSocket>
+
+#include "FreeAge/common/building_types.hpp"
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/message_buffer.hpp"
+#include "FreeAge/common/resources.hpp"
+#include "FreeAge/common/unit_types.hpp"
+
+/// Configures which commands the bots issue.
+struct BotBehavior {
+  /// Interval (in seconds) in which a bot issues its economic commands: It lets its idle
+  /// villagers gather resources, keeps its town center producing villagers, and builds
+  /// houses when it is housed.
+  double economyIntervalSeconds = 2;
+  
+  /// Interval (in seconds) in which a bot issues its military commands: It builds a barracks,
+  /// keeps it producing militia, and sends all of its military units to attack the closest
+  /// enemy object that it knows of (or to explore a random location if it does not know any).
+  double militaryIntervalSeconds = 20;
+  
+  /// Map size that the hosting bot sets in the lobby. Zero keeps the server's default.
+  u16 mapSize = 0;
+};
+
+/// Measurements of a bot. The bot program aggregates these over all bots for its reports.
+struct BotStatistics {
+  /// Appends the measurements of other to this.
+  void Add(const BotStatistics& other);
+  
+  void Clear();
+  
+  
+  /// Round-trip times (in milliseconds) of the pings that were answered.
+  std::vector<float> pingMilliseconds;
+  
+  /// For each received GameStepTime message, the time (in milliseconds) between the
+  /// server time of the game step and the receipt of the message. This uses the server
+  /// time offset that is estimated from the pings.
+  std::vector<float> messageLatencyMilliseconds;
+  
+  u64 bytesReceived = 0;
+  
+  /// Number of in-game commands (MoveToMapCoord, SetTarget, etc.) that were sent.
+  u64 commandsSent = 0;
+};
+
+/// A headless client that joins a match and plays it with scripted commands, used to
+/// generate load on a server for soak tests.
+///
+/// The bot speaks the same protocol as the FreeAge client, but only keeps track of the
+/// state that it needs for choosing its commands (the objects that it sees, its resources,
+/// and its production queues). It does not load any game data.
+///
+/// BotClient does not use signals and slots. Instead, Update() must be called regularly,
+/// for example after processing Qt events.
+class BotClient {
+ public:
+  enum class State {
+    /// Waiting for the connection to be made and for the server's Welcome message.
+    Connecting = 0,
+    
+    /// In the match lobby, waiting for the game to start.
+    InLobby,
+    
+    /// The game was started, waiting for the GameBegin message.
+    Loading,
+    
+    Playing,
+    
+    /// The game ended for this bot, it was aborted, or the connection was lost.
+    Finished
+  };
+  
+  /// Creates a bot that joins the match with the given match token. If isHost is true,
+  /// the bot hosts the match (with the token as host token) and starts the game once
+  /// playerCount players (including itself) joined and are ready.
+  BotClient(const QString& name, const QByteArray& matchToken, bool isHost, int playerCount, const BotBehavior& behavior, u32 randomSeed);
+  
+  ~BotClient();
+  
+  /// Starts connecting to the server.
+  void Connect(const QString& serverAddress);
+  
+  /// Handles the data received from the server and sends the messages that are due.
+  /// Does nothing if Connect() was not called yet.
+  void Update();
+  
+  /// Sends a Leave message and closes the connection (if connected), and sets the state to Finished.
+  void Leave();
+  
+  inline State GetState() const { return state; }
+  inline const QString& GetName() const { return name; }
+  inline BotStatistics* GetStatistics() { return &statistics; }
+  
+ private:
+  /// An object that the bot currently sees.
+  struct KnownObject {
+    bool isBuilding;
+    int playerIndex;
+    
+    /// BuildingType or UnitType of the object.
+    int type;
+    
+    /// For buildings, the base tile. For units, the start point of their last movement.
+    QPointF position;
+    
+    /// For buildings, the construction progress.
+    float buildPercentage;
+  };
+  
+  void HandleMessage(const QByteArray& msg);
+  void HandleWelcomeMessage(const QByteArray& msg);
+  void HandlePlayerListMessage(const QByteArray& msg);
+  void HandlePingResponseMessage(const QByteArray& msg);
+  void HandleGameBeginMessage(const QByteArray& msg);
+  void HandleGameStepTimeMessage(const QByteArray& msg);
+  void HandleAddObjectMessage(const QByteArray& msg);
+  void HandleObjectStateDeltaMessage(const QByteArray& msg);
+  void HandlePlayerLeaveBroadcastMessage(const QByteArray& msg);
+  
+  void RunEconomyCommands();
+  void RunMilitaryCommands();
+  
+  /// Returns the ID of the closest (non-depleted) resource of the given type to the given position,
+  /// or kInvalidObjectId if the bot does not know any.
+  u32 FindClosestResource(ResourceType type, const QPointF& position);
+  
+  /// Places a building foundation at a random location close to the bot's town center
+  /// and lets the given villager construct it.
+  void PlaceBuildingNearTownCenter(BuildingType type, u32 villagerId);
+  
+  /// Sends an in-game command.
+  void SendCommand(const QByteArray& msg);
+  
+  inline double GetLocalTime() const { return SecondsDuration(Clock::now() - creationTime).count(); }
+  
+  
+  QString name;
+  QByteArray matchToken;
+  bool isHost;
+  int playerCount;
+  BotBehavior behavior;
+  
+  State state = State::Connecting;
+  
+  QTcpSocket* socket = nullptr;
+  MessageBuffer unparsedBuffer;
+  
+  /// Whether the HostConnect or Connect message was sent.
+  bool sentConnectMessage = false;
+  
+  /// Whether the hosting bot sent the StartGame message.
+  bool sentStartGame = false;
+  
+  /// The index of this bot's player (in the lobby's player list, which is also the index in the game).
+  int playerIndex = -1;
+  
+  /// The time at which the bot was created. Used as reference for GetLocalTime().
+  TimePoint creationTime;
+  
+  TimePoint lastPingTime;
+  u64 nextPingNumber = 0;
+  
+  /// Local times at which the pings that were not answered yet were sent, indexed by their numbers.
+  std::unordered_map<u64, double> sentPingTimes;
+  
+  /// Offset from the local time to the server time, estimated with the ping that had the lowest round-trip time.
+  double serverTimeOffset = 0;
+  double lowestPingSeconds = -1;
+  
+  int mapWidth = 0;
+  int mapHeight = 0;
+  
+  ResourceAmount resources;
+  bool isHoused = false;
+  
+  /// The objects that the bot sees, indexed by their IDs.
+  std::unordered_map<u32, KnownObject> objects;
+  
+  /// For the bot's own production buildings, the number of items in their production queues.
+  std::unordered_map<u32, int> productionQueueSizes;
+  
+  /// For the bot's own villagers, the resource that they were sent to gather.
+  std::unordered_map<u32, u32> villagerTargets;
+  
+  /// For the bot's own villagers that were sent to construct a building, the time
+  /// until which they do not get new economic commands.
+  std::unordered_map<u32, TimePoint> builderBusyUntil;
+  
+  TimePoint nextEconomyTime;
+  TimePoint nextMilitaryTime;
+  TimePoint nextHouseTime;
+  
+  std::mt19937 randomEngine;
+  
+  BotStatistics statistics;
+};
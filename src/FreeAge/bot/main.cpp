@@ -0,0 +1,217 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+// Scripted bot clients for soak-testing a FreeAge server.
+//
+// Connects one or more bots to a running server. The bots go through the lobby like
+// the FreeAge client, the hosting bot starts the game once all bots joined, and then
+// the bots play with scripted economic and military commands. With --matches, the program
+// hosts several matches at once (which requires a server that was started with --multi-match).
+//
+// While the bots run, the program periodically prints the round-trip times of the pings,
+// the latency of the game step messages, the received data rate, and the command rate.
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <QCoreApplication>
+
+#include "FreeAge/bot/bot_client.hpp"
+#include "FreeAge/common/event_loop.hpp"
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/messages.hpp"
+
+static float GetPercentile(const std::vector<float>& sortedValues, double percentile) {
+  if (sortedValues.empty()) {
+    return 0;
+  }
+  usize index = std::min<usize>(sortedValues.size() - 1, static_cast<usize>(percentile / 100. * sortedValues.size()));
+  return sortedValues[index];
+}
+
+static void PrintValueStatistics(const char* label, std::vector<float>* values) {
+  std::sort(values->begin(), values->end());
+  std::cout << "  " << label << " (milliseconds): p50: " << GetPercentile(*values, 50)
+            << ", p99: " << GetPercentile(*values, 99)
+            << ", max: " << GetPercentile(*values, 100)
+            << " (samples: " << values->size() << ")" << std::endl;
+}
+
+/// Prints the statistics of all bots for the given time span and clears them.
+static void PrintReport(const std::vector<std::unique_ptr<BotClient>>& bots, double elapsedSeconds, double spanSeconds) {
+  int stateCounts[static_cast<int>(BotClient::State::Finished) + 1] = {0};
+  BotStatistics total;
+  for (const auto& bot : bots) {
+    ++ stateCounts[static_cast<int>(bot->GetState())];
+    total.Add(*bot->GetStatistics());
+    bot->GetStatistics()->Clear();
+  }
+  
+  std::cout << "[" << elapsedSeconds << " s] Bots connecting: " << stateCounts[static_cast<int>(BotClient::State::Connecting)]
+            << ", in lobby: " << stateCounts[static_cast<int>(BotClient::State::InLobby)]
+            << ", loading: " << stateCounts[static_cast<int>(BotClient::State::Loading)]
+            << ", playing: " << stateCounts[static_cast<int>(BotClient::State::Playing)]
+            << ", finished: " << stateCounts[static_cast<int>(BotClient::State::Finished)] << std::endl;
+  PrintValueStatistics("Ping", &total.pingMilliseconds);
+  PrintValueStatistics("Game step message latency", &total.messageLatencyMilliseconds);
+  
+  double kibPerSecond = (spanSeconds > 0) ? (total.bytesReceived / 1024. / spanSeconds) : 0;
+  std::cout << "  Received: " << kibPerSecond << " KiB/s (per bot: " << (kibPerSecond / bots.size()) << " KiB/s)" << std::endl;
+  std::cout << "  Commands sent: " << ((spanSeconds > 0) ? (total.commandsSent / spanSeconds) : 0) << " per second" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  // Initialize loguru.
+  loguru::g_preamble_date = false;
+  loguru::g_preamble_thread = false;
+  loguru::g_preamble_uptime = false;
+  loguru::g_stderr_verbosity = loguru::Verbosity_WARNING;
+  if (argc > 0) {
+    loguru::init(argc, argv, /*verbosity_flag*/ nullptr);
+  }
+  
+  QCoreApplication qapp(argc, argv);
+  
+  // Parse command line arguments.
+  QString serverAddress;
+  QByteArray token;
+  bool joinOnly = false;
+  int matchCount = 0;
+  int playersPerMatch = 2;
+  double durationSeconds = 0;
+  double reportIntervalSeconds = 10;
+  BotBehavior behavior;
+  
+  bool argumentsValid = argc >= 4;
+  for (int i = 2; argumentsValid && i < argc; ++ i) {
+    std::string argument = argv[i];
+    if (i + 1 >= argc) {
+      argumentsValid = false;
+      break;
+    }
+    std::string value = argv[++ i];
+    
+    if (argument == "--host") {
+      token = QByteArray::fromStdString(value);
+      matchCount = 1;
+    } else if (argument == "--join") {
+      token = QByteArray::fromStdString(value);
+      joinOnly = true;
+      matchCount = 1;
+    } else if (argument == "--matches") {
+      matchCount = std::stoi(value);
+    } else if (argument == "--players") {
+      playersPerMatch = std::stoi(value);
+    } else if (argument == "--economy-interval") {
+      behavior.economyIntervalSeconds = std::stod(value);
+    } else if (argument == "--military-interval") {
+      behavior.militaryIntervalSeconds = std::stod(value);
+    } else if (argument == "--map-size") {
+      behavior.mapSize = std::stoi(value);
+    } else if (argument == "--duration") {
+      durationSeconds = std::stod(value);
+    } else if (argument == "--report-interval") {
+      reportIntervalSeconds = std::stod(value);
+    } else {
+      argumentsValid = false;
+    }
+  }
+  if (!argumentsValid || matchCount < 1 || playersPerMatch < 1 || playersPerMatch > 8 ||
+      (!token.isEmpty() && token.size() != hostTokenLength)) {
+    LOG(ERROR) << "Usage: FreeAgeBot <server_address> (--host <token> | --join <token> | --matches <count>) [options]";
+    LOG(ERROR) << "  --host <token>: Host a match with the given token (of length " << hostTokenLength << ").";
+    LOG(ERROR) << "  --join <token>: Join the match with the given token, which must have been hosted by someone else.";
+    LOG(ERROR) << "  --matches <count>: Host the given number of matches with random tokens (requires a multi-match server).";
+    LOG(ERROR) << "  --players <count>: Number of bots per match (default: 2). With --join, this many bots join the match.";
+    LOG(ERROR) << "  --economy-interval <seconds>: Interval of the economic commands (default: " << behavior.economyIntervalSeconds << ").";
+    LOG(ERROR) << "  --military-interval <seconds>: Interval of the military commands (default: " << behavior.militaryIntervalSeconds << ").";
+    LOG(ERROR) << "  --map-size <size>: Map size that the hosting bots set (default: the server's default).";
+    LOG(ERROR) << "  --duration <seconds>: Leave the games after this time (default: play until the games end).";
+    LOG(ERROR) << "  --report-interval <seconds>: Interval of the statistics reports (default: " << reportIntervalSeconds << ").";
+    return 1;
+  }
+  serverAddress = QString::fromLocal8Bit(argv[1]);
+  
+  // Create the bots. In each match, the first bot is the host (unless joining another host's match).
+  std::mt19937 randomEngine(std::random_device{}());
+  std::vector<std::unique_ptr<BotClient>> bots;
+  std::vector<BotClient*> hostOfBot;
+  for (int match = 0; match < matchCount; ++ match) {
+    QByteArray matchToken = token;
+    if (matchToken.isEmpty()) {
+      matchToken.resize(hostTokenLength);
+      for (int i = 0; i < hostTokenLength; ++ i) {
+        matchToken[i] = 'a' + std::uniform_int_distribution<int>(0, 'z' - 'a')(randomEngine);
+      }
+    }
+    
+    BotClient* host = nullptr;
+    for (int player = 0; player < playersPerMatch; ++ player) {
+      bool isHost = !joinOnly && player == 0;
+      bots.emplace_back(new BotClient(
+          QString("Bot %1-%2").arg(match).arg(player),
+          matchToken, isHost, playersPerMatch, behavior, randomEngine()));
+      if (isHost) {
+        host = bots.back().get();
+      }
+      hostOfBot.push_back(host == bots.back().get() ? nullptr : host);
+    }
+  }
+  
+  // Connect the hosting bots first. The other bots of a match connect once the match
+  // was created on the server, since the server rejects connections to unknown matches.
+  std::vector<bool> connected(bots.size(), false);
+  for (usize i = 0; i < bots.size(); ++ i) {
+    if (hostOfBot[i] == nullptr) {
+      bots[i]->Connect(serverAddress);
+      connected[i] = true;
+    }
+  }
+  
+  // Run the bots.
+  TimePoint startTime = Clock::now();
+  TimePoint lastReportTime = startTime;
+  bool leftGames = false;
+  
+  while (true) {
+    for (usize i = 0; i < bots.size(); ++ i) {
+      if (!connected[i] && hostOfBot[i]->GetState() != BotClient::State::Connecting) {
+        bots[i]->Connect(serverAddress);
+        connected[i] = true;
+      }
+      bots[i]->Update();
+    }
+    
+    TimePoint now = Clock::now();
+    double elapsedSeconds = SecondsDuration(now - startTime).count();
+    
+    if (std::all_of(bots.begin(), bots.end(), [](const std::unique_ptr<BotClient>& bot) { return bot->GetState() == BotClient::State::Finished; })) {
+      break;
+    }
+    if (durationSeconds > 0 && elapsedSeconds >= durationSeconds && !leftGames) {
+      for (const auto& bot : bots) {
+        bot->Leave();
+      }
+      leftGames = true;
+      continue;
+    }
+    
+    double secondsSinceReport = SecondsDuration(now - lastReportTime).count();
+    if (secondsSinceReport >= reportIntervalSeconds) {
+      PrintReport(bots, elapsedSeconds, secondsSinceReport);
+      lastReportTime = now;
+    }
+    
+    ProcessEventsUntil(now + std::chrono::milliseconds(kMaxEventWaitMilliseconds));
+  }
+  
+  TimePoint endTime = Clock::now();
+  PrintReport(bots, SecondsDuration(endTime - startTime).count(), SecondsDuration(endTime - lastReportTime).count());
+  return 0;
+}
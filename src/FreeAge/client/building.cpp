@@ -39,12 +39,6 @@ bool ClientBuildingType::Load(BuildingType type, const std::filesystem::path& gr
     }
   }
   
-  const auto& buildingSprite = sprites[static_cast<int>(BuildingSprite::Building)]->sprite;
-  maxCenterY = 0;
-  for (int frame = 0; frame < buildingSprite.NumFrames(); ++ frame) {
-    maxCenterY = std::max(maxCenterY, buildingSprite.frame(frame).graphic.centerY);
-  }
-  
   std::filesystem::path ingameTexturesSubPath = std::filesystem::path("widgetui") / "textures" / "ingame";
   std::filesystem::path iconFilename = GetIconFilename();
   if (!iconFilename.empty()) {
@@ -56,6 +50,21 @@ bool ClientBuildingType::Load(BuildingType type, const std::filesystem::path& gr
   return true;
 }
 
+void ClientBuildingType::FinishLoading() {
+  const auto& buildingSprite = sprites[static_cast<int>(BuildingSprite::Building)]->sprite;
+  maxCenterY = 0;
+  for (int frame = 0; frame < buildingSprite.NumFrames(); ++ frame) {
+    maxCenterY = std::max(maxCenterY, buildingSprite.frame(frame).graphic.centerY);
+  }
+  
+  spriteBounds = QRectF();
+  for (BuildingSprite spriteType : {BuildingSprite::Foundation, BuildingSprite::Building}) {
+    if (sprites[static_cast<int>(spriteType)]) {
+      spriteBounds = spriteBounds.united(sprites[static_cast<int>(spriteType)]->sprite.ComputeBounds());
+    }
+  }
+}
+
 ClientBuildingType::~ClientBuildingType() {
   for (SpriteAndTextures* sprite : sprites) {
     if (sprite) {
@@ -285,7 +294,7 @@ void ClientBuildingType::SetCommandButtons(CommandButton commandButtons[3][5]) {
 
 
 ClientBuilding::ClientBuilding(int playerIndex, BuildingType type, int baseTileX, int baseTileY, float buildPercentage, u32 hp)
-    : ClientObject(ObjectType::Building, playerIndex, hp),
+    : ClientObject(ObjectType::Building, playerIndex, hp, GetClientBuildingType(type).GetSpriteBounds()),
       type(type),
       fixedFrameIndex(-1),
       baseTileX(baseTileX),
@@ -32,12 +32,22 @@ class ClientBuildingType {
   ClientBuildingType() = default;
   ~ClientBuildingType();
   
+  /// Requests the sprites of the building type from the SpriteManager and loads its icon.
+  /// FinishLoading() must be called once the sprites have been loaded.
   bool Load(BuildingType type, const std::filesystem::path& graphicsSubPath, const std::filesystem::path& cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes);
   
+  /// Computes the data that depends on the contents of the sprites requested by Load().
+  /// If the sprites are loaded by a SpriteLoader, this must only be called after
+  /// SpriteLoader::Finish() returned.
+  void FinishLoading();
+  
   QSize GetSize() const;
   bool UsesRandomSpriteFrame() const;
   /// Returns the height (in projected coordinates) above the building's center at which the health bar should be displayed.
   float GetHealthBarHeightAboveCenter(int frameIndex) const;
+  /// Returns a rect (in projected coordinates, relative to the building's center) that contains
+  /// all frames of the foundation and building sprites. Computed by FinishLoading().
+  inline const QRectF& GetSpriteBounds() const { return spriteBounds; }
   
   /// Sets up the command buttons for the actions that can be performed when this building type (only) is selected.
   void SetCommandButtons(CommandButton commandButtons[3][5]);
@@ -72,6 +82,9 @@ class ClientBuildingType {
   /// height for the building's health bar.
   int maxCenterY;
   
+  /// See GetSpriteBounds().
+  QRectF spriteBounds;
+  
   Texture iconTexture;
   
   bool doesCauseOutlines;
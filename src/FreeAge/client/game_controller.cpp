@@ -13,14 +13,19 @@
 #include "FreeAge/client/decal.hpp"
 #include "FreeAge/client/unit.hpp"
 
-GameController::GameController(const std::shared_ptr<Match>& match, const std::shared_ptr<ServerConnection>& connection, bool debugNetworking)
+GameController::GameController(const std::shared_ptr<Match>& match, const std::shared_ptr<ServerConnection>& connection, const QString& serverAddress, bool debugNetworking)
     : connection(connection),
       match(match),
+      serverAddress(serverAddress),
       debugNetworking(debugNetworking) {
   if (debugNetworking) {
     networkingDebugFile.open("network_debug_log_messages.txt", std::ios::out);
     networkingDebugFile << std::setprecision(14);
   }
+  
+  connect(connection.get(), &ServerConnection::ConnectionLost, this, &GameController::ConnectionLost);
+  connect(connection.get(), &ServerConnection::ConnectionAttemptFinished, this, &GameController::ReconnectAttemptFinished);
+  connect(&reconnectTimer, &QTimer::timeout, this, &GameController::TryReconnect);
 }
 
 void GameController::ParseMessagesUntil(double displayedServerTime) {
@@ -122,17 +127,63 @@ void GameController::ProduceUnit(const std::vector<u32>& selection, UnitType typ
   }
 }
 
+void GameController::ConnectionLost() {
+  if (sessionToken.isEmpty()) {
+    // The game did not begin yet, so there is no game to reconnect to.
+    return;
+  }
+  
+  // If the connection gets lost again before the game state was resynchronized
+  // (for example, because the server rejected the reconnection), then keep the original time
+  // such that the client gives up after kReconnectTimeout.
+  if (!awaitingResync) {
+    connectionLostTime = Clock::now();
+  }
+  
+  LOG(WARNING) << "Lost the connection to the server. Trying to reconnect ...";
+  constexpr int kReconnectInterval = 1000;
+  reconnectTimer.start(kReconnectInterval);
+}
+
+void GameController::TryReconnect() {
+  if (MillisecondsDuration(Clock::now() - connectionLostTime).count() > kReconnectTimeout) {
+    LOG(ERROR) << "Failed to reconnect to the server.";
+    reconnectTimer.stop();
+    
+    // Show the game end display for this player.
+    match->SetPlayerState(match->GetPlayerIndex(), Match::PlayerState::Dropped);
+    return;
+  }
+  
+  if (reconnectAttemptRunning) {
+    return;
+  }
+  
+  // The attempt runs on the connection thread, so rendering continues meanwhile.
+  // Its timeout is below the timer interval, such that each timer tick can start a new attempt.
+  constexpr int kReconnectAttemptTimeout = 900;
+  reconnectAttemptRunning = true;
+  connection->ConnectToServerAsync(serverAddress, kReconnectAttemptTimeout);
+}
+
+void GameController::ReconnectAttemptFinished(bool connected) {
+  reconnectAttemptRunning = false;
+  if (!connected || !reconnectTimer.isActive()) {
+    // If the timer is not active anymore, the client gave up on reconnecting in the meantime.
+    return;
+  }
+  
+  LOG(INFO) << "Reconnected to the server.";
+  connection->Write(CreateReconnectMessage(sessionToken));
+  awaitingResync = true;
+  reconnectTimer.stop();
+}
+
 void GameController::ParseMessage(const QByteArray& data, ServerToClientMessage msgType) {
   // The messages are sorted by the frequency in which we expect to get them.
   switch (msgType) {
-  case ServerToClientMessage::SetCarriedResources:
-    HandleSetCarriedResourcesMessage(data);
-    break;
-  case ServerToClientMessage::UnitMovement:
-    HandleUnitMovementMessage(data);
-    break;
-  case ServerToClientMessage::HPUpdate:
-    HandleHPUpdateMessage(data);
+  case ServerToClientMessage::ObjectStateDelta:
+    HandleObjectStateDeltaMessage(data);
     break;
   case ServerToClientMessage::AddObject:
     HandleAddObjectMessage(data);
@@ -140,8 +191,8 @@ void GameController::ParseMessage(const QByteArray& data, ServerToClientMessage
   case ServerToClientMessage::ObjectDeath:
     HandleObjectDeathMessage(data);
     break;
-  case ServerToClientMessage::BuildPercentageUpdate:
-    HandleBuildPercentageUpdate(data);
+  case ServerToClientMessage::ObjectLeftView:
+    HandleObjectLeftViewMessage(data);
     break;
   case ServerToClientMessage::QueueUnit:
     HandleQueueUnitMessage(data);
@@ -179,6 +230,9 @@ void GameController::ParseMessage(const QByteArray& data, ServerToClientMessage
   case ServerToClientMessage::GameBegin:
     HandleGameBeginMessage(data);
     break;
+  case ServerToClientMessage::GameResync:
+    HandleGameResyncMessage();
+    break;
   default:
     LOG(WARNING) << "GameController received a message that it cannot handle: " << static_cast<int>(msgType);
     break;
@@ -222,24 +276,53 @@ void GameController::HandleGameBeginMessage(const QByteArray& data) {
       std::max<float>(0, std::min<float>(map->GetWidth(), *reinterpret_cast<const float*>(buffer + 8))),
       std::max<float>(0, std::min<float>(map->GetHeight(), *reinterpret_cast<const float*>(buffer + 12))));
   renderWindow->SetScroll(initialViewCenterMapCoord);
+  
+  if (data.size() >= 36 + kSessionTokenLength) {
+    sessionToken = data.mid(36, kSessionTokenLength);
+  }
 }
 
 void GameController::HandleMapUncoverMessage(const QByteArray& data) {
-  if (data.size() < (map->GetWidth() + 1) * (map->GetHeight() + 1)) {
+  if (data.size() < 6) {
     LOG(ERROR) << "Received a too short MapUncover message";
     return;
   }
+  const char* buffer = data.data();
   
-  for (int y = 0; y <= map->GetHeight(); ++ y) {
-    for (int x = 0; x <= map->GetWidth(); ++ x) {
-      int elevation = data[x + y * (map->GetWidth() + 1)];
-      if (elevation < 0 || elevation > map->GetMaxElevation()) {
-        LOG(WARNING) << "Received invalid map elevation: " << elevation << " (should be from 0 to " << map->GetMaxElevation() << ")";
-      }
-      map->elevationAt(x, y) = elevation;
+  int minCornerX = mango::uload16(buffer + 0);
+  int minCornerY = mango::uload16(buffer + 2);
+  int width = *reinterpret_cast<const u8*>(buffer + 4);
+  int height = *reinterpret_cast<const u8*>(buffer + 5);
+  if (minCornerX + width > map->GetWidth() + 1 ||
+      minCornerY + height > map->GetHeight() + 1) {
+    LOG(ERROR) << "Received a MapUncover message for an area outside of the map";
+    return;
+  }
+  
+  // Decode the run-length encoded elevation.
+  int cornerCount = width * height;
+  int cornerIndex = 0;
+  for (int offset = 6; offset + 1 < data.size() && cornerIndex < cornerCount; offset += 2) {
+    int runLength = *reinterpret_cast<const u8*>(buffer + offset);
+    int elevation = *reinterpret_cast<const u8*>(buffer + offset + 1);
+    if (elevation > map->GetMaxElevation()) {
+      LOG(WARNING) << "Received invalid map elevation: " << elevation << " (should be from 0 to " << map->GetMaxElevation() << ")";
+    }
+    if (cornerIndex + runLength > cornerCount) {
+      LOG(ERROR) << "Received a MapUncover message with too many elevation values";
+      runLength = cornerCount - cornerIndex;
     }
+    for (int i = 0; i < runLength; ++ i) {
+      map->elevationAt(minCornerX + cornerIndex % width, minCornerY + cornerIndex / width) = elevation;
+      ++ cornerIndex;
+    }
+  }
+  if (cornerIndex < cornerCount) {
+    LOG(ERROR) << "Received a MapUncover message with too few elevation values";
   }
   
+  // The elevation changes the projected coordinates of objects on the uncovered corners.
+  map->UpdateAllObjectBounds();
   map->SetNeedsRenderResourcesUpdate(true);
 }
 
@@ -356,42 +439,26 @@ void GameController::HandleObjectDeathMessage(const QByteArray& data) {
     }
   }
   
-  delete object;
-  map->GetObjects().erase(it);
+  map->DeleteObject(objectId);
 }
 
-void GameController::HandleUnitMovementMessage(const QByteArray& data) {
-  if (data.size() < 21) {
-    LOG(ERROR) << "Received a too short SetCarriedResources message";
+void GameController::HandleObjectLeftViewMessage(const QByteArray& data) {
+  if (data.size() < 4) {
+    LOG(ERROR) << "Received a too short ObjectLeftView message";
     return;
   }
   const char* buffer = data.data();
   
-  u32 unitId = mango::uload32(buffer + 0);
-  QPointF startPoint(
-      *reinterpret_cast<const float*>(buffer + 4),
-      *reinterpret_cast<const float*>(buffer + 8));
-  QPointF speed(
-      *reinterpret_cast<const float*>(buffer + 12),
-      *reinterpret_cast<const float*>(buffer + 16));
-  if (buffer[20] >= static_cast<int>(UnitAction::NumActions)) {
-    LOG(ERROR) << "Received UnitMovement message with invalid UnitAction";
-    return;
-  }
-  UnitAction action = static_cast<UnitAction>(buffer[20]);
-  
-  auto it = map->GetObjects().find(unitId);
+  u32 objectId = mango::uload32(buffer + 0);
+  auto it = map->GetObjects().find(objectId);
   if (it == map->GetObjects().end()) {
-    LOG(ERROR) << "Received a UnitMovement message for an object ID that is not in the map.";
-    return;
-  }
-  if (!it->second->isUnit()) {
-    LOG(ERROR) << "Received a UnitMovement message for an object ID that is a different type than a unit.";
+    LOG(ERROR) << "Received an ObjectLeftView message for an object ID that is not in the map.";
     return;
   }
   
-  ClientUnit* unit = AsUnit(it->second);
-  unit->SetMovementSegment(currentGameStepServerTime, startPoint, speed, action, map.get(), match.get());
+  // The server only sends this for objects of other players, which do not
+  // contribute to the player stats or the field of view.
+  map->DeleteObject(objectId);
 }
 
 void GameController::HandleGameStepTimeMessage(const QByteArray& data) {
@@ -417,39 +484,6 @@ void GameController::HandleResourcesUpdateMessage(const QByteArray& data, Resour
   *resources = ResourceAmount(wood, food, gold, stone);
 }
 
-void GameController::HandleBuildPercentageUpdate(const QByteArray& data) {
-  if (data.size() < 4 + 4) {
-    LOG(ERROR) << "Received a too short BuildPercentageUpdate message";
-    return;
-  }
-  const char* buffer = data.data();
-  
-  u32 buildingId = mango::uload32(buffer + 0);
-  auto it = map->GetObjects().find(buildingId);
-  if (it == map->GetObjects().end()) {
-    LOG(ERROR) << "Received a BuildPercentageUpdate message for an object ID that is not in the map.";
-    return;
-  }
-  if (!it->second->isBuilding()) {
-    LOG(ERROR) << "Received a BuildPercentageUpdate message for an object ID that is a different type than a building.";
-    return;
-  }
-  
-  float percentage;
-  memcpy(&percentage, buffer + 4, 4);
-  
-  ClientBuilding* building = AsBuilding(it->second);
-  if (building->GetPlayerIndex() == match->GetPlayerIndex()) {
-    if (!building->IsCompleted() && percentage == 100) {
-      // The building has been completed.
-      playerStats.BuildingFinished(building->GetType());
-
-      building->UpdateFieldOfView(map.get(), 1);
-    }
-  }
-  building->SetBuildPercentage(percentage);
-}
-
 void GameController::HandleChangeUnitTypeMessage(const QByteArray& data) {
   if (data.size() < 4 + 2) {
     LOG(ERROR) << "Received a too short ChangeUnitType message";
@@ -477,60 +511,70 @@ void GameController::HandleChangeUnitTypeMessage(const QByteArray& data) {
   ClientUnit* unit = AsUnit(it->second);
   UnitType oldType = unit->GetType();
   unit->SetType(newType);
+  map->UpdateObjectBounds(unit);
 
   playerStats.UnitTransformed(oldType, newType);
 }
 
-void GameController::HandleSetCarriedResourcesMessage(const QByteArray& data) {
-  if (data.size() < 6) {
-    LOG(ERROR) << "Received too short SetCarriedResources message";
-    return;
-  }
-  const char* buffer = data.data();
-  
-  u32 unitId = mango::uload32(buffer + 0);
-  auto it = map->GetObjects().find(unitId);
-  if (it == map->GetObjects().end()) {
-    LOG(ERROR) << "Received a SetCarriedResources message for an object ID that is not in the map.";
-    return;
-  }
-  if (!it->second->isUnit()) {
-    LOG(ERROR) << "Received a SetCarriedResources message for an object ID that is a different type than a unit.";
-    return;
-  }
-  ClientUnit* villager = AsUnit(it->second);
-  if (!IsVillager(villager->GetType())) {
-    LOG(ERROR) << "Received a SetCarriedResources message for a unit that is not a villager.";
-    return;
-  }
-  
-  if (buffer[4] >= static_cast<int>(ResourceType::NumTypes)) {
-    LOG(ERROR) << "Received SetCarriedResources message with invalid resource type";
-    return;
-  }
-  ResourceType type = static_cast<ResourceType>(buffer[4]);
-  u8 amount = buffer[5];
-  
-  villager->SetCarriedResources(type, amount);
-}
-
-void GameController::HandleHPUpdateMessage(const QByteArray& data) {
-  if (data.size() < 8) {
-    LOG(ERROR) << "Received a too short HPUpdate message";
-    return;
-  }
-  const char* buffer = data.data();
+void GameController::HandleObjectStateDeltaMessage(const QByteArray& data) {
+  const char* cursor = data.data();
+  const char* end = data.data() + data.size();
   
-  u32 objectId = mango::uload32(buffer + 0);
-  auto it = map->GetObjects().find(objectId);
-  if (it == map->GetObjects().end()) {
-    LOG(ERROR) << "Received a HPUpdate message for an object ID that is not in the map.";
-    return;
+  u32 objectId = 0;
+  while (cursor < end) {
+    u32 objectIdDifference;
+    ObjectStateDelta delta;
+    if (!ReadObjectStateDeltaEntry(&cursor, end, &objectIdDifference, &delta)) {
+      LOG(ERROR) << "Received an invalid ObjectStateDelta message";
+      return;
+    }
+    objectId += objectIdDifference;
+    
+    auto it = map->GetObjects().find(objectId);
+    if (it == map->GetObjects().end()) {
+      LOG(ERROR) << "Received an ObjectStateDelta message for an object ID that is not in the map.";
+      continue;
+    }
+    ClientObject* object = it->second;
+    
+    if (delta.fields & kObjectStateMovement) {
+      if (!object->isUnit()) {
+        LOG(ERROR) << "Received a movement update for an object ID that is a different type than a unit.";
+      } else {
+        AsUnit(object)->SetMovementSegment(currentGameStepServerTime, delta.GetStartPoint(), delta.GetSpeed(), delta.action, map.get(), match.get());
+      }
+    }
+    
+    if (delta.fields & kObjectStateHP) {
+      object->SetHP(delta.hp);
+    }
+    
+    if (delta.fields & kObjectStateBuildPercentage) {
+      if (!object->isBuilding()) {
+        LOG(ERROR) << "Received a build percentage update for an object ID that is a different type than a building.";
+      } else {
+        float percentage = delta.GetBuildPercentage();
+        ClientBuilding* building = AsBuilding(object);
+        if (building->GetPlayerIndex() == match->GetPlayerIndex()) {
+          if (!building->IsCompleted() && percentage == 100) {
+            // The building has been completed.
+            playerStats.BuildingFinished(building->GetType());
+            
+            building->UpdateFieldOfView(map.get(), 1);
+          }
+        }
+        building->SetBuildPercentage(percentage);
+      }
+    }
+    
+    if (delta.fields & kObjectStateCarriedResources) {
+      if (!object->isUnit() || !IsVillager(AsUnit(object)->GetType())) {
+        LOG(ERROR) << "Received a carried resources update for an object that is not a villager.";
+      } else {
+        AsUnit(object)->SetCarriedResources(delta.carriedResourceType, delta.carriedResourceAmount);
+      }
+    }
   }
-  ClientObject* object = it->second;
-  
-  u32 newHP = mango::uload32(buffer + 4);
-  object->SetHP(newHP);
 }
 
 void GameController::HandlePlayerLeaveBroadcast(const QByteArray& data) {
@@ -665,3 +709,32 @@ void GameController::HandleSetHousedMessage(const QByteArray& data) {
   }
   isHoused = data.data()[0] != 0;
 }
+
+void GameController::HandleGameResyncMessage() {
+  if (!map) {
+    LOG(ERROR) << "Received a GameResync message before the GameBegin message";
+    return;
+  }
+  
+  // Drop all objects, since the updates for them were missed while the connection was lost.
+  // The server sends all objects that the client sees afterwards.
+  for (const auto& item : map->GetObjects()) {
+    ClientObject* object = item.second;
+    if (object->GetPlayerIndex() == match->GetPlayerIndex()) {
+      if (object->isBuilding()) {
+        ClientBuilding* building = AsBuilding(object);
+        playerStats.BuildingRemoved(building->GetType(), building->IsCompleted());
+        if (building->IsCompleted()) {
+          building->UpdateFieldOfView(map.get(), -1);
+        }
+      } else if (object->isUnit()) {
+        playerStats.UnitRemoved(AsUnit(object)->GetType());
+        object->UpdateFieldOfView(map.get(), -1);
+      }
+    }
+  }
+  map->DeleteAllObjects();
+  
+  isHoused = false;
+  awaitingResync = false;
+}
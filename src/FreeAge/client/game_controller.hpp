@@ -8,6 +8,7 @@
 #include <memory>
 
 #include <QObject>
+#include <QTimer>
 
 #include "FreeAge/client/map.hpp"
 #include "FreeAge/client/match.hpp"
@@ -22,7 +23,8 @@
 class GameController : public QObject {
  Q_OBJECT
  public:
-  GameController(const std::shared_ptr<Match>& match, const std::shared_ptr<ServerConnection>& connection, bool debugNetworking);
+  /// The serverAddress is used to reconnect to the server if the connection gets lost.
+  GameController(const std::shared_ptr<Match>& match, const std::shared_ptr<ServerConnection>& connection, const QString& serverAddress, bool debugNetworking);
   
   inline void SetRenderWindow(const std::shared_ptr<RenderWindow> renderWindow) { this->renderWindow = renderWindow; }
   
@@ -51,6 +53,19 @@ class GameController : public QObject {
   
   inline void SetLastDisplayedServerTime(double serverTime) { lastDisplayedServerTime = serverTime; }
   
+  /// The client tries to reconnect to the game for this time (in milliseconds) after losing the connection.
+  static constexpr int kReconnectTimeout = 60000;
+ 
+ private slots:
+  void ConnectionLost();
+  
+  /// Starts an attempt to reconnect to the server (unless the previous attempt is still running).
+  /// Gives up once kReconnectTimeout passed since losing the connection.
+  void TryReconnect();
+  
+  /// Called when the attempt started by TryReconnect() finished.
+  void ReconnectAttemptFinished(bool connected);
+  
  private:
   void ParseMessage(const QByteArray& data, ServerToClientMessage msgType);
   
@@ -60,18 +75,17 @@ class GameController : public QObject {
   void HandleMapUncoverMessage(const QByteArray& data);
   void HandleAddObjectMessage(const QByteArray& data);
   void HandleObjectDeathMessage(const QByteArray& data);
-  void HandleUnitMovementMessage(const QByteArray& data);
+  void HandleObjectLeftViewMessage(const QByteArray& data);
   void HandleGameStepTimeMessage(const QByteArray& data);
   void HandleResourcesUpdateMessage(const QByteArray& data, ResourceAmount* resources);
-  void HandleBuildPercentageUpdate(const QByteArray& data);
   void HandleChangeUnitTypeMessage(const QByteArray& data);
-  void HandleSetCarriedResourcesMessage(const QByteArray& data);
-  void HandleHPUpdateMessage(const QByteArray& data);
+  void HandleObjectStateDeltaMessage(const QByteArray& data);
   void HandlePlayerLeaveBroadcast(const QByteArray& data);
   void HandleQueueUnitMessage(const QByteArray& data);
   void HandleUpdateProductionMessage(const QByteArray& data);
   void HandleRemoveFromProductionQueueMessage(const QByteArray& data);
   void HandleSetHousedMessage(const QByteArray& data);
+  void HandleGameResyncMessage();
   
   
   std::shared_ptr<ServerConnection> connection;
@@ -81,6 +95,24 @@ class GameController : public QObject {
   
   double gameStartServerTimeSeconds = std::numeric_limits<double>::max();
   
+  /// The address of the server, used for reconnecting.
+  QString serverAddress;
+  
+  /// The token with which the client can reconnect to the game. It is received with the GameBegin message.
+  QByteArray sessionToken;
+  
+  /// Repeatedly calls TryReconnect() while the client tries to reconnect.
+  QTimer reconnectTimer;
+  
+  /// The time at which the connection to the server was lost.
+  TimePoint connectionLostTime;
+  
+  /// Whether a reconnection attempt is running on the connection thread.
+  bool reconnectAttemptRunning = false;
+  
+  /// Whether the client reconnected to the server, but did not receive the GameResync message yet.
+  bool awaitingResync = false;
+  
   /// The server time of the last received GameStepTime message. This applies to all
   /// following messages until the next GameStepTime message is received. Initially
   /// (as long as no GameStepTime message was received yet), currentGameStepServerTime
@@ -84,6 +84,7 @@ int main(int argc, char** argv) {
   
   // Communication with the server.
   std::shared_ptr<ServerConnection> connection(new ServerConnection());
+  QString serverAddress;
   
   // The screen on which the game shall be shown.
   QScreen* gameScreen = nullptr;
@@ -206,7 +207,8 @@ int main(int argc, char** argv) {
       
       // Connect to the server.
       constexpr int kConnectTimeout = 2500;
-      if (!connection->ConnectToServer(settingsDialog.GetHostPassword().isEmpty() ? "127.0.0.1" : settingsDialog.GetServerAddress(), kConnectTimeout, /*retryUntilTimeout*/ true)) {
+      serverAddress = settingsDialog.GetHostPassword().isEmpty() ? "127.0.0.1" : settingsDialog.GetServerAddress();
+      if (!connection->ConnectToServer(serverAddress, kConnectTimeout, /*retryUntilTimeout*/ true)) {
         QMessageBox::warning(nullptr, QObject::tr("Error"), QObject::tr("Failed to connect to the server."));
         QFontDatabase::removeApplicationFont(georgiaFontID);
         continue;
@@ -217,14 +219,15 @@ int main(int argc, char** argv) {
     } else {
       // Try to connect to the server.
       constexpr int kConnectTimeout = 2500;
-      if (!connection->ConnectToServer(settingsDialog.GetServerAddress(), kConnectTimeout, /*retryUntilTimeout*/ false)) {
+      serverAddress = settingsDialog.GetServerAddress();
+      if (!connection->ConnectToServer(serverAddress, kConnectTimeout, /*retryUntilTimeout*/ false)) {
         QMessageBox::warning(nullptr, QObject::tr("Error"), QObject::tr("Failed to connect to the server."));
         QFontDatabase::removeApplicationFont(georgiaFontID);
         continue;
       }
       
       // Send the Connect message.
-      connection->Write(CreateConnectMessage(settings.playerName));
+      connection->Write(CreateConnectMessage(settingsDialog.GetMatchToken().toUtf8(), settings.playerName));
     }
     
     // Wait for the server's welcome message.
@@ -298,7 +301,7 @@ int main(int argc, char** argv) {
   }
   
   // Create the game controller. It will start listening for network messages.
-  std::shared_ptr<GameController> gameController(new GameController(match, connection, settings.debugNetworking));
+  std::shared_ptr<GameController> gameController(new GameController(match, connection, serverAddress, settings.debugNetworking));
   
   // Get the graphics path.
   std::filesystem::path graphicsSubPath = std::filesystem::path("resources") / "_common" / "drs" / "graphics";
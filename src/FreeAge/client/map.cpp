@@ -26,6 +26,13 @@ Map::Map(int width, int height)
   maxElevation = 7;  // TODO: Make configurable
   elevation = new int[(width + 1) * (height + 1)];
   viewCount = new int[width * height];
+  occupiedForBuildings.Resize(width, height);
+  
+  // The grid for the objects covers the map for all elevation levels (including the
+  // unknown elevation of -1). See TileCornerToProjectedCoord().
+  float minProjectedY = -height * (kTileProjectedHeight / 2) - maxElevation * kTileProjectedElevationDifference;
+  float maxProjectedY = width * (kTileProjectedHeight / 2) + kTileProjectedElevationDifference;
+  objectGrid.Reset(QRectF(0, minProjectedY, (width + height) * (kTileProjectedWidth / 2), maxProjectedY - minProjectedY));
   
   // Initialize the elevation to "unknown" everywhere and the view count to zero.
   for (int y = 0; y <= height; ++ y) {
@@ -333,6 +340,13 @@ void Map::UnloadRenderResources() {
 
 void Map::AddObject(u32 objectId, ClientObject* object) {
   objects.insert(std::make_pair(objectId, object));
+  
+  if (object->isBuilding()) {
+    ClientBuilding* building = AsBuilding(object);
+    occupiedForBuildings.SetRect(QRect(building->GetBaseTile(), GetBuildingSize(building->GetType())), true);
+  }
+  
+  objectGrid.Insert(objectId, object, ComputeObjectBounds(object));
 }
 
 void Map::DeleteObject(u32 objectId) {
@@ -341,10 +355,37 @@ void Map::DeleteObject(u32 objectId) {
     LOG(ERROR) << "Cannot find to erase object id: " << objectId;
     return;
   }
+  
+  if (it->second->isBuilding()) {
+    ClientBuilding* building = AsBuilding(it->second);
+    occupiedForBuildings.SetRect(QRect(building->GetBaseTile(), GetBuildingSize(building->GetType())), false);
+  }
+  
+  objectGrid.Remove(it->second);
   delete it->second;
   objects.erase(it);
 }
 
+void Map::DeleteAllObjects() {
+  for (const auto& item : objects) {
+    delete item.second;
+  }
+  objects.clear();
+  
+  occupiedForBuildings.Clear();
+  objectGrid.Clear();
+}
+
+void Map::UpdateObjectBounds(ClientObject* object) {
+  objectGrid.Update(object, ComputeObjectBounds(object));
+}
+
+void Map::UpdateAllObjectBounds() {
+  for (const auto& item : objects) {
+    objectGrid.Update(item.second, ComputeObjectBounds(item.second));
+  }
+}
+
 bool Map::IsUnitInFogOfWar(ClientUnit* unit) {
   int tileX = std::max<int>(0, std::min<int>(width - 1, unit->GetMapCoord().x()));
   int tileY = std::max<int>(0, std::min<int>(height - 1, unit->GetMapCoord().y()));
@@ -367,6 +408,31 @@ int Map::ComputeMaxViewCountForBuilding(ClientBuilding* building) {
   return maxViewCount;
 }
 
+QRectF Map::ComputeObjectBounds(ClientObject* object) const {
+  if (object->isUnit()) {
+    return object->GetSpriteBounds().translated(MapCoordToProjectedCoord(AsUnit(object)->GetMapCoord()));
+  }
+  
+  ClientBuilding* building = AsBuilding(object);
+  const QPoint& baseTile = building->GetBaseTile();
+  QSize size = GetBuildingSize(building->GetType());
+  QPointF centerMapCoord(baseTile.x() + 0.5f * size.width(), baseTile.y() + 0.5f * size.height());
+  QRectF bounds = object->GetSpriteBounds().translated(MapCoordToProjectedCoord(centerMapCoord));
+  
+  // Include the building's ground tiles. Since their elevation is interpolated
+  // within each tile, it suffices to include the tile corners.
+  QPointF minCorner = TileCornerToProjectedCoord(baseTile.x(), baseTile.y());
+  QPointF maxCorner = minCorner;
+  for (int y = 0; y <= size.height(); ++ y) {
+    for (int x = 0; x <= size.width(); ++ x) {
+      QPointF corner = TileCornerToProjectedCoord(baseTile.x() + x, baseTile.y() + y);
+      minCorner = QPointF(std::min(minCorner.x(), corner.x()), std::min(minCorner.y(), corner.y()));
+      maxCorner = QPointF(std::max(maxCorner.x(), corner.x()), std::max(maxCorner.y(), corner.y()));
+    }
+  }
+  return bounds.united(QRectF(minCorner, maxCorner));
+}
+
 void Map::UpdateRenderResources(const std::filesystem::path& graphicsSubPath, QOpenGLFunctions_3_2_Core* f) {
   // Load texture
   if (!hasTextureBeenLoaded) {
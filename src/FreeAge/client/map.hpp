@@ -10,11 +10,13 @@
 #include <QPointF>
 
 #include "FreeAge/client/building.hpp"
+#include "FreeAge/client/projected_object_grid.hpp"
 #include "FreeAge/client/unit.hpp"
 #include "FreeAge/client/shader_program.hpp"
 #include "FreeAge/client/shader_terrain.hpp"
 #include "FreeAge/client/sprite.hpp"
 #include "FreeAge/client/texture.hpp"
+#include "FreeAge/common/occupancy_bitmap.hpp"
 
 class HealthBarShader;
 class SpriteShader;
@@ -94,9 +96,33 @@ class Map {
   inline std::unordered_map<u32, ClientObject*>& GetObjects() { return objects; }
   inline const std::unordered_map<u32, ClientObject*>& GetObjects() const { return objects; }
   
+  /// Adds the object to the map. The map takes ownership of the object.
   void AddObject(u32 objectId, ClientObject* object);
+  
+  /// Removes the object from the map and deletes it.
   void DeleteObject(u32 objectId);
   
+  /// Removes all objects from the map and deletes them. Like DeleteObject(), this
+  /// also frees the tiles that were occupied by buildings. Objects must therefore
+  /// never be deleted directly through GetObjects().
+  void DeleteAllObjects();
+  
+  /// Must be called when an object's position in projected coordinates may have changed
+  /// (i.e., when a unit moved), to update it in the spatial index of objects.
+  void UpdateObjectBounds(ClientObject* object);
+  
+  /// Updates all objects in the spatial index. Must be called after elevation values changed.
+  void UpdateAllObjectBounds();
+  
+  /// Appends the objects which may be drawn within the given rect in projected coordinates.
+  /// This is a conservative superset, callers still need to test the objects' actual sprite rects.
+  inline void FindObjectsInProjectedRect(const QRectF& rect, std::vector<std::pair<u32, ClientObject*>>* result) const {
+    objectGrid.Query(rect, result);
+  }
+  
+  /// Returns whether any tile within the given rectangle is occupied by a building (that the client knows of).
+  inline bool IsAreaOccupiedForBuildings(const QRect& tileRect) const { return occupiedForBuildings.IsAnySetInRect(tileRect); }
+  
   bool IsUnitInFogOfWar(ClientUnit* unit);
   bool IsBuildingInFogOfWar(ClientBuilding* building);
   int ComputeMaxViewCountForBuilding(ClientBuilding* building);
@@ -110,6 +136,10 @@ class Map {
   void UpdateRenderResources(const std::filesystem::path& graphicsSubPath, QOpenGLFunctions_3_2_Core* f);
   void UpdateViewCountTexture(QOpenGLFunctions_3_2_Core* f);
   
+  /// Computes the rect in projected coordinates that contains everything that the object may be drawn with
+  /// at its current position, as well as the ground tiles of buildings (which are used for picking them).
+  QRectF ComputeObjectBounds(ClientObject* object) const;
+  
   /// The maximum possible elevation level (the lowest is zero).
   /// This may be higher than the maximum actually existing
   /// elevation level (but never lower).
@@ -131,6 +161,13 @@ class Map {
   /// Map of object ID -> ClientObject.
   std::unordered_map<u32, ClientObject*> objects;
   
+  /// Stores whether each tile is occupied by a building in objects. Used for
+  /// checking building foundation placement.
+  OccupancyBitmap occupiedForBuildings;
+  
+  /// Spatial index of the objects, used for culling and picking.
+  ProjectedObjectGrid objectGrid;
+  
   /// Stores how many units or buildings view each map tile.
   /// As a special case, map tiles that have not been uncovered yet have the value -1.
   /// The array size is thus: width times height.
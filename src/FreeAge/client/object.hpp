@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <QRectF>
 #include <QString>
 
 #include "FreeAge/common/free_age.hpp"
@@ -15,9 +16,11 @@ class Map;
 /// Base class for buildings and units on the client.
 class ClientObject {
  public:
-  inline ClientObject(ObjectType objectType, int playerIndex, u32 hp)
+  /// spriteBounds must remain valid for the lifetime of the object (it is owned by the object's type).
+  inline ClientObject(ObjectType objectType, int playerIndex, u32 hp, const QRectF& spriteBounds)
       : playerIndex(playerIndex),
         hp(hp),
+        spriteBounds(&spriteBounds),
         objectType(static_cast<int>(objectType)) {}
   
   void UpdateFieldOfView(Map* map, int change);
@@ -34,6 +37,10 @@ class ClientObject {
   inline u32 GetHP() const { return hp; }
   inline void SetHP(u32 newHP) { hp = newHP; }
   
+  /// Returns a rect (in projected coordinates, relative to the object's center) that
+  /// contains all sprite frames that the object may be drawn with.
+  inline const QRectF& GetSpriteBounds() const { return *spriteBounds; }
+  
  protected:
   /// Index of the player which this object belongs to.
   int playerIndex;
@@ -41,6 +48,9 @@ class ClientObject {
   /// Current hitpoints of the object.
   u32 hp;
   
+  /// The sprite bounds of the object's type, see GetSpriteBounds().
+  const QRectF* spriteBounds;
+  
   /// 0 for buildings, 1 for units.
   u8 objectType;
 };
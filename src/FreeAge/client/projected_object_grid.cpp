@@ -0,0 +1,134 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/client/projected_object_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "FreeAge/common/logging.hpp"
+
+void ProjectedObjectGrid::Reset(const QRectF& area) {
+  origin = area.topLeft();
+  cellsX = std::max(1, static_cast<int>(std::ceil(area.width() / kCellSize)));
+  cellsY = std::max(1, static_cast<int>(std::ceil(area.height() / kCellSize)));
+  
+  cells.clear();
+  cells.resize(cellsX * cellsY);
+  placements.clear();
+}
+
+void ProjectedObjectGrid::Insert(u32 objectId, ClientObject* object, const QRectF& bounds) {
+  CellRange newCells = GetCellRange(bounds);
+  if (!placements.insert(std::make_pair(object, Placement{objectId, newCells})).second) {
+    LOG(ERROR) << "Object to insert is in the grid already: " << objectId;
+    return;
+  }
+  AddToCells(objectId, object, bounds, newCells);
+}
+
+void ProjectedObjectGrid::Update(ClientObject* object, const QRectF& bounds) {
+  auto it = placements.find(object);
+  if (it == placements.end()) {
+    LOG(ERROR) << "Object to update is not in the grid";
+    return;
+  }
+  
+  CellRange newCells = GetCellRange(bounds);
+  if (it->second.cells == newCells) {
+    // This is the common case for moving units: Only update the bounds in place.
+    for (int y = newCells.minY; y <= newCells.maxY; ++ y) {
+      for (int x = newCells.minX; x <= newCells.maxX; ++ x) {
+        for (Entry& entry : cells[y * cellsX + x]) {
+          if (entry.object == object) {
+            entry.bounds = bounds;
+            break;
+          }
+        }
+      }
+    }
+    return;
+  }
+  
+  RemoveFromCells(object, it->second.cells);
+  it->second.cells = newCells;
+  AddToCells(it->second.objectId, object, bounds, newCells);
+}
+
+void ProjectedObjectGrid::Remove(ClientObject* object) {
+  auto it = placements.find(object);
+  if (it == placements.end()) {
+    LOG(ERROR) << "Object to remove is not in the grid";
+    return;
+  }
+  
+  RemoveFromCells(object, it->second.cells);
+  placements.erase(it);
+}
+
+void ProjectedObjectGrid::Clear() {
+  for (std::vector<Entry>& cell : cells) {
+    cell.clear();
+  }
+  placements.clear();
+}
+
+void ProjectedObjectGrid::Query(const QRectF& rect, std::vector<std::pair<u32, ClientObject*>>* objects) const {
+  CellRange queryCells = GetCellRange(rect);
+  
+  for (int y = queryCells.minY; y <= queryCells.maxY; ++ y) {
+    for (int x = queryCells.minX; x <= queryCells.maxX; ++ x) {
+      for (const Entry& entry : cells[y * cellsX + x]) {
+        if (x != std::max(entry.minCellX, queryCells.minX) ||
+            y != std::max(entry.minCellY, queryCells.minY)) {
+          // The object is reported in another cell.
+          continue;
+        }
+        if (entry.bounds.intersects(rect)) {
+          objects->emplace_back(entry.objectId, entry.object);
+        }
+      }
+    }
+  }
+}
+
+ProjectedObjectGrid::CellRange ProjectedObjectGrid::GetCellRange(const QRectF& rect) const {
+  auto toCellX = [&](double projectedX) {
+    return std::max(0, std::min(cellsX - 1, static_cast<int>(std::floor((projectedX - origin.x()) / kCellSize))));
+  };
+  auto toCellY = [&](double projectedY) {
+    return std::max(0, std::min(cellsY - 1, static_cast<int>(std::floor((projectedY - origin.y()) / kCellSize))));
+  };
+  
+  QRectF normalized = rect.normalized();
+  return CellRange{
+      toCellX(normalized.left()),
+      toCellY(normalized.top()),
+      toCellX(normalized.right()),
+      toCellY(normalized.bottom())};
+}
+
+void ProjectedObjectGrid::AddToCells(u32 objectId, ClientObject* object, const QRectF& bounds, const CellRange& range) {
+  for (int y = range.minY; y <= range.maxY; ++ y) {
+    for (int x = range.minX; x <= range.maxX; ++ x) {
+      cells[y * cellsX + x].push_back(Entry{objectId, object, bounds, range.minX, range.minY});
+    }
+  }
+}
+
+void ProjectedObjectGrid::RemoveFromCells(ClientObject* object, const CellRange& range) {
+  for (int y = range.minY; y <= range.maxY; ++ y) {
+    for (int x = range.minX; x <= range.maxX; ++ x) {
+      std::vector<Entry>& cell = cells[y * cellsX + x];
+      for (usize i = 0; i < cell.size(); ++ i) {
+        if (cell[i].object == object) {
+          // The order within a cell does not matter, so swap the entry to the end for a cheap removal.
+          cell[i] = cell.back();
+          cell.pop_back();
+          break;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,101 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <QRectF>
+
+#include "FreeAge/common/free_age.hpp"
+
+class ClientObject;
+
+/// Spatial index of the objects on the client Map in projected coordinates, used to
+/// quickly find the objects that may be visible in the view (for culling) or that may
+/// be under the cursor (for picking).
+///
+/// Each object is inserted with a bounding rect in projected coordinates, which must
+/// contain everything that the object may be drawn with at its current position (i.e.,
+/// all frames of all of its sprites). The object is stored in all cells of a coarse grid
+/// (with cells of kCellSize x kCellSize projected pixels) that this rect overlaps.
+/// Rects outside of the area that the grid was set up for are clamped to its border
+/// cells, so they are still handled correctly (just less efficiently).
+///
+/// The bounding rect must be updated whenever the object moves (see Map::UpdateObjectBounds()).
+class ProjectedObjectGrid {
+ public:
+  /// Sets up the grid to cover the given area in projected coordinates. This removes all objects.
+  void Reset(const QRectF& area);
+  
+  /// Inserts the object with the given bounding rect.
+  void Insert(u32 objectId, ClientObject* object, const QRectF& bounds);
+  
+  /// Updates the bounding rect of an object that is in the grid.
+  void Update(ClientObject* object, const QRectF& bounds);
+  
+  void Remove(ClientObject* object);
+  
+  /// Removes all objects (keeping the area).
+  void Clear();
+  
+  /// Appends each object whose bounding rect intersects the given rect to objects (once).
+  /// Callers still need to test the object's actual sprite rect, since the bounding rect is conservative.
+  void Query(const QRectF& rect, std::vector<std::pair<u32, ClientObject*>>* objects) const;
+  
+  inline usize GetNumObjects() const { return placements.size(); }
+  
+  /// Side length of the grid cells in projected coordinates.
+  static constexpr float kCellSize = 256;
+  
+ private:
+  /// Range of cells (inclusive).
+  struct CellRange {
+    inline bool operator== (const CellRange& other) const {
+      return minX == other.minX && minY == other.minY && maxX == other.maxX && maxY == other.maxY;
+    }
+    
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+  };
+  
+  struct Entry {
+    u32 objectId;
+    ClientObject* object;
+    QRectF bounds;
+    
+    /// The first cell that the object is stored in. Query() reports the object only in the first cell
+    /// of the overlap between this object's cells and the queried cells, such that it gets reported once.
+    int minCellX;
+    int minCellY;
+  };
+  
+  struct Placement {
+    u32 objectId;
+    CellRange cells;
+  };
+  
+  /// Returns the range of cells that the rect overlaps (clamped to the grid).
+  CellRange GetCellRange(const QRectF& rect) const;
+  
+  void AddToCells(u32 objectId, ClientObject* object, const QRectF& bounds, const CellRange& range);
+  void RemoveFromCells(ClientObject* object, const CellRange& range);
+  
+  
+  /// Projected coordinates of the top-left corner of cell (0, 0).
+  QPointF origin;
+  
+  int cellsX = 0;
+  int cellsY = 0;
+  
+  /// An element (x, y) has index: [y * cellsX + x].
+  std::vector<std::vector<Entry>> cells;
+  
+  /// Map of object -> its ID and the cells it is stored in.
+  std::unordered_map<ClientObject*, Placement> placements;
+};
@@ -34,6 +34,7 @@
 #include "FreeAge/client/shader_color_dilation.hpp"
 #include "FreeAge/client/sprite.hpp"
 #include "FreeAge/client/sprite_atlas.hpp"
+#include "FreeAge/client/sprite_loader.hpp"
 #include "FreeAge/common/timing.hpp"
 #include "FreeAge/common/util.hpp"
 
@@ -370,43 +371,40 @@ bool RenderWindow::LoadResources() {
   hpDisplay.Initialize();
   carriedResourcesDisplay.Initialize();
   
-  // Load unit resources.
-  LOG(1) << "LoadResource(): Starting to load units";
+  // Load unit, building, and "move to" sprites. The sprite files are decoded and packed into atlases
+  // by the sprite loader's worker threads, while this thread (which has the OpenGL context) requests the
+  // sprites, loads the icons, and transfers the finished atlases to the GPU.
+  LOG(1) << "LoadResource(): Starting to load units and buildings";
+  
+  SpriteLoader spriteLoader(SpriteLoader::GetDefaultNumWorkerThreads());
+  SpriteManager::Instance().SetLoader(&spriteLoader);
   
   auto& unitTypes = ClientUnitType::GetUnitTypes();
   unitTypes.resize(static_cast<int>(UnitType::NumUnits));
   for (int unitType = 0; unitType < static_cast<int>(UnitType::NumUnits); ++ unitType) {
-    Timer timer("LoadResources() - Load unit");
     if (!unitTypes[unitType].Load(static_cast<UnitType>(unitType), graphicsSubPath, cachePath, colorDilationShader.get(), palettes)) {
       LOG(ERROR) << "Exiting because of a resource load error for unit " << unitType << ".";
       emit LoadingError(tr("Failed to load unit type: %1. Aborting.").arg(unitType));
+      SpriteManager::Instance().SetLoader(nullptr);
       return false;
     }
-    
-    didLoadingStep();
   }
   
-  // Load building resources.
-  LOG(1) << "LoadResource(): Starting to load buildings";
-  
   auto& buildingTypes = ClientBuildingType::GetBuildingTypes();
   buildingTypes.resize(static_cast<int>(BuildingType::NumBuildings));
   for (int buildingType = 0; buildingType < static_cast<int>(BuildingType::NumBuildings); ++ buildingType) {
-    Timer timer("LoadResources() - Load building");
     if (!buildingTypes[buildingType].Load(static_cast<BuildingType>(buildingType), graphicsSubPath, cachePath, colorDilationShader.get(), palettes)) {
       LOG(ERROR) << "Exiting because of a resource load error for building " << buildingType << ".";
       emit LoadingError(tr("Failed to load building type: %1. Aborting.").arg(buildingType));
+      SpriteManager::Instance().SetLoader(nullptr);
       return false;
     }
-    
-    didLoadingStep();
   }
   
-  // Load "move to" sprite.
-  LOG(1) << "LoadResource(): Loading the 'move-to' sprite";
+  SpriteManager::Instance().SetLoader(nullptr);
   
   moveToSprite.reset(new SpriteAndTextures());
-  LoadSpriteAndTexture(
+  spriteLoader.Submit(
       GetModdedPath(graphicsSubPath.parent_path().parent_path() / "particles" / "textures" / "test_move" / "p_all_move_%04i.png").string().c_str(),
       (cachePath / "p_all_move_0000.png").string().c_str(),
       GL_CLAMP_TO_EDGE,
@@ -415,7 +413,36 @@ bool RenderWindow::LoadResources() {
       &moveToSprite->graphicTexture,
       &moveToSprite->shadowTexture,
       palettes);
-  didLoadingStep();
+  
+  // Wait for the sprites. Their loading progress is mapped onto the loading steps that are
+  // reserved for them (one per unit type, one per building type, and one for the "move to" sprite).
+  LOG(1) << "LoadResource(): Waiting for " << spriteLoader.GetNumSubmittedJobs() << " sprites";
+  
+  const int numSpriteLoadingSteps = static_cast<int>(UnitType::NumUnits) + static_cast<int>(BuildingType::NumBuildings) + 1;
+  int numSpriteLoadingStepsDone = 0;
+  Timer spritesTimer("LoadResources() - Load sprites");
+  bool spritesLoaded = spriteLoader.Finish([&](int numFinishedJobs, int numJobs) {
+    while (numSpriteLoadingStepsDone < (numSpriteLoadingSteps * numFinishedJobs) / numJobs) {
+      ++ numSpriteLoadingStepsDone;
+      didLoadingStep();
+    }
+  });
+  spritesTimer.Stop();
+  if (!spritesLoaded) {
+    LOG(ERROR) << "Exiting because of a sprite load error.";
+    emit LoadingError(tr("Failed to load the unit and building sprites. Aborting."));
+    return false;
+  }
+  
+  for (ClientUnitType& unitType : unitTypes) {
+    unitType.FinishLoading();
+  }
+  for (ClientBuildingType& buildingType : buildingTypes) {
+    buildingType.FinishLoading();
+  }
+  
+  // Pack the sprite textures into a few texture arrays, such that each render pass needs only a few draw calls.
+  SpriteManager::Instance().PackTexturesIntoArrays();
   
   // Load game UI textures.
   const std::string architectureNameCaps = "ASIA";  // TODO: Choose depending on civilization
@@ -1014,8 +1041,8 @@ void RenderWindow::RenderSprites(std::vector<Texture*>* textures, const std::sha
   shader->GetProgram()->UseProgram(f);
   
   for (Texture* texture : *textures) {
-    // Bind the texture
-    f->glBindTexture(GL_TEXTURE_2D, texture->GetId());
+    // Bind the texture (sprite textures are always texture arrays, see SpriteManager::PackTexturesIntoArrays())
+    f->glBindTexture(GL_TEXTURE_2D_ARRAY, texture->GetId());
     f->glUniform2f(shader->GetTextureSizeLocation(), texture->GetWidth(), texture->GetHeight());
     
     // Issue the render call
@@ -1047,7 +1074,7 @@ void RenderWindow::RenderShadows(double displayedServerTime, QOpenGLFunctions_3_
   
   float effectiveZoom = ComputeEffectiveZoom();
   
-  for (auto& object : map->GetObjects()) {
+  for (auto& object : objectsInView) {
     // TODO: Use virtual functions here to reduce duplicated code among buildings and units?
     
     if (object.second->isBuilding()) {
@@ -1131,7 +1158,7 @@ void RenderWindow::RenderBuildings(double displayedServerTime, bool buildingsTha
   
   float effectiveZoom = ComputeEffectiveZoom();
   
-  for (auto& object : map->GetObjects()) {
+  for (auto& object : objectsInView) {
     if (!object.second->isBuilding()) {
       continue;
     }
@@ -1309,7 +1336,7 @@ void RenderWindow::RenderOutlines(double displayedServerTime, QOpenGLFunctions_3
   
   float effectiveZoom = ComputeEffectiveZoom();
   
-  for (auto& object : map->GetObjects()) {
+  for (auto& object : objectsInView) {
     // TODO: Use virtual functions here to reduce duplicated code among buildings and units?
     
     QRgb outlineColor;
@@ -1412,7 +1439,7 @@ void RenderWindow::RenderUnits(double displayedServerTime, QOpenGLFunctions_3_2_
   
   float effectiveZoom = ComputeEffectiveZoom();
   
-  for (auto& object : map->GetObjects()) {
+  for (auto& object : objectsInView) {
     if (!object.second->isUnit()) {
       continue;
     }
@@ -1804,13 +1831,21 @@ void RenderWindow::RenderGameUI(double displayedServerTime, double secondsSinceL
   if (menuShown) {
     RenderMenu(f);
   } else if (match->GetThisPlayer().state != Match::PlayerState::Playing) {
-    // Render the game end text display ("Victory!" or "Defeat!")
+    // Render the game end text display ("Victory!", "Defeat!", or "Connection lost" if reconnecting failed)
+    QString gameEndText;
+    if (match->GetThisPlayer().state == Match::PlayerState::Won) {
+      gameEndText = tr("Victory!");
+    } else if (match->GetThisPlayer().state == Match::PlayerState::Dropped) {
+      gameEndText = tr("Connection lost");
+    } else {
+      gameEndText = tr("Defeat!");
+    }
     for (int shadow = 0; shadow < 2; ++ shadow) {
       int offset = (shadow == 0) ? (uiScale * 8) : 0;
       gameEndTextDisplay.textDisplay->Render(
           georgiaFontHuge,
           (shadow == 0) ? qRgba(0, 0, 0, 255) : qRgba(255, 255, 255, 255),
-          (match->GetThisPlayer().state == Match::PlayerState::Won) ? tr("Victory!") : tr("Defeat!"),
+          gameEndText,
           QRect(offset, offset, widgetWidth, widgetHeight),
           Qt::AlignHCenter | Qt::AlignVCenter,
           (shadow == 0) ? gameEndTextDisplayShadowPointBuffer.buffer : gameEndTextDisplay.pointBuffer,
@@ -2667,7 +2702,15 @@ bool RenderWindow::GetObjectToSelectAt(float x, float y, u32* objectId, std::vec
     return area * std::min<float>(1.f, offsetLength / (0.5f * std::max(rect.width(), rect.height())));
   };
   
-  for (auto& object : map->GetObjects()) {
+  // Units can be selected slightly outside of their sprites.
+  constexpr float kExtendSize = 8;
+  
+  std::vector<std::pair<u32, ClientObject*>> objectsAtPosition;
+  map->FindObjectsInProjectedRect(
+      QRectF(projectedCoord.x() - kExtendSize, projectedCoord.y() - kExtendSize, 2 * kExtendSize, 2 * kExtendSize),
+      &objectsAtPosition);
+  
+  for (auto& object : objectsAtPosition) {
     // TODO: Use virtual functions here to reduce duplicated code among buildings and units?
     bool addToList = false;
     QRectF projectedCoordsRect;
@@ -2718,8 +2761,6 @@ bool RenderWindow::GetObjectToSelectAt(float x, float y, u32* objectId, std::vec
       }
       
       // Is the position close to the unit sprite?
-      constexpr float kExtendSize = 8;
-      
       projectedCoordsRect = unit.GetRectInProjectedCoords(
           map.get(),
           lastDisplayedServerTime,
@@ -2781,10 +2822,13 @@ void RenderWindow::BoxSelection(const QPoint& p0, const QPoint& p1) {
       std::abs(pr0.x() - pr1.x()),
       std::abs(pr0.y() - pr1.y()));
   
+  std::vector<std::pair<u32, ClientObject*>> candidateObjects;
+  map->FindObjectsInProjectedRect(selectionRect, &candidateObjects);
+  
   std::vector<std::pair<u32, ClientObject*>> objects;
   bool haveOwnObject = false;
   
-  for (auto& object : map->GetObjects()) {
+  for (auto& object : candidateObjects) {
     if (object.second->isUnit()) {
       ClientUnit& unit = *AsUnit(object.second);
       
@@ -3036,26 +3080,10 @@ QPointF projectedCoord = ScreenCoordToProjectedCoord(cursorPos.x(), cursorPos.y(
   
   // 1) Check whether any map tile at this location is occupied.
   // TODO: Prevent "foundation scanning" in the semi-black fog of war.
-  QRect foundationRect(foundationBaseTile, foundationSize);
-  for (const auto& item : map->GetObjects()) {
-    if (item.second->isBuilding()) {
-      ClientBuilding* building = AsBuilding(item.second);
-      QRect occupiedRect(building->GetBaseTile(), GetBuildingSize(building->GetType()));
-      if (foundationRect.intersects(occupiedRect)) {
-        return false;
-      }
-    }
+  if (map->IsAreaOccupiedForBuildings(QRect(foundationBaseTile, foundationSize))) {
+    return false;
   }
   
-  // NOTE: Code if we were to track the map occupancy on the client:
-  // for (int y = foundationBaseTile.y(); y < foundationBaseTile.y() + foundationSize.height(); ++ y) {
-  //   for (int x = foundationBaseTile.x(); x < foundationBaseTile.x() + foundationSize.width(); ++ x) {
-  //     if (map->occupiedAt(x, y)) {
-  //       return false;
-  //     }
-  //   }
-  // }
-  
   // 2) Check whether the maximum elevation difference within the building space does not exceed 2,
   //    and whether any building tile is in the black fog of war.
   //    TODO: I made the first part of this criterion up; is that actually how the original game works?
@@ -3642,6 +3670,10 @@ void RenderWindow::paintGL() {
   UpdateView(now, f);
   CHECK_OPENGL_NO_ERROR();
   
+  // Find the objects that may be visible for the rendering passes below.
+  objectsInView.clear();
+  map->FindObjectsInProjectedRect(projectedCoordsViewRect, &objectsInView);
+  
   // Set states for rendering.
   f->glDisable(GL_CULL_FACE);
   
@@ -300,6 +300,10 @@ class RenderWindow : public QOpenGLWindow {
   float viewMatrix[4];  // column-major
   QRectF projectedCoordsViewRect;
   
+  /// The objects that may be visible within projectedCoordsViewRect. Determined once
+  /// per frame, such that the rendering passes do not need to iterate over all objects.
+  std::vector<std::pair<u32, ClientObject*>> objectsInView;
+  
   // Shaders.
   std::shared_ptr<ColorDilationShader> colorDilationShader;
   std::shared_ptr<UIShader> uiShader;
@@ -11,6 +11,7 @@
 #include <QThread>
 
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/message_buffer.hpp"
 
 // TODO (puzzlepaint): For some reason, this include needed to be at the end using clang-10-rc2 on my laptop to not cause weird errors in CIDE. Why?
 #include <mango/core/endian.hpp>
@@ -76,7 +77,7 @@ class ServerConnectionThread : public QThread {
   bool ConnectToServer(const QString& serverAddress, int timeout, bool retryUntilTimeout) {
     // Clear old data.
     receivedMessagesMutex.lock();
-    unparsedReceivedBuffer.clear();
+    unparsedReceivedBuffer.Clear();
     receivedMessages.clear();
     receivedMessagesMutex.unlock();
     
@@ -93,6 +94,17 @@ class ServerConnectionThread : public QThread {
     sentPings.clear();
     nextPingNumber = 0;
     
+    // Clean up after a previous connection (when reconnecting).
+    if (pingAndConnectionCheckTimer) {
+      pingAndConnectionCheckTimer->stop();
+      delete pingAndConnectionCheckTimer;
+      pingAndConnectionCheckTimer = nullptr;
+    }
+    disconnect(socket, &QTcpSocket::readyRead, nullptr, nullptr);
+    if (socket->state() != QAbstractSocket::UnconnectedState) {
+      socket->abort();
+    }
+    
     // Issue the connection request
     socket->connectToHost(serverAddress, serverPort, QIODevice::ReadWrite);
     // socket.setLocalPort(TODO?);
@@ -167,37 +179,21 @@ class ServerConnectionThread : public QThread {
   void TryParseMessages() {
     TimePoint receiveTime = Clock::now();
     
-    QByteArray& buffer = unparsedReceivedBuffer;
-    buffer += socket->readAll();
+    unparsedReceivedBuffer.Append(socket->readAll());
     
-    while (true) {
-      if (buffer.size() < 3) {
-        return;
-      }
-      
-      char* data = buffer.data();
-      u16 msgLength = mango::uload16(data + 1);
-      
-      if (buffer.size() < msgLength) {
-        return;
-      }
+    QByteArray msg;
+    while (unparsedReceivedBuffer.TakeMessage(&msg)) {
+      ServerToClientMessage msgType = static_cast<ServerToClientMessage>(msg.at(0));
       
-      if (msgLength < 3) {
-        LOG(ERROR) << "Received a too short message. The given message length is (should be at least 3): " << msgLength;
+      if (msgType == ServerToClientMessage::PingResponse) {
+        HandlePingResponseMessage(msg, receiveTime);
       } else {
-        ServerToClientMessage msgType = static_cast<ServerToClientMessage>(data[0]);
-        
-        if (msgType == ServerToClientMessage::PingResponse) {
-          HandlePingResponseMessage(buffer, receiveTime);
-        } else {
-          receivedMessagesMutex.lock();
-          receivedMessages.emplace_back(msgType, buffer.mid(3, msgLength - 3));
-          receivedMessagesMutex.unlock();
-          emit NewMessage();
-        }
+        // Since the message gets processed on a different thread, it has to be copied out of the buffer here.
+        receivedMessagesMutex.lock();
+        receivedMessages.emplace_back(msgType, msg.mid(3));
+        receivedMessagesMutex.unlock();
+        emit NewMessage();
       }
-      
-      buffer.remove(0, msgLength);
     }
   }
   
@@ -367,7 +363,7 @@ class ServerConnectionThread : public QThread {
   QTcpSocket* socket = nullptr;
   
   /// Contains data which has been received from the server but was not parsed yet.
-  QByteArray unparsedReceivedBuffer;
+  MessageBuffer unparsedReceivedBuffer;
   
   /// Array of messages that were extracted from unparsedReceivedBuffer but have not been
   /// further processed yet.
@@ -458,6 +454,10 @@ struct ThreadWorker : public QObject {
     return thread->ConnectToServer(serverAddress, timeout, retryUntilTimeout);
   }
   
+  void ConnectToServerAsync(const QString& serverAddress, int timeout) {
+    emit ConnectionAttemptFinished(thread->ConnectToServer(serverAddress, timeout, /*retryUntilTimeout*/ false));
+  }
+  
   void Shutdown() {
     thread->Shutdown();
   }
@@ -466,6 +466,9 @@ struct ThreadWorker : public QObject {
     thread->Write(data);
   }
   
+ signals:
+  void ConnectionAttemptFinished(bool connected);
+  
  private:
   ServerConnectionThread* thread;
 };
@@ -480,8 +483,10 @@ ServerConnection::ServerConnection() {
   
   // Create a dummy QObject living in the thread. This allows to run code in the
   // thread by calling QMetaObject::invokeMethod() with the dummyWorker as context object.
-  dummyWorker = new ThreadWorker(thread);
-  dummyWorker->moveToThread(thread);
+  ThreadWorker* worker = new ThreadWorker(thread);
+  connect(worker, &ThreadWorker::ConnectionAttemptFinished, this, &ServerConnection::ConnectionAttemptFinishedInternal, Qt::QueuedConnection);
+  worker->moveToThread(thread);
+  dummyWorker = worker;
 }
 
 ServerConnection::~ServerConnection() {
@@ -506,6 +511,10 @@ bool ServerConnection::ConnectToServer(const QString& serverAddress, int timeout
   return result;
 }
 
+void ServerConnection::ConnectToServerAsync(const QString& serverAddress, int timeout) {
+  QMetaObject::invokeMethod(dummyWorker, "ConnectToServerAsync", Qt::QueuedConnection, Q_ARG(QString, serverAddress), Q_ARG(int, timeout));
+}
+
 void ServerConnection::Shutdown() {
   QMetaObject::invokeMethod(dummyWorker, "Shutdown", Qt::BlockingQueuedConnection);
 }
@@ -598,4 +607,11 @@ void ServerConnection::ConnectionLostInternal() {
   emit ConnectionLost();
 }
 
+void ServerConnection::ConnectionAttemptFinishedInternal(bool connected) {
+  if (connected) {
+    connectionToServerLost = false;
+  }
+  emit ConnectionAttemptFinished(connected);
+}
+
 #include "server_connection.moc"
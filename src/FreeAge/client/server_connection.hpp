@@ -46,6 +46,10 @@ class ServerConnection : public QObject {
   
   bool ConnectToServer(const QString& serverAddress, int timeout, bool retryUntilTimeout);
   
+  /// Variant of ConnectToServer() that returns immediately (without retrying).
+  /// The ConnectionAttemptFinished() signal is emitted once the attempt finished.
+  void ConnectToServerAsync(const QString& serverAddress, int timeout);
+  
   void Shutdown();
   
   bool WaitForWelcomeMessage(int timeout, u32* serverNetworkProtocolVersion);
@@ -88,10 +92,14 @@ class ServerConnection : public QObject {
   
   void ConnectionLost();
   
+  /// Signals that an attempt started with ConnectToServerAsync() finished.
+  void ConnectionAttemptFinished(bool connected);
+  
  private slots:
   void NewMessageInternal();
   void NewPingMeasurementInternal(int milliseconds);
   void ConnectionLostInternal();
+  void ConnectionAttemptFinishedInternal(bool connected);
   
  private:
   ServerConnectionThread* thread;
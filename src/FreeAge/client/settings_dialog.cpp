@@ -383,10 +383,19 @@ void SettingsDialog::JoinGame() {
   bool ok;
   serverAddressText = QInputDialog::getText(
       this, tr("Enter server address to connect to"), tr("Address:"), QLineEdit::Normal, "127.0.0.1", &ok);
-  if (ok && !serverAddressText.isEmpty()) {
-    hostGameChosen = false;
-    accept();
+  if (!ok || serverAddressText.isEmpty()) {
+    return;
   }
+  
+  // Servers that host multiple matches need to know which match to join.
+  matchToken = QInputDialog::getText(
+      this, tr("Enter match code"), tr("Match code (leave empty if the server hosts a single match):"), QLineEdit::Normal, "", &ok);
+  if (!ok) {
+    return;
+  }
+  
+  hostGameChosen = false;
+  accept();
 }
 
 void SettingsDialog::ShowAboutDialog() {
@@ -40,6 +40,7 @@ class SettingsDialog : public QDialog {
   inline bool HostGameChosen() const { return hostGameChosen; }
   inline const QString& GetServerAddress() const { return serverAddressText; }
   inline const QString& GetHostPassword() const { return hostPassword; }
+  inline const QString& GetMatchToken() const { return matchToken; }
   
  private slots:
   void HostGame();
@@ -62,6 +63,7 @@ class SettingsDialog : public QDialog {
   bool hostGameChosen;
   QString serverAddressText;
   QString hostPassword;
+  QString matchToken;
   
   Settings* settings;
 };
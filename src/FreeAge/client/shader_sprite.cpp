@@ -22,7 +22,8 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
       "in vec3 in_position;\n"
       "in vec2 in_size;\n"
       "in uvec2 in_tex_topleft;\n"
-      "in uvec2 in_tex_bottomright;\n";
+      "in uvec2 in_tex_bottomright;\n"
+      "in uint in_layer;\n";
   if (outline) {
     vertexShaderSrc +=
         "in vec3 in_playerColor;\n"
@@ -40,10 +41,12 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
       "out vec2 var_size;\n"
       "out vec2 var_tex_topleft;\n"
       "out vec2 var_tex_bottomright;\n"
+      "flat out float var_layer;\n"
       "\n"
       "uniform mat2 u_viewMatrix;\n"
       "void main() {\n"
       "  var_size = in_size;\n"
+      "  var_layer = float(in_layer);\n"
       "  var_tex_topleft = vec2(float(in_tex_topleft.x) / u_textureSize.x, float(in_tex_topleft.y) / u_textureSize.y);\n"
       "  var_tex_bottomright = vec2(float(in_tex_bottomright.x) / u_textureSize.x, float(in_tex_bottomright.y) / u_textureSize.y);\n";
   if (outline) {
@@ -67,7 +70,8 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
       "\n"
       "in vec2 var_size[];\n"
       "in vec2 var_tex_topleft[];\n"
-      "in vec2 var_tex_bottomright[];\n";
+      "in vec2 var_tex_bottomright[];\n"
+      "flat in float var_layer[];\n";
   if (outline) {
     geometryShaderSrc +=
         "in vec3 var_playerColor[];\n"
@@ -83,8 +87,10 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
   }
   geometryShaderSrc +=
       "out vec2 texcoord;\n"
+      "flat out float layer;\n"
       "\n"
       "void main() {\n"
+      "  layer = var_layer[0];\n"
       "  gl_Position = vec4(gl_in[0].gl_Position.x, gl_in[0].gl_Position.y, gl_in[0].gl_Position.z, 1.0);\n"
       "  texcoord = vec2(var_tex_topleft[0].x, var_tex_topleft[0].y);\n";
   if (outline) {
@@ -117,11 +123,12 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
         "layout(location = 0) out vec4 out_color;\n"
         "\n"
         "in vec2 texcoord;\n"
+        "flat in float layer;\n"
         "\n"
-        "uniform sampler2D u_texture;\n"
+        "uniform sampler2DArray u_texture;\n"
         "\n"
         "void main() {\n"
-        "  out_color = vec4(0, 0, 0, 1.5 * texture(u_texture, texcoord.xy).r);\n"  // TODO: Magic factor 1.5 makes it look nicer (darker shadows)
+        "  out_color = vec4(0, 0, 0, 1.5 * texture(u_texture, vec3(texcoord.xy, layer)).r);\n"  // TODO: Magic factor 1.5 makes it look nicer (darker shadows)
         "}\n",
         ShaderProgram::ShaderType::kFragmentShader, f));
   } else if (outline) {
@@ -130,9 +137,10 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
         "layout(location = 0) out vec4 out_color;\n"
         "\n"
         "in vec2 texcoord;\n"
+        "flat in float layer;\n"
         "in vec3 playerColor;\n"
         "\n"
-        "uniform sampler2D u_texture;\n"
+        "uniform sampler2DArray u_texture;\n"
         "uniform vec2 u_textureSize;\n"
         "\n"
         "float GetOutlineAlpha(vec4 value) {\n"
@@ -153,13 +161,13 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
         "  float fx = pixelTexcoord.x - 0.5 - ix;\n"
         "  float fy = pixelTexcoord.y - 0.5 - iy;\n"
         "  \n"
-        "  vec4 value = texture(u_texture, vec2((ix + 0.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y));\n"
+        "  vec4 value = texture(u_texture, vec3((ix + 0.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y, layer));\n"
         "  float topLeftAlpha = GetOutlineAlpha(value);\n"
-        "  value = texture(u_texture, vec2((ix + 1.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y));\n"
+        "  value = texture(u_texture, vec3((ix + 1.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y, layer));\n"
         "  float topRightAlpha = GetOutlineAlpha(value);\n"
-        "  value = texture(u_texture, vec2((ix + 0.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y));\n"
+        "  value = texture(u_texture, vec3((ix + 0.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y, layer));\n"
         "  float bottomLeftAlpha = GetOutlineAlpha(value);\n"
-        "  value = texture(u_texture, vec2((ix + 1.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y));\n"
+        "  value = texture(u_texture, vec3((ix + 1.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y, layer));\n"
         "  float bottomRightAlpha = GetOutlineAlpha(value);\n"
         "  \n"
         "  float outAlpha =\n"
@@ -180,10 +188,11 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
         "layout(location = 0) out vec4 out_color;\n"
         "\n"
         "in vec2 texcoord;\n"
+        "flat in float layer;\n"
         "flat in int playerIndex;\n"
         "in vec3 modulationColor;\n"
         "\n"
-        "uniform sampler2D u_texture;\n"
+        "uniform sampler2DArray u_texture;\n"
         "uniform vec2 u_textureSize;\n"
         "uniform sampler2D u_playerColorsTexture;\n"
         "uniform vec2 u_playerColorsTextureSize;\n"
@@ -206,13 +215,13 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
         "  float fx = pixelTexcoord.x - 0.5 - ix;\n"
         "  float fy = pixelTexcoord.y - 0.5 - iy;\n"
         "  \n"
-        "  vec4 topLeft = texture(u_texture, vec2((ix + 0.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y));\n"
+        "  vec4 topLeft = texture(u_texture, vec3((ix + 0.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y, layer));\n"
         "  topLeft = AdjustPlayerColor(topLeft);\n"
-        "  vec4 topRight = texture(u_texture, vec2((ix + 1.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y));\n"
+        "  vec4 topRight = texture(u_texture, vec3((ix + 1.5) / u_textureSize.x, (iy + 0.5) / u_textureSize.y, layer));\n"
         "  topRight = AdjustPlayerColor(topRight);\n"
-        "  vec4 bottomLeft = texture(u_texture, vec2((ix + 0.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y));\n"
+        "  vec4 bottomLeft = texture(u_texture, vec3((ix + 0.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y, layer));\n"
         "  bottomLeft = AdjustPlayerColor(bottomLeft);\n"
-        "  vec4 bottomRight = texture(u_texture, vec2((ix + 1.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y));\n"
+        "  vec4 bottomRight = texture(u_texture, vec3((ix + 1.5) / u_textureSize.x, (iy + 1.5) / u_textureSize.y, layer));\n"
         "  bottomRight = AdjustPlayerColor(bottomRight);\n"
         "  \n"
         "  out_color =\n"
@@ -254,13 +263,15 @@ SpriteShader::SpriteShader(bool shadow, bool outline)
   CHECK_GE(tex_topleft_location, 0);
   tex_bottomright_location = f->glGetAttribLocation(program->program_name(), "in_tex_bottomright");
   CHECK_GE(tex_bottomright_location, 0);
+  layer_location = f->glGetAttribLocation(program->program_name(), "in_layer");
+  CHECK_GE(layer_location, 0);
   
   if (outline) {
-    vertexSize = (3 + 2 + 1 + 1 + 1) * sizeof(float);
+    vertexSize = (3 + 2 + 1 + 1 + 1 + 1) * sizeof(float);
   } else if (shadow) {
-    vertexSize = (3 + 2 + 1 + 1) * sizeof(float);
-  } else {
     vertexSize = (3 + 2 + 1 + 1 + 1) * sizeof(float);
+  } else {
+    vertexSize = (3 + 2 + 1 + 1 + 1 + 1) * sizeof(float);
   }
 }
 
@@ -302,5 +313,9 @@ void SpriteShader::UseProgramAndSetAttribPointers(QOpenGLFunctions_3_2_Core* f)
     offset += 1;
   }
   
+  f->glEnableVertexAttribArray(layer_location);
+  f->glVertexAttribIPointer(layer_location, 1, GetGLType<u32>::value, vertexSize, reinterpret_cast<void*>(offset));
+  offset += 4;
+  
   CHECK_OPENGL_NO_ERROR();
 }
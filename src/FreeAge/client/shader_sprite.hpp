@@ -39,6 +39,7 @@ class SpriteShader {
   GLint playerIndex_location;
   GLint tex_topleft_location;
   GLint tex_bottomright_location;
+  GLint layer_location;
   GLint playerColor_location;
   GLint modulationColor_location;
   
@@ -4,6 +4,7 @@
 
 #include "FreeAge/client/sprite.hpp"
 
+#include <algorithm>
 #include <filesystem>
 
 #include <mango/image/image.hpp>
@@ -15,7 +16,11 @@
 #include "FreeAge/client/shader_program.hpp"
 #include "FreeAge/client/shader_sprite.hpp"
 #include "FreeAge/client/sprite_atlas.hpp"
+#include "FreeAge/client/sprite_cache.hpp"
+#include "FreeAge/client/sprite_decoding.hpp"
+#include "FreeAge/client/sprite_loader.hpp"
 #include "FreeAge/client/texture.hpp"
+#include "RectangleBinPack/MaxRectsBinPack.h"
 
 bool LoadSMXGraphicLayer(
     const SMXLayerHeader& layerHeader,
@@ -61,6 +66,8 @@ bool LoadSMXGraphicLayer(
   const u8* commandPtr = commandArray.data();
   const u8* pixelPtr = pixelArray.data();
   int decompressionState = 0;
+  PixelDecodingPath decodingPath = GetBestPixelDecodingPath();
+  u16 runIndices[kMaxSMXPixelRunLength];
   for (int row = 0; row < layerHeader.height; ++ row) {
     QRgb* out = reinterpret_cast<QRgb*>(graphic.scanLine(row));
     
@@ -94,21 +101,22 @@ bool LoadSMXGraphicLayer(
         }
         col += count;
       } else if (commandCode == 0b01 || commandCode == 0b10) {
-        // Choose the normal or player-color palette depending on the command.
-        const Palette* palette = (commandCode == 0b01) ? &standardPalette : nullptr;
-        
-        // Draw *count* pixels from that palette.
+        // Draw *count* pixels, using the normal or player-color palette depending on the command.
+        // The whole run is decoded at once: first its palette indices are unpacked, then
+        // they are expanded to colors (with SIMD instructions if available).
         u8 count = (command >> 2) + 1;
-        bool ignoreAlpha = true;  /*layerType == SMXLayerType::Graphic*/
-        for (int i = 0; i < count; ++ i) {
-          if (usesEightToFiveCompression) {
-            *out = DecompressNextPixel8To5(pixelPtr, decompressionState, palette, ignoreAlpha);
-          } else {
-            *out = DecompressNextPixel4Plus1(pixelPtr, decompressionState, palette, ignoreAlpha);
-          }
-          
-          ++ out;
+        if (usesEightToFiveCompression) {
+          UnpackPixels8To5(pixelPtr, decompressionState, count, runIndices);
+        } else {
+          UnpackPixels4Plus1(pixelPtr, decompressionState, count, runIndices);
         }
+        
+        if (commandCode == 0b01) {
+          ExpandPalettedPixels(runIndices, count, standardPalette.data(), standardPalette.size(), out, decodingPath);
+        } else {
+          ExpandPlayerColorPixels(runIndices, count, out, decodingPath);
+        }
+        out += count;
         col += count;
       } else if (commandCode == 0b11) {
         // End of row.
@@ -678,6 +686,17 @@ bool Sprite::LoadFromFile(const char* path, const Palettes& palettes) {
   }
 }
 
+QRectF Sprite::ComputeBounds() const {
+  QRectF bounds;
+  for (const Frame& frame : frames) {
+    bounds = bounds.united(QRectF(-frame.graphic.centerX, -frame.graphic.centerY, frame.graphic.imageWidth, frame.graphic.imageHeight));
+    if (frame.shadow.centerX >= 0) {
+      bounds = bounds.united(QRectF(-frame.shadow.centerX, -frame.shadow.centerY, frame.shadow.imageWidth, frame.shadow.imageHeight));
+    }
+  }
+  return bounds;
+}
+
 bool Sprite::LoadFromSMXFile(FILE* file, const Palettes& palettes) {
   // Read the header.
   SMXHeader smxHeader;
@@ -849,11 +868,12 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
         // NOTE: We only seek to the first offset and then assume that the following rows are stored sequentially.
         fseek(file, frameOffsets[frameIdx] + smpCommandOffsets[0], SEEK_SET);
         
-        constexpr bool ignoreAlpha = true;  /*layerType == SMXLayerType::Graphic*/
-        
         // Build the image.
         QImage graphic(layerHeader.width, layerHeader.height, QImage::Format_ARGB32);
         
+        PixelDecodingPath decodingPath = GetBestPixelDecodingPath();
+        SMPPixel runPixels[kMaxSMXPixelRunLength];
+        u16 runIndices[kMaxSMXPixelRunLength];
         for (usize row = 0; row < layerHeader.height; ++ row) {
           QRgb* out = reinterpret_cast<QRgb*>(graphic.scanLine(row));
           
@@ -892,20 +912,35 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
             } else if (commandCode == 0b01 || commandCode == 0b10) {
               u8 count = (command >> 2) + 1;
               
+              // Read all pixels of the run at once and unpack their palette indices.
+              if (fread(runPixels, sizeof(SMPPixel), count, file) != count) {
+                LOG(ERROR) << "Unexpected EOF while trying to read SMPPixels";
+                return false;
+              }
               for (int i = 0; i < count; ++ i) {
-                SMPPixel pixel;
-                if (fread(&pixel, sizeof(SMPPixel), 1, file) != 1) {
-                  LOG(ERROR) << "Unexpected EOF while trying to read an SMPPixel";
-                  return false;
+                int paletteSection = runPixels[i].palette & 0b11;
+                runIndices[i] = 256 * paletteSection + runPixels[i].index;
+              }
+              
+              if (commandCode == 0b01) {
+                // Expand the pixels in batches of consecutive pixels that use the same palette,
+                // such that the palette only needs to be looked up once per batch.
+                int batchStart = 0;
+                while (batchStart < count) {
+                  int paletteIndex = runPixels[batchStart].palette >> 2;
+                  int batchEnd = batchStart + 1;
+                  while (batchEnd < count && (runPixels[batchEnd].palette >> 2) == paletteIndex) {
+                    ++ batchEnd;
+                  }
+                  
+                  const Palette& palette = palettes.at(paletteIndex);
+                  ExpandPalettedPixels(runIndices + batchStart, batchEnd - batchStart, palette.data(), palette.size(), out + batchStart, decodingPath);
+                  batchStart = batchEnd;
                 }
-                
-                int paletteIndex = pixel.palette >> 2;
-                int paletteSection = pixel.palette & 0b11;
-                
-                // TODO: If we load a lot of SMPs, we might want to optimize the unordered_map access here (cache the last used palette and re-use it if it is the same for the next pixel)
-                *out = GetPalettedPixel((commandCode == 0b01) ? &palettes.at(paletteIndex) : nullptr, paletteSection, pixel.index, ignoreAlpha);
-                ++ out;
+              } else {
+                ExpandPlayerColorPixels(runIndices, count, out, decodingPath);
               }
+              out += count;
               col += count;
             } else if (commandCode == 0b11) {
               // End of row.
@@ -1016,9 +1051,17 @@ SpriteAndTextures* SpriteManager::GetOrLoad(const char* path, const char* cacheP
     return it->second;
   }
   
-  // Load the sprite.
   SpriteAndTextures* newSprite = new SpriteAndTextures();
   newSprite->referenceCount = 1;
+  
+  if (loader) {
+    // Let the loader load the sprite in the background. Errors are reported by SpriteLoader::Finish().
+    loader->Submit(path, cachePath, GL_CLAMP_TO_EDGE, colorDilationShader, &newSprite->sprite, &newSprite->graphicTexture, &newSprite->shadowTexture, palettes);
+    loadedSprites.insert(std::make_pair(path, newSprite));
+    return newSprite;
+  }
+  
+  // Load the sprite.
   if (!LoadSpriteAndTexture(path, cachePath, GL_CLAMP_TO_EDGE, colorDilationShader, &newSprite->sprite, &newSprite->graphicTexture, &newSprite->shadowTexture, palettes)) {
     LOG(ERROR) << "Failed to load sprite: " << path;
     return nullptr;
@@ -1043,18 +1086,136 @@ void SpriteManager::Dereference(SpriteAndTextures* sprite) {
     if (it->second == sprite) {
       loadedSprites.erase(it);
       delete sprite;
+      DeleteUnusedTextureArrays();
       return;
     }
   }
   
   LOG(ERROR) << "The reference count for a sprite reached zero, but it could not be found in loadedSprites to remove it from there.";
   delete sprite;
+  DeleteUnusedTextureArrays();
+}
+
+/// Packs the given sprite textures (texture arrays with a single layer each) into the layers of
+/// new texture arrays, which are appended to textureArrays.
+static void PackTexturesIntoArrays(const std::vector<Texture*>& textures, bool singleChannel, int magFilter, int minFilter, std::vector<std::unique_ptr<Texture>>* textureArrays) {
+  if (textures.empty()) {
+    return;
+  }
+  
+  QOpenGLFunctions_3_2_Core* f = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_2_Core>();
+  
+  GLint maxTextureSize;
+  f->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+  GLint maxArrayTextureLayers;
+  f->glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxArrayTextureLayers);
+  
+  // Use layers that are large enough for the largest atlas, and large enough
+  // for many small atlases to share a layer.
+  constexpr int kMinLayerSize = 4096;
+  int layerSize = kMinLayerSize;
+  for (Texture* texture : textures) {
+    layerSize = std::max(layerSize, std::max(texture->GetWidth(), texture->GetHeight()));
+  }
+  layerSize = std::min<int>(layerSize, maxTextureSize);
+  
+  std::vector<Texture*> sortedTextures = textures;
+  std::sort(sortedTextures.begin(), sortedTextures.end(), [](Texture* a, Texture* b) {
+    return a->GetHeight() > b->GetHeight();
+  });
+  
+  // Assign a layer and a position within it to each texture. The packed rects are enlarged by one pixel
+  // (and the layers as well, to compensate for that at their borders) to keep the textures one pixel apart.
+  // This prevents linear filtering at the border of a texture from picking up the neighboring texture.
+  // The layers are zero-initialized, such that linear filtering into these gaps samples transparent black
+  // (rather than undefined memory). Separate textures used to clamp to their edge pixels instead.
+  struct Placement {
+    Texture* texture;
+    int layer;
+    int x;
+    int y;
+  };
+  std::vector<Placement> placements;
+  placements.reserve(sortedTextures.size());
+  std::vector<rbp::MaxRectsBinPack> layerPackers;
+  for (Texture* texture : sortedTextures) {
+    rbp::Rect rect;
+    rect.height = 0;
+    usize layer = 0;
+    for (; layer < layerPackers.size(); ++ layer) {
+      rect = layerPackers[layer].Insert(texture->GetWidth() + 1, texture->GetHeight() + 1, rbp::MaxRectsBinPack::RectBestShortSideFit);
+      if (rect.height > 0) {
+        break;
+      }
+    }
+    if (rect.height == 0) {
+      layerPackers.emplace_back(layerSize + 1, layerSize + 1, /*allowFlip*/ false);
+      rect = layerPackers.back().Insert(texture->GetWidth() + 1, texture->GetHeight() + 1, rbp::MaxRectsBinPack::RectBestShortSideFit);
+      if (rect.height == 0) {
+        LOG(ERROR) << "Sprite texture of size " << texture->GetWidth() << " x " << texture->GetHeight() << " does not fit into a texture array layer of size " << layerSize;
+        layerPackers.pop_back();
+        continue;
+      }
+    }
+    placements.push_back(Placement{texture, static_cast<int>(layer), rect.x, rect.y});
+  }
+  
+  // Create the texture arrays and move the textures into them.
+  int numLayers = layerPackers.size();
+  usize firstArrayIndex = textureArrays->size();
+  for (int firstLayer = 0; firstLayer < numLayers; firstLayer += maxArrayTextureLayers) {
+    Texture* textureArray = new Texture();
+    textureArray->CreateEmptyArray(layerSize, layerSize, std::min<int>(maxArrayTextureLayers, numLayers - firstLayer), singleChannel, /*zeroInitialize*/ true, GL_CLAMP_TO_EDGE, magFilter, minFilter);
+    textureArrays->emplace_back(textureArray);
+  }
+  for (const Placement& placement : placements) {
+    Texture* textureArray = (*textureArrays)[firstArrayIndex + placement.layer / maxArrayTextureLayers].get();
+    placement.texture->MoveIntoArray(textureArray, placement.layer % maxArrayTextureLayers, placement.x, placement.y);
+  }
+  
+  LOG(INFO) << "Packed " << placements.size() << (singleChannel ? " shadow" : " graphic") << " sprite textures into "
+            << numLayers << " texture array layers of size " << layerSize << " x " << layerSize;
+}
+
+void SpriteManager::PackTexturesIntoArrays() {
+  Timer timer("SpriteManager::PackTexturesIntoArrays()");
+  
+  std::vector<Texture*> graphicTextures;
+  std::vector<Texture*> shadowTextures;
+  for (const auto& item : loadedSprites) {
+    SpriteAndTextures* sprite = item.second;
+    if (sprite->graphicTexture.GetTarget() == GL_TEXTURE_2D_ARRAY && !sprite->graphicTexture.IsInArray()) {
+      graphicTextures.push_back(&sprite->graphicTexture);
+    }
+    if (sprite->shadowTexture.GetTarget() == GL_TEXTURE_2D_ARRAY && !sprite->shadowTexture.IsInArray()) {
+      shadowTextures.push_back(&sprite->shadowTexture);
+    }
+  }
+  
+  // The filtering matches LoadAtlasTexture().
+  ::PackTexturesIntoArrays(graphicTextures, /*singleChannel*/ false, GL_NEAREST, GL_NEAREST, &textureArrays);
+  ::PackTexturesIntoArrays(shadowTextures, /*singleChannel*/ true, GL_LINEAR, GL_LINEAR, &textureArrays);
+}
+
+void SpriteManager::DeleteUnusedTextureArrays() {
+  for (usize i = 0; i < textureArrays.size(); ) {
+    if (textureArrays[i]->GetReferenceCount() == 0) {
+      textureArrays.erase(textureArrays.begin() + i);
+    } else {
+      ++ i;
+    }
+  }
 }
 
 SpriteManager::~SpriteManager() {
   for (const auto& item : loadedSprites) {
     LOG(ERROR) << "Sprite still loaded on SpriteManager destruction: " << item.first << " (references: " << item.second->referenceCount << ")";
   }
+  
+  // The texture arrays are referenced by the remaining sprites (if any), which are not freed either.
+  for (auto& textureArray : textureArrays) {
+    textureArray.release();
+  }
 }
 
 
@@ -1066,11 +1227,11 @@ bool DilateColorsIntoTransparentRegions(const Texture& srcTexture, int wrapMode,
   f->glGenFramebuffers(1, &framebuffer);
   f->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
   
-  // Create the destination texture
-  destTexture->CreateEmpty(srcTexture.GetWidth(), srcTexture.GetHeight(), wrapMode, magFilter, minFilter);
+  // Create the destination texture (as a texture array with one layer, see SpriteManager::PackTexturesIntoArrays())
+  destTexture->CreateEmptyArray(srcTexture.GetWidth(), srcTexture.GetHeight(), 1, /*singleChannel*/ false, /*zeroInitialize*/ false, wrapMode, magFilter, minFilter);
   
   // Set destTexture as our colour attachement #0
-  f->glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, destTexture->GetId(), 0);
+  f->glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, destTexture->GetId(), 0, 0);
 
   // Set the list of draw buffers.
   GLenum drawBuffers[1] = {GL_COLOR_ATTACHMENT0};
@@ -1116,8 +1277,37 @@ bool DilateColorsIntoTransparentRegions(const Texture& srcTexture, int wrapMode,
 }
 
 
-bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes) {
-  // TODO magFilter and minFilter are unused here
+/// Transfers a sprite atlas image (as returned by SpriteAtlas::RenderAtlas()) to the GPU,
+/// as a texture array with a single layer.
+static void LoadAtlasTexture(const QImage& atlasImage, bool isGraphic, int wrapMode, ColorDilationShader* colorDilationShader, Texture* texture) {
+  if (isGraphic) {
+    // For graphic sprites, dilate the colors by one pixel into transparent areas
+    // to prevent the rendering interpolating the colors towards black at the sprite boundary.
+    Texture temporaryTexture;
+    temporaryTexture.Load(atlasImage, wrapMode, GL_NEAREST, GL_NEAREST);
+    
+    DilateColorsIntoTransparentRegions(temporaryTexture, wrapMode, GL_NEAREST, GL_NEAREST, colorDilationShader, texture);
+  } else {
+    texture->LoadArray(atlasImage, wrapMode, GL_LINEAR, GL_LINEAR);
+  }
+}
+
+bool PrepareSpriteAtlases(const char* path, const char* cachePath, Sprite* sprite, const Palettes& palettes, PreparedSpriteAtlases* prepared) {
+  // Attempt to load the decoded sprite and its atlas images from the sprite cache.
+  // In this case, the atlas images reference the mapped cache file, which is kept
+  // open in prepared->spriteCache until the images have been transferred to the GPU.
+  std::string spriteCacheFilePath = std::string(cachePath) + ".sprite";
+  u64 spriteCacheKey;
+  bool haveSpriteCacheKey = SpriteCache::ComputeKey(path, palettes, &spriteCacheKey);
+  if (haveSpriteCacheKey) {
+    std::shared_ptr<SpriteCache> spriteCache(new SpriteCache());
+    if (spriteCache->Open(spriteCacheFilePath.c_str(), spriteCacheKey, sprite)) {
+      prepared->graphicAtlas = spriteCache->GetGraphicAtlas();
+      prepared->shadowAtlas = spriteCache->GetShadowAtlas();
+      prepared->spriteCache = spriteCache;
+      return true;
+    }
+  }
   
   if (!sprite->LoadFromFile(path, palettes)) {
     LOG(ERROR) << "Failed to load sprite from " << path;
@@ -1127,12 +1317,12 @@ bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode,
   // Create a sprite atlas texture containing all frames of the SMX animation.
   // TODO: This generally takes a LOT of memory. We probably want to do a dense packing of the images using
   //       non-rectangular geometry to save some more space.
+  QImage* atlasImages[2] = {&prepared->graphicAtlas, &prepared->shadowAtlas};
   for (int graphicOrShadow = 0; graphicOrShadow < 2; ++ graphicOrShadow) {
     if (graphicOrShadow == 1 && !sprite->HasShadow()) {
       continue;
     }
     SpriteAtlas::Mode mode = (graphicOrShadow == 0) ? SpriteAtlas::Mode::Graphic : SpriteAtlas::Mode::Shadow;
-    Texture* texture = (graphicOrShadow == 0) ? graphicTexture : shadowTexture;
     
     SpriteAtlas atlas(mode);
     atlas.AddSprite(sprite);
@@ -1143,7 +1333,8 @@ bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode,
     bool loaded = false;
     if (std::filesystem::exists(cacheFilePath)) {
       // Attempt to load the atlas from the cache.
-      // TODO: Add some mechanism which discards the cache in case the sprite file has changed
+      // NOTE: This cache does not detect changed sprite files. This is fine, since it only stores the
+      //       packing, which is only used if IsConsistent() confirms that the frame sizes still match.
       loaded = atlas.Load(cacheFilePath.c_str(), sprite->NumFrames());
       if (loaded) {
         // Check whether the loaded atlas is compatible with the sprite.
@@ -1203,7 +1394,8 @@ bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode,
       }
     }
     
-    QImage atlasImage = atlas.RenderAtlas();
+    QImage& atlasImage = *atlasImages[graphicOrShadow];
+    atlasImage = atlas.RenderAtlas();
     if (atlasImage.isNull()) {
       LOG(ERROR) << "Unexpected error while building an atlas image (2).";
       return false;
@@ -1213,20 +1405,32 @@ bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode,
         LOG(WARNING) << "Failed to save atlas cache file: " << cacheFilePath;
       }
     }
-    
-    // Transfer the atlasImage to the GPU.
-    if (graphicOrShadow == 0) {
-      // For graphic sprites, dilate the colors by one pixel into transparent areas
-      // to prevent the rendering interpolating the colors towards black at the sprite boundary.
-      Texture temporaryTexture;
-      temporaryTexture.Load(atlasImage, wrapMode, GL_NEAREST, GL_NEAREST);
-      
-      DilateColorsIntoTransparentRegions(temporaryTexture, wrapMode, GL_NEAREST, GL_NEAREST, colorDilationShader, texture);
-    } else {
-      texture->Load(atlasImage, wrapMode, GL_LINEAR, GL_LINEAR);
-    }
   }
   
+  // Store the decoded sprite in the sprite cache for the next start.
+  if (haveSpriteCacheKey &&
+      !SpriteCache::Save(spriteCacheFilePath.c_str(), spriteCacheKey, *sprite, prepared->graphicAtlas, prepared->shadowAtlas)) {
+    LOG(WARNING) << "Failed to save sprite cache file: " << spriteCacheFilePath;
+  }
+  
+  return true;
+}
+
+void UploadSpriteAtlases(const Sprite& sprite, const PreparedSpriteAtlases& prepared, int wrapMode, ColorDilationShader* colorDilationShader, Texture* graphicTexture, Texture* shadowTexture) {
+  LoadAtlasTexture(prepared.graphicAtlas, true, wrapMode, colorDilationShader, graphicTexture);
+  if (sprite.HasShadow()) {
+    LoadAtlasTexture(prepared.shadowAtlas, false, wrapMode, colorDilationShader, shadowTexture);
+  }
+}
+
+bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes) {
+  // TODO magFilter and minFilter are unused here
+  
+  PreparedSpriteAtlases prepared;
+  if (!PrepareSpriteAtlases(path, cachePath, sprite, palettes, &prepared)) {
+    return false;
+  }
+  UploadSpriteAtlases(*sprite, prepared, wrapMode, colorDilationShader, graphicTexture, shadowTexture);
   return true;
 }
 
@@ -1267,12 +1471,14 @@ void DrawSprite(
   data[3] = scaling * zoom * 2.f * (layer.imageWidth + 2 * negativeOffset) / static_cast<float>(widgetWidth);
   data[4] = scaling * zoom * 2.f * (layer.imageHeight + 2 * negativeOffset) / static_cast<float>(widgetHeight);
   // in_tex_topleft
+  int atlasX = texture.GetArrayOffsetX() + layer.atlasX;
+  int atlasY = texture.GetArrayOffsetY() + layer.atlasY;
   u16* u16Data = reinterpret_cast<u16*>(data + 5);
-  *u16Data++ = layer.atlasX + positiveOffset;
-  *u16Data++ = layer.atlasY + positiveOffset;
+  *u16Data++ = atlasX + positiveOffset;
+  *u16Data++ = atlasY + positiveOffset;
   // in_tex_bottomright
-  *u16Data++ = layer.atlasX + layer.imageWidth + negativeOffset;
-  *u16Data++ = layer.atlasY + layer.imageHeight + negativeOffset;
+  *u16Data++ = atlasX + layer.imageWidth + negativeOffset;
+  *u16Data++ = atlasY + layer.imageHeight + negativeOffset;
   // outline: in_playerColor; !outline && !shadow: in_modulationColor; shadow: unused
   if (!shadow) {
     u8* u8Data = reinterpret_cast<u8*>(data + 7);
@@ -1283,4 +1489,6 @@ void DrawSprite(
       *u8Data++ = playerIndex;
     }
   }
+  // in_layer
+  *reinterpret_cast<u32*>(data + (shadow ? 7 : 8)) = texture.GetArrayLayer();
 }
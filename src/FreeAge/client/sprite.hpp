@@ -6,8 +6,10 @@
 
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <QImage>
 #include <QOpenGLFunctions_3_2_Core>
+#include <QRectF>
 #include <QRgb>
 #include <unordered_map>
 #include <vector>
@@ -17,6 +19,8 @@
 #include "FreeAge/client/texture.hpp"
 
 class ColorDilationShader;
+class SpriteCache;
+class SpriteLoader;
 class SpriteShader;
 class Texture;
 
@@ -48,9 +52,9 @@ class Sprite {
       int centerY = -1;
       
       // The layer's position in the texture atlas.
-      int atlasX;
-      int atlasY;
-      bool rotated;
+      int atlasX = -1;
+      int atlasY = -1;
+      bool rotated = false;
     };
     
     /// Vector of size graphic.imageHeight, giving the row edges (distance from left/right
@@ -69,6 +73,10 @@ class Sprite {
   inline bool HasShadow() const { return frames.front().shadow.centerX >= 0; }
   inline bool HasOutline() const { return frames.front().outline.centerX >= 0; }
   
+  /// Returns a rect (in projected coordinates, relative to the sprite's center) that
+  /// contains the graphic and shadow layers of all frames.
+  QRectF ComputeBounds() const;
+  
   inline int NumFrames() const { return frames.size(); }
   inline Frame& frame(int index) { return frames[index]; }
   inline const Frame& frame(int index) const {
@@ -80,6 +88,9 @@ class Sprite {
   }
   
  private:
+  /// SpriteCache restores the frames of sprites from the cache directly.
+  friend class SpriteCache;
+  
   bool LoadFromSMXFile(FILE* file, const Palettes& palettes);
   bool LoadFromSMPFile(FILE* file, const Palettes& palettes);
   bool LoadFromPNGFiles(const char* path);
@@ -114,13 +125,56 @@ class SpriteManager {
   /// Must be called once the sprite is not needed anymore. Once all references are gone, the sprite is unloaded.
   void Dereference(SpriteAndTextures* sprite);
   
+  /// While a loader is set, GetOrLoad() does not load new sprites directly, but submits them
+  /// to the loader and returns immediately. The returned sprites must then not be used before
+  /// SpriteLoader::Finish() returned successfully. Pass nullptr to load sprites directly again.
+  inline void SetLoader(SpriteLoader* loader) { this->loader = loader; }
+  
+  /// Moves the atlas textures of all loaded sprites that are not in a texture array yet into the
+  /// layers of a few large texture arrays (separate ones for graphics and shadows). Everything that
+  /// is drawn from the same array is collected into a single draw call, so this greatly reduces the
+  /// number of draw calls per render pass. Must be called with a current OpenGL context.
+  void PackTexturesIntoArrays();
+  
  private:
   SpriteManager() = default;
   ~SpriteManager();
   
+  /// Deletes the texture arrays that no sprite texture refers to anymore.
+  void DeleteUnusedTextureArrays();
+  
+  
   std::unordered_map<std::string, SpriteAndTextures*> loadedSprites;
+  
+  /// Texture arrays created by PackTexturesIntoArrays().
+  std::vector<std::unique_ptr<Texture>> textureArrays;
+  
+  SpriteLoader* loader = nullptr;
+};
+
+
+/// The result of the CPU stages of loading a sprite (see PrepareSpriteAtlases()),
+/// which remains to be transferred to the GPU with UploadSpriteAtlases().
+struct PreparedSpriteAtlases {
+  /// If the sprite was loaded from the sprite cache, this holds the mapped cache
+  /// file that the atlas images reference. This is declared before the images such
+  /// that the images get destroyed before the file gets unmapped.
+  std::shared_ptr<SpriteCache> spriteCache;
+  
+  /// The atlas images as returned by SpriteAtlas::RenderAtlas().
+  /// The shadow atlas is null if the sprite has no shadow.
+  QImage graphicAtlas;
+  QImage shadowAtlas;
 };
 
+/// Performs the CPU stages of LoadSpriteAndTexture(): Loads the sprite (from the sprite
+/// cache if possible) and renders its atlas images. This does not use OpenGL, so it may be
+/// called on any thread, as long as different calls use different sprites and cache paths.
+bool PrepareSpriteAtlases(const char* path, const char* cachePath, Sprite* sprite, const Palettes& palettes, PreparedSpriteAtlases* prepared);
+
+/// Performs the OpenGL stages of LoadSpriteAndTexture(): Transfers the prepared atlas
+/// images to the GPU. Must be called on a thread with a current OpenGL context.
+void UploadSpriteAtlases(const Sprite& sprite, const PreparedSpriteAtlases& prepared, int wrapMode, ColorDilationShader* colorDilationShader, Texture* graphicTexture, Texture* shadowTexture);
 
 /// Convenience function which loads a sprite and creates a texture atlas (just) for it.
 /// Attempts to find a good texture size automatically.
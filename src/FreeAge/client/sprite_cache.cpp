@@ -0,0 +1,363 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/client/sprite_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "FreeAge/common/logging.hpp"
+
+namespace {
+
+/// Identifies sprite cache files (in the first four bytes).
+constexpr char kMagic[4] = {'F', 'A', 'S', 'C'};
+
+/// Alignment of the atlas pixel data within the cache file (relative to the start of
+/// the file, which is mapped to a page boundary). QImage requires 32-bit aligned data.
+constexpr usize kPixelDataAlignment = 16;
+
+#pragma pack(push, 1)
+struct CachedLayer {
+  i32 imageWidth;
+  i32 imageHeight;
+  i32 centerX;
+  i32 centerY;
+  i32 atlasX;
+  i32 atlasY;
+  u8 rotated;
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct CachedAtlasHeader {
+  enum class Format {
+    None = 0,
+    ARGB32,
+    Grayscale8
+  };
+  
+  i32 width;
+  i32 height;
+  i32 bytesPerLine;
+  u8 format;
+};
+#pragma pack(pop)
+
+/// Hashes data in the style of 64-bit FNV-1a, but (for speed) consuming
+/// 64-bit words instead of single bytes wherever possible.
+class KeyHasher {
+ public:
+  inline void Add(const void* data, usize size) {
+    const u8* bytes = static_cast<const u8*>(data);
+    usize i = 0;
+    for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+      u64 word;
+      memcpy(&word, bytes + i, sizeof(u64));
+      Mix(word);
+    }
+    for (; i < size; ++ i) {
+      Mix(bytes[i]);
+    }
+  }
+  
+  template <typename T>
+  inline void Add(const T& value) { Add(&value, sizeof(T)); }
+  
+  /// Adds the size and contents of the given file. Returns false if the file cannot be read.
+  bool AddFile(const char* path) {
+    QFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::ReadOnly)) {
+      return false;
+    }
+    
+    u64 size = file.size();
+    Add(size);
+    if (size == 0) {
+      return true;
+    }
+    
+    const uchar* data = file.map(0, size);
+    if (data) {
+      Add(data, size);
+      return true;
+    }
+    
+    // Fall back to reading the file if it cannot be mapped.
+    QByteArray contents = file.readAll();
+    if (static_cast<u64>(contents.size()) != size) {
+      return false;
+    }
+    Add(contents.constData(), size);
+    return true;
+  }
+  
+  inline u64 Get() const { return hash; }
+  
+ private:
+  inline void Mix(u64 value) {
+    hash = (hash ^ value) * 1099511628211ull;
+  }
+  
+  
+  u64 hash = 14695981039346656037ull;
+};
+
+CachedLayer ToCachedLayer(const Sprite::Frame::Layer& layer) {
+  CachedLayer result;
+  result.imageWidth = layer.imageWidth;
+  result.imageHeight = layer.imageHeight;
+  result.centerX = layer.centerX;
+  result.centerY = layer.centerY;
+  result.atlasX = layer.atlasX;
+  result.atlasY = layer.atlasY;
+  result.rotated = layer.rotated ? 1 : 0;
+  return result;
+}
+
+void FromCachedLayer(const CachedLayer& cached, Sprite::Frame::Layer* layer) {
+  layer->imageWidth = cached.imageWidth;
+  layer->imageHeight = cached.imageHeight;
+  layer->centerX = cached.centerX;
+  layer->centerY = cached.centerY;
+  layer->atlasX = cached.atlasX;
+  layer->atlasY = cached.atlasY;
+  layer->rotated = cached.rotated != 0;
+}
+
+}
+
+
+bool SpriteCache::ComputeKey(const char* path, const Palettes& palettes, u64* key) {
+  KeyHasher hasher;
+  hasher.Add(kVersion);
+  
+  // The path contains the directory of the mod that provides the file (if any).
+  hasher.Add(path, strlen(path));
+  
+  // Hash the source file(s). For PNG sprites, the path is a pattern for the frame
+  // files, which are enumerated in the same way as in Sprite::LoadFromPNGFiles().
+  int pathLen = strlen(path);
+  if (pathLen > 3 &&
+      (path[pathLen - 3] == 'P' || path[pathLen - 3] == 'p') &&
+      (path[pathLen - 2] == 'N' || path[pathLen - 2] == 'n') &&
+      (path[pathLen - 1] == 'G' || path[pathLen - 1] == 'g')) {
+    int frameIdx = 0;
+    while (true) {
+      char pathBuffer[512];
+      sprintf(pathBuffer, path, frameIdx);
+      if (!std::filesystem::exists(pathBuffer)) {
+        break;
+      }
+      if (!hasher.AddFile(pathBuffer)) {
+        return false;
+      }
+      ++ frameIdx;
+    }
+    if (frameIdx == 0) {
+      return false;
+    }
+  } else if (!hasher.AddFile(path)) {
+    return false;
+  }
+  
+  // Hash the palettes, which the decoded colors depend on. Sort them by their
+  // numbers, since the iteration order of the unordered_map is unspecified.
+  std::vector<int> paletteNumbers;
+  paletteNumbers.reserve(palettes.size());
+  for (const auto& item : palettes) {
+    paletteNumbers.push_back(item.first);
+  }
+  std::sort(paletteNumbers.begin(), paletteNumbers.end());
+  for (int paletteNumber : paletteNumbers) {
+    const Palette& palette = palettes.at(paletteNumber);
+    hasher.Add(paletteNumber);
+    hasher.Add(static_cast<u64>(palette.size()));
+    hasher.Add(palette.data(), palette.size() * sizeof(QRgb));
+  }
+  
+  *key = hasher.Get();
+  return true;
+}
+
+bool SpriteCache::Save(const char* path, u64 key, const Sprite& sprite, const QImage& graphicAtlas, const QImage& shadowAtlas) {
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  std::shared_ptr<FILE> fileCloser(file, [&](FILE* file) { fclose(file); });
+  
+  usize offset = 0;
+  bool ok = true;
+  auto write = [&](const void* data, usize size) {
+    ok = ok && fwrite(data, 1, size, file) == size;
+    offset += size;
+  };
+  
+  u32 version = kVersion;
+  i32 numFrames = sprite.NumFrames();
+  write(kMagic, sizeof(kMagic));
+  write(&version, sizeof(version));
+  write(&key, sizeof(key));
+  write(&numFrames, sizeof(numFrames));
+  
+  for (int frameIdx = 0; frameIdx < numFrames; ++ frameIdx) {
+    const Sprite::Frame& frame = sprite.frame(frameIdx);
+    
+    i32 numRowEdges = frame.rowEdges.size();
+    write(&numRowEdges, sizeof(numRowEdges));
+    write(frame.rowEdges.data(), numRowEdges * sizeof(SMPLayerRowEdge));
+    
+    for (const Sprite::Frame::Layer* layer : {&frame.graphic, &frame.shadow, &frame.outline}) {
+      CachedLayer cachedLayer = ToCachedLayer(*layer);
+      write(&cachedLayer, sizeof(cachedLayer));
+    }
+  }
+  
+  for (const QImage* atlas : {&graphicAtlas, &shadowAtlas}) {
+    CachedAtlasHeader header;
+    header.width = atlas->width();
+    header.height = atlas->height();
+    header.bytesPerLine = atlas->bytesPerLine();
+    if (atlas->isNull()) {
+      header.format = static_cast<u8>(CachedAtlasHeader::Format::None);
+    } else if (atlas->format() == QImage::Format_ARGB32) {
+      header.format = static_cast<u8>(CachedAtlasHeader::Format::ARGB32);
+    } else if (atlas->format() == QImage::Format_Grayscale8) {
+      header.format = static_cast<u8>(CachedAtlasHeader::Format::Grayscale8);
+    } else {
+      LOG(ERROR) << "Unsupported QImage format for the sprite cache.";
+      return false;
+    }
+    write(&header, sizeof(header));
+    if (atlas->isNull()) {
+      continue;
+    }
+    
+    const u8 padding[kPixelDataAlignment] = {0};
+    write(padding, (kPixelDataAlignment - offset % kPixelDataAlignment) % kPixelDataAlignment);
+    write(atlas->constBits(), static_cast<usize>(header.bytesPerLine) * header.height);
+  }
+  
+  return ok;
+}
+
+bool SpriteCache::Open(const char* path, u64 key, Sprite* sprite) {
+  Close();
+  
+  file.setFileName(QString::fromStdString(path));
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  usize size = file.size();
+  const uchar* data = (size > 0) ? file.map(0, size) : nullptr;
+  if (!data) {
+    Close();
+    return false;
+  }
+  
+  usize offset = 0;
+  auto read = [&](void* dest, usize readSize) {
+    if (offset + readSize > size) {
+      return false;
+    }
+    memcpy(dest, data + offset, readSize);
+    offset += readSize;
+    return true;
+  };
+  
+  // Check the header. A different version or key is the expected case for stale cache files.
+  char magic[sizeof(kMagic)];
+  u32 version;
+  u64 fileKey;
+  i32 numFrames;
+  if (!read(magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+      !read(&version, sizeof(version)) || version != kVersion ||
+      !read(&fileKey, sizeof(fileKey)) || fileKey != key ||
+      !read(&numFrames, sizeof(numFrames)) || numFrames <= 0) {
+    Close();
+    return false;
+  }
+  
+  std::vector<Sprite::Frame> frames(numFrames);
+  for (Sprite::Frame& frame : frames) {
+    i32 numRowEdges;
+    if (!read(&numRowEdges, sizeof(numRowEdges)) || numRowEdges < 0 ||
+        numRowEdges * sizeof(SMPLayerRowEdge) > size - offset) {
+      LOG(WARNING) << "Invalid sprite cache file: " << path;
+      Close();
+      return false;
+    }
+    frame.rowEdges.resize(numRowEdges);
+    read(frame.rowEdges.data(), numRowEdges * sizeof(SMPLayerRowEdge));
+    
+    for (Sprite::Frame::Layer* layer : {&frame.graphic, &frame.shadow, &frame.outline}) {
+      CachedLayer cachedLayer;
+      if (!read(&cachedLayer, sizeof(cachedLayer))) {
+        LOG(WARNING) << "Invalid sprite cache file: " << path;
+        Close();
+        return false;
+      }
+      FromCachedLayer(cachedLayer, layer);
+    }
+  }
+  
+  for (QImage* atlas : {&graphicAtlas, &shadowAtlas}) {
+    CachedAtlasHeader header;
+    if (!read(&header, sizeof(header))) {
+      LOG(WARNING) << "Invalid sprite cache file: " << path;
+      Close();
+      return false;
+    }
+    
+    QImage::Format format;
+    int bytesPerPixel;
+    if (header.format == static_cast<u8>(CachedAtlasHeader::Format::None)) {
+      continue;
+    } else if (header.format == static_cast<u8>(CachedAtlasHeader::Format::ARGB32)) {
+      format = QImage::Format_ARGB32;
+      bytesPerPixel = 4;
+    } else if (header.format == static_cast<u8>(CachedAtlasHeader::Format::Grayscale8)) {
+      format = QImage::Format_Grayscale8;
+      bytesPerPixel = 1;
+    } else {
+      LOG(WARNING) << "Invalid sprite cache file: " << path;
+      Close();
+      return false;
+    }
+    
+    offset += (kPixelDataAlignment - offset % kPixelDataAlignment) % kPixelDataAlignment;
+    usize pixelDataSize = static_cast<usize>(header.bytesPerLine) * header.height;
+    if (header.width <= 0 || header.height <= 0 ||
+        header.bytesPerLine < header.width * bytesPerPixel || header.bytesPerLine % 4 != 0 ||
+        offset > size || pixelDataSize > size - offset) {
+      LOG(WARNING) << "Invalid sprite cache file: " << path;
+      Close();
+      return false;
+    }
+    
+    // Since the data pointer is const, QImage references the mapped memory without copying it.
+    *atlas = QImage(data + offset, header.width, header.height, header.bytesPerLine, format);
+    offset += pixelDataSize;
+  }
+  
+  bool hasShadow = frames.front().shadow.centerX >= 0;
+  if (graphicAtlas.isNull() || hasShadow == shadowAtlas.isNull()) {
+    LOG(WARNING) << "Invalid sprite cache file (missing or unexpected atlas): " << path;
+    Close();
+    return false;
+  }
+  
+  sprite->frames.swap(frames);
+  return true;
+}
+
+void SpriteCache::Close() {
+  graphicAtlas = QImage();
+  shadowAtlas = QImage();
+  file.close();
+}
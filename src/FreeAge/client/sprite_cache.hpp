@@ -0,0 +1,62 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QFile>
+#include <QImage>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/client/sprite.hpp"
+
+/// On-disk cache of fully decoded sprites, which allows to skip decoding the
+/// SMX / SMP / PNG files (and packing their frames into atlases) on subsequent starts.
+///
+/// A cache file stores the metadata of all frames of a sprite (sizes, centers,
+/// atlas positions, and row edges), plus the final atlas images for the graphic
+/// and shadow layers (as returned by SpriteAtlas::RenderAtlas()). It is tagged with
+/// a key that is computed from the contents of the source file(s), their path (which
+/// includes the directory of the mod that provides them, if any), and the palettes.
+/// If any of these change, the key changes and the cache file is ignored.
+///
+/// Loading a cache file memory-maps it and references the atlas pixels in the
+/// mapped memory directly, such that they can be passed on to the texture upload
+/// without being copied.
+class SpriteCache {
+ public:
+  /// Computes the cache key for the sprite with the given path (as passed to
+  /// Sprite::LoadFromFile()). Returns false if the source file(s) cannot be read.
+  static bool ComputeKey(const char* path, const Palettes& palettes, u64* key);
+  
+  /// Saves the sprite (after its atlases were rendered) and its atlas images to
+  /// the cache file at the given path. shadowAtlas may be null if the sprite has no shadow.
+  static bool Save(const char* path, u64 key, const Sprite& sprite, const QImage& graphicAtlas, const QImage& shadowAtlas);
+  
+  /// Memory-maps the cache file at the given path and loads the sprite metadata
+  /// from it. Returns false if the file does not exist, has a different format
+  /// version or key, or is invalid. In this case, the sprite is left unchanged.
+  bool Open(const char* path, u64 key, Sprite* sprite);
+  
+  /// After Open() succeeded, returns the atlas images. They reference the mapped
+  /// file, so they are only valid as long as this SpriteCache object exists.
+  /// The shadow atlas is null if the sprite has no shadow.
+  inline const QImage& GetGraphicAtlas() const { return graphicAtlas; }
+  inline const QImage& GetShadowAtlas() const { return shadowAtlas; }
+  
+  /// Version of the cache file format. Must be increased whenever the format,
+  /// or the decoding of sprites, changes.
+  static constexpr u32 kVersion = 1;
+  
+ private:
+  /// Releases the atlas images and unmaps the file.
+  void Close();
+  
+  
+  /// The mapped cache file. This is declared before the images such that
+  /// the images get destroyed before the file gets unmapped.
+  QFile file;
+  
+  QImage graphicAtlas;
+  QImage shadowAtlas;
+};
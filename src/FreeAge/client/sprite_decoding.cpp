@@ -0,0 +1,251 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/client/sprite_decoding.hpp"
+
+#include <algorithm>
+
+#include "FreeAge/common/logging.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define FREEAGE_HAVE_SSE2
+#endif
+
+// The AVX2 functions are compiled with the target attribute (instead of enabling AVX2
+// for the whole build), such that the program still runs on CPUs without AVX2.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <immintrin.h>
+  #define FREEAGE_HAVE_AVX2
+#endif
+
+namespace {
+
+constexpr QRgb kOpaqueAlpha = 0xff000000u;
+constexpr QRgb kPlayerColorAlpha = 0xfe000000u;
+
+inline u16 GetFirstIndex8To5(const u8* block) {
+  return block[0] | ((block[1] & 0b11) << 8);
+}
+
+inline u16 GetSecondIndex8To5(const u8* block) {
+  // colorIndex: ((block[2] & 0b11) << 6) | (block[1] >> 2), paletteSection: (block[2] >> 2) & 0b11
+  return (block[1] >> 2) | ((block[2] & 0b1111) << 6);
+}
+
+inline u16 GetIndex4Plus1(const u8* block, int pixelInBlock) {
+  return block[pixelInBlock] | (((block[4] >> (2 * pixelInBlock)) & 0b11) << 8);
+}
+
+void ExpandPalettedPixelsScalar(const u16* indices, int count, const QRgb* palette, int paletteSize, QRgb* out) {
+  for (int i = 0; i < count; ++ i) {
+    if (indices[i] < paletteSize) {
+      out[i] = palette[indices[i]] | kOpaqueAlpha;
+    } else {
+      LOG(ERROR) << "ExpandPalettedPixels(): Index (" << indices[i] << ") is larger than the palette size (" << paletteSize << ")";
+      out[i] = qRgba(0, 0, 0, 0);
+    }
+  }
+}
+
+void ExpandPlayerColorPixelsScalar(const u16* indices, int count, QRgb* out) {
+  for (int i = 0; i < count; ++ i) {
+    out[i] = kPlayerColorAlpha | ((indices[i] & 0xff) << 16) | ((indices[i] >> 8) << 8);
+  }
+}
+
+#ifdef FREEAGE_HAVE_SSE2
+void ExpandPalettedPixelsSSE2(const u16* indices, int count, const QRgb* palette, int paletteSize, QRgb* out) {
+  const __m128i alpha = _mm_set1_epi32(static_cast<int>(kOpaqueAlpha));
+  
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const u16* index = indices + i;
+    if (std::max(std::max(index[0], index[1]), std::max(index[2], index[3])) >= paletteSize) {
+      ExpandPalettedPixelsScalar(index, 4, palette, paletteSize, out + i);
+      continue;
+    }
+    
+    // SSE2 does not have a gather instruction, but the alpha and the stores are done for four pixels at once.
+    __m128i color = _mm_setr_epi32(palette[index[0]], palette[index[1]], palette[index[2]], palette[index[3]]);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_or_si128(color, alpha));
+  }
+  ExpandPalettedPixelsScalar(indices + i, count - i, palette, paletteSize, out + i);
+}
+
+void ExpandPlayerColorPixelsSSE2(const u16* indices, int count, QRgb* out) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi32(static_cast<int>(kPlayerColorAlpha));
+  const __m128i lowByteMask = _mm_set1_epi32(0xff);
+  
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i index16 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i));
+    __m128i index32[2] = {_mm_unpacklo_epi16(index16, zero), _mm_unpackhi_epi16(index16, zero)};
+    for (int half = 0; half < 2; ++ half) {
+      __m128i red = _mm_slli_epi32(_mm_and_si128(index32[half], lowByteMask), 16);
+      __m128i green = _mm_slli_epi32(_mm_srli_epi32(index32[half], 8), 8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4 * half), _mm_or_si128(_mm_or_si128(red, green), alpha));
+    }
+  }
+  ExpandPlayerColorPixelsScalar(indices + i, count - i, out + i);
+}
+#endif
+
+#ifdef FREEAGE_HAVE_AVX2
+__attribute__((target("avx2")))
+void ExpandPalettedPixelsAVX2(const u16* indices, int count, const QRgb* palette, int paletteSize, QRgb* out) {
+  const __m256i alpha = _mm256_set1_epi32(static_cast<int>(kOpaqueAlpha));
+  const __m256i size = _mm256_set1_epi32(paletteSize);
+  
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i)));
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(size, index)) != -1) {
+      ExpandPalettedPixelsScalar(indices + i, 8, palette, paletteSize, out + i);
+      continue;
+    }
+    
+    __m256i color = _mm256_i32gather_epi32(reinterpret_cast<const int*>(palette), index, 4);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_or_si256(color, alpha));
+  }
+  ExpandPalettedPixelsScalar(indices + i, count - i, palette, paletteSize, out + i);
+}
+
+__attribute__((target("avx2")))
+void ExpandPlayerColorPixelsAVX2(const u16* indices, int count, QRgb* out) {
+  const __m256i alpha = _mm256_set1_epi32(static_cast<int>(kPlayerColorAlpha));
+  const __m256i lowByteMask = _mm256_set1_epi32(0xff);
+  
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i)));
+    __m256i red = _mm256_slli_epi32(_mm256_and_si256(index, lowByteMask), 16);
+    __m256i green = _mm256_slli_epi32(_mm256_srli_epi32(index, 8), 8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_or_si256(_mm256_or_si256(red, green), alpha));
+  }
+  ExpandPlayerColorPixelsScalar(indices + i, count - i, out + i);
+}
+#endif
+
+PixelDecodingPath DetectBestPixelDecodingPath() {
+  if (IsPixelDecodingPathSupported(PixelDecodingPath::AVX2)) {
+    return PixelDecodingPath::AVX2;
+  } else if (IsPixelDecodingPathSupported(PixelDecodingPath::SSE2)) {
+    return PixelDecodingPath::SSE2;
+  }
+  return PixelDecodingPath::Scalar;
+}
+
+}
+
+
+bool IsPixelDecodingPathSupported(PixelDecodingPath path) {
+  switch (path) {
+  case PixelDecodingPath::Scalar:
+    return true;
+  case PixelDecodingPath::SSE2:
+    #ifdef FREEAGE_HAVE_SSE2
+      return true;
+    #else
+      return false;
+    #endif
+  case PixelDecodingPath::AVX2:
+    #ifdef FREEAGE_HAVE_AVX2
+      return __builtin_cpu_supports("avx2");
+    #else
+      return false;
+    #endif
+  }
+  return false;
+}
+
+PixelDecodingPath GetBestPixelDecodingPath() {
+  static PixelDecodingPath bestPath = DetectBestPixelDecodingPath();
+  return bestPath;
+}
+
+void UnpackPixels8To5(const u8*& pixelPtr, int& decompressionState, int count, u16* indices) {
+  int i = 0;
+  if (decompressionState == 1 && count > 0) {
+    // Finish the block that the previous run started.
+    indices[i] = GetSecondIndex8To5(pixelPtr);
+    pixelPtr += 5;
+    decompressionState = 0;
+    ++ i;
+  }
+  
+  for (; i + 2 <= count; i += 2) {
+    indices[i] = GetFirstIndex8To5(pixelPtr);
+    indices[i + 1] = GetSecondIndex8To5(pixelPtr);
+    pixelPtr += 5;
+  }
+  
+  if (i < count) {
+    indices[i] = GetFirstIndex8To5(pixelPtr);
+    decompressionState = 1;
+  }
+}
+
+void UnpackPixels4Plus1(const u8*& pixelPtr, int& decompressionState, int count, u16* indices) {
+  int i = 0;
+  
+  // Finish the block that the previous run started.
+  while (decompressionState != 0 && i < count) {
+    indices[i] = GetIndex4Plus1(pixelPtr, decompressionState);
+    ++ i;
+    decompressionState = (decompressionState + 1) % 4;
+    if (decompressionState == 0) {
+      pixelPtr += 5;
+    }
+  }
+  
+  for (; i + 4 <= count; i += 4) {
+    for (int pixelInBlock = 0; pixelInBlock < 4; ++ pixelInBlock) {
+      indices[i + pixelInBlock] = GetIndex4Plus1(pixelPtr, pixelInBlock);
+    }
+    pixelPtr += 5;
+  }
+  
+  for (; i < count; ++ i) {
+    indices[i] = GetIndex4Plus1(pixelPtr, decompressionState);
+    ++ decompressionState;
+  }
+}
+
+void ExpandPalettedPixels(const u16* indices, int count, const QRgb* palette, int paletteSize, QRgb* out, PixelDecodingPath path) {
+  switch (path) {
+  case PixelDecodingPath::AVX2:
+    #ifdef FREEAGE_HAVE_AVX2
+      ExpandPalettedPixelsAVX2(indices, count, palette, paletteSize, out);
+      return;
+    #endif
+  case PixelDecodingPath::SSE2:
+    #ifdef FREEAGE_HAVE_SSE2
+      ExpandPalettedPixelsSSE2(indices, count, palette, paletteSize, out);
+      return;
+    #endif
+  case PixelDecodingPath::Scalar:
+    break;
+  }
+  ExpandPalettedPixelsScalar(indices, count, palette, paletteSize, out);
+}
+
+void ExpandPlayerColorPixels(const u16* indices, int count, QRgb* out, PixelDecodingPath path) {
+  switch (path) {
+  case PixelDecodingPath::AVX2:
+    #ifdef FREEAGE_HAVE_AVX2
+      ExpandPlayerColorPixelsAVX2(indices, count, out);
+      return;
+    #endif
+  case PixelDecodingPath::SSE2:
+    #ifdef FREEAGE_HAVE_SSE2
+      ExpandPlayerColorPixelsSSE2(indices, count, out);
+      return;
+    #endif
+  case PixelDecodingPath::Scalar:
+    break;
+  }
+  ExpandPlayerColorPixelsScalar(indices, count, out);
+}
@@ -0,0 +1,55 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QRgb>
+
+#include "FreeAge/common/free_age.hpp"
+
+// Batch decoding of the paletted pixel runs in SMX / SMP files.
+//
+// Decoding a run is split into two steps: First, the run's pixels are unpacked
+// into an array of palette indices (256 * paletteSection + colorIndex). Second,
+// the indices are expanded to colors, either with a palette lookup or with the
+// player-color marking that the sprite shader interprets. The second step has
+// SSE2 and AVX2 implementations; the fastest one that the CPU supports is chosen
+// at runtime. All implementations give results that are bit-exact to the per-pixel
+// functions in sprite.hpp (GetPalettedPixel() with ignoreAlpha == true).
+
+/// Maximum number of pixels in a single run of an SMX / SMP drawing command.
+constexpr int kMaxSMXPixelRunLength = 64;
+
+/// Implementations of the batch decoding functions.
+enum class PixelDecodingPath {
+  Scalar = 0,
+  SSE2,
+  AVX2
+};
+
+/// Returns whether the given path was compiled in and is supported by the CPU.
+bool IsPixelDecodingPathSupported(PixelDecodingPath path);
+
+/// Returns the fastest supported path. This is determined once and then cached.
+PixelDecodingPath GetBestPixelDecodingPath();
+
+/// Unpacks @p count pixels in 8to5 compression (two pixels in each block of 5 bytes).
+/// pixelPtr and decompressionState are advanced in the same way as by
+/// DecompressNextPixel8To5(), such that runs may start and end within blocks.
+void UnpackPixels8To5(const u8*& pixelPtr, int& decompressionState, int count, u16* indices);
+
+/// Unpacks @p count pixels in 4plus1 compression (four pixels in each block of 5 bytes).
+/// pixelPtr and decompressionState are advanced in the same way as by
+/// DecompressNextPixel4Plus1(), such that runs may start and end within blocks.
+void UnpackPixels4Plus1(const u8*& pixelPtr, int& decompressionState, int count, u16* indices);
+
+// For the following functions, the path must be supported (see IsPixelDecodingPathSupported()).
+
+/// Looks up the colors of the given palette indices in the palette and sets their
+/// alpha to 255. Indices that are out of bounds of the palette yield transparent pixels.
+void ExpandPalettedPixels(const u16* indices, int count, const QRgb* palette, int paletteSize, QRgb* out, PixelDecodingPath path);
+
+/// Encodes the given palette indices as player-color pixels: The index is stored in
+/// the red and green channels, and the alpha is set to the magic value of 254.
+void ExpandPlayerColorPixels(const u16* indices, int count, QRgb* out, PixelDecodingPath path);
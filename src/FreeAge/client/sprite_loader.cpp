@@ -0,0 +1,123 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/client/sprite_loader.hpp"
+
+#include <algorithm>
+
+#include "FreeAge/common/logging.hpp"
+
+SpriteLoader::SpriteLoader(int numWorkerThreads) {
+  workerThreads.reserve(numWorkerThreads);
+  for (int i = 0; i < numWorkerThreads; ++ i) {
+    workerThreads.emplace_back(&SpriteLoader::WorkerThreadMain, this);
+  }
+}
+
+SpriteLoader::~SpriteLoader() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    exitWorkerThreads = true;
+    queue.clear();
+  }
+  queueCondition.notify_all();
+  
+  for (std::thread& thread : workerThreads) {
+    thread.join();
+  }
+}
+
+void SpriteLoader::Submit(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes) {
+  jobs.emplace_back(new Job());
+  Job* job = jobs.back().get();
+  job->path = path;
+  job->cachePath = cachePath;
+  job->wrapMode = wrapMode;
+  job->colorDilationShader = colorDilationShader;
+  job->sprite = sprite;
+  job->graphicTexture = graphicTexture;
+  job->shadowTexture = shadowTexture;
+  job->palettes = &palettes;
+  
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(job);
+  }
+  queueCondition.notify_one();
+}
+
+bool SpriteLoader::Finish(const std::function<void(int, int)>& progressCallback) {
+  bool success = true;
+  
+  int numJobs = jobs.size();
+  for (int numFinishedJobs = 0; numFinishedJobs < numJobs; ) {
+    Job* job;
+    bool prepareHere = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (preparedJobs.empty() && !queue.empty()) {
+        // No result is ready to be transferred to the GPU, so help with preparing the queued jobs.
+        job = queue.front();
+        queue.pop_front();
+        prepareHere = true;
+      } else {
+        preparedCondition.wait(lock, [&]() { return !preparedJobs.empty(); });
+        job = preparedJobs.front();
+        preparedJobs.pop_front();
+      }
+    }
+    
+    if (prepareHere) {
+      Prepare(job);
+    }
+    
+    if (job->succeeded) {
+      UploadSpriteAtlases(*job->sprite, job->prepared, job->wrapMode, job->colorDilationShader, job->graphicTexture, job->shadowTexture);
+    } else {
+      LOG(ERROR) << "Failed to load sprite: " << job->path;
+      success = false;
+    }
+    job->prepared = PreparedSpriteAtlases();
+    
+    ++ numFinishedJobs;
+    if (progressCallback) {
+      progressCallback(numFinishedJobs, numJobs);
+    }
+  }
+  
+  jobs.clear();
+  return success;
+}
+
+int SpriteLoader::GetDefaultNumWorkerThreads() {
+  return std::max<int>(0, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+}
+
+void SpriteLoader::Prepare(Job* job) {
+  job->succeeded = PrepareSpriteAtlases(job->path.c_str(), job->cachePath.c_str(), job->sprite, *job->palettes, &job->prepared);
+}
+
+void SpriteLoader::WorkerThreadMain() {
+  while (true) {
+    Job* job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      queueCondition.wait(lock, [&]() { return exitWorkerThreads || !queue.empty(); });
+      if (exitWorkerThreads) {
+        return;
+      }
+      
+      job = queue.front();
+      queue.pop_front();
+    }
+    
+    Prepare(job);
+    
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      preparedJobs.push_back(job);
+    }
+    preparedCondition.notify_one();
+  }
+}
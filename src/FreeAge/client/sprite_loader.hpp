@@ -0,0 +1,102 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/client/sprite.hpp"
+
+/// Loads sprites on a pool of worker threads.
+///
+/// Loading a sprite is split into the CPU stages (reading and decoding the sprite
+/// file or opening its sprite cache file, packing the frames into atlases, and rendering
+/// the atlas images; see PrepareSpriteAtlases()), and the OpenGL stages (the texture
+/// uploads and the color dilation; see UploadSpriteAtlases()). The CPU stages run on the
+/// worker threads. Since the OpenGL stages need the OpenGL context, they are all done
+/// by Finish() on the thread that calls it, in the order in which the jobs get ready.
+///
+/// Submit() and Finish() must only be called from the thread with the OpenGL context.
+class SpriteLoader {
+ public:
+  /// Starts the given number of worker threads. If this is zero, all sprites get
+  /// loaded by Finish() on the calling thread.
+  explicit SpriteLoader(int numWorkerThreads);
+  
+  /// Exits the worker threads. Jobs that have not been started yet are dropped.
+  ~SpriteLoader();
+  
+  /// Queues the sprite for loading. The sprite and textures are written to by Finish().
+  /// The palettes must remain valid until Finish() returned.
+  void Submit(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes);
+  
+  /// Waits for all submitted jobs and transfers their results to the GPU on the calling
+  /// thread as soon as they get ready. If no result is ready, the calling thread helps
+  /// the worker threads with preparing the queued jobs. After each finished job, the
+  /// progress callback (if given) is called with the number of finished jobs and the
+  /// total number of jobs. Returns false if any sprite failed to load.
+  bool Finish(const std::function<void(int, int)>& progressCallback);
+  
+  /// Returns the number of jobs that have been submitted since the last call to Finish().
+  inline int GetNumSubmittedJobs() const { return jobs.size(); }
+  
+  /// Returns the number of worker threads to use for loading sprites on this system:
+  /// one for each core, except for the one that runs the OpenGL stages.
+  static int GetDefaultNumWorkerThreads();
+  
+ private:
+  struct Job {
+    std::string path;
+    std::string cachePath;
+    int wrapMode;
+    ColorDilationShader* colorDilationShader;
+    Sprite* sprite;
+    Texture* graphicTexture;
+    Texture* shadowTexture;
+    const Palettes* palettes;
+    
+    /// The result of the CPU stages. Released once it has been transferred to the GPU.
+    PreparedSpriteAtlases prepared;
+    
+    /// Whether PrepareSpriteAtlases() succeeded. Valid once the job is done.
+    bool succeeded = false;
+  };
+  
+  /// Runs the CPU stages of the job.
+  static void Prepare(Job* job);
+  
+  void WorkerThreadMain();
+  
+  
+  /// All submitted jobs that have not been finished yet. Only accessed by the OpenGL thread.
+  std::vector<std::unique_ptr<Job>> jobs;
+  
+  /// Jobs that have not been started yet, in submission order. Protected by the mutex.
+  std::deque<Job*> queue;
+  
+  /// Jobs whose CPU stages are done, in the order in which they got done.
+  /// Protected by the mutex.
+  std::deque<Job*> preparedJobs;
+  
+  /// Set to true to make the worker threads exit. Protected by the mutex.
+  bool exitWorkerThreads = false;
+  
+  std::mutex mutex;
+  
+  /// Notified when a job is added to the queue, or when the worker threads should exit.
+  std::condition_variable queueCondition;
+  
+  /// Notified when a job is added to preparedJobs.
+  std::condition_variable preparedCondition;
+  
+  std::vector<std::thread> workerThreads;
+};
@@ -4,6 +4,8 @@
 
 #include "FreeAge/client/texture.hpp"
 
+#include <vector>
+
 #include <mango/image/image.hpp>
 
 #include "FreeAge/client/opengl.hpp"
@@ -74,7 +76,10 @@ TextureManager::~TextureManager() {
 
 
 Texture::~Texture() {
-  if (width != -1) {
+  if (arrayTexture) {
+    // The texture memory belongs to the array.
+    arrayTexture->RemoveReference();
+  } else if (width != -1) {
     QOpenGLFunctions_3_2_Core* f = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_2_Core>();
     f->glDeleteTextures(1, &textureId);
     
@@ -183,3 +188,112 @@ bool Texture::Load(const std::filesystem::path& path, int wrapMode, int magFilte
   CHECK_OPENGL_NO_ERROR();
   return true;
 }
+
+void Texture::CreateEmptyArray(int width, int height, int numLayers, bool singleChannel, bool zeroInitialize, int wrapMode, int magFilter, int minFilter) {
+  QOpenGLFunctions_3_2_Core* f = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_2_Core>();
+  
+  this->width = width;
+  this->height = height;
+  // NOTE: This counts all layers, since bytesPerPixel is only used to keep track of the used GPU memory.
+  bytesPerPixel = (singleChannel ? 1 : 4) * numLayers;
+  target = GL_TEXTURE_2D_ARRAY;
+  
+  f->glGenTextures(1, &textureId);
+  f->glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+  
+  f->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrapMode);
+  f->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrapMode);
+  f->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, magFilter);
+  f->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, minFilter);
+  
+  if (singleChannel) {
+    f->glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8, width, height, numLayers, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+  } else {
+    f->glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, width, height, numLayers, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+  }
+  
+  if (zeroInitialize) {
+    // Upload the zeros layer by layer to bound the size of the temporary buffer.
+    std::vector<u8> zeroLayer(width * height * (singleChannel ? 1 : 4), 0);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int layer = 0; layer < numLayers; ++ layer) {
+      f->glTexSubImage3D(
+          GL_TEXTURE_2D_ARRAY,
+          0, 0, 0, layer,
+          width, height, 1,
+          singleChannel ? GL_RED : GL_BGRA, GL_UNSIGNED_BYTE,
+          zeroLayer.data());
+    }
+  }
+  
+  debugUsedGPUMemory += width * height * bytesPerPixel;
+  PrintGPUMemoryUsage();
+  CHECK_OPENGL_NO_ERROR();
+}
+
+void Texture::LoadArray(const QImage& image, int wrapMode, int magFilter, int minFilter) {
+  QOpenGLFunctions_3_2_Core* f = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_2_Core>();
+  
+  bool singleChannel;
+  if (image.format() == QImage::Format_ARGB32) {
+    singleChannel = false;
+  } else if (image.format() == QImage::Format_Grayscale8) {
+    singleChannel = true;
+  } else {
+    LOG(FATAL) << "Unsupported QImage format.";
+    return;
+  }
+  CreateEmptyArray(image.width(), image.height(), 1, singleChannel, /*zeroInitialize*/ false, wrapMode, magFilter, minFilter);
+  
+  // QImage scan lines are aligned to multiples of 4 bytes. Ensure that OpenGL reads this correctly.
+  f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  
+  f->glTexSubImage3D(
+      GL_TEXTURE_2D_ARRAY,
+      0, 0, 0, 0,
+      image.width(), image.height(), 1,
+      singleChannel ? GL_RED : GL_BGRA, GL_UNSIGNED_BYTE,
+      image.scanLine(0));
+  
+  CHECK_OPENGL_NO_ERROR();
+}
+
+void Texture::MoveIntoArray(Texture* arrayTexture, int layer, int offsetX, int offsetY) {
+  QOpenGLFunctions_3_2_Core* f = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_2_Core>();
+  
+  if (target != GL_TEXTURE_2D_ARRAY || IsInArray()) {
+    LOG(ERROR) << "MoveIntoArray() must be called on a texture array that is not in another array yet";
+    return;
+  }
+  
+  // Copy the texture contents on the GPU by attaching the texture to a framebuffer
+  // and reading from that into the array.
+  GLuint framebuffer = 0;
+  f->glGenFramebuffers(1, &framebuffer);
+  f->glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+  f->glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textureId, 0, 0);
+  f->glReadBuffer(GL_COLOR_ATTACHMENT0);
+  
+  if (f->glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    LOG(ERROR) << "Failed to create framebuffer";
+  } else {
+    f->glBindTexture(GL_TEXTURE_2D_ARRAY, arrayTexture->textureId);
+    f->glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, offsetX, offsetY, layer, 0, 0, width, height);
+  }
+  
+  f->glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  f->glDeleteFramebuffers(1, &framebuffer);
+  
+  // Free the own texture and refer to the array instead.
+  f->glDeleteTextures(1, &textureId);
+  textureId = -1;
+  debugUsedGPUMemory -= width * height * bytesPerPixel;
+  
+  this->arrayTexture = arrayTexture;
+  arrayTexture->AddReference();
+  arrayLayer = layer;
+  arrayOffsetX = offsetX;
+  arrayOffsetY = offsetY;
+  
+  CHECK_OPENGL_NO_ERROR();
+}
@@ -99,23 +99,60 @@ class Texture {
   /// The file is assumed to have 8 bits per color channel, with 4 channels in total.
   bool Load(const std::filesystem::path& path, int wrapMode, int magFilter, int minFilter);
   
+  /// Creates an empty texture array (GL_TEXTURE_2D_ARRAY) with the given size and number of layers.
+  /// If singleChannel is true, the texture has one 8-bit channel, otherwise four.
+  /// If zeroInitialize is true, all layers are cleared to zero; otherwise, their contents are undefined
+  /// until they are written to, so this should only be false if the caller overwrites all pixels.
+  void CreateEmptyArray(int width, int height, int numLayers, bool singleChannel, bool zeroInitialize, int wrapMode, int magFilter, int minFilter);
+  
+  /// Loads the texture from the given QImage into GPU memory as a texture array with a single layer.
+  /// The image can be released afterwards.
+  void LoadArray(const QImage& image, int wrapMode, int magFilter, int minFilter);
+  
+  /// For a texture array with a single layer (as created by LoadArray() or CreateEmptyArray()), copies its
+  /// contents into the given layer of the given texture array at the given offset, frees the own texture
+  /// memory, and makes this texture a reference to that region of the array (see IsInArray()).
+  void MoveIntoArray(Texture* arrayTexture, int layer, int offsetX, int offsetY);
+  
+  /// Returns whether this texture is a region of a larger texture array (see MoveIntoArray()).
+  /// In this case, GetId(), GetWidth(), GetHeight() and DrawCallBuffer() refer to the whole array,
+  /// such that everything that is drawn from the same array gets collected into a single draw call.
+  inline bool IsInArray() const { return arrayTexture != nullptr; }
+  
+  /// Returns the layer within the texture array. This is 0 for texture arrays that have not been moved into a larger array.
+  inline int GetArrayLayer() const { return arrayLayer; }
+  
+  /// Returns the offset of this texture's region within its layer of the texture array.
+  inline int GetArrayOffsetX() const { return arrayOffsetX; }
+  inline int GetArrayOffsetY() const { return arrayOffsetY; }
+  
   /// Returns the OpenGL texture Id.
-  GLuint GetId() const { return textureId; }
+  GLuint GetId() const { return arrayTexture ? arrayTexture->textureId : textureId; }
+  
+  /// Returns the OpenGL texture target (GL_TEXTURE_2D or GL_TEXTURE_2D_ARRAY).
+  GLenum GetTarget() const { return target; }
+  
+  int GetWidth() const { return arrayTexture ? arrayTexture->width : width; }
+  int GetHeight() const { return arrayTexture ? arrayTexture->height : height; }
   
-  int GetWidth() const { return width; }
-  int GetHeight() const { return height; }
+  /// Returns the size of the region of the texture array for textures that are in an array (see IsInArray()).
+  int GetRegionWidth() const { return width; }
+  int GetRegionHeight() const { return height; }
   
   inline void AddReference() { ++ referenceCount; }
   /// Returns true if the reference count reaches zero.
   inline bool RemoveReference() { -- referenceCount; return referenceCount == 0; }
   inline int GetReferenceCount() const { return referenceCount; }
   
-  inline QByteArray& DrawCallBuffer() { return drawCallBuffer; }
+  inline QByteArray& DrawCallBuffer() { return arrayTexture ? arrayTexture->drawCallBuffer : drawCallBuffer; }
   
  private:
   /// OpenGL texture Id.
   GLuint textureId = -1;
   
+  /// OpenGL texture target.
+  GLenum target = GL_TEXTURE_2D;
+  
   /// Width of the texture in pixels.
   int width = -1;
   
@@ -130,4 +167,11 @@ class Texture {
   
   /// Temporary helper buffer for accumulating vertex data to draw with this texture being active.
   QByteArray drawCallBuffer;
+  
+  /// If this texture is a region of a texture array, the array texture. The reference count of the array
+  /// counts the textures that refer to it; the array must not be deleted before all of them are.
+  Texture* arrayTexture = nullptr;
+  int arrayLayer = 0;
+  int arrayOffsetX = 0;
+  int arrayOffsetY = 0;
 };
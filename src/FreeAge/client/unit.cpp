@@ -24,6 +24,8 @@ ClientUnitType::~ClientUnitType() {
 }
 
 bool ClientUnitType::Load(UnitType type, const std::filesystem::path& graphicsSubPath, const std::filesystem::path& cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes) {
+  this->type = type;
+  
   std::filesystem::path ingameUnitsSubPath = std::filesystem::path("widgetui") / "textures" / "ingame" / "units";
   
   // Later entries are used as fallbacks if the previous do not contain an animation type.
@@ -158,20 +160,21 @@ bool ClientUnitType::Load(UnitType type, const std::filesystem::path& graphicsSu
       if (!ok) {
         return false;
       }
-      
-      // For extracting attack durations.
-      // TODO: Remove this once we get those in a better way.
-      if (animationType == UnitAnimation::Attack) {
-        LOG(INFO) << "Attack animation " << animationVariants[variant] << " has " << (animations[static_cast<int>(animationType)][variant]->sprite.NumFrames() / kNumFacingDirections) << " frames per facing direction";
-      }
     }
   }
   
   // Load the icon.
   iconTexture = TextureManager::Instance().GetOrLoad(GetModdedPath(iconSubPath), TextureManager::Loader::Mango, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR);
   
-  if (!ok) {
-    return false;
+  return ok;
+}
+
+void ClientUnitType::FinishLoading() {
+  // For extracting attack durations.
+  // TODO: Remove this once we get those in a better way.
+  const auto& attackAnimations = animations[static_cast<int>(UnitAnimation::Attack)];
+  for (usize variant = 0; variant < attackAnimations.size(); ++ variant) {
+    LOG(INFO) << "Attack animation " << variant << " of " << GetUnitName(type).toStdString() << " has " << (attackAnimations[variant]->sprite.NumFrames() / kNumFacingDirections) << " frames per facing direction";
   }
   
   maxCenterY = 0;
@@ -183,7 +186,14 @@ bool ClientUnitType::Load(UnitType type, const std::filesystem::path& graphicsSu
     }
   }
   
-  return true;
+  spriteBounds = QRectF();
+  for (const auto& animationVariants : animations) {
+    for (const SpriteAndTextures* animation : animationVariants) {
+      if (animation) {
+        spriteBounds = spriteBounds.united(animation->sprite.ComputeBounds());
+      }
+    }
+  }
 }
 
 int ClientUnitType::GetHealthBarHeightAboveCenter() const {
@@ -203,7 +213,7 @@ bool ClientUnitType::LoadAnimation(int index, const char* filename, const std::f
 
 
 ClientUnit::ClientUnit(int playerIndex, UnitType type, const QPointF& mapCoord, u32 hp)
-    : ClientObject(ObjectType::Unit, playerIndex, hp),
+    : ClientObject(ObjectType::Unit, playerIndex, hp, ::GetClientUnitType(type).GetSpriteBounds()),
       type(type),
       mapCoord(mapCoord),
       direction(rand() % kNumFacingDirections),
@@ -412,6 +422,7 @@ void ClientUnit::UpdateGameState(double serverTime, Map* map, Match* match) {
 }
 
 void ClientUnit::UpdateMapCoord(double serverTime, Map* map, Match* match) {
+  QPointF oldMapCoord = mapCoord;
   int oldTileX = static_cast<int>(mapCoord.x());
   int oldTileY = static_cast<int>(mapCoord.y());
   
@@ -425,6 +436,10 @@ void ClientUnit::UpdateMapCoord(double serverTime, Map* map, Match* match) {
     mapCoord = movementSegment.startPoint + (serverTime - movementSegment.serverTime) * movementSegment.speed;
   }
   
+  if (mapCoord != oldMapCoord) {
+    map->UpdateObjectBounds(this);
+  }
+  
   int newTileX = static_cast<int>(mapCoord.x());
   int newTileY = static_cast<int>(mapCoord.y());
   
@@ -40,10 +40,21 @@ class ClientUnitType {
   ClientUnitType() = default;
   ~ClientUnitType();
   
+  /// Requests the sprites of the unit type from the SpriteManager and loads its icon.
+  /// FinishLoading() must be called once the sprites have been loaded.
   bool Load(UnitType type, const std::filesystem::path& graphicsSubPath, const std::filesystem::path& cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes);
   
+  /// Computes the data that depends on the contents of the sprites requested by Load().
+  /// If the sprites are loaded by a SpriteLoader, this must only be called after
+  /// SpriteLoader::Finish() returned.
+  void FinishLoading();
+  
   int GetHealthBarHeightAboveCenter() const;
   
+  /// Returns a rect (in projected coordinates, relative to the unit's center) that contains
+  /// all frames of all animations of this unit type. Computed by FinishLoading().
+  inline const QRectF& GetSpriteBounds() const { return spriteBounds; }
+  
   inline const std::vector<SpriteAndTextures*>& GetAnimations(UnitAnimation type) const { return animations[static_cast<int>(type)]; }
   
   inline const Texture* GetIconTexture() const { return iconTexture; }
@@ -57,6 +68,8 @@ class ClientUnitType {
  private:
   bool LoadAnimation(int index, const char* filename, const std::filesystem::path& graphicsSubPath, const std::filesystem::path& cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes, UnitAnimation type);
   
+  UnitType type;
+  
   /// Indexed by: [static_cast<int>(UnitAnimation animation)][animation_variant]
   std::vector<std::vector<SpriteAndTextures*>> animations;
   
@@ -64,6 +77,9 @@ class ClientUnitType {
   /// This can be used to determine a reasonable height for the unit's health bar.
   int maxCenterY;
   
+  /// See GetSpriteBounds().
+  QRectF spriteBounds;
+  
   Texture* iconTexture = nullptr;
 };
 
@@ -101,7 +117,10 @@ class ClientUnit : public ClientObject {
       bool outline);
   
   inline UnitType GetType() const { return type; }
-  inline void SetType(UnitType newType) { type = newType; }
+  inline void SetType(UnitType newType) {
+    type = newType;
+    spriteBounds = &::GetClientUnitType(newType).GetSpriteBounds();
+  }
   
   /// Convenience function that returns the ClientUnitType for this unit.
   inline ClientUnitType& GetClientUnitType() const {
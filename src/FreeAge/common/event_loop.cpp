@@ -0,0 +1,28 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/common/event_loop.hpp"
+
+#include <thread>
+
+#include <QCoreApplication>
+#include <QTimer>
+
+void ProcessEventsUntil(const TimePoint& deadline) {
+  int remainingMilliseconds = static_cast<int>(MillisecondsDuration(deadline - Clock::now()).count());
+  
+  if (remainingMilliseconds >= 1) {
+    // The timer ensures that the wait ends at the latest when it fires.
+    // Its timeout event is sufficient for that, it does not need to be connected to anything.
+    QTimer deadlineTimer;
+    deadlineTimer.setTimerType(Qt::PreciseTimer);
+    deadlineTimer.setSingleShot(true);
+    deadlineTimer.start(remainingMilliseconds);
+    
+    QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+  } else {
+    QCoreApplication::processEvents(QEventLoop::AllEvents);
+    std::this_thread::sleep_until(deadline);
+  }
+}
@@ -0,0 +1,22 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include "FreeAge/common/free_age.hpp"
+
+/// The maximum time that the event loops of the server and of the bot client wait for events
+/// if nothing else is due. This bounds the delay of the periodic checks, e.g., for timed-out connections.
+constexpr int kMaxEventWaitMilliseconds = 100;
+
+/// Processes Qt events, blocking until either some events have been processed
+/// (for example, data arrived on a socket, a socket got disconnected, or a new connection
+/// came in) or the given deadline has been reached. Returns as soon as one of these happens.
+///
+/// In contrast to polling with processEvents() and sleeping in between, this does not
+/// use any CPU time while waiting, and reacts immediately to socket readiness.
+/// Since Qt timers only have millisecond precision, the function waits for events
+/// only until the last full millisecond before the deadline, and then sleeps precisely
+/// until the deadline, such that callers can use the deadline for accurate timing.
+void ProcessEventsUntil(const TimePoint& deadline);
@@ -0,0 +1,82 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/common/message_buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "FreeAge/common/logging.hpp"
+
+/// The initial ring buffer size.
+constexpr int kMinCapacity = 4096;
+
+void MessageBuffer::Append(const QByteArray& data) {
+  if (data.isEmpty()) {
+    return;
+  }
+  if (dataSize + data.size() > static_cast<int>(ring.size())) {
+    Grow(dataSize + data.size());
+  }
+  
+  // Copy the data to the write position, which may wrap around the end of the ring buffer.
+  int capacity = ring.size();
+  int writeIndex = (readIndex + dataSize) & (capacity - 1);
+  int firstPartSize = std::min(data.size(), capacity - writeIndex);
+  memcpy(ring.data() + writeIndex, data.data(), firstPartSize);
+  memcpy(ring.data(), data.data() + firstPartSize, data.size() - firstPartSize);
+  dataSize += data.size();
+}
+
+bool MessageBuffer::TakeMessage(QByteArray* message) {
+  if (dataSize < 3) {
+    return false;
+  }
+  
+  u16 msgLength = static_cast<u8>(At(1)) | (static_cast<u16>(static_cast<u8>(At(2))) << 8);
+  if (msgLength < 3) {
+    // The stream cannot be split into messages anymore after this.
+    LOG(ERROR) << "Received a too short message. The given message length is (should be at least 3): " << msgLength << ". Discarding all buffered data.";
+    Clear();
+    return false;
+  }
+  if (dataSize < msgLength) {
+    return false;
+  }
+  
+  int capacity = ring.size();
+  if (readIndex + msgLength <= capacity) {
+    *message = QByteArray::fromRawData(ring.data() + readIndex, msgLength);
+  } else {
+    int firstPartSize = capacity - readIndex;
+    linearizedMessage.resize(msgLength);
+    memcpy(linearizedMessage.data(), ring.data() + readIndex, firstPartSize);
+    memcpy(linearizedMessage.data() + firstPartSize, ring.data(), msgLength - firstPartSize);
+    *message = linearizedMessage;
+  }
+  
+  readIndex = (readIndex + msgLength) & (capacity - 1);
+  dataSize -= msgLength;
+  return true;
+}
+
+void MessageBuffer::Clear() {
+  readIndex = 0;
+  dataSize = 0;
+}
+
+void MessageBuffer::Grow(int minCapacity) {
+  int newCapacity = std::max<int>(kMinCapacity, ring.size());
+  while (newCapacity < minCapacity) {
+    newCapacity *= 2;
+  }
+  
+  // Move the buffered data to the start of the new ring buffer.
+  std::vector<char> newRing(newCapacity);
+  for (int i = 0; i < dataSize; ++ i) {
+    newRing[i] = At(i);
+  }
+  ring.swap(newRing);
+  readIndex = 0;
+}
@@ -0,0 +1,62 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QByteArray>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Buffers the data received on a connection and splits it up into messages.
+///
+/// All messages start with a 3-byte header consisting of the u8 message type and
+/// the u16 message length (including the header). The data is stored in a ring buffer
+/// that grows as needed. Taking a message out of the buffer only advances the read position,
+/// so in contrast to removing the message from the front of a QByteArray, the remaining
+/// data does not get moved. This makes parsing linear in the number of received bytes.
+///
+/// The messages are handed out as QByteArrays that reference the ring buffer's memory
+/// (see QByteArray::fromRawData()) instead of copies. Only messages that wrap around
+/// the end of the ring buffer get copied into a separate buffer to make them contiguous.
+class MessageBuffer {
+ public:
+  /// Appends received data to the buffer.
+  void Append(const QByteArray& data);
+  
+  /// If a complete message is available, removes it from the buffer, sets *message to it
+  /// (including its header), and returns true. Otherwise, returns false.
+  ///
+  /// The returned message may reference the buffer's memory. It stays valid until the
+  /// next call to Append() or Clear(), so it must be copied if it is needed for longer.
+  bool TakeMessage(QByteArray* message);
+  
+  /// Removes all data from the buffer.
+  void Clear();
+  
+  /// Returns the number of buffered bytes that have not been taken out as messages yet.
+  inline int size() const { return dataSize; }
+  inline bool isEmpty() const { return dataSize == 0; }
+  
+ private:
+  /// Grows the ring buffer such that it can hold at least minCapacity bytes.
+  void Grow(int minCapacity);
+  
+  /// Returns the buffered byte at the given offset from the read position.
+  inline char At(int offset) const { return ring[(readIndex + offset) & (ring.size() - 1)]; }
+  
+  
+  /// The ring buffer. Its size is always a power of two (or zero).
+  std::vector<char> ring;
+  
+  /// Index in the ring buffer of the first byte that has not been taken out yet.
+  int readIndex = 0;
+  
+  /// Number of bytes in the ring buffer that have not been taken out yet.
+  int dataSize = 0;
+  
+  /// Buffer for messages that wrap around the end of the ring buffer.
+  QByteArray linearizedMessage;
+};
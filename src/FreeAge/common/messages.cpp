@@ -4,6 +4,9 @@
 
 #include "FreeAge/common/messages.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 #include <mango/core/endian.hpp>
 #include <QString>
 
@@ -38,16 +41,18 @@ QByteArray CreateHostConnectMessage(const QByteArray& hostToken, const QString&
   return msg;
 }
 
-QByteArray CreateConnectMessage(const QString& playerName) {
+QByteArray CreateConnectMessage(const QByteArray& matchToken, const QString& playerName) {
   // Prepare
   QByteArray playerNameUtf8 = playerName.toUtf8();
   
   // Create buffer
-  QByteArray msg = CreateClientToServerMessageHeader(playerNameUtf8.size(), ClientToServerMessage::Connect);
+  QByteArray msg = CreateClientToServerMessageHeader(hostTokenLength + playerNameUtf8.size(), ClientToServerMessage::Connect);
   char* data = msg.data();
   
-  // Fill buffer
-  memcpy(data + 3, playerNameUtf8.data(), playerNameUtf8.size());
+  // Fill buffer. The match token is padded with zeros if it is too short.
+  memset(data + 3, 0, hostTokenLength);
+  memcpy(data + 3, matchToken.data(), std::min<int>(hostTokenLength, matchToken.size()));
+  memcpy(data + 3 + hostTokenLength, playerNameUtf8.data(), playerNameUtf8.size());
   
   return msg;
 }
@@ -200,6 +205,14 @@ QByteArray CreateDequeueProductionQueueItemMessage(u32 productionBuildingId, u8
   return msg;
 }
 
+QByteArray CreateReconnectMessage(const QByteArray& sessionToken) {
+  QByteArray msg = CreateClientToServerMessageHeader(kSessionTokenLength, ClientToServerMessage::Reconnect);
+  char* data = msg.data();
+  memset(data + 3, 0, kSessionTokenLength);
+  memcpy(data + 3, sessionToken.data(), std::min<int>(kSessionTokenLength, sessionToken.size()));
+  return msg;
+}
+
 
 static inline QByteArray CreateServerToClientMessageHeader(int dataSize, ServerToClientMessage type) {
   // Create buffer
@@ -268,9 +281,10 @@ QByteArray CreateGameBeginMessage(
     u32 initialGold,
     u32 initialStone,
     u16 mapWidth,
-    u16 mapHeight) {
+    u16 mapHeight,
+    const QByteArray& sessionToken) {
   // Create buffer
-  QByteArray msg = CreateServerToClientMessageHeader(36, ServerToClientMessage::GameBegin);
+  QByteArray msg = CreateServerToClientMessageHeader(36 + kSessionTokenLength, ServerToClientMessage::GameBegin);
   char* data = msg.data();
   
   // Fill buffer
@@ -283,6 +297,8 @@ QByteArray CreateGameBeginMessage(
   mango::ustore32(data + 31, initialStone);
   mango::ustore16(data + 35, mapWidth);
   mango::ustore16(data + 37, mapHeight);
+  memset(data + 39, 0, kSessionTokenLength);
+  memcpy(data + 39, sessionToken.data(), std::min<int>(kSessionTokenLength, sessionToken.size()));
   
   return msg;
 }
@@ -294,18 +310,6 @@ QByteArray CreateGameStepTimeMessage(double gameStepServerTime) {
   return msg;
 }
 
-QByteArray CreateUnitMovementMessage(u32 unitId, const QPointF& startPoint, const QPointF& speed, UnitAction action) {
-  QByteArray msg = CreateServerToClientMessageHeader(21, ServerToClientMessage::UnitMovement);
-  char* data = msg.data();
-  mango::ustore32(data + 3, unitId);
-  *reinterpret_cast<float*>(data + 7) = startPoint.x();
-  *reinterpret_cast<float*>(data + 11) = startPoint.y();
-  *reinterpret_cast<float*>(data + 15) = speed.x();
-  *reinterpret_cast<float*>(data + 19) = speed.y();
-  data[23] = static_cast<u8>(action);
-  return msg;
-}
-
 QByteArray CreateResourcesUpdateMessage(const ResourceAmount& amount) {
   QByteArray msg = CreateServerToClientMessageHeader(16, ServerToClientMessage::ResourcesUpdate);
   char* data = msg.data();
@@ -316,14 +320,6 @@ QByteArray CreateResourcesUpdateMessage(const ResourceAmount& amount) {
   return msg;
 }
 
-QByteArray CreateBuildPercentageUpdateMessage(u32 buildingId, float progress) {
-  QByteArray msg = CreateServerToClientMessageHeader(4 + 4, ServerToClientMessage::BuildPercentageUpdate);
-  char* data = msg.data();
-  mango::ustore32(data + 3, buildingId);
-  memcpy(data + 3 + 4, &progress, 4);
-  return msg;
-}
-
 QByteArray CreateChangeUnitTypeMessage(u32 unitId, UnitType type) {
   QByteArray msg = CreateServerToClientMessageHeader(4 + 2, ServerToClientMessage::ChangeUnitType);
   char* data = msg.data();
@@ -332,25 +328,203 @@ QByteArray CreateChangeUnitTypeMessage(u32 unitId, UnitType type) {
   return msg;
 }
 
-QByteArray CreateSetCarriedResourcesMessage(u32 unitId, ResourceType type, u8 amount) {
-  QByteArray msg = CreateServerToClientMessageHeader(6, ServerToClientMessage::SetCarriedResources);
-  char* data = msg.data();
-  mango::ustore32(data + 3, unitId);
-  data[7] = static_cast<u8>(type);
-  data[8] = amount;
+/// Appends the given value as a variable-length integer, using 7 bits per byte
+/// (starting with the least significant bits). The highest bit of each byte is
+/// set if more bytes follow.
+static void AppendVarUInt(u32 value, QByteArray* data) {
+  while (value >= 0x80) {
+    data->append(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data->append(static_cast<char>(value));
+}
+
+static bool ReadVarUInt(const char** cursor, const char* end, u32* value) {
+  *value = 0;
+  for (int shift = 0; shift < 32; shift += 7) {
+    if (*cursor >= end) {
+      return false;
+    }
+    u8 byte = **cursor;
+    ++ *cursor;
+    *value |= static_cast<u32>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Maps signed to unsigned integers such that values with a small magnitude
+/// get small encodings: 0, -1, 1, -2, 2, ... map to 0, 1, 2, 3, 4, ...
+static inline u32 ZigZagEncode(i32 value) {
+  return (static_cast<u32>(value) << 1) ^ static_cast<u32>(value >> 31);
+}
+
+static inline i32 ZigZagDecode(u32 value) {
+  return static_cast<i32>(value >> 1) ^ -static_cast<i32>(value & 1);
+}
+
+void ObjectStateDelta::SetMovement(const QPointF& startPoint, const QPointF& speed, UnitAction action) {
+  fields |= kObjectStateMovement;
+  startX = static_cast<u32>(std::max(0., startPoint.x()) * kPositionScale + 0.5f);
+  startY = static_cast<u32>(std::max(0., startPoint.y()) * kPositionScale + 0.5f);
+  speedX = static_cast<i32>(std::round(speed.x() * kSpeedScale));
+  speedY = static_cast<i32>(std::round(speed.y() * kSpeedScale));
+  this->action = action;
+}
+
+void ObjectStateDelta::SetHP(u32 newHP) {
+  fields |= kObjectStateHP;
+  hp = newHP;
+}
+
+void ObjectStateDelta::SetBuildPercentage(float percentage) {
+  fields |= kObjectStateBuildPercentage;
+  buildPercentage = static_cast<u16>(std::max(0.f, std::min(1.f, percentage / 100.f)) * std::numeric_limits<u16>::max() + 0.5f);
+}
+
+void ObjectStateDelta::SetCarriedResources(ResourceType type, u8 amount) {
+  fields |= kObjectStateCarriedResources;
+  carriedResourceType = type;
+  carriedResourceAmount = amount;
+}
+
+void ObjectStateDelta::Merge(const ObjectStateDelta& other) {
+  if (other.fields & kObjectStateMovement) {
+    startX = other.startX;
+    startY = other.startY;
+    speedX = other.speedX;
+    speedY = other.speedY;
+    action = other.action;
+  }
+  if (other.fields & kObjectStateHP) {
+    hp = other.hp;
+  }
+  if (other.fields & kObjectStateBuildPercentage) {
+    buildPercentage = other.buildPercentage;
+  }
+  if (other.fields & kObjectStateCarriedResources) {
+    carriedResourceType = other.carriedResourceType;
+    carriedResourceAmount = other.carriedResourceAmount;
+  }
+  fields |= other.fields;
+}
+
+bool ObjectStateDelta::FieldEquals(u8 field, const ObjectStateDelta& other) const {
+  switch (field) {
+  case kObjectStateMovement:
+    return startX == other.startX && startY == other.startY &&
+           speedX == other.speedX && speedY == other.speedY &&
+           action == other.action;
+  case kObjectStateHP:
+    return hp == other.hp;
+  case kObjectStateBuildPercentage:
+    return buildPercentage == other.buildPercentage;
+  case kObjectStateCarriedResources:
+    return carriedResourceType == other.carriedResourceType &&
+           carriedResourceAmount == other.carriedResourceAmount;
+  }
+  return false;
+}
+
+void AppendObjectStateDeltaEntry(u32 objectIdDifference, const ObjectStateDelta& delta, QByteArray* payload) {
+  AppendVarUInt(objectIdDifference, payload);
+  payload->append(static_cast<char>(delta.fields));
+  
+  if (delta.fields & kObjectStateMovement) {
+    AppendVarUInt(delta.startX, payload);
+    AppendVarUInt(delta.startY, payload);
+    AppendVarUInt(ZigZagEncode(delta.speedX), payload);
+    AppendVarUInt(ZigZagEncode(delta.speedY), payload);
+    payload->append(static_cast<char>(delta.action));
+  }
+  if (delta.fields & kObjectStateHP) {
+    AppendVarUInt(delta.hp, payload);
+  }
+  if (delta.fields & kObjectStateBuildPercentage) {
+    char data[2];
+    mango::ustore16(data, delta.buildPercentage);
+    payload->append(data, 2);
+  }
+  if (delta.fields & kObjectStateCarriedResources) {
+    payload->append(static_cast<char>(delta.carriedResourceType));
+    payload->append(static_cast<char>(delta.carriedResourceAmount));
+  }
+}
+
+bool ReadObjectStateDeltaEntry(const char** cursor, const char* end, u32* objectIdDifference, ObjectStateDelta* delta) {
+  if (!ReadVarUInt(cursor, end, objectIdDifference) ||
+      *cursor >= end) {
+    return false;
+  }
+  delta->fields = **cursor;
+  ++ *cursor;
+  
+  if (delta->fields & kObjectStateMovement) {
+    u32 speedX;
+    u32 speedY;
+    if (!ReadVarUInt(cursor, end, &delta->startX) ||
+        !ReadVarUInt(cursor, end, &delta->startY) ||
+        !ReadVarUInt(cursor, end, &speedX) ||
+        !ReadVarUInt(cursor, end, &speedY) ||
+        *cursor >= end) {
+      return false;
+    }
+    delta->speedX = ZigZagDecode(speedX);
+    delta->speedY = ZigZagDecode(speedY);
+    u8 action = **cursor;
+    ++ *cursor;
+    if (action >= static_cast<int>(UnitAction::NumActions)) {
+      LOG(ERROR) << "Received ObjectStateDelta message with invalid UnitAction";
+      return false;
+    }
+    delta->action = static_cast<UnitAction>(action);
+  }
+  if (delta->fields & kObjectStateHP) {
+    if (!ReadVarUInt(cursor, end, &delta->hp)) {
+      return false;
+    }
+  }
+  if (delta->fields & kObjectStateBuildPercentage) {
+    if (end - *cursor < 2) {
+      return false;
+    }
+    delta->buildPercentage = mango::uload16(*cursor);
+    *cursor += 2;
+  }
+  if (delta->fields & kObjectStateCarriedResources) {
+    if (end - *cursor < 2) {
+      return false;
+    }
+    u8 type = (*cursor)[0];
+    if (type >= static_cast<int>(ResourceType::NumTypes)) {
+      LOG(ERROR) << "Received ObjectStateDelta message with invalid resource type";
+      return false;
+    }
+    delta->carriedResourceType = static_cast<ResourceType>(type);
+    delta->carriedResourceAmount = (*cursor)[1];
+    *cursor += 2;
+  }
+  
+  return true;
+}
+
+QByteArray CreateObjectStateDeltaMessage(const QByteArray& payload) {
+  QByteArray msg = CreateServerToClientMessageHeader(payload.size(), ServerToClientMessage::ObjectStateDelta);
+  memcpy(msg.data() + 3, payload.data(), payload.size());
   return msg;
 }
 
-QByteArray CreateHPUpdateMessage(u32 objectId, u32 newHP) {
-  QByteArray msg = CreateServerToClientMessageHeader(8, ServerToClientMessage::HPUpdate);
+QByteArray CreateObjectDeathMessage(u32 objectId) {
+  QByteArray msg = CreateServerToClientMessageHeader(4, ServerToClientMessage::ObjectDeath);
   char* data = msg.data();
   mango::ustore32(data + 3, objectId);
-  mango::ustore32(data + 7, newHP);
   return msg;
 }
 
-QByteArray CreateObjectDeathMessage(u32 objectId) {
-  QByteArray msg = CreateServerToClientMessageHeader(4, ServerToClientMessage::ObjectDeath);
+QByteArray CreateObjectLeftViewMessage(u32 objectId) {
+  QByteArray msg = CreateServerToClientMessageHeader(4, ServerToClientMessage::ObjectLeftView);
   char* data = msg.data();
   mango::ustore32(data + 3, objectId);
   return msg;
@@ -394,3 +568,7 @@ QByteArray CreateSetHousedMessage(bool housed) {
   msg.data()[3] = housed ? 1 : 0;
   return msg;
 }
+
+QByteArray CreateGameResyncMessage() {
+  return CreateServerToClientMessageHeader(0, ServerToClientMessage::GameResync);
+}
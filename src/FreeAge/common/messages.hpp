@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <limits>
 #include <vector>
 
 #include <QByteArray>
@@ -24,17 +25,26 @@ struct ResourceAmount;
 // # when connecting to a server with a        #
 // # different version.                        #
 // #############################################
-static constexpr u32 networkProtocolVersion = 1;
+static constexpr u32 networkProtocolVersion = 4;
 
 static constexpr int hostTokenLength = 6;
 
+/// Length of the session tokens with which players can reconnect to a running game.
+static constexpr int kSessionTokenLength = 16;
+
+/// The map elevation is sent to the clients in chunks of (up to) this many
+/// corners in each direction, with one MapUncover message per chunk.
+static constexpr int kMapUncoverChunkSize = 64;
+
 
 /// Types of messages sent by clients to the server.
 enum class ClientToServerMessage {
   /// Initial message sent by the host to the server.
   HostConnect = 0,
   
-  /// Initial message sent by a non-host to the server.
+  /// Initial message sent by a non-host to the server. It contains the match token
+  /// (with length hostTokenLength), which selects the match to join on servers that host
+  /// multiple matches, followed by the player name.
   Connect,
   
   /// A message that contains the latest game settings set by the host.
@@ -97,11 +107,16 @@ enum class ClientToServerMessage {
   /// used the index from the front, this would change the item that this message
   /// refers to. Using the index from the back does not change it.
   DequeueProductionQueueItem,
+  
+  /// Initial message sent on a new connection by a client that lost its connection
+  /// to a running game. It contains the session token (with length kSessionTokenLength)
+  /// that the client received with the GameBegin message.
+  Reconnect,
 };
 
 QByteArray CreateHostConnectMessage(const QByteArray& hostToken, const QString& playerName);
 
-QByteArray CreateConnectMessage(const QString& playerName);
+QByteArray CreateConnectMessage(const QByteArray& matchToken, const QString& playerName);
 
 QByteArray CreateSettingsUpdateMessage(bool allowMorePlayersToJoin, u16 mapSize, bool isBroadcast);
 
@@ -143,6 +158,8 @@ QByteArray CreateDequeueProductionQueueItemMessage(
     u32 productionBuildingId,
     u8 queueIndexFromBack);
 
+QByteArray CreateReconnectMessage(const QByteArray& sessionToken);
+
 
 /// Types of messages sent by the server to clients.
 enum class ServerToClientMessage {
@@ -177,12 +194,18 @@ enum class ServerToClientMessage {
   /// * The server time at which the game starts,
   /// * The initial center of the view for the client,
   /// * The initial resources of the client,
-  /// * The map size.
+  /// * The map size,
+  /// * The client's session token, which it can use to reconnect to the game.
   GameBegin,
   
   // --- In-game messages ---
   
   /// A portion of the map is uncovered. The server tells the client about the map content there.
+  /// The message covers a rectangle of map corners (of at most kMapUncoverChunkSize in each
+  /// direction). It contains:
+  /// * u16 minCornerX, u16 minCornerY, u8 width, u8 height of the rectangle
+  /// * The run-length encoded elevation of the corners in the rectangle, in row-major order,
+  ///   as pairs of (u8 run length, u8 elevation).
   MapUncover,
   
   /// A new map object (building or unit) is created respectively enters the client's view.
@@ -192,24 +215,22 @@ enum class ServerToClientMessage {
   /// step time, until the next GameStepTime message is received.
   GameStepTime,
   
-  /// Tells the client about the start point and speed of a unit's movement.
-  /// The speed may be zero, which indicates that the unit has stopped moving.
-  UnitMovement,
-  
   /// Tells the client about updates to its game resource amounts (wood, food, etc.)
   ResourcesUpdate,
   
-  /// Tells the client about a new build percentage of a building being constructed.
-  BuildPercentageUpdate,
-  
   /// Tells the client that an existing unit seen by the client changed its UnitType.
   ChangeUnitType,
   
-  /// Sets the type and amount of carried resources for a villager.
-  SetCarriedResources,
-  
-  /// Tells the client about a new HP value for a unit or building.
-  HPUpdate,
+  /// Tells the client about all changes to the state of the objects that it sees in one game step.
+  /// The message contains a sequence of entries with one entry for each changed object, sorted by
+  /// object ID. Each entry contains:
+  /// * The difference of the object ID to the one of the previous entry (or to zero for the first entry),
+  ///   as a variable-length integer.
+  /// * A u8 bitmask of the fields that changed (see the kObjectState... constants).
+  /// * The changed fields, in the order of their bits. See ObjectStateDelta for their encoding.
+  /// This replaces separate messages for each state change, saving the message headers, and
+  /// allows to send only those fields that actually changed.
+  ObjectStateDelta,
   
   /// An object was destroyed / killed / deleted and should be removed from the object list.
   /// - If there is a destruction / death animation for the object,
@@ -220,6 +241,11 @@ enum class ServerToClientMessage {
   /// in this state should not be selectable anymore.
   ObjectDeath,
   
+  /// An object left the client's view and should be removed from the object list
+  /// (without any death animation). If it enters the view again, the client receives
+  /// a new AddObject message for it.
+  ObjectLeftView,
+  
   /// Sent to notify a client about another client leaving the game (either by resigning or due to dropping).
   PlayerLeaveBroadcast,
   
@@ -239,6 +265,13 @@ enum class ServerToClientMessage {
   ///       client behaves the same way as the server in this regard. And the amount of additional
   ///       transmitted data should be completely irrelevant.
   SetHoused,
+  
+  /// Sent to a client that reconnected to the game. The client drops all of its objects,
+  /// since it has missed the updates for them. Afterwards, the server sends a snapshot of the
+  /// game state as seen by the client (spread over a few game steps): the map content,
+  /// the objects that the client sees (with their state and production queues),
+  /// the client's resources and housed state, and the players that left the game.
+  GameResync,
 };
 
 QByteArray CreateWelcomeMessage();
@@ -261,28 +294,86 @@ QByteArray CreateGameBeginMessage(
     u32 initialGold,
     u32 initialStone,
     u16 mapWidth,
-    u16 mapHeight);
+    u16 mapHeight,
+    const QByteArray& sessionToken);
 
 QByteArray CreateGameStepTimeMessage(double gameStepServerTime);
 
-QByteArray CreateUnitMovementMessage(
-    u32 unitId,
-    const QPointF& startPoint,
-    const QPointF& speed,
-    UnitAction action);
-
 QByteArray CreateResourcesUpdateMessage(const ResourceAmount& amount);
 
-QByteArray CreateBuildPercentageUpdateMessage(u32 buildingId, float progress);
-
 QByteArray CreateChangeUnitTypeMessage(u32 unitId, UnitType type);
 
-QByteArray CreateSetCarriedResourcesMessage(u32 unitId, ResourceType type, u8 amount);
+/// Bits in the field mask of ObjectStateDelta.
+static constexpr u8 kObjectStateMovement = 1 << 0;
+static constexpr u8 kObjectStateHP = 1 << 1;
+static constexpr u8 kObjectStateBuildPercentage = 1 << 2;
+static constexpr u8 kObjectStateCarriedResources = 1 << 3;
 
-QByteArray CreateHPUpdateMessage(u32 objectId, u32 newHP);
+/// Changes to the state of an object, as transmitted in an ObjectStateDelta message.
+/// Only the fields whose bits are set in the field mask are valid. The values are stored
+/// in quantized form, such that they can be compared to previously sent values directly.
+///
+/// Encoding of the fields:
+/// * Movement: The start point (in 1/kPositionScale tiles) and speed (in 1/kSpeedScale tiles
+///   per second) of the unit's movement as variable-length integers (with zig-zag encoding
+///   for the speed), followed by the u8 UnitAction. The speed may be zero, which indicates
+///   that the unit has stopped moving.
+/// * HP: Variable-length integer.
+/// * Build percentage: u16, with 0xffff corresponding to 100%.
+/// * Carried resources: u8 ResourceType, u8 amount.
+struct ObjectStateDelta {
+  static constexpr float kPositionScale = 256;
+  static constexpr float kSpeedScale = 1024;
+  
+  void SetMovement(const QPointF& startPoint, const QPointF& speed, UnitAction action);
+  inline QPointF GetStartPoint() const { return QPointF(startX / kPositionScale, startY / kPositionScale); }
+  inline QPointF GetSpeed() const { return QPointF(speedX / kSpeedScale, speedY / kSpeedScale); }
+  
+  void SetHP(u32 newHP);
+  
+  void SetBuildPercentage(float percentage);
+  inline float GetBuildPercentage() const { return (100.f * buildPercentage) / std::numeric_limits<u16>::max(); }
+  
+  void SetCarriedResources(ResourceType type, u8 amount);
+  
+  /// Sets all fields of this object whose bits are set in other.fields to the values in other.
+  void Merge(const ObjectStateDelta& other);
+  
+  /// Returns whether the given field has the same value in both objects (which must both have this field set).
+  bool FieldEquals(u8 field, const ObjectStateDelta& other) const;
+  
+  
+  /// Bitmask of the fields (kObjectState... constants) that are valid.
+  u8 fields = 0;
+  
+  u32 startX;
+  u32 startY;
+  i32 speedX;
+  i32 speedY;
+  UnitAction action;
+  
+  u32 hp;
+  
+  u16 buildPercentage;
+  
+  ResourceType carriedResourceType;
+  u8 carriedResourceAmount;
+};
+
+/// Appends an entry to the payload of an ObjectStateDelta message.
+void AppendObjectStateDeltaEntry(u32 objectIdDifference, const ObjectStateDelta& delta, QByteArray* payload);
+
+/// Reads an entry of an ObjectStateDelta message starting at *cursor, and advances the cursor
+/// to the next entry. Returns false if the data is invalid or ends before the end of the entry.
+bool ReadObjectStateDeltaEntry(const char** cursor, const char* end, u32* objectIdDifference, ObjectStateDelta* delta);
+
+/// Creates an ObjectStateDelta message from entries appended with AppendObjectStateDeltaEntry().
+QByteArray CreateObjectStateDeltaMessage(const QByteArray& payload);
 
 QByteArray CreateObjectDeathMessage(u32 objectId);
 
+QByteArray CreateObjectLeftViewMessage(u32 objectId);
+
 enum class PlayerExitReason {
   Resign = 0,
   Drop = 1,
@@ -298,3 +389,5 @@ QByteArray CreateUpdateProductionMessage(u32 buildingId, float progressValue, fl
 QByteArray CreateRemoveFromProductionQueueMessage(u32 buildingId, u8 queueIndex);
 
 QByteArray CreateSetHousedMessage(bool housed);
+
+QByteArray CreateGameResyncMessage();
@@ -0,0 +1,48 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/common/occupancy_bitmap.hpp"
+
+void OccupancyBitmap::Resize(int width, int height) {
+  this->width = width;
+  this->height = height;
+  wordsPerRow = (width + 63) / 64;
+  words.assign(wordsPerRow * height, 0);
+}
+
+void OccupancyBitmap::SetRect(const QRect& tileRect, bool value) {
+  QRect clippedRect = tileRect.intersected(QRect(0, 0, width, height));
+  if (clippedRect.isEmpty()) {
+    return;
+  }
+  
+  int minWord = clippedRect.left() >> 6;
+  int maxWord = clippedRect.right() >> 6;
+  for (int y = clippedRect.top(); y <= clippedRect.bottom(); ++ y) {
+    u64* row = words.data() + y * wordsPerRow;
+    for (int wordIndex = minWord; wordIndex <= maxWord; ++ wordIndex) {
+      u64 mask = GetWordMask(wordIndex, clippedRect.left(), clippedRect.right());
+      row[wordIndex] = value ? (row[wordIndex] | mask) : (row[wordIndex] & ~mask);
+    }
+  }
+}
+
+bool OccupancyBitmap::IsAnySetInRect(const QRect& tileRect) const {
+  QRect clippedRect = tileRect.intersected(QRect(0, 0, width, height));
+  if (clippedRect.isEmpty()) {
+    return false;
+  }
+  
+  int minWord = clippedRect.left() >> 6;
+  int maxWord = clippedRect.right() >> 6;
+  for (int y = clippedRect.top(); y <= clippedRect.bottom(); ++ y) {
+    const u64* row = words.data() + y * wordsPerRow;
+    for (int wordIndex = minWord; wordIndex <= maxWord; ++ wordIndex) {
+      if (row[wordIndex] & GetWordMask(wordIndex, clippedRect.left(), clippedRect.right())) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,63 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Stores one bit per map tile, for example whether the tile is occupied by a building.
+///
+/// Each row of tiles is packed into 64-bit words, such that testing whether any tile
+/// within a rectangle is set (which is done for each candidate position when placing
+/// a building foundation) only needs a few masked word tests per row.
+class OccupancyBitmap {
+ public:
+  /// Resizes the bitmap to the given size in tiles and clears all bits.
+  void Resize(int width, int height);
+  
+  /// Clears all bits.
+  inline void Clear() { std::fill(words.begin(), words.end(), 0); }
+  
+  inline bool Get(int tileX, int tileY) const {
+    return (words[tileY * wordsPerRow + (tileX >> 6)] >> (tileX & 63)) & 1;
+  }
+  
+  inline void Set(int tileX, int tileY, bool value) {
+    u64& word = words[tileY * wordsPerRow + (tileX >> 6)];
+    u64 bit = static_cast<u64>(1) << (tileX & 63);
+    word = value ? (word | bit) : (word & ~bit);
+  }
+  
+  /// Sets all bits within the given tile rectangle (clipped to the bitmap) to the value.
+  void SetRect(const QRect& tileRect, bool value);
+  
+  /// Returns whether any bit within the given tile rectangle (clipped to the bitmap) is set.
+  bool IsAnySetInRect(const QRect& tileRect) const;
+  
+  inline int GetWidth() const { return width; }
+  inline int GetHeight() const { return height; }
+  
+ private:
+  /// Returns the mask of the bits within [minX, maxX] in the word with the given index within a row.
+  static inline u64 GetWordMask(int wordIndex, int minX, int maxX) {
+    int firstBit = std::max(0, minX - 64 * wordIndex);
+    int lastBit = std::min(63, maxX - 64 * wordIndex);
+    return (~static_cast<u64>(0) >> (63 - lastBit)) & (~static_cast<u64>(0) << firstBit);
+  }
+  
+  
+  int width = 0;
+  int height = 0;
+  
+  /// Number of words that store a row of tiles.
+  int wordsPerRow = 0;
+  
+  /// The bit of tile (x, y) is bit (x % 64) of word [y * wordsPerRow + x / 64].
+  std::vector<u64> words;
+};
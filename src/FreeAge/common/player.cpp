@@ -67,12 +67,14 @@ void PlayerStats::BuildingFinished(BuildingType buildingType) {
 
 void PlayerStats::UnfinishedBuildingChange(BuildingType buildingType, int d) {
   buildingConstructions[static_cast<int>(buildingType)] += d;
+  buildingCount += d;
 
   Change();
 }
 
 void PlayerStats::FinishedBuildingChange(BuildingType buildingType, int d) {
   buildingAlive[static_cast<int>(buildingType)] += d;
+  buildingCount += d;
   if (d > 0) {
     buildingExisted[static_cast<int>(buildingType)] = true;
   }
@@ -90,6 +92,7 @@ void PlayerStats::UnitChange(UnitType unitType, bool death, int d) {
   populationCount += d;
 
   unitsAlive[static_cast<int>(unitType)] += d;
+  unitCount += d;
   if (death) {
     unitsDied[static_cast<int>(unitType)] += -d;
   }
@@ -70,6 +70,16 @@ struct PlayerStats {
 
   inline int GetVillagerCount() const { return villagerCount; }
 
+  /// The number of units that are alive.
+  inline int GetUnitCount() const { return unitCount; }
+
+  /// The number of buildings that are alive, including the ones under construction.
+  inline int GetBuildingCount() const { return buildingCount; }
+
+  /// The number of units and buildings that are alive. A player whose object count
+  /// drops to zero is defeated.
+  inline int GetObjectCount() const { return unitCount + buildingCount; }
+
   /// The number of buildings with the given type that have been constructred
   /// or are under construction and are alive.
   inline int GetBuildingTypeCount(BuildingType buildingType) const {
@@ -118,6 +128,12 @@ struct PlayerStats {
   /// The current population count.
   int populationCount = 0;
 
+  /// The number of units alive (of all types).
+  int unitCount = 0;
+
+  /// The number of buildings alive (of all types, finished or under construction).
+  int buildingCount = 0;
+
   /// The available population space.
   int availablePopulationSpace = 0;
 
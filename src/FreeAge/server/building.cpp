@@ -7,22 +7,20 @@
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/server/game.hpp"
 
-ServerBuilding::ServerBuilding(int playerIndex, BuildingType type, const QPoint& baseTile, float buildPercentage)
-    : ServerObject(ObjectType::Building, playerIndex),
+ServerBuilding::ServerBuilding(ServerObjectComponents* components, u32 slot, Fixed buildPercentage)
+    : ServerObject(components, slot),
       productionPercentage(0),
-      type(type),
-      baseTile(baseTile),
       buildPercentage(buildPercentage) {
-  SetHP(buildPercentage / 100.0 * GetBuildingMaxHP(type));
+  SetHP(buildPercentage * static_cast<int>(GetBuildingMaxHP(GetType())) / 100);
 }
 
 bool ServerBuilding::CanProduce(UnitType unitType, PlayerInGame* /*player*/) {
   // Can the building produce this unit in principle?
-  if (type == BuildingType::TownCenter) {
+  if (GetType() == BuildingType::TownCenter) {
     if (!IsVillager(unitType)) {
       return false;
     }
-  } else if (type == BuildingType::Barracks) {
+  } else if (GetType() == BuildingType::Barracks) {
     if (unitType != UnitType::Militia) {
       return false;
     }
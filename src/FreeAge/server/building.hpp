@@ -17,7 +17,8 @@ struct PlayerInGame;
 /// Represents a building on the server.
 class ServerBuilding : public ServerObject {
  public:
-  ServerBuilding(int playerIndex, BuildingType type, const QPoint& baseTile, float buildPercentage);
+  /// Creates the building for the given slot of the ServerObjectStore, whose components must have been initialized already.
+  ServerBuilding(ServerObjectComponents* components, u32 slot, Fixed buildPercentage);
   
   /// Returns whether this building can produce the given type of unit for the given player.
   /// Checks:
@@ -40,14 +41,16 @@ class ServerBuilding : public ServerObject {
   
   inline const std::vector<UnitType>& GetProductionQueue() const { return productionQueue; }
   
-  inline float GetProductionPercentage() const { return productionPercentage; }
-  inline void SetProductionPercentage(float percentage) { productionPercentage = percentage; }
+  inline Fixed GetProductionPercentage() const { return productionPercentage; }
+  inline void SetProductionPercentage(Fixed percentage) { productionPercentage = percentage; }
   
-  inline BuildingType GetType() const { return type; }
-  inline const QPoint& GetBaseTile() const { return baseTile; }
+  inline BuildingType GetType() const { return static_cast<BuildingType>(components->types[slot]); }
   
-  inline float GetBuildPercentage() const { return buildPercentage; }
-  inline void SetBuildPercentage(float percentage) { buildPercentage = percentage; }
+  /// The "base tile" is the minimum map tile coordinate on which the building stands on.
+  inline QPoint GetBaseTile() const { return components->mapCoords[slot].GetTile(); }
+  
+  inline Fixed GetBuildPercentage() const { return buildPercentage; }
+  inline void SetBuildPercentage(Fixed percentage) { buildPercentage = percentage; }
   
   inline bool IsFoundation() const { return buildPercentage <= 0; }
   inline bool IsCompleted() const { return buildPercentage >= 100; }
@@ -57,18 +60,12 @@ class ServerBuilding : public ServerObject {
   std::vector<UnitType> productionQueue;
   
   /// The progress on the production of the first item in the productionQueue, in percent.
-  float productionPercentage;
-  
-  BuildingType type;
-  
-  /// The "base tile" is the minimum map tile coordinate on which the building
-  /// stands on.
-  QPoint baseTile;
+  Fixed productionPercentage;
   
   /// The build percentage of this building, in percent. Special cases:
   /// * Exactly 100 means that the building is completed.
   /// * Exactly   0 means that this is a building foundation (i.e., it does not affect map occupancy (yet)).
-  float buildPercentage;
+  Fixed buildPercentage;
 };
 
 /// Convenience function to cast a ServerBuilding to a ServerObject.
@@ -0,0 +1,121 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/drop_off_index.hpp"
+
+#include <algorithm>
+
+#include "FreeAge/common/building_types.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/server/building.hpp"
+
+/// Returns the center of the building, which is used as its position in the index.
+static FixedPoint GetBuildingCenter(ServerBuilding* building) {
+  QSize size = GetBuildingSize(building->GetType());
+  return FixedPoint(
+      building->GetBaseTile().x() + Fixed(size.width()) / 2,
+      building->GetBaseTile().y() + Fixed(size.height()) / 2);
+}
+
+DropOffIndex::DropOffIndex(int width, int height, int playerCount)
+    : cellsX(std::max(1, (width + kCellSize - 1) / kCellSize)),
+      cellsY(std::max(1, (height + kCellSize - 1) / kCellSize)),
+      playerCount(playerCount) {
+  grids.resize(playerCount * static_cast<int>(ResourceType::NumTypes));
+  for (Grid& grid : grids) {
+    grid.cells.resize(cellsX * cellsY);
+  }
+}
+
+void DropOffIndex::AddBuilding(u32 buildingId, ServerBuilding* building) {
+  if (building->GetPlayerIndex() < 0 || building->GetPlayerIndex() >= playerCount) {
+    return;
+  }
+  
+  FixedPoint center = GetBuildingCenter(building);
+  int cellIndex = GetCellIndex(center);
+  for (int resourceType = 0; resourceType < static_cast<int>(ResourceType::NumTypes); ++ resourceType) {
+    if (IsDropOffPointForResource(building->GetType(), static_cast<ResourceType>(resourceType))) {
+      Grid& grid = GetGrid(building->GetPlayerIndex(), static_cast<ResourceType>(resourceType));
+      grid.cells[cellIndex].push_back({buildingId, center});
+      ++ grid.entryCount;
+    }
+  }
+}
+
+void DropOffIndex::RemoveBuilding(u32 buildingId, ServerBuilding* building) {
+  if (building->GetPlayerIndex() < 0 || building->GetPlayerIndex() >= playerCount) {
+    return;
+  }
+  
+  int cellIndex = GetCellIndex(GetBuildingCenter(building));
+  for (int resourceType = 0; resourceType < static_cast<int>(ResourceType::NumTypes); ++ resourceType) {
+    Grid& grid = GetGrid(building->GetPlayerIndex(), static_cast<ResourceType>(resourceType));
+    std::vector<Entry>& cell = grid.cells[cellIndex];
+    for (usize i = 0; i < cell.size(); ++ i) {
+      if (cell[i].buildingId == buildingId) {
+        // Keep the order of the remaining entries, such that ties in FindClosest() are always resolved the same way.
+        cell.erase(cell.begin() + i);
+        -- grid.entryCount;
+        break;
+      }
+    }
+  }
+}
+
+u32 DropOffIndex::FindClosest(int playerIndex, ResourceType resourceType, const FixedPoint& position) const {
+  if (playerIndex < 0 || playerIndex >= playerCount) {
+    LOG(ERROR) << "Invalid player index: " << playerIndex;
+    return kInvalidObjectId;
+  }
+  const Grid& grid = GetGrid(playerIndex, resourceType);
+  if (grid.entryCount == 0) {
+    return kInvalidObjectId;
+  }
+  
+  int cellIndex = GetCellIndex(position);
+  int centerCellX = cellIndex % cellsX;
+  int centerCellY = cellIndex / cellsX;
+  int maxRing = std::max(std::max(centerCellX, cellsX - 1 - centerCellX),
+                         std::max(centerCellY, cellsY - 1 - centerCellY));
+  
+  u32 bestBuildingId = kInvalidObjectId;
+  Fixed bestSquaredDistance = Fixed::Max();
+  for (int ring = 0; ring <= maxRing; ++ ring) {
+    // Visit all cells whose Chebyshev distance to the center cell equals the ring index.
+    for (int cellY = std::max(0, centerCellY - ring); cellY <= std::min(cellsY - 1, centerCellY + ring); ++ cellY) {
+      bool isTopOrBottomRow = cellY == centerCellY - ring || cellY == centerCellY + ring;
+      int cellXStep = isTopOrBottomRow ? 1 : (2 * ring);
+      for (int cellX = centerCellX - ring; cellX <= centerCellX + ring; cellX += cellXStep) {
+        if (cellX < 0 || cellX >= cellsX) {
+          continue;
+        }
+        
+        for (const Entry& entry : grid.cells[cellY * cellsX + cellX]) {
+          Fixed squaredDistance = SquaredDistance(entry.center, position);
+          if (squaredDistance < bestSquaredDistance) {
+            bestSquaredDistance = squaredDistance;
+            bestBuildingId = entry.buildingId;
+          }
+        }
+      }
+    }
+    
+    // All buildings in the following rings are at least (ring * kCellSize) away from the position.
+    if (bestBuildingId != kInvalidObjectId) {
+      Fixed minDistanceOfNextRing = ring * kCellSize;
+      if (bestSquaredDistance <= minDistanceOfNextRing * minDistanceOfNextRing) {
+        break;
+      }
+    }
+  }
+  
+  return bestBuildingId;
+}
+
+int DropOffIndex::GetCellIndex(const FixedPoint& position) const {
+  int cellX = std::max(0, std::min(cellsX - 1, position.x.Floor() / kCellSize));
+  int cellY = std::max(0, std::min(cellsY - 1, position.y.Floor() / kCellSize));
+  return cellY * cellsX + cellX;
+}
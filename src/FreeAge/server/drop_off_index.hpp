@@ -0,0 +1,73 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/resources.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+
+class ServerBuilding;
+
+/// Indexes the completed resource drop-off buildings (town centers, lumber camps, etc.)
+/// of each player, such that villagers with a full load can quickly find the closest
+/// building to return their resources to.
+///
+/// For each player and resource type, the buildings are sorted into a coarse grid of
+/// cells with kCellSize x kCellSize tiles. Queries visit the cells in rings of increasing
+/// distance around the query position, and stop once no closer building can follow.
+///
+/// Buildings must be added once they are completed, and removed when they get deleted
+/// (with the same arguments).
+class DropOffIndex {
+ public:
+  DropOffIndex(int width, int height, int playerCount);
+  
+  /// Adds the building for all resource types that it accepts. Does nothing for buildings
+  /// that are no drop-off points or that belong to Gaia.
+  void AddBuilding(u32 buildingId, ServerBuilding* building);
+  
+  void RemoveBuilding(u32 buildingId, ServerBuilding* building);
+  
+  /// Returns the ID of the player's drop-off building for the given resource type whose center
+  /// is closest to the given position, or kInvalidObjectId if the player does not have any.
+  u32 FindClosest(int playerIndex, ResourceType resourceType, const FixedPoint& position) const;
+  
+  /// Side length of the grid cells in tiles.
+  static constexpr int kCellSize = 16;
+  
+ private:
+  struct Entry {
+    u32 buildingId;
+    FixedPoint center;
+  };
+  
+  /// The drop-off buildings of a player for a resource type.
+  struct Grid {
+    /// An element (x, y) has index: [y * cellsX + x].
+    std::vector<std::vector<Entry>> cells;
+    
+    int entryCount = 0;
+  };
+  
+  inline Grid& GetGrid(int playerIndex, ResourceType resourceType) {
+    return grids[playerIndex * static_cast<int>(ResourceType::NumTypes) + static_cast<int>(resourceType)];
+  }
+  inline const Grid& GetGrid(int playerIndex, ResourceType resourceType) const {
+    return grids[playerIndex * static_cast<int>(ResourceType::NumTypes) + static_cast<int>(resourceType)];
+  }
+  
+  /// Returns the index of the grid cell that contains the given position (clamped to the grid).
+  int GetCellIndex(const FixedPoint& position) const;
+  
+  
+  int cellsX;
+  int cellsY;
+  int playerCount;
+  
+  /// Indexed by: [playerIndex * ResourceType::NumTypes + resourceType].
+  std::vector<Grid> grids;
+};
@@ -0,0 +1,232 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include <QPoint>
+#include <QPointF>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Fixed-point number with kFractionBits fractional bits, which is used for the
+/// simulation state on the server (unit positions, hitpoints, path costs, etc.).
+///
+/// In contrast to floating-point numbers, all operations on fixed-point numbers are plain
+/// integer operations, so their results are bit-exact on all platforms and with all compiler
+/// flags (e.g., x87 vs. SSE math, or FMA contraction). This makes the game simulation deterministic,
+/// which is required for validating replays across machines and for lockstep networking.
+///
+/// The value is stored in a 64-bit integer, such that products of map coordinates
+/// (e.g., squared distances) do not overflow. Multiplications and divisions round towards
+/// negative infinity. Conversions from floating-point numbers (for example, for map coordinates
+/// in client messages) round to the nearest representable value; since multiplying with
+/// a power of two is exact, these conversions are deterministic as well. Converting
+/// to floating-point is only intended for sending values to the clients.
+class Fixed {
+ public:
+  static constexpr int kFractionBits = 16;
+  static constexpr i64 kOne = static_cast<i64>(1) << kFractionBits;
+  
+  inline constexpr Fixed()
+      : raw(0) {}
+  
+  inline constexpr Fixed(int value)
+      : raw(static_cast<i64>(value) * kOne) {}
+  
+  /// Implicit conversions from floating-point values are not allowed, since they
+  /// would silently introduce platform-dependent values into the simulation.
+  Fixed(float value) = delete;
+  Fixed(double value) = delete;
+  
+  static inline constexpr Fixed FromRaw(i64 raw) { Fixed result; result.raw = raw; return result; }
+  
+  /// Returns numerator / denominator. Used for constants, e.g., FromFraction(1, 10) for 0.1.
+  static inline constexpr Fixed FromFraction(i64 numerator, i64 denominator) { return FromRaw(numerator * kOne / denominator); }
+  
+  static inline Fixed FromFloat(double value) { return FromRaw(static_cast<i64>(std::llround(value * kOne))); }
+  
+  static inline constexpr Fixed Max() { return FromRaw(std::numeric_limits<i64>::max()); }
+  
+  inline constexpr i64 GetRaw() const { return raw; }
+  
+  inline double ToDouble() const { return raw / static_cast<double>(kOne); }
+  inline float ToFloat() const { return static_cast<float>(ToDouble()); }
+  
+  /// Returns the largest integer that is less than or equal to the value.
+  inline constexpr int Floor() const { return static_cast<int>(raw >> kFractionBits); }
+  
+  /// Returns the integer that is closest to the value (rounding up for .5).
+  inline constexpr int Round() const { return static_cast<int>((raw + kOne / 2) >> kFractionBits); }
+  
+  inline constexpr Fixed Abs() const { return FromRaw((raw < 0) ? -raw : raw); }
+  
+  inline constexpr Fixed operator- () const { return FromRaw(-raw); }
+  
+  inline constexpr Fixed operator+ (const Fixed& other) const { return FromRaw(raw + other.raw); }
+  inline constexpr Fixed operator- (const Fixed& other) const { return FromRaw(raw - other.raw); }
+  inline constexpr Fixed operator* (const Fixed& other) const { return FromRaw((raw * other.raw) >> kFractionBits); }
+  inline constexpr Fixed operator/ (const Fixed& other) const { return FromRaw((raw * kOne) / other.raw); }
+  
+  inline Fixed& operator+= (const Fixed& other) { raw += other.raw; return *this; }
+  inline Fixed& operator-= (const Fixed& other) { raw -= other.raw; return *this; }
+  inline Fixed& operator*= (const Fixed& other) { *this = *this * other; return *this; }
+  inline Fixed& operator/= (const Fixed& other) { *this = *this / other; return *this; }
+  
+  inline constexpr bool operator== (const Fixed& other) const { return raw == other.raw; }
+  inline constexpr bool operator!= (const Fixed& other) const { return raw != other.raw; }
+  inline constexpr bool operator< (const Fixed& other) const { return raw < other.raw; }
+  inline constexpr bool operator<= (const Fixed& other) const { return raw <= other.raw; }
+  inline constexpr bool operator> (const Fixed& other) const { return raw > other.raw; }
+  inline constexpr bool operator>= (const Fixed& other) const { return raw >= other.raw; }
+  
+ private:
+  i64 raw;
+};
+
+inline constexpr Fixed operator+ (int a, const Fixed& b) { return Fixed(a) + b; }
+inline constexpr Fixed operator- (int a, const Fixed& b) { return Fixed(a) - b; }
+inline constexpr Fixed operator* (int a, const Fixed& b) { return Fixed(a) * b; }
+
+inline constexpr Fixed Min(const Fixed& a, const Fixed& b) { return (a < b) ? a : b; }
+inline constexpr Fixed Max(const Fixed& a, const Fixed& b) { return (a > b) ? a : b; }
+
+/// Returns the square root of the value (rounded down), or zero for non-positive values.
+/// This is computed with integer operations only.
+inline Fixed Sqrt(const Fixed& value) {
+  if (value.GetRaw() <= 0) {
+    return Fixed();
+  }
+  
+  // sqrt(raw / kOne) * kOne == sqrt(raw * kOne), so take the integer square root of raw * kOne.
+  u64 remainder = static_cast<u64>(value.GetRaw()) << Fixed::kFractionBits;
+  u64 result = 0;
+  u64 bit = static_cast<u64>(1) << 62;
+  while (bit > remainder) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (remainder >= result + bit) {
+      remainder -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return Fixed::FromRaw(static_cast<i64>(result));
+}
+
+/// sqrt(2), used for the cost of diagonal steps in path planning.
+constexpr Fixed kFixedSqrt2 = Fixed::FromRaw(92682);
+
+/// 2 * pi.
+constexpr Fixed kFixed2Pi = Fixed::FromRaw(411775);
+
+/// Computes the sine and cosine of the angle turns * 2 * pi (i.e., turns is the angle as a
+/// fraction of a full turn). This is computed with integer operations only, so in contrast to
+/// std::sin() and std::cos(), the result does not depend on the platform's math library.
+/// The angle is reduced to an eighth of a turn, on which Taylor polynomials are evaluated.
+/// The absolute error is below 1e-4.
+inline void SinCos(const Fixed& turns, Fixed* sine, Fixed* cosine) {
+  constexpr i64 kQuarterTurn = Fixed::kOne / 4;
+  
+  i64 raw = turns.GetRaw() % Fixed::kOne;
+  if (raw < 0) {
+    raw += Fixed::kOne;
+  }
+  int quadrant = static_cast<int>(raw / kQuarterTurn);
+  i64 angleInQuadrant = raw % kQuarterTurn;
+  
+  // For the second half of the quadrant, use sin(pi/2 - x) = cos(x) and cos(pi/2 - x) = sin(x).
+  bool mirrored = angleInQuadrant > kQuarterTurn / 2;
+  if (mirrored) {
+    angleInQuadrant = kQuarterTurn - angleInQuadrant;
+  }
+  
+  Fixed x = Fixed::FromRaw(angleInQuadrant) * kFixed2Pi;
+  Fixed x2 = x * x;
+  Fixed s = x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42)));
+  Fixed c = 1 - x2 / 2 * (1 - x2 / 12 * (1 - x2 / 30 * (1 - x2 / 56)));
+  if (mirrored) {
+    std::swap(s, c);
+  }
+  
+  switch (quadrant) {
+  case 0: *sine = s; *cosine = c; break;
+  case 1: *sine = c; *cosine = -s; break;
+  case 2: *sine = -s; *cosine = -c; break;
+  default: *sine = -c; *cosine = s; break;
+  }
+}
+
+/// A point or vector with fixed-point coordinates. This is the counterpart of QPointF
+/// (which is used on the client and in the messages) for the server's simulation state.
+struct FixedPoint {
+  inline constexpr FixedPoint() {}
+  
+  inline constexpr FixedPoint(const Fixed& x, const Fixed& y)
+      : x(x),
+        y(y) {}
+  
+  /// Returns the center of the given tile.
+  static inline FixedPoint TileCenter(const QPoint& tile) {
+    return FixedPoint(Fixed::FromRaw(tile.x() * Fixed::kOne + Fixed::kOne / 2), Fixed::FromRaw(tile.y() * Fixed::kOne + Fixed::kOne / 2));
+  }
+  
+  static inline FixedPoint FromQPointF(const QPointF& point) { return FixedPoint(Fixed::FromFloat(point.x()), Fixed::FromFloat(point.y())); }
+  inline QPointF ToQPointF() const { return QPointF(x.ToDouble(), y.ToDouble()); }
+  
+  /// Returns the tile that contains the point.
+  inline QPoint GetTile() const { return QPoint(x.Floor(), y.Floor()); }
+  
+  inline constexpr FixedPoint operator- () const { return FixedPoint(-x, -y); }
+  
+  inline constexpr FixedPoint operator+ (const FixedPoint& other) const { return FixedPoint(x + other.x, y + other.y); }
+  inline constexpr FixedPoint operator- (const FixedPoint& other) const { return FixedPoint(x - other.x, y - other.y); }
+  inline constexpr FixedPoint operator* (const Fixed& factor) const { return FixedPoint(x * factor, y * factor); }
+  inline constexpr FixedPoint operator/ (const Fixed& divisor) const { return FixedPoint(x / divisor, y / divisor); }
+  
+  inline FixedPoint& operator+= (const FixedPoint& other) { x += other.x; y += other.y; return *this; }
+  inline FixedPoint& operator-= (const FixedPoint& other) { x -= other.x; y -= other.y; return *this; }
+  
+  inline constexpr bool operator== (const FixedPoint& other) const { return x == other.x && y == other.y; }
+  inline constexpr bool operator!= (const FixedPoint& other) const { return x != other.x || y != other.y; }
+  
+  Fixed x;
+  Fixed y;
+};
+
+inline constexpr FixedPoint operator* (const Fixed& factor, const FixedPoint& point) { return point * factor; }
+
+// Counterparts of the QPointF functions in util.hpp.
+
+inline constexpr Fixed Dot(const FixedPoint& a, const FixedPoint& b) {
+  return a.x * b.x + a.y * b.y;
+}
+
+inline constexpr Fixed SquaredLength(const FixedPoint& vector) {
+  return Dot(vector, vector);
+}
+
+inline Fixed Length(const FixedPoint& vector) {
+  return Sqrt(SquaredLength(vector));
+}
+
+inline constexpr Fixed SquaredDistance(const FixedPoint& a, const FixedPoint& b) {
+  return SquaredLength(a - b);
+}
+
+inline Fixed Distance(const FixedPoint& a, const FixedPoint& b) {
+  return Sqrt(SquaredDistance(a, b));
+}
+
+/// Returns the vector scaled to unit length, or (0, 0) if its length is zero.
+inline FixedPoint Normalized(const FixedPoint& vector) {
+  Fixed length = Length(vector);
+  return (length == Fixed()) ? FixedPoint() : (vector / length);
+}
@@ -0,0 +1,152 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/flow_field.hpp"
+
+#include <algorithm>
+#include <functional>
+
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+/// Directions in the direction field. Direction i + 4 is the opposite of direction i.
+static const QPoint kDirections[8] = {
+  QPoint(1, 0),
+  QPoint(1, 1),
+  QPoint(0, 1),
+  QPoint(-1, 1),
+  QPoint(-1, 0),
+  QPoint(-1, -1),
+  QPoint(0, -1),
+  QPoint(1, -1),
+};
+
+FlowField::FlowField(const QRect& goalRect, const std::shared_ptr<const OccupancySnapshot>& occupancy)
+    : goalRect(goalRect),
+      occupancy(occupancy),
+      width(occupancy->width),
+      height(occupancy->height) {
+  integratedCost.assign(width * height, Fixed::Max());
+  direction.assign(width * height, kNoDirection);
+  
+  auto isFree = [&](int x, int y) {
+    return !occupancy->occupiedForUnitsAt(x, y) || goalRect.contains(x, y, false);
+  };
+  
+  // Run Dijkstra's algorithm, starting from all goal tiles.
+  std::vector<std::pair<Fixed, int>> openList;
+  int minGoalX = std::max(0, goalRect.x());
+  int minGoalY = std::max(0, goalRect.y());
+  int maxGoalX = std::min(width - 1, goalRect.x() + goalRect.width() - 1);
+  int maxGoalY = std::min(height - 1, goalRect.y() + goalRect.height() - 1);
+  for (int y = minGoalY; y <= maxGoalY; ++ y) {
+    for (int x = minGoalX; x <= maxGoalX; ++ x) {
+      integratedCost[y * width + x] = 0;
+      openList.emplace_back(Fixed(), y * width + x);
+    }
+  }
+  
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), std::greater<std::pair<Fixed, int>>());
+    Fixed currentCost = openList.back().first;
+    int currentIndex = openList.back().second;
+    openList.pop_back();
+    
+    if (currentCost > integratedCost[currentIndex]) {
+      // Outdated entry.
+      continue;
+    }
+    
+    int x = currentIndex % width;
+    int y = currentIndex / width;
+    
+    for (int d = 0; d < 8; ++ d) {
+      int nextX = x + kDirections[d].x();
+      int nextY = y + kDirections[d].y();
+      if (nextX < 0 || nextY < 0 ||
+          nextX >= width || nextY >= height ||
+          !isFree(nextX, nextY)) {
+        continue;
+      }
+      
+      // Diagonal movements require the two adjacent tiles to be free.
+      bool isDiagonal = kDirections[d].x() != 0 && kDirections[d].y() != 0;
+      if (isDiagonal && (!isFree(nextX, y) || !isFree(x, nextY))) {
+        continue;
+      }
+      
+      Fixed newCost = currentCost + (isDiagonal ? kFixedSqrt2 : Fixed(1));
+      int nextIndex = nextY * width + nextX;
+      if (newCost < integratedCost[nextIndex]) {
+        integratedCost[nextIndex] = newCost;
+        direction[nextIndex] = (d + 4) % 8;
+        openList.emplace_back(newCost, nextIndex);
+        std::push_heap(openList.begin(), openList.end(), std::greater<std::pair<Fixed, int>>());
+      }
+    }
+  }
+}
+
+bool FlowField::GetReversePath(const QPoint& startTile, std::vector<FixedPoint>* reversePath) const {
+  reversePath->clear();
+  
+  if (integratedCost[startTile.y() * width + startTile.x()] == Fixed::Max()) {
+    return false;
+  }
+  
+  QPoint currentTile = startTile;
+  while (integratedCost[currentTile.y() * width + currentTile.x()] > 0) {
+    u8 currentDirection = direction[currentTile.y() * width + currentTile.x()];
+    if (currentDirection == kNoDirection ||
+        reversePath->size() > static_cast<usize>(width * height)) {
+      LOG(ERROR) << "Erroneous direction field while following a flow field";
+      reversePath->clear();
+      return false;
+    }
+    
+    currentTile += kDirections[currentDirection];
+    reversePath->push_back(FixedPoint::TileCenter(currentTile));
+  }
+  
+  std::reverse(reversePath->begin(), reversePath->end());
+  return true;
+}
+
+std::shared_ptr<const FlowField> FlowFieldCache::Find(const QRect& goalRect, const OccupancySnapshot* occupancy) {
+  DropOutdated(occupancy);
+  
+  for (usize i = 0; i < fields.size(); ++ i) {
+    if (fields[i]->GetGoalRect() == goalRect) {
+      // Move the field to the end to mark it as most recently used.
+      std::shared_ptr<const FlowField> field = fields[i];
+      fields.erase(fields.begin() + i);
+      fields.push_back(field);
+      return field;
+    }
+  }
+  
+  return nullptr;
+}
+
+std::shared_ptr<const FlowField> FlowFieldCache::GetOrCreate(const QRect& goalRect, const std::shared_ptr<const OccupancySnapshot>& occupancy) {
+  std::shared_ptr<const FlowField> field = Find(goalRect, occupancy.get());
+  if (field) {
+    return field;
+  }
+  
+  if (fields.size() >= kMaxCachedFields) {
+    fields.erase(fields.begin());
+  }
+  field.reset(new FlowField(goalRect, occupancy));
+  fields.push_back(field);
+  return field;
+}
+
+void FlowFieldCache::DropOutdated(const OccupancySnapshot* occupancy) {
+  fields.erase(
+      std::remove_if(fields.begin(), fields.end(), [&](const std::shared_ptr<const FlowField>& field) {
+        return field->GetOccupancy() != occupancy;
+      }),
+      fields.end());
+}
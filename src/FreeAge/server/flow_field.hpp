@@ -0,0 +1,90 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <QPoint>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+
+struct OccupancySnapshot;
+
+/// A flow field towards a goal area on the unit occupancy grid. It consists of:
+/// * An integration field, storing for each tile the cost of the shortest path to the goal.
+/// * A direction field, storing for each tile the direction to the next tile on this path.
+///
+/// Building a flow field costs a single Dijkstra pass over the map. Afterwards, the path
+/// from any tile to the goal can be read off by following the directions. This makes it
+/// much cheaper than running A* for each unit if many units move to the same goal.
+class FlowField {
+ public:
+  /// Value in the direction field for tiles that cannot reach the goal (and for the goal tiles).
+  static constexpr u8 kNoDirection = 8;
+  
+  /// Computes the flow field towards the given goal tiles. The goal tiles are treated as free
+  /// even if they are occupied (to be able to plan a path into a target building).
+  /// The same rules for diagonal movements as in PlanUnitPath() are used.
+  FlowField(const QRect& goalRect, const std::shared_ptr<const OccupancySnapshot>& occupancy);
+  
+  /// If the goal is reachable from the given start tile, returns true and the path to the goal
+  /// as tile centers in reversePath. As for the paths planned by PlanUnitPath(), the first
+  /// entry is the last node in the path, and the start tile is not included.
+  /// Returns false if the goal is not reachable from the start tile.
+  bool GetReversePath(const QPoint& startTile, std::vector<FixedPoint>* reversePath) const;
+  
+  /// Returns the cost of the shortest path from the given tile to the goal,
+  /// or Fixed::Max() if the goal cannot be reached from it.
+  inline Fixed GetIntegratedCost(int tileX, int tileY) const { return integratedCost[tileY * width + tileX]; }
+  
+  inline const QRect& GetGoalRect() const { return goalRect; }
+  inline const OccupancySnapshot* GetOccupancy() const { return occupancy.get(); }
+  
+ private:
+  QRect goalRect;
+  
+  /// The occupancy grid that the flow field was computed for.
+  std::shared_ptr<const OccupancySnapshot> occupancy;
+  
+  int width;
+  int height;
+  
+  /// Integration field. An element (x, y) has index: [y * width + x].
+  std::vector<Fixed> integratedCost;
+  
+  /// Direction field, indexing into kDirections in flow_field.cpp. An element (x, y) has index: [y * width + x].
+  std::vector<u8> direction;
+};
+
+/// Caches the flow fields for a small number of recently used goals. A cached flow field
+/// only remains valid as long as the occupancy grid that it was computed for is current,
+/// i.e., as long as ServerMap::GetOccupancySnapshot() returns the same snapshot.
+class FlowFieldCache {
+ public:
+  /// Move orders for at least this many units make the server create a flow field for the goal.
+  static constexpr int kMinGroupSize = 8;
+  
+  /// Returns the cached flow field for the given goal if it was computed for the given
+  /// occupancy snapshot, or nullptr otherwise.
+  std::shared_ptr<const FlowField> Find(const QRect& goalRect, const OccupancySnapshot* occupancy);
+  
+  /// Returns the cached flow field for the given goal if it was computed for the given
+  /// occupancy snapshot. Otherwise, computes it and adds it to the cache.
+  std::shared_ptr<const FlowField> GetOrCreate(const QRect& goalRect, const std::shared_ptr<const OccupancySnapshot>& occupancy);
+  
+ private:
+  /// Drops all flow fields that were not computed for the given occupancy snapshot.
+  void DropOutdated(const OccupancySnapshot* occupancy);
+  
+  
+  static constexpr usize kMaxCachedFields = 8;
+  
+  /// The cached flow fields, with the most recently used ones at the end.
+  std::vector<std::shared_ptr<const FlowField>> fields;
+};
@@ -5,11 +5,15 @@
 #include "FreeAge/server/game.hpp"
 
 #include <iostream>
+#include <random>
+#include <thread>
 
 #include <QApplication>
+#include <QDateTime>
+#include <QDir>
 #include <QImage>
-#include <QThread>
 
+#include "FreeAge/common/event_loop.hpp"
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/common/messages.hpp"
 #include "FreeAge/common/timing.hpp"
@@ -22,20 +26,43 @@
 // in order for CIDE not to show some errors. Compiling always worked. Check the reason for the errors.
 #include <mango/core/endian.hpp>
 
+/// Number of map chunks that get sent to a reconnected player per game step.
+constexpr int kResyncMapChunksPerStep = 4;
+
+/// New connections during the game which do not send a Reconnect message within this time (in milliseconds) get dropped.
+constexpr int kReconnectAuthorizeTimeout = 2000;
+
+/// Returns whether the message is a player command that affects the game simulation.
+/// These messages are recorded in replays.
+static bool IsPlayerCommand(ClientToServerMessage msgType) {
+  return msgType == ClientToServerMessage::MoveToMapCoord ||
+         msgType == ClientToServerMessage::SetTarget ||
+         msgType == ClientToServerMessage::ProduceUnit ||
+         msgType == ClientToServerMessage::PlaceBuildingFoundation ||
+         msgType == ClientToServerMessage::DequeueProductionQueueItem ||
+         msgType == ClientToServerMessage::DeleteObject;
+}
+
 void PlayerInGame::RemoveFromGame() {
-  unparsedBuffer.clear();
+  unparsedBuffer.Clear();
   isConnected = false;
+  awaitingReconnect = false;
+  nextResyncMapChunk = -1;
 }
 
 
 Game::Game(ServerSettings* settings)
     : settings(settings) {}
 
-void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame) {
-  constexpr float kTargetFPS = 30;
-  constexpr float kSimulationTimeInterval = 1 / kTargetFPS;
+void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame, QTcpServer* reconnectServer) {
+  {
+    std::unique_lock<std::mutex> lock(reconnectionsMutex);
+    gameLoopThread = QThread::currentThread();
+  }
+  this->reconnectServer = reconnectServer;
   
   accumulatedMessages.resize(playersInGame->size());
+  objectStateDeltas.resize(playersInGame->size());
   for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
     accumulatedMessages[playerIndex].reserve(1024);
   }
@@ -49,13 +76,16 @@ void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame
       auto& player = playersInGame->at(playerIndex);
       
       if (!player->isConnected) {
-        // TODO: Allow players to reconnect to the game
+        if (player->awaitingReconnect &&
+            MillisecondsDuration(Clock::now() - player->disconnectTime).count() > kReconnectTimeout) {
+          RemovePlayer(playerIndex, PlayerExitReason::Drop);
+        }
         continue;
       }
       
       // Read new data from the connection.
       int prevSize = player->unparsedBuffer.size();
-      player->unparsedBuffer += player->socket->readAll();
+      player->unparsedBuffer.Append(player->socket->readAll());
       
       bool removePlayer = false;
       if (player->unparsedBuffer.size() > prevSize ||
@@ -69,18 +99,19 @@ void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame
       constexpr int kNoPingTimeout = 5000;
       bool socketDisconnected = player->socket->state() != QAbstractSocket::ConnectedState;
       bool pingTimeout = MillisecondsDuration(Clock::now() - player->lastPingTime).count() > kNoPingTimeout;
-      if (removePlayer || socketDisconnected || pingTimeout) {
-        RemovePlayer(playerIndex, (socketDisconnected || pingTimeout) ? PlayerExitReason::Drop : PlayerExitReason::Resign);
-        continue;
+      if (removePlayer) {
+        RemovePlayer(playerIndex, PlayerExitReason::Resign);
+      } else if (socketDisconnected || pingTimeout) {
+        DisconnectPlayer(playerIndex);
       }
     }
     
-    // Process Qt events.
-    qApp->processEvents(QEventLoop::AllEvents);
+    HandleReconnections();
     
     // Simulate a game step if it is due.
     // TODO: Do we need to consider the possibility of falling behind more and more with the simulation?
     //       I guess that the game would break anyway then.
+    TimePoint nextWakeUpTime;
     if (map) {
       double serverTime = GetCurrentServerTime();
       while (serverTime >= lastSimulationTime + kSimulationTimeInterval) {
@@ -90,31 +121,121 @@ void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame
         lastSimulationTime += kSimulationTimeInterval;
       }
       
-      // If the next game step is due far enough in the future, sleep a bit to avoid "busy waiting" and reduce the CPU load.
-      // However, we must not sleep for the whole time, since we should keep handling client messages
-      // and processing Qt events in the meantime.
-      constexpr double kMaxSleepTimeSeconds = 0.0005;  // 0.5 milliseconds
-      double nextIterationTime = lastSimulationTime + kSimulationTimeInterval;
-      serverTime = GetCurrentServerTime();
-      double sleepTimeSeconds = std::min(kMaxSleepTimeSeconds, nextIterationTime - serverTime);
-      if (sleepTimeSeconds > 0) {
-        constexpr double kSecondsToMicroseconds = 1000 * 1000;
-        QThread::usleep(kSecondsToMicroseconds * sleepTimeSeconds + 0.5);
-      }
+      nextWakeUpTime = settings->serverStartTime + std::chrono::duration_cast<Clock::duration>(SecondsDuration(lastSimulationTime + kSimulationTimeInterval));
     } else {
-      QThread::msleep(1);
+      nextWakeUpTime = Clock::now() + std::chrono::milliseconds(kMaxEventWaitMilliseconds);
+    }
+    
+    if (replayWriter) {
+      replayWriter->Flush();
     }
     
+    // Wait for client messages and process Qt events until the next game step is due.
+    ProcessEventsUntil(nextWakeUpTime);
+    
     firstLoopIteration = false;
   }
   
-  // Before exiting, continue processing events for a bit.
+  if (replayWriter) {
+    replayWriter->Close(gameStepIndex);
+    replayWriter.reset();
+  }
+  
+  // Before exiting, continue processing events for a bit (at most 200 milliseconds).
   // This is an attempt to ensure that all of the messages that were sent do actually get sent.
-  // TODO: Is this really necessary, and if yes, is there a better way to do it?
-  for (int i = 0; i < 200; ++ i) {
-    qApp->processEvents(QEventLoop::AllEvents);
-    QThread::msleep(1);
+  TimePoint exitDeadline = Clock::now() + std::chrono::milliseconds(200);
+  while (Clock::now() < exitDeadline) {
+    bool allMessagesWritten = true;
+    for (auto& player : *playersInGame) {
+      if (player->isConnected && player->socket->bytesToWrite() > 0) {
+        allMessagesWritten = false;
+        break;
+      }
+    }
+    if (allMessagesWritten) {
+      break;
+    }
+    
+    ProcessEventsUntil(exitDeadline);
+  }
+  
+  // Drop the connections of players that did not finish reconnecting.
+  {
+    std::unique_lock<std::mutex> lock(reconnectionsMutex);
+    gameLoopThread = nullptr;
+    for (PendingReconnection& reconnection : addedReconnections) {
+      pendingReconnections.push_back(std::move(reconnection));
+    }
+    addedReconnections.clear();
+  }
+  for (PendingReconnection& reconnection : pendingReconnections) {
+    delete reconnection.socket;
+  }
+  pendingReconnections.clear();
+}
+
+bool Game::AddReconnection(QTcpSocket* socket, const QByteArray& receivedData) {
+  std::unique_lock<std::mutex> lock(reconnectionsMutex);
+  if (!gameLoopThread) {
+    return false;
+  }
+  
+  socket->setParent(nullptr);
+  socket->moveToThread(gameLoopThread);
+  
+  PendingReconnection reconnection;
+  reconnection.socket = socket;
+  reconnection.unparsedBuffer.Append(receivedData);
+  reconnection.connectionTime = Clock::now();
+  addedReconnections.push_back(std::move(reconnection));
+  return true;
+}
+
+void Game::StartHeadlessGame(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame, int mapSeed, double gameBeginServerTime) {
+  isHeadless = true;
+  headlessMessageBytes = 0;
+  
+  this->playersInGame = playersInGame;
+  accumulatedMessages.clear();
+  accumulatedMessages.resize(playersInGame->size());
+  objectStateDeltas.clear();
+  objectStateDeltas.resize(playersInGame->size());
+  
+  SetupGame(mapSeed);
+  
+  this->gameBeginServerTime = gameBeginServerTime;
+  lastSimulationTime = gameBeginServerTime;
+}
+
+void Game::SimulateHeadlessGameStep() {
+  SimulateGameStep(lastSimulationTime + kSimulationTimeInterval, kSimulationTimeInterval);
+  lastSimulationTime += kSimulationTimeInterval;
+}
+
+void Game::HandleHeadlessClientMessages(PlayerInGame* player, const QByteArray& messages) {
+  if (!player->isConnected) {
+    return;
+  }
+  player->unparsedBuffer.Append(messages);
+  if (TryParseClientMessages(player, *playersInGame) == ParseMessagesResult::PlayerLeftOrShouldBeDisconnected) {
+    RemovePlayer(player->index, PlayerExitReason::Resign);
+  }
+}
+
+void Game::HandleHeadlessPlayerExit(PlayerInGame* player, PlayerExitReason reason) {
+  if (!player->isConnected) {
+    return;
+  }
+  RemovePlayer(player->index, reason);
+}
+
+void Game::SpawnUnit(u32 buildingId, UnitType type) {
+  ServerObject* object = map->GetObjects().Find(buildingId);
+  if (!object || !object->isBuilding()) {
+    LOG(ERROR) << "SpawnUnit() called for an ID that is not a building: " << buildingId;
+    return;
   }
+  ProduceUnit(AsBuilding(object), type);
 }
 
 void Game::HandleLoadingProgress(const QByteArray& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
@@ -160,6 +281,9 @@ void Game::SendChatBroadcast(u16 sendingPlayerIndex, const QString& text, const
   // clients receive the chat in the same order.
   QByteArray chatBroadcastMsg = CreateChatBroadcastMessage(sendingPlayerIndex, text);
   for (const auto& player : players) {
+    if (!player->socket) {
+      continue;
+    }
     player->socket->write(chatBroadcastMsg);
     player->socket->flush();
   }
@@ -211,9 +335,9 @@ void Game::HandleMoveToMapCoordMessage(const QByteArray& msg, PlayerInGame* play
   }
   const char* data = msg.data();
   
-  QPointF targetMapCoord(
+  FixedPoint targetMapCoord = FixedPoint::FromQPointF(QPointF(
       *reinterpret_cast<const float*>(data + 3),
-      *reinterpret_cast<const float*>(data + 7));
+      *reinterpret_cast<const float*>(data + 7)));
   
   usize selectedUnitIdsSize = mango::uload16(data + 11);
   if (len != 13 + 4 * selectedUnitIdsSize) {
@@ -228,17 +352,24 @@ void Game::HandleMoveToMapCoordMessage(const QByteArray& msg, PlayerInGame* play
   }
   
   // Handle move command (for all IDs which are actually units of the sending client)
+  ServerUnit* lastCommandedUnit = nullptr;
+  int numCommandedUnits = 0;
   for (u32 id : selectedUnitIds) {
-    auto it = map->GetObjects().find(id);
-    if (it == map->GetObjects().end() ||
-        !it->second->isUnit() ||
-        it->second->GetPlayerIndex() != player->index) {
+    ServerObject* object = map->GetObjects().Find(id);
+    if (!object ||
+        !object->isUnit() ||
+        object->GetPlayerIndex() != player->index) {
       continue;
     }
     
-    ServerUnit* unit = AsUnit(it->second);
+    ServerUnit* unit = AsUnit(object);
     unit->SetMoveToTarget(targetMapCoord);
+    
+    lastCommandedUnit = unit;
+    ++ numCommandedUnits;
   }
+  
+  PrepareGroupPathPlanning(lastCommandedUnit, numCommandedUnits);
 }
 
 void Game::HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u32 len) {
@@ -250,8 +381,8 @@ void Game::HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u
   const char* data = msg.data();
   
   u32 targetId = mango::uload32(data + 3);
-  auto targetIt = map->GetObjects().find(targetId);
-  if (targetIt == map->GetObjects().end()) {
+  ServerObject* target = map->GetObjects().Find(targetId);
+  if (!target) {
     LOG(WARNING) << "Server: Received a SetTarget message for a target ID that does not exist (anymore?)";
     return;
   }
@@ -269,7 +400,7 @@ void Game::HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u
   }
   
   // Handle command (for all suitable IDs which are actually units of the sending client)
-  SetUnitTargets(unitIds, player->index, targetId, targetIt->second, true);
+  SetUnitTargets(unitIds, player->index, targetId, target, true);
 }
 
 void Game::HandleProduceUnitMessage(const QByteArray& msg, PlayerInGame* player) {
@@ -283,12 +414,11 @@ void Game::HandleProduceUnitMessage(const QByteArray& msg, PlayerInGame* player)
   UnitType unitType = static_cast<UnitType>(mango::uload16(data + 7));
   
   // Safely get the production building.
-  auto buildingIt = map->GetObjects().find(buildingId);
-  if (buildingIt == map->GetObjects().end()) {
+  ServerObject* buildingObject = map->GetObjects().Find(buildingId);
+  if (!buildingObject) {
     LOG(WARNING) << "Received a ProduceUnit message for a building with a non-existant object ID";
     return;
   }
-  ServerObject* buildingObject = buildingIt->second;
   if (!buildingObject->isBuilding()) {
     LOG(WARNING) << "Received a ProduceUnit message for a production building object ID that is not a building";
     return;
@@ -372,15 +502,11 @@ void Game::HandlePlaceBuildingFoundationMessage(const QByteArray& msg, PlayerInG
   
   // 1) Check whether any map tile at this location is occupied.
   // TODO: We should also check against foundations set by the same player.
-  for (int y = baseTile.y(); y < baseTile.y() + foundationSize.height(); ++ y) {
-    for (int x = baseTile.x(); x < baseTile.x() + foundationSize.width(); ++ x) {
-      if (map->occupiedForBuildingsAt(x, y)) {
-        // TODO: Once map visibility is implemented, players must be allowed to place foundations over other players'
-        //       buildings that they don't see. Otherwise, "foundation scanning" will be possible (as in the original game).
-        LOG(WARNING) << "Received a PlaceBuildingFoundation message for an occupied space";
-        return;
-      }
-    }
+  if (map->IsAreaOccupiedForBuildings(QRect(baseTile, foundationSize))) {
+    // TODO: Once map visibility is implemented, players must be allowed to place foundations over other players'
+    //       buildings that they don't see. Otherwise, "foundation scanning" will be possible (as in the original game).
+    LOG(WARNING) << "Received a PlaceBuildingFoundation message for an occupied space";
+    return;
   }
   
   // 2) Check whether the maximum elevation difference within the building space does not exceed 2.
@@ -418,6 +544,7 @@ void Game::HandlePlaceBuildingFoundationMessage(const QByteArray& msg, PlayerInG
 
   QByteArray addObjectMsg = CreateAddObjectMessage(newBuildingId, newBuildingFoundation);
   accumulatedMessages[player->index] += addObjectMsg;
+  newBuildingFoundation->SetObservedBy(player->index, true);
   
   // For all given villagers, set the target to the new foundation.
   SetUnitTargets(villagerIds, player->index, newBuildingId, newBuildingFoundation, true);
@@ -433,12 +560,11 @@ void Game::HandleDeleteObjectMessage(const QByteArray& msg, PlayerInGame* player
   u32 objectId = mango::uload32(data + 3);
   
   // Safely get the object.
-  auto buildingIt = map->GetObjects().find(objectId);
-  if (buildingIt == map->GetObjects().end()) {
+  ServerObject* object = map->GetObjects().Find(objectId);
+  if (!object) {
     LOG(WARNING) << "Received a DeleteObject message for an ID that does not exist";
     return;
   }
-  ServerObject* object = buildingIt->second;
   if (object->GetPlayerIndex() != player->index) {
     LOG(ERROR) << "Received a DeleteObject message for an object that the player does not own";
     return;
@@ -457,12 +583,11 @@ void Game::HandleDequeueProductionQueueItemMessage(const QByteArray& msg, Player
   u32 objectId = mango::uload32(data + 3);
   
   // Safely get the production building.
-  auto buildingIt = map->GetObjects().find(objectId);
-  if (buildingIt == map->GetObjects().end()) {
+  ServerObject* object = map->GetObjects().Find(objectId);
+  if (!object) {
     LOG(WARNING) << "Received a DequeueProductionQueueItem message for an ID that does not exist";
     return;
   }
-  ServerObject* object = buildingIt->second;
   if (object->GetPlayerIndex() != player->index) {
     LOG(ERROR) << "Received a DequeueProductionQueueItem message for an object that the player does not own";
     return;
@@ -497,76 +622,275 @@ void Game::HandleDequeueProductionQueueItemMessage(const QByteArray& msg, Player
 }
 
 Game::ParseMessagesResult Game::TryParseClientMessages(PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
-  while (true) {
-    if (player->unparsedBuffer.size() < 3) {
-      return ParseMessagesResult::NoAction;
-    }
-    
-    char* data = player->unparsedBuffer.data();
-    u16 msgLength = mango::uload16(data + 1);
+  QByteArray msg;
+  while (player->unparsedBuffer.TakeMessage(&msg)) {
+    u16 msgLength = msg.size();
+    ClientToServerMessage msgType = static_cast<ClientToServerMessage>(msg.at(0));
     
-    if (player->unparsedBuffer.size() < msgLength) {
-      return ParseMessagesResult::NoAction;
+    if (replayWriter && IsPlayerCommand(msgType)) {
+      replayWriter->WriteClientMessage(gameStepIndex, player->index, msg);
     }
     
-    if (msgLength < 3) {
-      LOG(ERROR) << "Received a too short message. The received message length is (should be at least 3): " << msgLength;
-    } else {
-      ClientToServerMessage msgType = static_cast<ClientToServerMessage>(data[0]);
+    switch (msgType) {
+    case ClientToServerMessage::MoveToMapCoord:
+      HandleMoveToMapCoordMessage(msg, player, msgLength);
+      break;
+    case ClientToServerMessage::SetTarget:
+      HandleSetTargetMessage(msg, player, msgLength);
+      break;
+    case ClientToServerMessage::ProduceUnit:
+      HandleProduceUnitMessage(msg, player);
+      break;
+    case ClientToServerMessage::PlaceBuildingFoundation:
+      HandlePlaceBuildingFoundationMessage(msg, player);
+      break;
+    case ClientToServerMessage::DequeueProductionQueueItem:
+      HandleDequeueProductionQueueItemMessage(msg, player);
+      break;
+    case ClientToServerMessage::DeleteObject:
+      HandleDeleteObjectMessage(msg, player);
+      break;
+    case ClientToServerMessage::Chat:
+      HandleChat(msg, player, msgLength, players);
+      break;
+    case ClientToServerMessage::Ping:
+      HandlePing(msg, player);
+      break;
+    case ClientToServerMessage::Leave:
+      LOG(INFO) << "Server: Got leave message from player " << player->name.toStdString() << " (index " << player->index << ")";
+      return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
+    case ClientToServerMessage::LoadingProgress:
+      HandleLoadingProgress(msg, player, players);
+      break;
+    case ClientToServerMessage::LoadingFinished:
+      HandleLoadingFinished(player, players);
+      break;
+    default:
+      LOG(ERROR) << "Server: Received a message in the game phase that cannot be parsed in this phase: " << static_cast<int>(msgType);
+      break;
+    }
+  }
+  
+  return ParseMessagesResult::NoAction;
+}
+
+void Game::HandleReconnections() {
+  // Collect the new connections.
+  if (reconnectServer) {
+    while (QTcpSocket* socket = reconnectServer->nextPendingConnection()) {
+      socket->setParent(nullptr);
+      socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
       
-      switch (msgType) {
-      case ClientToServerMessage::MoveToMapCoord:
-        HandleMoveToMapCoordMessage(player->unparsedBuffer, player, msgLength);
-        break;
-      case ClientToServerMessage::SetTarget:
-        HandleSetTargetMessage(player->unparsedBuffer, player, msgLength);
-        break;
-      case ClientToServerMessage::ProduceUnit:
-        HandleProduceUnitMessage(player->unparsedBuffer, player);
-        break;
-      case ClientToServerMessage::PlaceBuildingFoundation:
-        HandlePlaceBuildingFoundationMessage(player->unparsedBuffer, player);
-        break;
-      case ClientToServerMessage::DequeueProductionQueueItem:
-        HandleDequeueProductionQueueItemMessage(player->unparsedBuffer, player);
-        break;
-      case ClientToServerMessage::DeleteObject:
-        HandleDeleteObjectMessage(player->unparsedBuffer, player);
-        break;
-      case ClientToServerMessage::Chat:
-        HandleChat(player->unparsedBuffer, player, msgLength, players);
-        break;
-      case ClientToServerMessage::Ping:
-        HandlePing(player->unparsedBuffer, player);
-        break;
-      case ClientToServerMessage::Leave:
-        LOG(INFO) << "Server: Got leave message from player " << player->name.toStdString() << " (index " << player->index << ")";
-        return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
-      case ClientToServerMessage::LoadingProgress:
-        HandleLoadingProgress(player->unparsedBuffer, player, players);
-        break;
-      case ClientToServerMessage::LoadingFinished:
-        HandleLoadingFinished(player, players);
-        break;
-      default:
-        LOG(ERROR) << "Server: Received a message in the game phase that cannot be parsed in this phase: " << static_cast<int>(msgType);
-        break;
+      PendingReconnection reconnection;
+      reconnection.socket = socket;
+      reconnection.connectionTime = Clock::now();
+      pendingReconnections.push_back(std::move(reconnection));
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock(reconnectionsMutex);
+    for (PendingReconnection& reconnection : addedReconnections) {
+      pendingReconnections.push_back(std::move(reconnection));
+    }
+    addedReconnections.clear();
+  }
+  
+  // Wait for the Reconnect messages.
+  for (auto it = pendingReconnections.begin(); it != pendingReconnections.end(); ) {
+    it->unparsedBuffer.Append(it->socket->readAll());
+    
+    QByteArray msg;
+    if (it->unparsedBuffer.TakeMessage(&msg)) {
+      if (!HandleReconnectMessage(msg, it->socket, &it->unparsedBuffer)) {
+        delete it->socket;
       }
+      it = pendingReconnections.erase(it);
+      continue;
+    }
+    
+    if (it->socket->state() != QAbstractSocket::ConnectedState ||
+        MillisecondsDuration(Clock::now() - it->connectionTime).count() > kReconnectAuthorizeTimeout) {
+      delete it->socket;
+      it = pendingReconnections.erase(it);
+      continue;
     }
     
-    player->unparsedBuffer.remove(0, msgLength);
+    ++ it;
   }
 }
 
-QByteArray Game::CreateMapUncoverMessage() {
-  int width = map->GetWidth();
-  int height = map->GetHeight();
+bool Game::HandleReconnectMessage(const QByteArray& msg, QTcpSocket* socket, MessageBuffer* unparsedBuffer) {
+  if (static_cast<ClientToServerMessage>(msg.at(0)) != ClientToServerMessage::Reconnect) {
+    LOG(WARNING) << "Server: Received a message other than Reconnect on a new connection during the game: " << static_cast<int>(msg.at(0));
+    return false;
+  }
+  if (msg.size() < 3 + kSessionTokenLength) {
+    LOG(ERROR) << "Server: Received a too short Reconnect message";
+    return false;
+  }
+  if (!map) {
+    LOG(WARNING) << "Server: Received a Reconnect message before the game started";
+    return false;
+  }
+  QByteArray sessionToken = msg.mid(3, kSessionTokenLength);
+  
+  for (auto& player : *playersInGame) {
+    if (player->sessionToken.isEmpty() || player->sessionToken != sessionToken) {
+      continue;
+    }
+    if (!player->isConnected && !player->awaitingReconnect) {
+      LOG(WARNING) << "Server: Received a Reconnect message for a player that left the game";
+      return false;
+    }
+    
+    if (player->isConnected) {
+      // The client noticed the connection loss before the server did. Replace the old connection.
+      delete player->socket;
+    }
+    
+    player->socket = socket;
+    player->unparsedBuffer = std::move(*unparsedBuffer);
+    player->isConnected = true;
+    player->awaitingReconnect = false;
+    player->lastPingTime = Clock::now();
+    
+    // Resend the game state to the player, starting with the next game step.
+    player->nextResyncMapChunk = 0;
+    
+    LOG(INFO) << "Server: Player reconnected: " << player->name.toStdString() << " (index " << player->index << ")";
+    SendChatBroadcast(std::numeric_limits<u16>::max(), QObject::tr("[%1 reconnected.]").arg(player->name), *playersInGame);
+    return true;
+  }
+  
+  LOG(WARNING) << "Server: Received a Reconnect message with an unknown session token";
+  return false;
+}
+
+void Game::DisconnectPlayer(int playerIndex) {
+  auto& player = playersInGame->at(playerIndex);
+  
+  // Before the game starts, there is no game state to resynchronize a reconnecting client with.
+  if (!map || isHeadless) {
+    RemovePlayer(playerIndex, PlayerExitReason::Drop);
+    return;
+  }
+  
+  LOG(WARNING) << "Lost the connection to player: " << player->name.toStdString() << " (index " << player->index << "). Waiting for the player to reconnect.";
+  
+  delete player->socket;
+  player->socket = nullptr;
+  player->unparsedBuffer.Clear();
+  player->isConnected = false;
+  player->awaitingReconnect = true;
+  player->disconnectTime = Clock::now();
+  player->nextResyncMapChunk = -1;
+  
+  SendChatBroadcast(std::numeric_limits<u16>::max(), QObject::tr("[The connection to %1 was lost. Waiting for the player to reconnect ...]").arg(player->name), *playersInGame);
+}
+
+void Game::AppendResyncMessages(PlayerInGame* player, QByteArray* messages) {
+  if (player->nextResyncMapChunk == 0) {
+    // Tell the client to drop its outdated game state.
+    *messages += CreateGameResyncMessage();
+  }
+  
+  // Send only a few map chunks per game step, such that creating the snapshot
+  // does not delay the game steps for the other players.
+  int mapChunkCount = GetMapUncoverChunkCount();
+  int endMapChunk = std::min(mapChunkCount, player->nextResyncMapChunk + kResyncMapChunksPerStep);
+  for (int chunkIndex = player->nextResyncMapChunk; chunkIndex < endMapChunk; ++ chunkIndex) {
+    *messages += CreateMapUncoverMessage(GetMapUncoverChunkRect(chunkIndex));
+  }
+  player->nextResyncMapChunk = endMapChunk;
+  if (endMapChunk < mapChunkCount) {
+    return;
+  }
+  
+  // After the map, send the objects that the player observes, including their current state.
+  // This is done in a single step, since any state updates for the objects could not be applied
+  // by the client before it knows about the objects.
+  ObjectStateDeltaEncoder& deltas = objectStateDeltas[player->index];
+  deltas = ObjectStateDeltaEncoder();
+  
+  map->GetObjects().ForEach([&](u32 objectId, ServerObject* object) {
+    if (!object->IsObservedBy(player->index)) {
+      return;
+    }
+    *messages += CreateAddObjectMessage(objectId, object);
+    
+    if (object->isUnit()) {
+      ServerUnit* unit = AsUnit(object);
+      if (unit->GetMovementDirection() != FixedPoint() ||
+          unit->GetCurrentAction() != UnitAction::Idle) {
+        deltas.SetMovement(
+            objectId,
+            unit->GetMapCoord().ToQPointF(),
+            (unit->GetMoveSpeed() * unit->GetMovementDirection()).ToQPointF(),
+            unit->GetCurrentAction());
+      }
+      if (unit->GetPlayerIndex() == player->index &&
+          IsVillager(unit->GetType()) &&
+          unit->GetCarriedResourceAmount() > 0) {
+        deltas.SetCarriedResources(objectId, unit->GetCarriedResourceType(), unit->GetCarriedResourceAmount());
+      }
+    } else if (object->GetPlayerIndex() == player->index) {
+      ServerBuilding* building = AsBuilding(object);
+      for (UnitType queuedType : building->GetProductionQueue()) {
+        *messages += CreateQueueUnitMessage(objectId, static_cast<u16>(queuedType));
+      }
+      if (!building->GetProductionQueue().empty() && building->GetProductionPercentage() > 0) {
+        *messages += CreateUpdateProductionMessage(objectId, building->GetProductionPercentage().ToFloat(), 100.f / GetUnitProductionTime(building->GetProductionQueue().front()));
+      }
+    }
+  });
+  deltas.AppendMessages(messages);
+  
+  *messages += CreateResourcesUpdateMessage(player->resources);
+  player->lastResources = player->resources;
+  *messages += CreateSetHousedMessage(player->isHoused);
+  player->wasHousedBefore = player->isHoused;
+  
+  // Tell the client about the players that left the game.
+  for (const auto& otherPlayer : *playersInGame) {
+    if (!otherPlayer->isConnected && !otherPlayer->awaitingReconnect) {
+      *messages += CreatePlayerLeaveBroadcastMessage(otherPlayer->index, otherPlayer->exitReason);
+    }
+  }
   
-  // TODO: Support large maps. If the message is too large, split it up into two or more messages.
-  CHECK_LE(1 + 2 + (width + 1) * (height + 1), std::numeric_limits<u16>::max());
+  player->nextResyncMapChunk = -1;
+}
+
+QByteArray Game::CreateMapUncoverMessage(const QRect& cornerRect) {
+  CHECK_LE(cornerRect.width(), kMapUncoverChunkSize);
+  CHECK_LE(cornerRect.height(), kMapUncoverChunkSize);
+  
+  // Run-length encode the elevation. Since large parts of the map are usually flat,
+  // this makes the message much smaller than the raw elevation values.
+  QByteArray runs;
+  int runLength = 0;
+  int runElevation = -1;
+  for (int y = cornerRect.y(); y < cornerRect.y() + cornerRect.height(); ++ y) {
+    for (int x = cornerRect.x(); x < cornerRect.x() + cornerRect.width(); ++ x) {
+      int elevation = map->elevationAt(x, y);
+      if (elevation == runElevation && runLength < std::numeric_limits<u8>::max()) {
+        ++ runLength;
+      } else {
+        if (runLength > 0) {
+          runs.append(static_cast<char>(runLength));
+          runs.append(static_cast<char>(runElevation));
+        }
+        runLength = 1;
+        runElevation = elevation;
+      }
+    }
+  }
+  if (runLength > 0) {
+    runs.append(static_cast<char>(runLength));
+    runs.append(static_cast<char>(runElevation));
+  }
   
   // Create buffer
-  QByteArray msg(1 + 2 + (width + 1) * (height + 1), Qt::Initialization::Uninitialized);
+  QByteArray msg(1 + 2 + 6 + runs.size(), Qt::Initialization::Uninitialized);
   char* data = msg.data();
   
   // Set buffer header (3 bytes)
@@ -574,15 +898,33 @@ QByteArray Game::CreateMapUncoverMessage() {
   mango::ustore16(data + 1, msg.size());
   
   // Fill buffer
-  for (int y = 0; y <= height; ++ y) {
-    for (int x = 0; x <= width; ++ x) {
-      data[3 + x + y * (width + 1)] = map->elevationAt(x, y);
-    }
-  }
+  mango::ustore16(data + 3, cornerRect.x());
+  mango::ustore16(data + 5, cornerRect.y());
+  data[7] = cornerRect.width();
+  data[8] = cornerRect.height();
+  memcpy(data + 9, runs.data(), runs.size());
   
   return msg;
 }
 
+int Game::GetMapUncoverChunkCount() {
+  // The map has (width + 1) x (height + 1) corners.
+  int chunkCountX = (map->GetWidth() + kMapUncoverChunkSize) / kMapUncoverChunkSize;
+  int chunkCountY = (map->GetHeight() + kMapUncoverChunkSize) / kMapUncoverChunkSize;
+  return chunkCountX * chunkCountY;
+}
+
+QRect Game::GetMapUncoverChunkRect(int chunkIndex) {
+  int chunkCountX = (map->GetWidth() + kMapUncoverChunkSize) / kMapUncoverChunkSize;
+  int minCornerX = (chunkIndex % chunkCountX) * kMapUncoverChunkSize;
+  int minCornerY = (chunkIndex / chunkCountX) * kMapUncoverChunkSize;
+  return QRect(
+      minCornerX,
+      minCornerY,
+      std::min(kMapUncoverChunkSize, map->GetWidth() + 1 - minCornerX),
+      std::min(kMapUncoverChunkSize, map->GetHeight() + 1 - minCornerY));
+}
+
 QByteArray Game::CreateAddObjectMessage(u32 objectId, ServerObject* object) {
   // Create buffer
   QByteArray msg(object->isBuilding() ? 23 : 23, Qt::Initialization::Uninitialized);
@@ -603,23 +945,53 @@ QByteArray Game::CreateAddObjectMessage(u32 objectId, ServerObject* object) {
     mango::ustore16(data + 13, static_cast<u16>(building->GetType()));  // TODO: Would 8 bits be sufficient here?
     mango::ustore16(data + 15, building->GetBaseTile().x());
     mango::ustore16(data + 17, building->GetBaseTile().y());
-    *reinterpret_cast<float*>(data + 19) = building->GetBuildPercentage();
+    *reinterpret_cast<float*>(data + 19) = building->GetBuildPercentage().ToFloat();
   } else {
     ServerUnit* unit = AsUnit(object);
     mango::ustore16(data + 13, static_cast<u16>(unit->GetType()));  // TODO: Would 8 bits be sufficient here?
-    *reinterpret_cast<float*>(data + 15) = unit->GetMapCoord().x();
-    *reinterpret_cast<float*>(data + 19) = unit->GetMapCoord().y();
+    *reinterpret_cast<float*>(data + 15) = unit->GetMapCoord().x.ToFloat();
+    *reinterpret_cast<float*>(data + 19) = unit->GetMapCoord().y.ToFloat();
   }
   
   return msg;
 }
 
-void Game::StartGame() {
+void Game::SetupGame(int mapSeed) {
   LOG(INFO) << "Server: Generating map ...";
   
   // Generate the map.
   map.reset(new ServerMap(settings->mapSize, settings->mapSize));
-  map->GenerateRandomMap(playersInGame->size(), /*seed*/ 0);  // TODO: Choose seed
+  map->GenerateRandomMap(playersInGame->size(), mapSeed);
+  
+  // Start the path planning threads. Leave one core for the simulation thread.
+  constexpr int kMaxPathPlanningThreads = 4;
+  int numPathPlanningThreads = std::max(1, std::min(kMaxPathPlanningThreads, static_cast<int>(std::thread::hardware_concurrency()) - 1));
+  pathPlanner.reset(new PathPlanner(numPathPlanningThreads));
+  gameStepIndex = 0;
+  
+  // Update the stats and the drop-off index for the initial map objects.
+  dropOffIndex.reset(new DropOffIndex(map->GetWidth(), map->GetHeight(), playersInGame->size()));
+  map->GetObjects().ForEach([&](u32 objectId, ServerObject* object) {
+    if (object->isBuilding()) {
+      ServerBuilding* building = AsBuilding(object);
+      GetPlayerStats(building->GetPlayerIndex())->BuildingAdded(building->GetType(), true);
+      if (building->IsCompleted()) {
+        dropOffIndex->AddBuilding(objectId, building);
+      }
+    } else if (object->isUnit()) {
+      GetPlayerStats(object->GetPlayerIndex())->UnitAdded(AsUnit(object)->GetType());
+    }
+  });
+  
+  // Determine which initial objects each player sees.
+  visibility.reset(new ServerVisibility(map->GetWidth(), map->GetHeight(), playersInGame->size()));
+  UpdateObjectVisibility();
+}
+
+void Game::StartGame() {
+  std::random_device randomDevice;
+  int mapSeed = std::uniform_int_distribution<int>(0, std::numeric_limits<int>::max())(randomDevice);
+  SetupGame(mapSeed);
   
   LOG(INFO) << "Server: Preparing game start ...";
   
@@ -631,30 +1003,32 @@ void Game::StartGame() {
   gameBeginServerTime = serverTime + kGameBeginOffsetSeconds;
   lastSimulationTime = gameBeginServerTime;
   
+  StartReplayRecording(mapSeed);
+  
   for (auto& player : *playersInGame) {
     // Find the player's town center and start with it in the center of the view.
     // If the player does not have a town center, find any villager and center on it instead.
     // If there is neither a town center nor a villager, center on any object of the player.
     QPointF initialViewCenter(0.5f * map->GetWidth(), 0.5f * map->GetHeight());
-    for (const auto& item : map->GetObjects()) {
-      if (item.second->GetPlayerIndex() != player->index) {
-        continue;
+    bool foundTownCenter = false;
+    for (ServerBuilding* building : map->GetObjects().GetBuildings()) {
+      if (building->GetPlayerIndex() == player->index &&
+          building->GetType() == BuildingType::TownCenter) {
+        QSize buildingSize = GetBuildingSize(building->GetType());
+        initialViewCenter =
+            QPointF(building->GetBaseTile().x() + 0.5f * buildingSize.width(),
+                    building->GetBaseTile().y() + 0.5f * buildingSize.height());
+        foundTownCenter = true;
+        break;
       }
-      
-      if (item.second->isBuilding()) {
-        ServerBuilding* building = AsBuilding(item.second);
-        if (building->GetType() == BuildingType::TownCenter) {
-          QSize buildingSize = GetBuildingSize(building->GetType());
-          initialViewCenter =
-              QPointF(building->GetBaseTile().x() + 0.5f * buildingSize.width(),
-                      building->GetBaseTile().y() + 0.5f * buildingSize.height());
+    }
+    if (!foundTownCenter) {
+      for (ServerUnit* unit : map->GetObjects().GetUnits()) {
+        if (unit->GetPlayerIndex() == player->index &&
+            IsVillager(unit->GetType())) {
+          initialViewCenter = unit->GetMapCoord().ToQPointF();
           break;
         }
-      } else {  // if (item.second->isUnit()) {
-        ServerUnit* unit = AsUnit(item.second);
-        if (IsVillager(unit->GetType())) {
-          initialViewCenter = unit->GetMapCoord();
-        }
       }
     }
     
@@ -667,34 +1041,27 @@ void Game::StartGame() {
         player->resources.gold(),
         player->resources.stone(),
         map->GetWidth(),
-        map->GetHeight());
+        map->GetHeight(),
+        player->sessionToken);
     player->socket->write(gameBeginMsg);
   }
   
-  // Send a message with the initial visible map content
-  QByteArray mapUncoverMsg = CreateMapUncoverMessage();
-  for (auto& player : *playersInGame) {
-    player->socket->write(mapUncoverMsg);
-  }
-  
-  // Send creation messages for the initial map objects and update stats
-  const auto& objects = map->GetObjects();
-  for (const auto& item : objects) {
-    ServerObject* object = item.second;
-    
-    QByteArray addObjectMsg = CreateAddObjectMessage(item.first, object);
+  // Send the initial visible map content, split up into chunks such that
+  // each message stays within the message size limit regardless of the map size.
+  int mapChunkCount = GetMapUncoverChunkCount();
+  for (int chunkIndex = 0; chunkIndex < mapChunkCount; ++ chunkIndex) {
+    QByteArray mapUncoverMsg = CreateMapUncoverMessage(GetMapUncoverChunkRect(chunkIndex));
     for (auto& player : *playersInGame) {
-      player->socket->write(addObjectMsg);
-    }
-    
-    if (object->isBuilding()) {
-      ServerBuilding* building = AsBuilding(object);
-      GetPlayerStats(building->GetPlayerIndex())->BuildingAdded(building->GetType(), true);
-    } else if (object->isUnit()) {
-      GetPlayerStats(object->GetPlayerIndex())->UnitAdded(AsUnit(object)->GetType());
+      player->socket->write(mapUncoverMsg);
     }
   }
+  
+  // Send creation messages for the initial map objects that each player observes
+  // (these have been accumulated by SetupGame()).
   for (auto& player : *playersInGame) {
+    objectStateDeltas[player->index].AppendMessages(&accumulatedMessages[player->index]);
+    player->socket->write(accumulatedMessages[player->index]);
+    accumulatedMessages[player->index].clear();
     player->socket->flush();
   }
   
@@ -705,38 +1072,80 @@ void Game::StartGame() {
   }
 }
 
+void Game::StartReplayRecording(int mapSeed) {
+  if (settings->replayDirectory.isEmpty()) {
+    return;
+  }
+  
+  ReplayHeader header;
+  header.mapSize = settings->mapSize;
+  header.mapSeed = mapSeed;
+  header.gameBeginServerTime = gameBeginServerTime;
+  for (const auto& player : *playersInGame) {
+    ReplayHeader::Player replayPlayer;
+    replayPlayer.name = player->name;
+    replayPlayer.playerColorIndex = player->playerColorIndex;
+    replayPlayer.initialResources = player->resources;
+    header.players.push_back(replayPlayer);
+  }
+  
+  QString fileName = QString("%1-%2.fareplay")
+      .arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"))
+      .arg(mapSeed);
+  QString path = QDir(settings->replayDirectory).filePath(fileName);
+  replayWriter.reset(new ReplayWriter());
+  if (replayWriter->Open(path, header)) {
+    LOG(INFO) << "Server: Recording the game to: " << path.toStdString();
+  } else {
+    replayWriter.reset();
+  }
+}
+
 void Game::SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds) {
   // Reset all players to "not housed".
   for (auto& player : *playersInGame) {
     player->isHoused = false;
   }
   
-  // Iterate over all game objects to update their state.
-  auto end = map->GetObjects().end();
-  for (auto it = map->GetObjects().begin(); it != end; ++ it) {
-    const u32& objectId = it->first;
-    ServerObject* object = it->second;
-    
-    if (object->isUnit()) {
-      ServerUnit* unit = AsUnit(object);
-      SimulateGameStepForUnit(objectId, unit, gameStepServerTime, stepLengthInSeconds);
-    } else if (object->isBuilding()) {
-      ServerBuilding* building = AsBuilding(object);
-      SimulateGameStepForBuilding(objectId, building, stepLengthInSeconds);
-    }
-  }
+  // Assign the paths that were planned asynchronously. This is always done at this point
+  // and in the order in which the paths were requested, regardless of when the planning actually
+  // finished, which keeps the simulation deterministic.
+  Timer pathResultsTimer("SimulateGameStep() - path results");
+  ApplyPathPlanningResults();
+  pathResultsTimer.Stop();
+  
+  // Iterate over all game objects to update their state, in slot order. This scans the store's
+  // contiguous ID and type arrays. Units that get produced in the building pass are not simulated
+  // before the next step. Objects do not get removed during the step (see objectDeleteList).
+  const ServerObjectStore& objects = map->GetObjects();
+  Timer unitsTimer("SimulateGameStep() - units");
+  objects.ForEachUnit([&](u32 unitId, ServerUnit* unit) {
+    SimulateGameStepForUnit(unitId, unit, stepLengthInSeconds);
+  });
+  unitsTimer.Stop();
+  Timer buildingsTimer("SimulateGameStep() - buildings");
+  objects.ForEachBuilding([&](u32 buildingId, ServerBuilding* building) {
+    SimulateGameStepForBuilding(buildingId, building, stepLengthInSeconds);
+  });
+  buildingsTimer.Stop();
   
   // Handle delayed object deletion.
+  Timer deletionTimer("SimulateGameStep() - object deletion");
   for (u32 id : objectDeleteList) {
-    auto it = map->GetObjects().find(id);
-    if (it != map->GetObjects().end()) {
-      delete it->second;
-      map->GetObjects().erase(it);
+    if (map->GetObjects().Contains(id)) {
+      map->RemoveObject(id);
     }
   }
   objectDeleteList.clear();
+  deletionTimer.Stop();
+  
+  // Tell the players about objects that entered or left their view.
+  Timer visibilityTimer("SimulateGameStep() - visibility");
+  UpdateObjectVisibility();
+  visibilityTimer.Stop();
   
   // Check whether we need to send "housed" messages to clients.
+  Timer messagesTimer("SimulateGameStep() - messages");
   for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
     auto& player = (*playersInGame)[playerIndex];
     if (!player->isConnected) {
@@ -757,6 +1166,12 @@ void Game::SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds
   // which avoids sending it with each single message.
   for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
     auto& player = (*playersInGame)[playerIndex];
+    objectStateDeltas[playerIndex].AppendMessages(&accumulatedMessages[playerIndex]);
+    if (player->nextResyncMapChunk >= 0) {
+      // The player reconnected. The messages for this step are superseded by the game state snapshot.
+      accumulatedMessages[playerIndex].clear();
+      AppendResyncMessages(player.get(), &accumulatedMessages[playerIndex]);
+    }
     if (!player->isConnected) {
       accumulatedMessages[playerIndex].clear();
       continue;
@@ -769,167 +1184,406 @@ void Game::SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds
     }
     
     if (!accumulatedMessages[playerIndex].isEmpty()) {
-      player->socket->write(
-          CreateGameStepTimeMessage(gameStepServerTime) +
-          accumulatedMessages[playerIndex]);
+      QByteArray stepMessages = CreateGameStepTimeMessage(gameStepServerTime) + accumulatedMessages[playerIndex];
+      if (isHeadless) {
+        headlessMessageBytes += stepMessages.size();
+      } else {
+        player->socket->write(stepMessages);
+        player->socket->flush();
+      }
       accumulatedMessages[playerIndex].clear();
-      player->socket->flush();
     }
   }
+  messagesTimer.Stop();
+  
+  stateChecksum = ComputeStateChecksum();
+  ++ gameStepIndex;
+  if (replayWriter && gameStepIndex % kReplayChecksumInterval == 0) {
+    replayWriter->WriteStateChecksum(gameStepIndex, stateChecksum);
+  }
+}
+
+/// Computes a 64-bit FNV-1a hash over the values that are added to it.
+class StateHasher {
+ public:
+  inline void Add(u64 value) {
+    for (int byte = 0; byte < 8; ++ byte) {
+      hash = (hash ^ ((value >> (8 * byte)) & 0xff)) * 1099511628211ull;
+    }
+  }
+  
+  inline void Add(const Fixed& value) { Add(static_cast<u64>(value.GetRaw())); }
+  
+  inline u64 GetHash() const { return hash; }
+  
+ private:
+  u64 hash = 14695981039346656037ull;
+};
+
+u64 Game::ComputeStateChecksum() const {
+  StateHasher hasher;
+  
+  map->GetObjects().ForEach([&](u32 id, ServerObject* object) {
+    hasher.Add(id);
+    hasher.Add(static_cast<u64>(object->GetObjectType()));
+    hasher.Add(static_cast<u64>(object->GetPlayerIndex()));
+    hasher.Add(object->GetHPInternal());
+    
+    if (object->isUnit()) {
+      ServerUnit* unit = AsUnit(object);
+      hasher.Add(static_cast<u64>(unit->GetType()));
+      hasher.Add(unit->GetMapCoord().x);
+      hasher.Add(unit->GetMapCoord().y);
+      hasher.Add(unit->GetMovementDirection().x);
+      hasher.Add(unit->GetMovementDirection().y);
+      hasher.Add(static_cast<u64>(unit->GetCurrentAction()));
+      hasher.Add(unit->GetCurrentActionStartStep());
+      hasher.Add(unit->GetTargetObjectId());
+      hasher.Add(static_cast<u64>(unit->GetCarriedResourceType()));
+      hasher.Add(unit->GetCarriedResourceAmountInternal());
+    } else {
+      ServerBuilding* building = AsBuilding(object);
+      hasher.Add(static_cast<u64>(building->GetType()));
+      hasher.Add(static_cast<u64>(building->GetBaseTile().x()));
+      hasher.Add(static_cast<u64>(building->GetBaseTile().y()));
+      hasher.Add(building->GetBuildPercentage());
+      hasher.Add(building->GetProductionPercentage());
+      hasher.Add(building->GetProductionQueue().size());
+    }
+  });
+  
+  for (const auto& player : *playersInGame) {
+    for (int i = 0; i < static_cast<int>(ResourceType::NumTypes); ++ i) {
+      hasher.Add(player->resources.resources[i]);
+    }
+  }
+  
+  return hasher.GetHash();
+}
+
+void Game::RequestUnitPath(u32 unitId, ServerUnit* unit) {
+  PathRequest request;
+  CreatePathRequest(unit, map.get(), /*continueWaypoints*/ false, &request);
+  request.unitId = unitId;
+  unit->SetPendingPathRequestId(pathPlanner->Submit(std::move(request), gameStepIndex + kPathPlanningLatencyGameSteps));
+}
+
+void Game::ApplyPathPlanningResults() {
+  pathPlanner->TakeResults(gameStepIndex, &pathResults);
+  
+  for (const PathResult& result : pathResults) {
+    ServerObject* object = map->GetObjects().Find(result.unitId);
+    if (!object || !object->isUnit()) {
+      // The unit has been deleted in the meantime.
+      continue;
+    }
+    ServerUnit* unit = AsUnit(object);
+    if (unit->GetPendingPathRequestId() != result.requestId) {
+      // The unit got a new target in the meantime, so the result is outdated.
+      continue;
+    }
+    
+    unit->SetPendingPathRequestId(0);
+    ApplyPathResult(result, unit);
+    AccumulateUnitMovement(result.unitId, unit);
+  }
+}
+
+void Game::AccumulateUnitMovement(u32 unitId, ServerUnit* unit) {
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    if (unit->IsObservedBy(playerIndex)) {
+      objectStateDeltas[playerIndex].SetMovement(
+          unitId,
+          unit->GetMapCoord().ToQPointF(),
+          (unit->GetMoveSpeed() * unit->GetMovementDirection()).ToQPointF(),
+          unit->GetCurrentAction());
+    }
+  }
+}
+
+void Game::AccumulateHPUpdate(u32 objectId, ServerObject* object) {
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    if (object->IsObservedBy(playerIndex)) {
+      objectStateDeltas[playerIndex].SetHP(objectId, object->GetHP());
+    }
+  }
+}
+
+void Game::AccumulateMessageForObservers(ServerObject* object, const QByteArray& msg) {
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    if (object->IsObservedBy(playerIndex)) {
+      accumulatedMessages[playerIndex] += msg;
+    }
+  }
+}
+
+/// Returns the center of the given object's field of view. For units, this is the center
+/// of the tile that they stand on (as on the client), which has to be remembered in
+/// ServerUnit::SetFieldOfViewTile() beforehand.
+static QPointF GetFieldOfViewCenter(ServerObject* object) {
+  if (object->isUnit()) {
+    const QPoint& tile = AsUnit(object)->GetFieldOfViewTile();
+    return QPointF(tile.x() + 0.5f, tile.y() + 0.5f);
+  } else {
+    ServerBuilding* building = AsBuilding(object);
+    QSize buildingSize = GetBuildingSize(building->GetType());
+    return QPointF(building->GetBaseTile().x() + 0.5f * buildingSize.width(),
+                   building->GetBaseTile().y() + 0.5f * buildingSize.height());
+  }
+}
+
+void Game::AddFieldOfView(ServerObject* object) {
+  float radius;
+  if (object->isUnit()) {
+    ServerUnit* unit = AsUnit(object);
+    unit->SetFieldOfViewTile(unit->GetMapCoord().GetTile());
+    radius = GetUnitLineOfSight(unit->GetType());
+  } else {
+    radius = GetBuildingLineOfSight(AsBuilding(object)->GetType());
+  }
+  
+  QPointF center = GetFieldOfViewCenter(object);
+  visibility->UpdateFieldOfView(object->GetPlayerIndex(), center.x(), center.y(), radius, 1);
+  object->SetFieldOfView(radius);
+}
+
+void Game::RemoveFieldOfView(ServerObject* object) {
+  if (!object->HasFieldOfView()) {
+    return;
+  }
+  
+  QPointF center = GetFieldOfViewCenter(object);
+  visibility->UpdateFieldOfView(object->GetPlayerIndex(), center.x(), center.y(), object->GetFieldOfViewRadius(), -1);
+  object->ClearFieldOfView();
+}
+
+void Game::UpdateObjectVisibility() {
+  const ServerObjectStore& objects = map->GetObjects();
+  int playerCount = playersInGame->size();
+  
+  // Update the fields of view of the players' objects. As on the client, units move their
+  // field of view when they enter another tile, and buildings add theirs once they are completed.
+  objects.ForEachUnit([&](u32 /*unitId*/, ServerUnit* unit) {
+    if (unit->GetPlayerIndex() == kGaiaPlayerIndex) {
+      return;
+    }
+    QPoint tile = unit->GetMapCoord().GetTile();
+    if (!unit->HasFieldOfView() || unit->GetFieldOfViewTile() != tile) {
+      RemoveFieldOfView(unit);
+      AddFieldOfView(unit);
+    }
+  });
+  objects.ForEachBuilding([&](u32 /*buildingId*/, ServerBuilding* building) {
+    if (building->GetPlayerIndex() != kGaiaPlayerIndex &&
+        building->IsCompleted() &&
+        !building->HasFieldOfView()) {
+      AddFieldOfView(building);
+    }
+  });
+  
+  // Units are observed by their own player and by the players who currently see the tile that they stand on.
+  // Send AddObject messages to players that start observing a unit, and ObjectLeftView messages
+  // to players that stop observing it.
+  objects.ForEachUnit([&](u32 unitId, ServerUnit* unit) {
+    int tileX = unit->GetMapCoord().x.Floor();
+    int tileY = unit->GetMapCoord().y.Floor();
+    
+    for (int playerIndex = 0; playerIndex < playerCount; ++ playerIndex) {
+      bool observes = (unit->GetPlayerIndex() == playerIndex) || visibility->IsTileVisible(playerIndex, tileX, tileY);
+      if (observes == unit->IsObservedBy(playerIndex)) {
+        continue;
+      }
+      
+      unit->SetObservedBy(playerIndex, observes);
+      if (observes) {
+        accumulatedMessages[playerIndex] += CreateAddObjectMessage(unitId, unit);
+        if (unit->GetMovementDirection() != FixedPoint() ||
+            unit->GetCurrentAction() != UnitAction::Idle) {
+          objectStateDeltas[playerIndex].SetMovement(
+              unitId,
+              unit->GetMapCoord().ToQPointF(),
+              (unit->GetMoveSpeed() * unit->GetMovementDirection()).ToQPointF(),
+              unit->GetCurrentAction());
+        }
+      } else {
+        accumulatedMessages[playerIndex] += CreateObjectLeftViewMessage(unitId);
+        objectStateDeltas[playerIndex].Forget(unitId);
+      }
+    }
+  });
+  
+  // Buildings are observed by their own player, and by the players who have seen any of their tiles
+  // after their construction started. Since players remember the buildings that they have explored,
+  // buildings remain observed once they have been seen.
+  objects.ForEachBuilding([&](u32 buildingId, ServerBuilding* building) {
+    for (int playerIndex = 0; playerIndex < playerCount; ++ playerIndex) {
+      if (building->IsObservedBy(playerIndex)) {
+        continue;
+      }
+      
+      bool observes = (building->GetPlayerIndex() == playerIndex);
+      if (!observes && !building->IsFoundation()) {
+        observes = visibility->IsAreaVisible(playerIndex, QRect(building->GetBaseTile(), GetBuildingSize(building->GetType())));
+      }
+      if (observes) {
+        building->SetObservedBy(playerIndex, true);
+        accumulatedMessages[playerIndex] += CreateAddObjectMessage(buildingId, building);
+      }
+    }
+  });
 }
 
-static bool DoesUnitTouchBuildingArea(ServerUnit* unit, const QPointF& unitMapCoord, ServerBuilding* building, float errorMargin) {
+static bool DoesUnitTouchBuildingArea(ServerUnit* unit, const FixedPoint& unitMapCoord, ServerBuilding* building, Fixed errorMargin) {
   // Get the point withing the building's area which is closest to the unit
   QSize buildingSize = GetBuildingSize(building->GetType());
-  const QPoint& baseTile = building->GetBaseTile();
-  QPointF closestPointInBuilding(
-      std::max<float>(baseTile.x(), std::min<float>(baseTile.x() + buildingSize.width(), unitMapCoord.x())),
-      std::max<float>(baseTile.y(), std::min<float>(baseTile.y() + buildingSize.height(), unitMapCoord.y())));
+  QPoint baseTile = building->GetBaseTile();
+  FixedPoint closestPointInBuilding(
+      Max(baseTile.x(), Min(baseTile.x() + buildingSize.width(), unitMapCoord.x)),
+      Max(baseTile.y(), Min(baseTile.y() + buildingSize.height(), unitMapCoord.y)));
   
   // Check whether this point is closer to the unit than the unit's radius.
-  float unitRadius = GetUnitRadius(unit->GetType());
-  float threshold = unitRadius - errorMargin;
+  Fixed unitRadius = GetUnitRadiusFixed(unit->GetType());
+  Fixed threshold = unitRadius - errorMargin;
   return SquaredDistance(unitMapCoord, closestPointInBuilding) < threshold * threshold;
 }
 
-static bool DoUnitsTouch(ServerUnit* unit, const QPointF& unitMapCoord, ServerUnit* otherUnit, float errorMargin) {
-  float unitRadius = GetUnitRadius(unit->GetType());
-  float otherUnitRadius = GetUnitRadius(otherUnit->GetType());
+static bool DoUnitsTouch(ServerUnit* unit, const FixedPoint& unitMapCoord, ServerUnit* otherUnit, Fixed errorMargin) {
+  Fixed unitRadius = GetUnitRadiusFixed(unit->GetType());
+  Fixed otherUnitRadius = GetUnitRadiusFixed(otherUnit->GetType());
   
-  float threshold = unitRadius + otherUnitRadius - errorMargin;
+  Fixed threshold = unitRadius + otherUnitRadius - errorMargin;
   return SquaredDistance(unitMapCoord, otherUnit->GetMapCoord()) < threshold * threshold;
 }
 
 static bool IsFoundationFree(ServerBuilding* foundation, ServerMap* map) {
   // Check whether map tiles are occupied
-  const QPoint& baseTile = foundation->GetBaseTile();
+  QPoint baseTile = foundation->GetBaseTile();
   QSize foundationSize = GetBuildingSize(foundation->GetType());
-  for (int y = baseTile.y(); y < baseTile.y() + foundationSize.height(); ++ y) {
-    for (int x = baseTile.x(); x < baseTile.x() + foundationSize.width(); ++ x) {
-      if (map->occupiedForBuildingsAt(x, y)) {
-        return false;
-      }
-    }
+  QRect foundationRect(baseTile, foundationSize);
+  if (map->IsAreaOccupiedForBuildings(foundationRect)) {
+    return false;
   }
   
-  // Check whether units are on top of the foundation
-  for (const auto& item : map->GetObjects()) {
-    if (item.second->isUnit()) {
-      ServerUnit* unit = AsUnit(item.second);
-      if (DoesUnitTouchBuildingArea(unit, unit->GetMapCoord(), foundation, 0.01f)) {
-        return false;
-      }
-    }
+  // Check whether units are on top of the foundation. Usually, no unit footprint overlaps the
+  // foundation at all. Only otherwise, the exact test against the units' circles is required.
+  if (!map->IsAnyUnitFootprintInArea(foundationRect)) {
+    return true;
   }
-  
-  return true;
+  Fixed maxUnitRadius = map->GetMaxUnitRadius();
+  return map->ForEachUnitInArea(
+      FixedPoint(baseTile.x() - maxUnitRadius, baseTile.y() - maxUnitRadius),
+      FixedPoint(baseTile.x() + foundationSize.width() + maxUnitRadius, baseTile.y() + foundationSize.height() + maxUnitRadius),
+      [&](ServerUnit* unit) {
+        return !DoesUnitTouchBuildingArea(unit, unit->GetMapCoord(), foundation, Fixed::FromFraction(1, 100));
+      });
 }
 
-static bool TryEvadeUnit(ServerUnit* unit, float moveDistance, const QPointF& newMapCoord, ServerUnit* collidingUnit, QPointF* evadeMapCoord) {
+static bool TryEvadeUnit(ServerUnit* unit, Fixed moveDistance, const FixedPoint& newMapCoord, ServerUnit* collidingUnit, FixedPoint* evadeMapCoord) {
   // Intersect a circle of radius "moveDistance", centered at unit->GetMapCoord(),
   // with a circle of radius GetUnitRadius(unit->GetType()) + GetUnitRadius(collidingUnit->GetType()), centered at collidingUnit->GetMapCoord().
-  constexpr float kErrorTolerance = 1e-3f;
+  constexpr Fixed kErrorTolerance = Fixed::FromFraction(1, 1000);
   
-  const QPointF unitCenter = unit->GetMapCoord();
-  float unitMoveRadius = moveDistance;
+  const FixedPoint unitCenter = unit->GetMapCoord();
+  Fixed unitMoveRadius = moveDistance;
   
-  const QPointF obstacleCenter = collidingUnit->GetMapCoord();
-  float obstacleRadius = GetUnitRadius(unit->GetType()) + GetUnitRadius(collidingUnit->GetType()) + kErrorTolerance;
+  const FixedPoint obstacleCenter = collidingUnit->GetMapCoord();
+  Fixed obstacleRadius = GetUnitRadiusFixed(unit->GetType()) + GetUnitRadiusFixed(collidingUnit->GetType()) + kErrorTolerance;
   
-  QPointF unitToObstacle = obstacleCenter - unitCenter;
-  float centerDistance = Length(unitToObstacle);
-  QPointF unitToObstacleDir = unitToObstacle / std::max(1e-5f, centerDistance);
+  FixedPoint unitToObstacle = obstacleCenter - unitCenter;
+  Fixed centerDistance = Length(unitToObstacle);
+  if (centerDistance == Fixed()) {
+    return false;
+  }
+  FixedPoint unitToObstacleDir = unitToObstacle / centerDistance;
   
-  float a = (unitMoveRadius * unitMoveRadius - obstacleRadius * obstacleRadius + centerDistance * centerDistance) / (2 * centerDistance);
-  float termInSqrt = unitMoveRadius * unitMoveRadius - a * a;
+  Fixed a = (unitMoveRadius * unitMoveRadius - obstacleRadius * obstacleRadius + centerDistance * centerDistance) / (2 * centerDistance);
+  Fixed termInSqrt = unitMoveRadius * unitMoveRadius - a * a;
   if (termInSqrt <= 0) {
     return false;
   }
-  float h = sqrtf(termInSqrt);
+  Fixed h = Sqrt(termInSqrt);
   
-  QPointF basePoint = unitCenter + a * unitToObstacleDir;
+  FixedPoint basePoint = unitCenter + a * unitToObstacleDir;
   
-  QPointF intersection1 = basePoint + h * QPointF(unitToObstacleDir.y(), -unitToObstacleDir.x());
-  QPointF intersection2 = basePoint - h * QPointF(unitToObstacleDir.y(), -unitToObstacleDir.x());
+  FixedPoint intersection1 = basePoint + h * FixedPoint(unitToObstacleDir.y, -unitToObstacleDir.x);
+  FixedPoint intersection2 = basePoint - h * FixedPoint(unitToObstacleDir.y, -unitToObstacleDir.x);
   
-  float squaredDistance1 = SquaredDistance(newMapCoord, intersection1);
-  float squaredDistance2 = SquaredDistance(newMapCoord, intersection2);
+  Fixed squaredDistance1 = SquaredDistance(newMapCoord, intersection1);
+  Fixed squaredDistance2 = SquaredDistance(newMapCoord, intersection2);
   
   *evadeMapCoord = (squaredDistance1 < squaredDistance2) ? intersection1 : intersection2;
   return true;
 }
 
-void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStepServerTime, float stepLengthInSeconds) {
+void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, float stepLengthInSeconds) {
   bool unitMovementChanged = false;
   
   // If the unit is currently attacking, continue this, since it cannot be interrupted.
   if (unit->GetCurrentAction() == UnitAction::Attack) {
     bool stayInPlace = false;
     
-    auto targetIt = map->GetObjects().find(unit->GetTargetObjectId());
-    u32 targetId;
-    ServerObject* target;
-    if (targetIt == map->GetObjects().end()) {
-      targetId = kInvalidObjectId;
-      target = nullptr;
-    } else {
-      targetId = targetIt->first;
-      target = targetIt->second;
-    }
+    ServerObject* target = map->GetObjects().Find(unit->GetTargetObjectId());
+    u32 targetId = target ? unit->GetTargetObjectId() : kInvalidObjectId;
     
-    if (SimulateMeleeAttack(unitId, unit, targetId, target, gameStepServerTime, stepLengthInSeconds, &unitMovementChanged, &stayInPlace)) {
+    if (SimulateMeleeAttack(unitId, unit, targetId, target, &unitMovementChanged, &stayInPlace)) {
       // The attack is still in progress.
       return;
     }
     
     // The attack finished.
     // If any other command has been given to the unit in the meantime, follow the other command.
-    auto manualTargetIt = map->GetObjects().find(unit->GetManuallyTargetedObjectId());
-    if (manualTargetIt != map->GetObjects().end()) {
-      SetUnitTargets({unitId}, unit->GetPlayerIndex(), manualTargetIt->first, manualTargetIt->second, false);
+    ServerObject* manualTarget = map->GetObjects().Find(unit->GetManuallyTargetedObjectId());
+    if (manualTarget) {
+      SetUnitTargets({unitId}, unit->GetPlayerIndex(), unit->GetManuallyTargetedObjectId(), manualTarget, false);
     }
   }
   
-  // If the unit's goal has been updated, plan a path towards the goal.
+  // If the unit's goal has been updated, request a path towards the goal.
+  // The path gets planned asynchronously and will be assigned to the unit in a later
+  // game step (see ApplyPathPlanningResults()). Until then, the unit stands still.
   if (unit->HasMoveToTarget() && !unit->HasPath()) {
-    PlanUnitPath(unit, map.get());
-    unitMovementChanged = true;
+    if (!unit->IsWaitingForPath()) {
+      RequestUnitPath(unitId, unit);
+    }
+    if (unit->GetMovementDirection() != FixedPoint()) {
+      unit->SetMovementDirection(FixedPoint());
+      unit->PauseMovement();
+      unitMovementChanged = true;
+    }
   } else if (unit->HasMoveToTarget() && unit->GetTargetObjectId() != kInvalidObjectId) {
     // Check whether we target a moving object. If yes and the target has moved too much,
     // re-plan our path to the target.
-    auto targetIt = map->GetObjects().find(unit->GetTargetObjectId());
-    if (targetIt == map->GetObjects().end()) {
+    ServerObject* target = map->GetObjects().Find(unit->GetTargetObjectId());
+    if (!target) {
       unit->RemoveTarget();
-    } else if (targetIt->second->isUnit()) {
-      ServerUnit* targetUnit = AsUnit(targetIt->second);
+    } else if (target->isUnit() && !unit->IsWaitingForPath()) {
+      ServerUnit* targetUnit = AsUnit(target);
       
-      constexpr float kReplanThresholdDistance = 0.1f * 0.1f;
+      constexpr Fixed kReplanThresholdDistance = Fixed::FromFraction(1, 100);  // 0.1 * 0.1
       if (SquaredDistance(targetUnit->GetMapCoord(), unit->GetMoveToTargetMapCoord()) > kReplanThresholdDistance) {
-        // Since we keep the target here, there is no need to use SetUnitTargets() since the unit's type will never change.
-        unit->SetTarget(unit->GetTargetObjectId(), targetUnit, false);
-        PlanUnitPath(unit, map.get());
-        unitMovementChanged = true;
+        // Keep following the current path until the re-planned one is available.
+        unit->UpdateMoveToTargetMapCoord(targetUnit->GetMapCoord());
+        RequestUnitPath(unitId, unit);
       }
     }
   }
   
-  if (unit->GetMovementDirection() != QPointF(0, 0)) {
-    float moveDistance = unit->GetMoveSpeed() * stepLengthInSeconds;
+  if (unit->GetMovementDirection() != FixedPoint()) {
+    Fixed moveDistance = unit->GetMoveSpeed() * Fixed::FromFloat(stepLengthInSeconds);
     
-    QPointF newMapCoord = unit->GetMapCoord() + moveDistance * unit->GetMovementDirection();
+    FixedPoint newMapCoord = unit->GetMapCoord() + moveDistance * unit->GetMovementDirection();
     bool stayInPlace = false;
     
     // If the unit has a target object, test whether it touches this target.
     u32 targetObjectId = unit->GetTargetObjectId();
     if (targetObjectId != kInvalidObjectId) {
-      auto targetIt = map->GetObjects().find(targetObjectId);
-      if (targetIt == map->GetObjects().end()) {
+      ServerObject* targetObject = map->GetObjects().Find(targetObjectId);
+      if (!targetObject) {
         unit->RemoveTarget();
       } else {
-        ServerObject* targetObject = targetIt->second;
         if (targetObject->isBuilding()) {
           ServerBuilding* targetBuilding = AsBuilding(targetObject);
-          if (DoesUnitTouchBuildingArea(unit, newMapCoord, targetBuilding, 0)) {
+          if (DoesUnitTouchBuildingArea(unit, newMapCoord, targetBuilding, Fixed())) {
             InteractionType interaction = GetInteractionType(unit, targetBuilding);
             
             if (interaction == InteractionType::Construct) {
@@ -942,16 +1596,16 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
             } else if (interaction == InteractionType::DropOffResource) {
               SimulateResourceDropOff(unitId, unit, &unitMovementChanged);
             } else if (interaction == InteractionType::Attack) {
-              SimulateMeleeAttack(unitId, unit, targetIt->first, targetBuilding, gameStepServerTime, stepLengthInSeconds, &unitMovementChanged, &stayInPlace);
+              SimulateMeleeAttack(unitId, unit, targetObjectId, targetBuilding, &unitMovementChanged, &stayInPlace);
             }
           }
         } else if (targetObject->isUnit()) {
           ServerUnit* targetUnit = AsUnit(targetObject);
-          if (DoUnitsTouch(unit, newMapCoord, targetUnit, 0)) {
+          if (DoUnitsTouch(unit, newMapCoord, targetUnit, Fixed())) {
             InteractionType interaction = GetInteractionType(unit, targetUnit);
             
             if (interaction == InteractionType::Attack) {
-              SimulateMeleeAttack(unitId, unit, targetIt->first, targetUnit, gameStepServerTime, stepLengthInSeconds, &unitMovementChanged, &stayInPlace);
+              SimulateMeleeAttack(unitId, unit, targetObjectId, targetUnit, &unitMovementChanged, &stayInPlace);
             }
           }
         }
@@ -960,26 +1614,27 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
     
     if (!stayInPlace && unit->HasPath()) {
       // Test whether the current goal was reached.
-      QPointF toGoal = unit->GetNextPathTarget() - unit->GetMapCoord();
-      float squaredDistanceToGoal = SquaredLength(toGoal);
-      float directionDotToGoal =
-          unit->GetMovementDirection().x() * toGoal.x() +
-          unit->GetMovementDirection().y() * toGoal.y();
+      FixedPoint toGoal = unit->GetNextPathTarget() - unit->GetMapCoord();
+      Fixed squaredDistanceToGoal = SquaredLength(toGoal);
+      Fixed directionDotToGoal = Dot(unit->GetMovementDirection(), toGoal);
       
       if (squaredDistanceToGoal <= moveDistance * moveDistance || directionDotToGoal <= 0) {
         // The goal was reached.
         if (!map->DoesUnitCollide(unit, unit->GetNextPathTarget())) {
-          unit->SetMapCoord(unit->GetNextPathTarget());
+          map->SetUnitMapCoord(unit, unit->GetNextPathTarget());
         }
         
         // Continue with the next part of the path if any, or stop if the path was completed.
         unit->PathSegmentCompleted();
         if (unit->HasPath()) {
           // Continue with the next path segment.
-          // TODO: This is a duplicate of the code at the end of PlanUnitPath()
-          QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
-          direction = direction / std::max(1e-4f, Length(direction));
-          unit->SetMovementDirection(direction);
+          // TODO: This is a duplicate of the code at the end of ApplyPathResult()
+          unit->SetMovementDirection(Normalized(unit->GetNextPathTarget() - unit->GetMapCoord()));
+        } else if (unit->HasWaypoints()) {
+          // Refine the hierarchical path up to the next waypoint. This is done synchronously,
+          // since it is cheap (the waypoints are close to each other) and the unit would
+          // otherwise need to stop at each waypoint while waiting for the path.
+          PlanUnitPath(unit, map.get());
         } else {
           // Completed the path.
           unit->StopMovement();
@@ -993,7 +1648,7 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
           bool evaded = false;
           if (collidingUnit != nullptr) {
             // Try to evade the unit by moving alongside it.
-            QPointF evadeMapCoord;
+            FixedPoint evadeMapCoord;
             if (TryEvadeUnit(unit, moveDistance, newMapCoord, collidingUnit, &evadeMapCoord) &&
                 !map->DoesUnitCollide(unit, evadeMapCoord, &collidingUnit)) {
               // Successfully found a side step to avoid bumping into the other unit.
@@ -1002,11 +1657,9 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
                   SquaredDistance(unit->GetNextPathTarget(), unit->GetMapCoord())) {
                 // Use the evade step.
                 // Change our movement direction in order to still face the next path goal.
-                unit->SetMapCoord(evadeMapCoord);
+                map->SetUnitMapCoord(unit, evadeMapCoord);
                 
-                QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
-                direction = direction / std::max(1e-4f, Length(direction));
-                unit->SetMovementDirection(direction);
+                unit->SetMovementDirection(Normalized(unit->GetNextPathTarget() - unit->GetMapCoord()));
                 
                 if (unit->GetCurrentAction() != UnitAction::Moving) {
                   unit->SetCurrentAction(UnitAction::Moving);
@@ -1023,7 +1676,7 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
             unitMovementChanged = true;
           }
         } else {
-          unit->SetMapCoord(newMapCoord);
+          map->SetUnitMapCoord(unit, newMapCoord);
           
           if (unit->GetCurrentAction() != UnitAction::Moving) {
             unitMovementChanged = true;
@@ -1036,16 +1689,7 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
   
   if (unitMovementChanged) {
     // Notify all clients that see the unit about its new movement / animation.
-    for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
-      // TODO: Only do this if the player sees the unit.
-      
-      accumulatedMessages[playerIndex] +=
-          CreateUnitMovementMessage(
-              unitId,
-              unit->GetMapCoord(),
-              unit->GetMoveSpeed() * unit->GetMovementDirection(),
-              unit->GetCurrentAction());
-    }
+    AccumulateUnitMovement(unitId, unit);
   }
 }
 
@@ -1065,14 +1709,8 @@ void Game::SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* v
       // TODO: The foundation's occupancy may differ from the final building's occupancy, e.g., for town centers. Handle this case properly.
       map->AddBuildingOccupancy(targetBuilding);
       
-      // Tell all clients that observe the foundation about it (except the client which
-      // is constructing it, which already knows it).
-      QByteArray addObjectMsg = CreateAddObjectMessage(targetObjectId, targetBuilding);
-      for (auto& player : *playersInGame) {
-        if (player->index != targetBuilding->GetPlayerIndex()) {
-          accumulatedMessages[player->index] += addObjectMsg;
-        }
-      }
+      // Once the construction has started, the other players that see the building
+      // get told about it by UpdateObjectVisibility().
     } else {
       // Construction blocked.
       // TODO: Rather than stopping, try to move to the nearest point next to the building (if necessary),
@@ -1087,34 +1725,35 @@ void Game::SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* v
   // Add progress to the construction.
   // TODO: In the original game, two villagers building does not result in twice the speed. Account for this.
   if (canConstruct) {
-    double constructionTime = GetBuildingConstructionTime(targetBuilding->GetType());
-    double constructionStepAmount = stepLengthInSeconds / constructionTime;
+    Fixed constructionTime = Fixed::FromFloat(GetBuildingConstructionTime(targetBuilding->GetType()));
+    Fixed constructionStepAmount = Fixed::FromFloat(stepLengthInSeconds) / constructionTime;
     
-    double newPercentage = std::min<double>(100, targetBuilding->GetBuildPercentage() + 100 * constructionStepAmount);
-    if (newPercentage == 100 && !targetBuilding->IsCompleted()) {
+    Fixed newPercentage = Min(100, targetBuilding->GetBuildPercentage() + 100 * constructionStepAmount);
+    bool wasCompleted = targetBuilding->IsCompleted();
+    if (newPercentage == 100 && !wasCompleted) {
       // Building completed.
       if (targetBuilding->GetPlayerIndex() != kGaiaPlayerIndex) {
         GetPlayerStats(targetBuilding->GetPlayerIndex())->BuildingFinished(targetBuilding->GetType());
       }
     }
     targetBuilding->SetBuildPercentage(newPercentage);
+    if (newPercentage == 100 && !wasCompleted) {
+      dropOffIndex->AddBuilding(targetObjectId, targetBuilding);
+    }
     
     // Tell all clients that see the building about the new build percentage.
-    // TODO: Group those updates together for each frame (together with the build speed handling in case multiple villagers are building at the same time)
-    QByteArray msg = CreateBuildPercentageUpdateMessage(targetObjectId, targetBuilding->GetBuildPercentage());
-    for (auto& player : *playersInGame) {
-      accumulatedMessages[player->index] += msg;
+    // If multiple villagers are building at the same time, these updates get coalesced by the ObjectStateDeltaEncoder.
+    for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+      if (targetBuilding->IsObservedBy(playerIndex)) {
+        objectStateDeltas[playerIndex].SetBuildPercentage(targetObjectId, targetBuilding->GetBuildPercentage().ToFloat());
+      }
     }
     
-    u32 maxHP = GetBuildingMaxHP(targetBuilding->GetType());
-    double addedHP = constructionStepAmount * maxHP;
-    targetBuilding->SetHP(std::min<float>(targetBuilding->GetHPInternalFloat() + addedHP, maxHP));
+    Fixed maxHP = static_cast<int>(GetBuildingMaxHP(targetBuilding->GetType()));
+    Fixed addedHP = constructionStepAmount * maxHP;
+    targetBuilding->SetHP(Min(targetBuilding->GetHPInternal() + addedHP, maxHP));
     
-    // TODO: Would it make sense to batch these together in case there are multiple updates to an object's HP in the same time step?
-    QByteArray msg2 = CreateHPUpdateMessage(targetObjectId, targetBuilding->GetHP());
-    for (auto& player : *playersInGame) {
-      accumulatedMessages[player->index] += msg2;
-    }
+    AccumulateHPUpdate(targetObjectId, targetBuilding);
     
     if (villager->GetCurrentAction() != UnitAction::Task) {
       *unitMovementChanged = true;
@@ -1155,48 +1794,27 @@ void Game::SimulateResourceGathering(float stepLengthInSeconds, u32 villagerId,
   
   // Determine the number of resource units collected.
   // TODO: The gather rate should vary per resource type and depend on the player's civilization and technologies
-  constexpr double gatherRate = 1.3;
-  double resourcesGathered = gatherRate * stepLengthInSeconds;
+  constexpr Fixed gatherRate = Fixed::FromFraction(13, 10);
+  Fixed resourcesGathered = gatherRate * Fixed::FromFloat(stepLengthInSeconds);
   
   constexpr int carryCapacity = 10;  // TODO: Should depend on technologies etc.
   
   int previousIntegerAmount = villager->GetCarriedResourceAmount();
   villager->SetCarriedResourceAmount(
-      std::min<float>(carryCapacity, villager->GetCarriedResourceAmountInternalFloat() + resourcesGathered));
+      Min(carryCapacity, villager->GetCarriedResourceAmountInternal() + resourcesGathered));
   int currentIntegerAmount = villager->GetCarriedResourceAmount();
   
   if (resourcesDropped || currentIntegerAmount != previousIntegerAmount) {
     // Notify the client that owns the villager about its new carry amount
-    accumulatedMessages[villager->GetPlayerIndex()] += CreateSetCarriedResourcesMessage(villagerId, gatheredType, currentIntegerAmount);
+    objectStateDeltas[villager->GetPlayerIndex()].SetCarriedResources(villagerId, gatheredType, currentIntegerAmount);
   }
   
   // Make the villager target a resource drop-off point if its carrying capacity is reached.
   if (villager->GetCarriedResourceAmount() == carryCapacity) {
-    // TODO: Speed up this search?
-    float bestSquaredDistance = std::numeric_limits<float>::infinity();
-    u32 bestDropOffPointId;
-    ServerBuilding* bestDropOffPoint = nullptr;
-    
-    for (auto& item : map->GetObjects()) {
-      if (item.second->GetPlayerIndex() == villager->GetPlayerIndex() &&
-          item.second->isBuilding()) {
-        ServerBuilding* candidateDropOffPoint = AsBuilding(item.second);
-        if (IsDropOffPointForResource(candidateDropOffPoint->GetType(), villager->GetCarriedResourceType())) {
-          // TODO: Improve the distance computation. Ideally we would use the distance that the
-          //       villager has to walk to the edge of the building, not the straight-line distance to its center.
-          QSize candidateSize = GetBuildingSize(candidateDropOffPoint->GetType());
-          QPointF candidateCenter = candidateDropOffPoint->GetBaseTile() + 0.5f * QPointF(candidateSize.width(), candidateSize.height());
-          
-          float squaredDistance = SquaredDistance(candidateCenter, villager->GetMapCoord());
-          
-          if (squaredDistance < bestSquaredDistance) {
-            bestSquaredDistance = squaredDistance;
-            bestDropOffPoint = candidateDropOffPoint;
-            bestDropOffPointId = item.first;
-          }
-        }
-      }
-    }
+    // TODO: Improve the distance computation. Ideally we would use the distance that the
+    //       villager has to walk to the edge of the building, not the straight-line distance to its center.
+    u32 bestDropOffPointId = dropOffIndex->FindClosest(villager->GetPlayerIndex(), villager->GetCarriedResourceType(), villager->GetMapCoord());
+    ServerObject* bestDropOffPoint = map->GetObjects().Find(bestDropOffPointId);
     
     if (bestDropOffPoint) {
       SetUnitTargets({villagerId}, villager->GetPlayerIndex(), bestDropOffPointId, bestDropOffPoint, false);
@@ -1218,13 +1836,13 @@ void Game::SimulateResourceDropOff(u32 villagerId, ServerUnit* villager, bool* u
   (*playersInGame)[villager->GetPlayerIndex()]->resources.Add(amount);
   
   villager->SetCarriedResourceAmount(0);
-  accumulatedMessages[villager->GetPlayerIndex()] += CreateSetCarriedResourcesMessage(villagerId, villager->GetCarriedResourceType(), 0);
+  objectStateDeltas[villager->GetPlayerIndex()].SetCarriedResources(villagerId, villager->GetCarriedResourceType(), 0);
   
   // If the villager was originally tasked onto a resource, make it return to this resource.
   if (villager->GetManuallyTargetedObjectId() != villager->GetTargetObjectId()) {
-    auto it = map->GetObjects().find(villager->GetManuallyTargetedObjectId());
-    if (it != map->GetObjects().end()) {
-      SetUnitTargets({villagerId}, villager->GetPlayerIndex(), it->first, it->second, /*isManualTargeting*/ false);
+    ServerObject* manualTarget = map->GetObjects().Find(villager->GetManuallyTargetedObjectId());
+    if (manualTarget) {
+      SetUnitTargets({villagerId}, villager->GetPlayerIndex(), villager->GetManuallyTargetedObjectId(), manualTarget, /*isManualTargeting*/ false);
     } else {
       // The manually targeted object does not exist anymore, stop.
       // TODO: This happens when a resource is depleted. In this case, make the villager move on to a nearby resource of the same type.
@@ -1244,7 +1862,7 @@ void Game::SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building,
     auto& player = *playersInGame->at(building->GetPlayerIndex());
     
     bool canProduce = true;
-    float previousPercentage = building->GetProductionPercentage();
+    Fixed previousPercentage = building->GetProductionPercentage();
     if (previousPercentage == 0) {
       // Only start producing the unit if population space is available.
       canProduce = player.stats.GetPopulationCountIncludingInProduction() < player.stats.GetAvailablePopulationSpace();
@@ -1255,8 +1873,8 @@ void Game::SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building,
     
     if (canProduce) {
       float productionTime = GetUnitProductionTime(unitInProduction);
-      float timeStepPercentage = 100 * stepLengthInSeconds / productionTime;
-      float newPercentage = building->GetProductionPercentage() + timeStepPercentage;
+      Fixed timeStepPercentage = 100 * Fixed::FromFloat(stepLengthInSeconds) / Fixed::FromFloat(productionTime);
+      Fixed newPercentage = building->GetProductionPercentage() + timeStepPercentage;
       
       bool completed = false;
       if (newPercentage >= 100) {
@@ -1265,7 +1883,7 @@ void Game::SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building,
         
         // Special case for UnitType::MaleVillager: Randomly decide whether to produce a male or female.
         if (unitInProduction == UnitType::MaleVillager) {
-          unitInProduction = (rand() % 2 == 0) ? UnitType::MaleVillager : UnitType::FemaleVillager;
+          unitInProduction = (map->RandomInt(2) == 0) ? UnitType::MaleVillager : UnitType::FemaleVillager;
         }
         
         // Create the unit.
@@ -1280,7 +1898,7 @@ void Game::SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building,
       building->SetProductionPercentage(newPercentage);
       if (!completed && previousPercentage == 0) {
         // If the production just starts, notify the client about it.
-        accumulatedMessages[building->GetPlayerIndex()] += CreateUpdateProductionMessage(buildingId, building->GetProductionPercentage(), 100.f / productionTime);
+        accumulatedMessages[building->GetPlayerIndex()] += CreateUpdateProductionMessage(buildingId, building->GetProductionPercentage().ToFloat(), 100.f / productionTime);
         
         // Add the population count for the unit in production.
         player.stats.populationInProduction += 1;
@@ -1289,22 +1907,26 @@ void Game::SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building,
   }
 }
 
-bool Game::SimulateMeleeAttack(u32 /*unitId*/, ServerUnit* unit, u32 targetId, ServerObject* target, double gameStepServerTime, float stepLengthInSeconds, bool* unitMovementChanged, bool* stayInPlace) {
+bool Game::SimulateMeleeAttack(u32 /*unitId*/, ServerUnit* unit, u32 targetId, ServerObject* target, bool* unitMovementChanged, bool* stayInPlace) {
   if (unit->GetCurrentAction() != UnitAction::Attack) {
     *unitMovementChanged = true;
     unit->SetCurrentAction(UnitAction::Attack);
-    unit->SetCurrentActionStartTime(gameStepServerTime);
+    unit->SetCurrentActionStartStep(gameStepIndex);
   }
   *stayInPlace = true;
   
-  int numAttackFrames = GetUnitAttackFrames(unit->GetType());
-  double fullAttackTime = numAttackFrames / (1.f * animationFramesPerSecond);
-  double attackDamageTime = 0.5 * fullAttackTime;  // TODO: Does this differ among units? Is this available in some data file?
+  // The attack timing is computed in integers only: after s game steps,
+  // s * kAnimationFramesPerStepNumerator / kAnimationFramesPerStepDenominator animation frames have played.
+  // Both sides of the comparisons below are scaled by 2 * kAnimationFramesPerStepDenominator.
+  i64 fullAttackFramesScaled = 2 * GetUnitAttackFrames(unit->GetType()) * kAnimationFramesPerStepDenominator;
+  i64 attackDamageFramesScaled = fullAttackFramesScaled / 2;  // TODO: Does this differ among units? Is this available in some data file?
   
-  double timeSinceActionStart = gameStepServerTime - unit->GetCurrentActionStartTime();
+  i64 stepsSinceActionStart = static_cast<i64>(gameStepIndex - unit->GetCurrentActionStartStep());
+  i64 framesSinceActionStartScaled = 2 * stepsSinceActionStart * kAnimationFramesPerStepNumerator;
+  i64 framesBeforeThisStepScaled = framesSinceActionStartScaled - 2 * kAnimationFramesPerStepNumerator;
   
-  if (timeSinceActionStart >= attackDamageTime &&
-      timeSinceActionStart - stepLengthInSeconds < attackDamageTime &&
+  if (framesSinceActionStartScaled >= attackDamageFramesScaled &&
+      framesBeforeThisStepScaled < attackDamageFramesScaled &&
       target != nullptr) {
     // Compute the attack damage.
     int meleeArmor;
@@ -1323,26 +1945,22 @@ bool Game::SimulateMeleeAttack(u32 /*unitId*/, ServerUnit* unit, u32 targetId, S
     int totalDamage = std::max(1, meleeDamage);
     
     // Do the attack damage.
-    float oldHP = target->GetHPInternalFloat();
-    float hp = target->GetHPInternalFloat() - totalDamage;
-    if (hp > 0.5f) {
+    Fixed oldHP = target->GetHPInternal();
+    Fixed hp = target->GetHPInternal() - totalDamage;
+    if (hp > Fixed::FromFraction(1, 2)) {
       target->SetHP(hp);
       
       // Notify all clients that see the target about its HP change
-      // TODO: Would it make sense to batch these together in case there are multiple updates to an object's HP in the same time step?
-      QByteArray msg = CreateHPUpdateMessage(targetId, target->GetHP());
-      for (auto& player : *playersInGame) {
-        accumulatedMessages[player->index] += msg;
-      }
-    } else if (oldHP > 0.5f) {
+      AccumulateHPUpdate(targetId, target);
+    } else if (oldHP > Fixed::FromFraction(1, 2)) {
       // Remove the target.
       DeleteObject(targetId, false);
     }
   }
   
-  if (timeSinceActionStart >= fullAttackTime) {
+  if (framesSinceActionStartScaled >= fullAttackFramesScaled) {
     // The attack animation finished.
-    unit->SetCurrentActionStartTime(gameStepServerTime);
+    unit->SetCurrentActionStartStep(gameStepIndex);
     return false;
   }
   
@@ -1352,26 +1970,26 @@ bool Game::SimulateMeleeAttack(u32 /*unitId*/, ServerUnit* unit, u32 targetId, S
 void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
   // Create the unit object.
   u32 newUnitId;
-  ServerUnit* newUnit = map->AddUnit(building->GetPlayerIndex(), unitInProduction, QPointF(-999, -999), &newUnitId);
+  ServerUnit* newUnit = map->AddUnit(building->GetPlayerIndex(), unitInProduction, FixedPoint(-999, -999), &newUnitId);
   
   // Look for a free space to place the unit next to the building.
-  float unitRadius = GetUnitRadius(unitInProduction);
+  Fixed unitRadius = GetUnitRadiusFixed(unitInProduction);
   
   QSize buildingSize = GetBuildingSize(building->GetType());
-  QPointF buildingBaseCoord(building->GetBaseTile() + QPointF(buildingSize.width() + unitRadius, -unitRadius));
-  float extendedWidth = buildingSize.width() + 2 * unitRadius;
-  float extendedHeight = buildingSize.height() + 2 * unitRadius;
+  FixedPoint buildingBaseCoord(building->GetBaseTile().x() + buildingSize.width() + unitRadius, building->GetBaseTile().y() - unitRadius);
+  Fixed extendedWidth = buildingSize.width() + 2 * unitRadius;
+  Fixed extendedHeight = buildingSize.height() + 2 * unitRadius;
   
   bool foundFreeSpace = false;
-  QPointF freeSpace(-999, -999);
+  FixedPoint freeSpace(-999, -999);
   
   // Try to place the unit on the bottom-left or bottom-right side of the building.
   // This equals +x or -y in map coordinates.
-  float offset = 0;
-  while (offset <= std::max(extendedWidth, extendedHeight)) {
+  Fixed offset = 0;
+  while (offset <= Max(extendedWidth, extendedHeight)) {
     // Test bottom-right side
     if (offset < extendedHeight) {
-      QPointF testPoint = buildingBaseCoord + QPointF(0, offset);
+      FixedPoint testPoint = buildingBaseCoord + FixedPoint(0, offset);
       if (!map->DoesUnitCollide(newUnit, testPoint)) {
         foundFreeSpace = true;
         freeSpace = testPoint;
@@ -1381,7 +1999,7 @@ void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
     
     // Test bottom-left side
     if (offset < extendedWidth) {
-      QPointF testPoint = buildingBaseCoord + QPointF(-offset, 0);
+      FixedPoint testPoint = buildingBaseCoord + FixedPoint(-offset, 0);
       if (!map->DoesUnitCollide(newUnit, testPoint)) {
         foundFreeSpace = true;
         freeSpace = testPoint;
@@ -1391,17 +2009,17 @@ void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
     
     // Incease the offset. Make sure that we reach the end in a reasonable number
     // of steps, even in case the unit radius is very small (or even zero).
-    offset += std::min(0.02f * extendedWidth, 2 * unitRadius);
+    offset += Min(extendedWidth / 50, 2 * unitRadius);
   }
   
   // Try to place the unit on the top-left or top-right side of the building.
   // This equals -x or +y in map coordinates.
   if (!foundFreeSpace) {
     offset = 2 * unitRadius;
-    while (offset <= std::max(extendedWidth, extendedHeight)) {
+    while (offset <= Max(extendedWidth, extendedHeight)) {
       // Test top-left side
       if (offset < extendedHeight) {
-        QPointF testPoint = buildingBaseCoord + QPointF(-extendedWidth, offset);
+        FixedPoint testPoint = buildingBaseCoord + FixedPoint(-extendedWidth, offset);
         if (!map->DoesUnitCollide(newUnit, testPoint)) {
           foundFreeSpace = true;
           freeSpace = testPoint;
@@ -1411,7 +2029,7 @@ void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
       
       // Test top-right side
       if (offset < extendedWidth) {
-        QPointF testPoint = buildingBaseCoord + QPointF(-offset, extendedHeight);
+        FixedPoint testPoint = buildingBaseCoord + FixedPoint(-offset, extendedHeight);
         if (!map->DoesUnitCollide(newUnit, testPoint)) {
           foundFreeSpace = true;
           freeSpace = testPoint;
@@ -1421,36 +2039,34 @@ void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
       
       // Incease the offset. Make sure that we reach the end in a reasonable number
       // of steps, even in case the unit radius is very small (or even zero).
-      offset += std::min(0.02f * extendedWidth, 2 * unitRadius);
+      offset += Min(extendedWidth / 50, 2 * unitRadius);
     }
   }
   
   if (foundFreeSpace) {
-    newUnit->SetMapCoord(freeSpace);
+    map->SetUnitMapCoord(newUnit, freeSpace);
   } else {
     // TODO: Garrison the unit in the building
   }
   
-  // Send messages to clients that see the new unit
-  QByteArray addObjectMsg = CreateAddObjectMessage(newUnitId, newUnit);
-  for (auto& player : *playersInGame) {
-    accumulatedMessages[player->index] += addObjectMsg;
-  }
+  // The clients that see the new unit get told about it by UpdateObjectVisibility().
   
   GetPlayerStats(newUnit->GetPlayerIndex())->UnitAdded(unitInProduction);
 }
 
 void Game::SetUnitTargets(const std::vector<u32>& unitIds, int playerIndex, u32 targetId, ServerObject* targetObject, bool isManualTargeting) {
+  ServerUnit* lastCommandedUnit = nullptr;
+  int numCommandedUnits = 0;
   for (u32 id : unitIds) {
-    auto it = map->GetObjects().find(id);
-    if (it == map->GetObjects().end() ||
-        !it->second->isUnit() ||
-        it->second->GetPlayerIndex() != playerIndex) {
+    ServerObject* object = map->GetObjects().Find(id);
+    if (!object ||
+        !object->isUnit() ||
+        object->GetPlayerIndex() != playerIndex) {
       LOG(WARNING) << "SetUnitTargets() for invalid unit ID, may for example be caused by incorrect messages from a client: " << id;
       continue;
     }
     
-    ServerUnit* unit = AsUnit(it->second);
+    ServerUnit* unit = AsUnit(object);
     UnitType oldUnitType = unit->GetType();
     
     unit->SetTarget(targetId, targetObject, isManualTargeting);
@@ -1458,50 +2074,60 @@ void Game::SetUnitTargets(const std::vector<u32>& unitIds, int playerIndex, u32
     if (oldUnitType != unit->GetType()) {
       GetPlayerStats(playerIndex)->UnitTransformed(oldUnitType, unit->GetType());
       // Notify all clients that see the unit about its change of type.
-      QByteArray msg = CreateChangeUnitTypeMessage(id, unit->GetType());
-      for (auto& player : *playersInGame) {
-        accumulatedMessages[player->index] += msg;
-      }
+      AccumulateMessageForObservers(unit, CreateChangeUnitTypeMessage(id, unit->GetType()));
     }
+    
+    lastCommandedUnit = unit;
+    ++ numCommandedUnits;
+  }
+  
+  // Flow fields are only useful for static targets.
+  if (targetObject->isBuilding()) {
+    PrepareGroupPathPlanning(lastCommandedUnit, numCommandedUnits);
   }
 }
 
-void Game::DeleteObject(u32 objectId, bool deletedManually) {
-  // Objects are deleted lazily. This means that for example if multiple
-  // militia hit a 1-HP house in the same time step, it could be deleted twice.
-  // This e.g., causes inconsitencies regarding population count. Prevent this.
-  for (u32 id : objectDeleteList) {
-    if (id == objectId) {
-      return;
-    }
+void Game::PrepareGroupPathPlanning(ServerUnit* unit, int groupSize) {
+  if (groupSize < FlowFieldCache::kMinGroupSize) {
+    return;
   }
   
+  map->GetFlowFieldCache()->GetOrCreate(GetPathGoalRect(unit, map.get()), map->GetOccupancySnapshot());
+}
+
+void Game::DeleteObject(u32 objectId, bool deletedManually) {
   // TODO: Convert the object into some other form to remember
   //       the potential destroy / death animation and rubble / decay sprite.
   //       We need to store this so we can tell other clients about its existence
   //       which currently do not see the object but may explore its location later.
   
-  auto it = map->GetObjects().find(objectId);
-  if (it == map->GetObjects().end()) {
+  ServerObject* object = map->GetObjects().Find(objectId);
+  if (!object) {
     LOG(ERROR) << "Did not find the object to delete in the object map.";
     return;
   }
-  ServerObject* object = it->second;
   
-  // For building foundations, only the player that owns them knows about the object.
-  // So we only need to send the object death message to this player.
-  bool isFoundation = object->isBuilding() && AsBuilding(object)->IsFoundation();
-  bool sendObjectDeathToOwningPlayerOnly = isFoundation;
+  // Objects are deleted lazily. This means that for example if multiple
+  // militia hit a 1-HP house in the same time step, it could be deleted twice.
+  // This e.g., causes inconsitencies regarding population count. Prevent this.
+  if (object->IsDeleted()) {
+    return;
+  }
+  object->SetDeleted();
   
+  // Send the object death message to all players that observe the object. Afterwards, the object is not
+  // observed by anyone anymore, which ensures that no further messages get sent about it.
   QByteArray msg = CreateObjectDeathMessage(objectId);
   for (auto& player : *playersInGame) {
-    if (sendObjectDeathToOwningPlayerOnly && player->index != object->GetPlayerIndex()) {
-      continue;
+    if (object->IsObservedBy(player->index)) {
+      accumulatedMessages[player->index] += msg;
+      objectStateDeltas[player->index].Forget(objectId);
+      object->SetObservedBy(player->index, false);
     }
-    
-    accumulatedMessages[player->index] += msg;
   }
   
+  RemoveFieldOfView(object);
+  
   objectDeleteList.push_back(objectId);
   
   // For buildings:
@@ -1515,10 +2141,13 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
       map->RemoveBuildingOccupancy(building);
     }
     if (deletedManually && !building->IsCompleted()) {
-      float remainingResourceAmount = 1 - building->GetBuildPercentage() / 100.f;
+      Fixed remainingResourceAmount = 1 - building->GetBuildPercentage() / 100;
       
-      ResourceAmount cost = GetBuildingCost(building->GetType());
-      playersInGame->at(building->GetPlayerIndex())->resources.Add(remainingResourceAmount * cost);
+      ResourceAmount refund = GetBuildingCost(building->GetType());
+      for (int i = 0; i < static_cast<int>(ResourceType::NumTypes); ++ i) {
+        refund.resources[i] = (remainingResourceAmount * static_cast<int>(refund.resources[i])).Round();
+      }
+      playersInGame->at(building->GetPlayerIndex())->resources.Add(refund);
     }
     for (usize queueIndex = 0; queueIndex < building->GetProductionQueue().size(); ++ queueIndex) {
       playersInGame->at(building->GetPlayerIndex())->resources.Add(GetUnitCost(building->GetProductionQueue()[queueIndex]));
@@ -1532,32 +2161,18 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
   if (object->isBuilding()) {
     ServerBuilding* building = AsBuilding(object);
     GetPlayerStats(building->GetPlayerIndex())->BuildingRemoved(building->GetType(), building->IsCompleted());
+    if (building->IsCompleted()) {
+      dropOffIndex->RemoveBuilding(objectId, building);
+    }
   } else if (object->isUnit()) {
     GetPlayerStats(object->GetPlayerIndex())->UnitRemoved(AsUnit(object)->GetType());
   }
   
   // If all objects of a player are gone, the player gets defeated.
-  if (object->GetPlayerIndex() != kGaiaPlayerIndex) {
-    bool playerHasRemainingObject = false;
-    for (const auto& item : map->GetObjects()) {
-      if (item.second->GetPlayerIndex() == object->GetPlayerIndex() &&
-          item.first != it->first) {
-        playerHasRemainingObject = true;
-        for (u32 id : objectDeleteList) {
-          if (id == item.first) {
-            playerHasRemainingObject = false;
-            break;
-          }
-        }
-        if (playerHasRemainingObject) {
-          break;
-        }
-      }
-    }
-    
-    if (!playerHasRemainingObject) {
-      RemovePlayer(object->GetPlayerIndex(), PlayerExitReason::Defeat);
-    }
+  // The stats were updated above, so they do not count the objects in objectDeleteList anymore.
+  if (object->GetPlayerIndex() != kGaiaPlayerIndex &&
+      GetPlayerStats(object->GetPlayerIndex())->GetObjectCount() == 0) {
+    RemovePlayer(object->GetPlayerIndex(), PlayerExitReason::Defeat);
   }
 }
 
@@ -1573,9 +2188,15 @@ void Game::RemovePlayer(int playerIndex, PlayerExitReason reason) {
     LOG(ERROR) << "Unknown reason passed to RemovePlayer(): " << static_cast<int>(reason);
   }
   
+  // Defeats follow from the simulation, so only the other exits need to be recorded.
+  if (replayWriter && reason != PlayerExitReason::Defeat) {
+    replayWriter->WritePlayerExit(gameStepIndex, playerIndex, reason);
+  }
+  
   auto& player = playersInGame->at(playerIndex);
   LOG(WARNING) << "Removing player: " << player->name.toStdString() << " (index " << player->index << "). Reason: " << reasonString.toStdString();
   player->RemoveFromGame();
+  player->exitReason = reason;
   
   // Notify the remaining players about the player's exit
   // TODO: For these messages and the one sent below, clients may think
@@ -1583,14 +2204,14 @@ void Game::RemovePlayer(int playerIndex, PlayerExitReason reason) {
   //       Maybe create a special case for this message type on the client side?
   QByteArray leaveBroadcastMsg = CreatePlayerLeaveBroadcastMessage(player->index, reason);
   for (auto& otherPlayer : *playersInGame) {
-    if (otherPlayer->isConnected) {
+    if (otherPlayer->isConnected && !isHeadless) {
       otherPlayer->socket->write(leaveBroadcastMsg);
       otherPlayer->socket->flush();
     }
   }
   
   // In case of a defeat, notify the defeated player.
-  if (reason == PlayerExitReason::Defeat) {
+  if (reason == PlayerExitReason::Defeat && !isHeadless && player->socket) {
     player->socket->write(CreatePlayerLeaveBroadcastMessage(player->index, reason));
     player->socket->flush();
   }
@@ -1598,9 +2219,10 @@ void Game::RemovePlayer(int playerIndex, PlayerExitReason reason) {
   // TODO: If all other players finished loading and the last player who did not drops,
   //       then start the game for the remaining players (or cancel it altogether)
   
+  // Players who may still reconnect count as connected.
   int numConnectedPlayers = 0;
   for (auto& otherPlayer : *playersInGame) {
-    if (otherPlayer->isConnected) {
+    if (otherPlayer->isConnected || otherPlayer->awaitingReconnect) {
       ++ numConnectedPlayers;
     }
   }
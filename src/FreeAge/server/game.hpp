@@ -5,18 +5,27 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <QByteArray>
 #include <QString>
+#include <QTcpServer>
 #include <QTcpSocket>
+#include <QThread>
 
 #include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/message_buffer.hpp"
 #include "FreeAge/common/messages.hpp"
 #include "FreeAge/common/player.hpp"
 #include "FreeAge/common/resources.hpp"
+#include "FreeAge/server/drop_off_index.hpp"
 #include "FreeAge/server/map.hpp"
+#include "FreeAge/server/object_state_delta_encoder.hpp"
+#include "FreeAge/server/path_planner.hpp"
+#include "FreeAge/server/replay.hpp"
 #include "FreeAge/server/settings.hpp"
+#include "FreeAge/server/visibility.hpp"
 
 class ServerBuilding;
 class ServerUnit;
@@ -34,7 +43,7 @@ struct PlayerInGame {
   
   /// Buffer for bytes that have been received from the client, but could not
   /// be parsed yet (because only a partial message was received so far).
-  QByteArray unparsedBuffer;
+  MessageBuffer unparsedBuffer;
   
   /// The player name as provided by the client.
   QString name;
@@ -48,6 +57,23 @@ struct PlayerInGame {
   /// Whether there (still) is an active connection to this player.
   bool isConnected = true;
   
+  /// Secret token with which the client can reconnect to the game after losing its connection.
+  QByteArray sessionToken;
+  
+  /// Whether the connection to this player was lost during the game, and the player may still
+  /// reconnect (until Game::kReconnectTimeout passed after disconnectTime).
+  bool awaitingReconnect = false;
+  
+  /// The time at which the connection to this player was lost.
+  TimePoint disconnectTime;
+  
+  /// After the player reconnected, the game state is resent to it over the following game steps.
+  /// During this, this is the index of the next map chunk to send. Otherwise, it is -1.
+  int nextResyncMapChunk = -1;
+  
+  /// The reason for which the player left the game. Only valid after the player left.
+  PlayerExitReason exitReason;
+  
   /// Whether the player finished loading the game resources.
   bool finishedLoading = false;
   
@@ -76,9 +102,74 @@ class Game {
  public:
   Game(ServerSettings* settings);
   
-  void RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame);
+  /// Runs the game until it ends. If reconnectServer is given, new connections on it are
+  /// used for players that reconnect after losing their connection.
+  void RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame, QTcpServer* reconnectServer = nullptr);
+  
+  /// Hands a new connection over to the game, which uses it for a reconnecting player.
+  /// receivedData must contain the Reconnect message that was received on the connection.
+  /// This is used by servers that run the game loop on a separate thread. It must be called
+  /// on the thread that the socket belongs to, and moves the socket to the game loop's thread.
+  /// Returns false if the game loop is not running, in which case the socket is not taken over.
+  bool AddReconnection(QTcpSocket* socket, const QByteArray& receivedData);
+  
+  /// Starts the game in headless mode, which is used by the server benchmark:
+  /// There are no client connections (the players' sockets may be null), no messages
+  /// are sent, and the game only advances when SimulateHeadlessGameStep() is called.
+  /// To play back a replay, gameBeginServerTime must be set to the value from the replay header.
+  void StartHeadlessGame(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame, int mapSeed, double gameBeginServerTime = 0);
+  
+  /// In headless mode, simulates the next game step immediately (instead of waiting for its due time).
+  void SimulateHeadlessGameStep();
+  
+  /// In headless mode, handles the given client-to-server messages as if they had been received from the player.
+  void HandleHeadlessClientMessages(PlayerInGame* player, const QByteArray& messages);
+  
+  /// In headless mode, removes the player from the game for the given reason.
+  void HandleHeadlessPlayerExit(PlayerInGame* player, PlayerExitReason reason);
+  
+  /// In headless mode, creates a unit of the given type next to the given building,
+  /// as if the building had produced it.
+  void SpawnUnit(u32 buildingId, UnitType type);
+  
+  /// In headless mode, returns the number of bytes of all messages that would have been sent to the clients so far.
+  inline u64 GetHeadlessMessageBytes() const { return headlessMessageBytes; }
+  
+  /// Returns the checksum of the game state at the end of the last simulated game step
+  /// (see ComputeStateChecksum()). Since the simulation is deterministic, two runs of the
+  /// same game must have the same checksum after each step; a difference indicates a desync.
+  inline u64 GetStateChecksum() const { return stateChecksum; }
+  
+  inline ServerMap* GetMap() { return map.get(); }
+  inline bool ShouldExit() const { return shouldExit; }
+  
+  /// Every this many game steps, the state checksum gets recorded in the replay.
+  static constexpr int kReplayChecksumInterval = 30;
+  
+  /// Game steps are simulated with this frequency.
+  static constexpr float kTargetFPS = 30;
+  static constexpr float kSimulationTimeInterval = 1 / kTargetFPS;
+  
+  /// Number of sprite animation frames that play per game step (animationFramesPerSecond / kTargetFPS),
+  /// as an exact fraction. Used to time animation-bound actions in whole game steps.
+  static constexpr int kAnimationFramesPerStepNumerator = 17;
+  static constexpr int kAnimationFramesPerStepDenominator = 10;
+  static_assert(kAnimationFramesPerStepNumerator * kTargetFPS / kAnimationFramesPerStepDenominator - animationFramesPerSecond < 1e-3f &&
+                kAnimationFramesPerStepNumerator * kTargetFPS / kAnimationFramesPerStepDenominator - animationFramesPerSecond > -1e-3f,
+                "kAnimationFramesPerStep{Numerator, Denominator} must match animationFramesPerSecond");
+  
+  /// Players who lost their connection can reconnect within this time (in milliseconds).
+  static constexpr int kReconnectTimeout = 60000;
   
  private:
+  /// A new connection on which a player may reconnect, but which did not send
+  /// its Reconnect message yet.
+  struct PendingReconnection {
+    QTcpSocket* socket;
+    MessageBuffer unparsedBuffer;
+    TimePoint connectionTime;
+  };
+  
   enum class ParseMessagesResult {
     NoAction = 0,
     PlayerLeftOrShouldBeDisconnected
@@ -97,28 +188,77 @@ class Game {
   void HandleDequeueProductionQueueItemMessage(const QByteArray& msg, PlayerInGame* player);
   ParseMessagesResult TryParseClientMessages(PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players);
   
-  // TODO: Right now, this creates a message containing the whole map content.
+  /// Accepts new connections for reconnecting players and handles their Reconnect messages.
+  void HandleReconnections();
+  /// Handles the first message received on a new connection during the game. If this is a valid
+  /// Reconnect message, the connection gets assigned to the player and true is returned.
+  bool HandleReconnectMessage(const QByteArray& msg, QTcpSocket* socket, MessageBuffer* unparsedBuffer);
+  /// Called when the connection to a player was lost. Once the game has started,
+  /// the player may reconnect within kReconnectTimeout. Otherwise, the player gets removed.
+  void DisconnectPlayer(int playerIndex);
+  /// Appends the next part of the game state snapshot for a reconnected player to the messages.
+  void AppendResyncMessages(PlayerInGame* player, QByteArray* messages);
+  
+  /// Creates a MapUncover message for the map corners in the given rectangle,
+  /// which must be at most kMapUncoverChunkSize large in each direction.
+  // TODO: Right now, the whole map content is sent to all clients in StartGame().
   //       Later, only the areas seen by a client (and a small border around them)
   //       should be sent to the client.
-  QByteArray CreateMapUncoverMessage();
+  QByteArray CreateMapUncoverMessage(const QRect& cornerRect);
+  /// Returns the number of chunks in which the map is sent to the clients.
+  int GetMapUncoverChunkCount();
+  /// Returns the map corners that are contained in the map chunk with the given index.
+  QRect GetMapUncoverChunkRect(int chunkIndex);
   QByteArray CreateAddObjectMessage(u32 objectId, ServerObject* object);
   
   inline double GetCurrentServerTime() { return SecondsDuration(Clock::now() - settings->serverStartTime).count(); }
   
   void StartGame();
+  /// Creates the replay file in the replay directory (if set) and starts recording the game to it.
+  void StartReplayRecording(int mapSeed);
+  /// Generates the map and prepares the simulation. Part of StartGame() and StartHeadlessGame().
+  void SetupGame(int mapSeed);
   void SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds);
-  void SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStepServerTime, float stepLengthInSeconds);
+  /// Computes a hash of the simulation state: the objects (in slot order) with their
+  /// fixed-point positions, HP, and progress values, and the players' resources.
+  /// State that does not influence the simulation (e.g., visibility) is not included.
+  u64 ComputeStateChecksum() const;
+  void SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, float stepLengthInSeconds);
+  /// Submits an asynchronous path planning request for the unit to the pathPlanner.
+  void RequestUnitPath(u32 unitId, ServerUnit* unit);
+  /// Assigns the results of all path planning requests that are due in the current game step.
+  void ApplyPathPlanningResults();
+  /// Adds the unit's current movement to the object state deltas of all players that observe the unit.
+  void AccumulateUnitMovement(u32 unitId, ServerUnit* unit);
+  /// Adds the object's current HP to the object state deltas of all players that observe the object.
+  void AccumulateHPUpdate(u32 objectId, ServerObject* object);
+  /// Adds the message to the accumulated messages of all players that observe the object.
+  void AccumulateMessageForObservers(ServerObject* object, const QByteArray& msg);
+  /// Adds the object's line of sight to the visibility of its player.
+  void AddFieldOfView(ServerObject* object);
+  /// Removes the object's line of sight from the visibility of its player, if it was added.
+  void RemoveFieldOfView(ServerObject* object);
+  /// Updates the players' visibility and the set of objects that each player observes
+  /// (see ServerObject::IsObservedBy()). Sends AddObject messages for objects that get observed,
+  /// and ObjectLeftView messages for units that stop being observed. All other messages about
+  /// an object only get sent to the players that observe it.
+  void UpdateObjectVisibility();
   void SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* villager, u32 targetObjectId, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace);
   void SimulateResourceGathering(float stepLengthInSeconds, u32 villagerId, ServerUnit* villager, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace);
   void SimulateResourceDropOff(u32 villagerId, ServerUnit* villager, bool* unitMovementChanged);
   void SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building, float stepLengthInSeconds);
   /// Returns true if the attack is still in progress, false if it finished.
-  bool SimulateMeleeAttack(u32 unitId, ServerUnit* unit, u32 targetId, ServerObject* target, double gameStepServerTime, float stepLengthInSeconds, bool* unitMovementChanged, bool* stayInPlace);
+  bool SimulateMeleeAttack(u32 unitId, ServerUnit* unit, u32 targetId, ServerObject* target, bool* unitMovementChanged, bool* stayInPlace);
   
   void ProduceUnit(ServerBuilding* building, UnitType unitInProduction);
   
   void SetUnitTargets(const std::vector<u32>& unitIds, int playerIndex, u32 targetId, ServerObject* targetObject, bool isManualTargeting);
   
+  /// Creates a flow field towards the path goal of the given unit if a group of at least
+  /// FlowFieldCache::kMinGroupSize units has been ordered there. All units of the group
+  /// then use this flow field instead of planning their paths individually.
+  void PrepareGroupPathPlanning(ServerUnit* unit, int groupSize);
+  
   void DeleteObject(u32 objectId, bool deletedManually);
   
   void RemovePlayer(int playerIndex, PlayerExitReason reason);
@@ -149,6 +289,26 @@ class Game {
   /// elements could invalidate the iterator.
   std::vector<u32> objectDeleteList;
   
+  /// Tracks which tiles each player currently sees.
+  std::unique_ptr<ServerVisibility> visibility;
+  
+  /// The completed drop-off buildings of each player, used by villagers to return their resources.
+  std::unique_ptr<DropOffIndex> dropOffIndex;
+  
+  /// Plans unit paths asynchronously. The results of requests submitted in game step i
+  /// are applied at the beginning of game step (i + kPathPlanningLatencyGameSteps).
+  std::unique_ptr<PathPlanner> pathPlanner;
+  static constexpr int kPathPlanningLatencyGameSteps = 2;
+  
+  /// Buffer for ApplyPathPlanningResults().
+  std::vector<PathResult> pathResults;
+  
+  /// Index of the current game step, counting from zero at the start of the game.
+  u64 gameStepIndex = 0;
+  
+  /// Result of ComputeStateChecksum() at the end of the last game step.
+  u64 stateChecksum = 0;
+  
   /// For each player, stores accumulated messages that will be sent out
   /// upon the next conclusion of a game simulation step. Accumulating
   /// messages helps to reduce the overhead that many individual messages
@@ -158,7 +318,37 @@ class Game {
   /// time in each message.
   std::vector<QByteArray> accumulatedMessages;
   
+  /// For each player, collects the changes to the state of the objects that the player observes.
+  /// At the conclusion of each game simulation step, these get appended to the accumulatedMessages
+  /// as ObjectStateDelta messages.
+  std::vector<ObjectStateDeltaEncoder> objectStateDeltas;
+  
   bool shouldExit = false;
   
+  /// Whether the game was started with StartHeadlessGame().
+  bool isHeadless = false;
+  
+  /// Counts the bytes of the messages that were not sent in headless mode.
+  u64 headlessMessageBytes = 0;
+  
+  /// Records the game if a replay directory is configured, nullptr otherwise.
+  std::unique_ptr<ReplayWriter> replayWriter;
+  
+  /// Server on which new connections for reconnecting players are accepted (may be nullptr). Not owned.
+  QTcpServer* reconnectServer = nullptr;
+  
+  /// New connections that did not send their Reconnect message yet.
+  std::vector<PendingReconnection> pendingReconnections;
+  
+  /// Connections that were handed over with AddReconnection() and that were not moved
+  /// to pendingReconnections yet.
+  std::vector<PendingReconnection> addedReconnections;
+  
+  /// The thread that runs the game loop while it is running, nullptr otherwise.
+  QThread* gameLoopThread = nullptr;
+  
+  /// Guards addedReconnections and gameLoopThread.
+  std::mutex reconnectionsMutex;
+  
   ServerSettings* settings;  // not owned
 };
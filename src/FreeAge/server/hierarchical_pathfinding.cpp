@@ -0,0 +1,373 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/hierarchical_pathfinding.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/server/map.hpp"
+
+/// Entrances that are at least this wide get two nodes (one at each end)
+/// instead of a single node in the middle.
+constexpr int kMinWideEntranceLength = 6;
+
+/// Returns the "diagonal distance" between the two tiles, which is a lower bound
+/// for the length of a path between them if diagonal movements are allowed.
+static Fixed DiagonalDistance(int x0, int y0, int x1, int y1) {
+  int xDiff = std::abs(x1 - x0);
+  int yDiff = std::abs(y1 - y0);
+  int minDiff = std::min(xDiff, yDiff);
+  int maxDiff = std::max(xDiff, yDiff);
+  return minDiff * kFixedSqrt2 + (maxDiff - minDiff);
+}
+
+HierarchicalPathfindingGraph::HierarchicalPathfindingGraph(int mapWidth, int mapHeight)
+    : mapWidth(mapWidth),
+      mapHeight(mapHeight) {
+  clustersX = (mapWidth + kClusterSize - 1) / kClusterSize;
+  clustersY = (mapHeight + kClusterSize - 1) / kClusterSize;
+  clusters.resize(clustersX * clustersY);
+  
+  nodeIndexAtTile.resize(mapWidth * mapHeight, -1);
+  
+  localCost.resize(kClusterSize * kClusterSize);
+  
+  nodeGeneration.resize(mapWidth * mapHeight + 1, 0);
+  nodeCost.resize(mapWidth * mapHeight + 1);
+  nodeParent.resize(mapWidth * mapHeight + 1);
+}
+
+void HierarchicalPathfindingGraph::MarkAreaDirty(const QRect& tileArea) {
+  int minClusterX = std::max(0, tileArea.x() / kClusterSize);
+  int minClusterY = std::max(0, tileArea.y() / kClusterSize);
+  int maxClusterX = std::min(clustersX - 1, (tileArea.x() + tileArea.width() - 1) / kClusterSize);
+  int maxClusterY = std::min(clustersY - 1, (tileArea.y() + tileArea.height() - 1) / kClusterSize);
+  for (int clusterY = minClusterY; clusterY <= maxClusterY; ++ clusterY) {
+    for (int clusterX = minClusterX; clusterX <= maxClusterX; ++ clusterX) {
+      clusters[clusterY * clustersX + clusterX].dirty = true;
+      anyClusterDirty = true;
+    }
+  }
+}
+
+bool HierarchicalPathfindingGraph::FindPath(ServerMap* map, const QPoint& start, const QPoint& goal, const QRect& goalRect, std::vector<QPoint>* reverseWaypoints) {
+  reverseWaypoints->clear();
+  
+  // Only use the hierarchy if the start and goal are at least one cluster apart.
+  int startClusterX = start.x() / kClusterSize;
+  int startClusterY = start.y() / kClusterSize;
+  int goalClusterX = goal.x() / kClusterSize;
+  int goalClusterY = goal.y() / kClusterSize;
+  if (std::abs(goalClusterX - startClusterX) <= 1 &&
+      std::abs(goalClusterY - startClusterY) <= 1) {
+    return false;
+  }
+  
+  Update(map);
+  
+  // Start a new search. Notice that the state of all nodes gets invalidated by this.
+  ++ searchGeneration;
+  if (searchGeneration == 0) {
+    std::fill(nodeGeneration.begin(), nodeGeneration.end(), 0);
+    searchGeneration = 1;
+  }
+  openList.clear();
+  
+  const int goalNode = mapWidth * mapHeight;
+  auto relax = [&](int node, Fixed cost, int parent) {
+    if (nodeGeneration[node] == searchGeneration && nodeCost[node] <= cost) {
+      return;
+    }
+    nodeGeneration[node] = searchGeneration;
+    nodeCost[node] = cost;
+    nodeParent[node] = parent;
+    
+    Fixed heuristic = (node == goalNode) ? Fixed() : DiagonalDistance(node % mapWidth, node / mapWidth, goal.x(), goal.y());
+    openList.emplace_back(cost + heuristic, node);
+    std::push_heap(openList.begin(), openList.end(), std::greater<std::pair<Fixed, int>>());
+  };
+  
+  // Connect the start to the nodes of its cluster.
+  Cluster& startCluster = clusters[startClusterY * clustersX + startClusterX];
+  QRect startClusterRect = GetClusterRect(startClusterX, startClusterY);
+  ComputeLocalCosts(map, startClusterRect, start, QRect());
+  for (const Node& node : startCluster.nodes) {
+    Fixed cost = localCost[(node.tile / mapWidth - startClusterRect.y()) * kClusterSize + (node.tile % mapWidth - startClusterRect.x())];
+    if (cost < Fixed::Max()) {
+      relax(node.tile, cost, -1);
+    }
+  }
+  
+  // Determine the cost to reach the goal from the nodes of the goal's cluster.
+  // Since the costs are symmetric, this is done by searching from the goal.
+  int goalClusterIndex = goalClusterY * clustersX + goalClusterX;
+  QRect goalClusterRect = GetClusterRect(goalClusterX, goalClusterY);
+  ComputeLocalCosts(map, goalClusterRect, goal, goalRect);
+  const Cluster& goalCluster = clusters[goalClusterIndex];
+  std::vector<Fixed> goalCosts(goalCluster.nodes.size());
+  for (usize i = 0; i < goalCluster.nodes.size(); ++ i) {
+    int tile = goalCluster.nodes[i].tile;
+    goalCosts[i] = localCost[(tile / mapWidth - goalClusterRect.y()) * kClusterSize + (tile % mapWidth - goalClusterRect.x())];
+  }
+  
+  // Run A* on the abstract graph.
+  bool goalReached = false;
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), std::greater<std::pair<Fixed, int>>());
+    int currentNode = openList.back().second;
+    openList.pop_back();
+    
+    if (currentNode == goalNode) {
+      goalReached = true;
+      break;
+    }
+    
+    Fixed currentCost = nodeCost[currentNode];
+    int tileX = currentNode % mapWidth;
+    int tileY = currentNode / mapWidth;
+    int clusterIndex = GetClusterIndexOfTile(tileX, tileY);
+    const Cluster& cluster = clusters[clusterIndex];
+    int nodeIndex = nodeIndexAtTile[currentNode];
+    if (nodeIndex < 0) {
+      LOG(ERROR) << "Abstract pathfinding graph is inconsistent: a partner tile is not a node.";
+      continue;
+    }
+    const Node& node = cluster.nodes[nodeIndex];
+    
+    // Edges to the partner nodes in the neighboring clusters.
+    for (int i = 0; i < node.numPartners; ++ i) {
+      relax(node.partnerTiles[i], currentCost + 1, currentNode);
+    }
+    
+    // Edges to the other nodes in the same cluster.
+    usize numNodes = cluster.nodes.size();
+    for (usize other = 0; other < numNodes; ++ other) {
+      Fixed intraCost = cluster.intraCosts[nodeIndex * numNodes + other];
+      if (static_cast<int>(other) != nodeIndex && intraCost < Fixed::Max()) {
+        relax(cluster.nodes[other].tile, currentCost + intraCost, currentNode);
+      }
+    }
+    
+    // Edge to the goal.
+    if (clusterIndex == goalClusterIndex && goalCosts[nodeIndex] < Fixed::Max()) {
+      relax(goalNode, currentCost + goalCosts[nodeIndex], currentNode);
+    }
+  }
+  
+  if (!goalReached) {
+    return false;
+  }
+  
+  // Extract the waypoints. We only keep the nodes at which the path enters a cluster,
+  // i.e., we drop nodes that are directly followed by their partner in the next cluster.
+  int nextNode = goalNode;
+  int currentNode = nodeParent[goalNode];
+  while (currentNode >= 0) {
+    bool isClusterExit =
+        nextNode != goalNode &&
+        GetClusterIndexOfTile(currentNode % mapWidth, currentNode / mapWidth) !=
+            GetClusterIndexOfTile(nextNode % mapWidth, nextNode / mapWidth);
+    if (!isClusterExit) {
+      reverseWaypoints->push_back(QPoint(currentNode % mapWidth, currentNode / mapWidth));
+    }
+    
+    nextNode = currentNode;
+    currentNode = nodeParent[currentNode];
+  }
+  
+  return !reverseWaypoints->empty();
+}
+
+void HierarchicalPathfindingGraph::Update(ServerMap* map) {
+  if (!anyClusterDirty) {
+    return;
+  }
+  
+  std::vector<u8> needsRebuild(clusters.size(), 0);
+  for (int clusterY = 0; clusterY < clustersY; ++ clusterY) {
+    for (int clusterX = 0; clusterX < clustersX; ++ clusterX) {
+      if (!clusters[clusterY * clustersX + clusterX].dirty) {
+        continue;
+      }
+      
+      needsRebuild[clusterY * clustersX + clusterX] = 1;
+      if (clusterX > 0) { needsRebuild[clusterY * clustersX + clusterX - 1] = 1; }
+      if (clusterY > 0) { needsRebuild[(clusterY - 1) * clustersX + clusterX] = 1; }
+      if (clusterX < clustersX - 1) { needsRebuild[clusterY * clustersX + clusterX + 1] = 1; }
+      if (clusterY < clustersY - 1) { needsRebuild[(clusterY + 1) * clustersX + clusterX] = 1; }
+    }
+  }
+  
+  for (int clusterY = 0; clusterY < clustersY; ++ clusterY) {
+    for (int clusterX = 0; clusterX < clustersX; ++ clusterX) {
+      if (needsRebuild[clusterY * clustersX + clusterX]) {
+        RebuildCluster(map, clusterX, clusterY);
+      }
+    }
+  }
+  
+  anyClusterDirty = false;
+}
+
+void HierarchicalPathfindingGraph::RebuildCluster(ServerMap* map, int clusterX, int clusterY) {
+  Cluster& cluster = clusters[clusterY * clustersX + clusterX];
+  
+  // Remove the old nodes.
+  for (const Node& node : cluster.nodes) {
+    nodeIndexAtTile[node.tile] = -1;
+  }
+  cluster.nodes.clear();
+  
+  // Determine the new nodes.
+  if (clusterX > 0) { AddBorderNodes(map, clusterX, clusterY, -1, 0, &cluster); }
+  if (clusterY > 0) { AddBorderNodes(map, clusterX, clusterY, 0, -1, &cluster); }
+  if (clusterX < clustersX - 1) { AddBorderNodes(map, clusterX, clusterY, 1, 0, &cluster); }
+  if (clusterY < clustersY - 1) { AddBorderNodes(map, clusterX, clusterY, 0, 1, &cluster); }
+  
+  // Compute the intra-cluster edges.
+  QRect clusterRect = GetClusterRect(clusterX, clusterY);
+  usize numNodes = cluster.nodes.size();
+  cluster.intraCosts.resize(numNodes * numNodes);
+  for (usize i = 0; i < numNodes; ++ i) {
+    int tile = cluster.nodes[i].tile;
+    ComputeLocalCosts(map, clusterRect, QPoint(tile % mapWidth, tile / mapWidth), QRect());
+    
+    for (usize j = 0; j < numNodes; ++ j) {
+      int otherTile = cluster.nodes[j].tile;
+      cluster.intraCosts[i * numNodes + j] =
+          localCost[(otherTile / mapWidth - clusterRect.y()) * kClusterSize + (otherTile % mapWidth - clusterRect.x())];
+    }
+  }
+  
+  cluster.dirty = false;
+}
+
+void HierarchicalPathfindingGraph::AddBorderNodes(ServerMap* map, int clusterX, int clusterY, int dx, int dy, Cluster* cluster) {
+  QRect clusterRect = GetClusterRect(clusterX, clusterY);
+  
+  // Determine the row / column of tiles within this cluster that is next to the border,
+  // and the direction along the border.
+  QPoint borderStart;
+  QPoint alongBorder;
+  int borderLength;
+  if (dx != 0) {
+    borderStart = QPoint((dx > 0) ? (clusterRect.x() + clusterRect.width() - 1) : clusterRect.x(), clusterRect.y());
+    alongBorder = QPoint(0, 1);
+    borderLength = clusterRect.height();
+  } else {
+    borderStart = QPoint(clusterRect.x(), (dy > 0) ? (clusterRect.y() + clusterRect.height() - 1) : clusterRect.y());
+    alongBorder = QPoint(1, 0);
+    borderLength = clusterRect.width();
+  }
+  
+  auto addNode = [&](int positionOnBorder) {
+    QPoint tile = borderStart + alongBorder * positionOnBorder;
+    int tileIndex = tile.y() * mapWidth + tile.x();
+    int partnerTileIndex = (tile.y() + dy) * mapWidth + (tile.x() + dx);
+    
+    int& nodeIndex = nodeIndexAtTile[tileIndex];
+    if (nodeIndex < 0) {
+      nodeIndex = cluster->nodes.size();
+      cluster->nodes.emplace_back();
+      Node& newNode = cluster->nodes.back();
+      newNode.tile = tileIndex;
+      newNode.numPartners = 0;
+    }
+    Node& node = cluster->nodes[nodeIndex];
+    if (node.numPartners < 2) {
+      node.partnerTiles[node.numPartners] = partnerTileIndex;
+      ++ node.numPartners;
+    }
+  };
+  
+  // Find the maximal runs of positions where the tiles on both sides of the border are free.
+  // Notice that this must be symmetric, such that the neighboring cluster determines
+  // the same entrances from its side.
+  int runStart = -1;
+  for (int position = 0; position <= borderLength; ++ position) {
+    bool free = false;
+    if (position < borderLength) {
+      QPoint tile = borderStart + alongBorder * position;
+      free = !map->occupiedForUnitsAt(tile.x(), tile.y()) &&
+             !map->occupiedForUnitsAt(tile.x() + dx, tile.y() + dy);
+    }
+    
+    if (free && runStart < 0) {
+      runStart = position;
+    } else if (!free && runStart >= 0) {
+      int runEnd = position - 1;
+      if (runEnd - runStart + 1 >= kMinWideEntranceLength) {
+        addNode(runStart);
+        addNode(runEnd);
+      } else {
+        addNode((runStart + runEnd) / 2);
+      }
+      runStart = -1;
+    }
+  }
+}
+
+void HierarchicalPathfindingGraph::ComputeLocalCosts(ServerMap* map, const QRect& clusterRect, const QPoint& source, const QRect& openRect) {
+  std::fill(localCost.begin(), localCost.end(), Fixed::Max());
+  localOpenList.clear();
+  
+  auto isFree = [&](int x, int y) {
+    return !map->occupiedForUnitsAt(x, y) || openRect.contains(x, y, false);
+  };
+  
+  int minX = clusterRect.x();
+  int minY = clusterRect.y();
+  int maxX = clusterRect.x() + clusterRect.width() - 1;
+  int maxY = clusterRect.y() + clusterRect.height() - 1;
+  
+  int sourceIndex = (source.y() - minY) * kClusterSize + (source.x() - minX);
+  localCost[sourceIndex] = 0;
+  localOpenList.emplace_back(Fixed(), sourceIndex);
+  
+  while (!localOpenList.empty()) {
+    std::pop_heap(localOpenList.begin(), localOpenList.end(), std::greater<std::pair<Fixed, int>>());
+    Fixed currentCost = localOpenList.back().first;
+    int currentIndex = localOpenList.back().second;
+    localOpenList.pop_back();
+    
+    if (currentCost > localCost[currentIndex]) {
+      // Outdated entry.
+      continue;
+    }
+    
+    int x = minX + currentIndex % kClusterSize;
+    int y = minY + currentIndex / kClusterSize;
+    
+    for (int dy = -1; dy <= 1; ++ dy) {
+      for (int dx = -1; dx <= 1; ++ dx) {
+        int nextX = x + dx;
+        int nextY = y + dy;
+        if ((dx == 0 && dy == 0) ||
+            nextX < minX || nextY < minY ||
+            nextX > maxX || nextY > maxY ||
+            !isFree(nextX, nextY)) {
+          continue;
+        }
+        
+        // Diagonal movements require the two adjacent tiles to be free
+        // (as in PlanUnitPath()).
+        bool isDiagonal = dx != 0 && dy != 0;
+        if (isDiagonal && (!isFree(nextX, y) || !isFree(x, nextY))) {
+          continue;
+        }
+        
+        Fixed newCost = currentCost + (isDiagonal ? kFixedSqrt2 : Fixed(1));
+        int nextIndex = (nextY - minY) * kClusterSize + (nextX - minX);
+        if (newCost < localCost[nextIndex]) {
+          localCost[nextIndex] = newCost;
+          localOpenList.emplace_back(newCost, nextIndex);
+          std::push_heap(localOpenList.begin(), localOpenList.end(), std::greater<std::pair<Fixed, int>>());
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,132 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <QPoint>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+
+class ServerMap;
+
+/// Abstract graph over the map's unit occupancy grid for hierarchical pathfinding
+/// (in the style of HPA*). The map is divided into square clusters of tiles.
+/// Along each border between two neighboring clusters, the free passages ("entrances")
+/// are determined, and each entrance contributes a graph node on both sides of the border.
+/// Nodes within the same cluster are connected by edges whose cost is the length of
+/// the shortest path between them within the cluster.
+///
+/// Long paths are planned on this graph, yielding a sequence of waypoints (one per
+/// traversed cluster), which PlanUnitPath() refines lazily with the tile-level A*.
+///
+/// When the occupancy changes (buildings being placed or destroyed), the affected
+/// clusters are marked as dirty and get rebuilt before the next query.
+class HierarchicalPathfindingGraph {
+ public:
+  /// Side length of the clusters in tiles.
+  static constexpr int kClusterSize = 10;
+  
+  /// Creates a graph for a map of the given size. Initially, all clusters are dirty.
+  HierarchicalPathfindingGraph(int mapWidth, int mapHeight);
+  
+  /// Marks all clusters that overlap the given tile area as dirty.
+  /// This must be called whenever the unit occupancy of these tiles changes.
+  void MarkAreaDirty(const QRect& tileArea);
+  
+  /// Attempts to plan a path on the abstract graph from the start tile to the goal tile.
+  /// The tiles within goalRect are treated as free (to be able to plan a path into
+  /// a target building). Returns true if a hierarchical path was found. In this case,
+  /// reverseWaypoints contains the tiles at which the path enters each further cluster
+  /// (in reverse order, i.e., the first entry is the last waypoint). Returns false
+  /// if the start and goal are close to each other (such that using the hierarchy is not
+  /// beneficial), or if no path was found. The caller should use a direct tile-level
+  /// search in this case.
+  bool FindPath(ServerMap* map, const QPoint& start, const QPoint& goal, const QRect& goalRect, std::vector<QPoint>* reverseWaypoints);
+  
+ private:
+  struct Node {
+    /// Tile index (y * mapWidth + x) of this node.
+    int tile;
+    
+    /// Tile indices of the nodes on the other side of the cluster borders that
+    /// this node is connected to. A node in a cluster corner may have two partners.
+    int partnerTiles[2];
+    int numPartners;
+  };
+  
+  struct Cluster {
+    std::vector<Node> nodes;
+    
+    /// Costs of the shortest paths within the cluster between all pairs of nodes,
+    /// indexed by [i * nodes.size() + j]. Fixed::Max() if there is no path.
+    std::vector<Fixed> intraCosts;
+    
+    bool dirty = true;
+  };
+  
+  /// Rebuilds all dirty clusters. Since the entrances on a border belong to both
+  /// clusters next to it, this also rebuilds the direct neighbors of dirty clusters.
+  void Update(ServerMap* map);
+  
+  /// Rebuilds the nodes and intra-cluster edges of the given cluster.
+  void RebuildCluster(ServerMap* map, int clusterX, int clusterY);
+  
+  /// Determines the entrances on the border between the cluster (clusterX, clusterY)
+  /// and its neighbor in direction (dx, dy), which must be (1, 0), (-1, 0), (0, 1), or (0, -1).
+  /// Adds the nodes on the side of the cluster (clusterX, clusterY) to the cluster.
+  void AddBorderNodes(ServerMap* map, int clusterX, int clusterY, int dx, int dy, Cluster* cluster);
+  
+  /// Runs Dijkstra's algorithm from the given source tile, restricted to the given
+  /// cluster rectangle. Tiles in openRect are treated as free. Afterwards, localCost
+  /// contains the cost to reach each tile of the rectangle (indexed relative to
+  /// the rectangle's top-left corner), or Fixed::Max() if the tile cannot be reached.
+  void ComputeLocalCosts(ServerMap* map, const QRect& clusterRect, const QPoint& source, const QRect& openRect);
+  
+  inline QRect GetClusterRect(int clusterX, int clusterY) const {
+    return QRect(
+        clusterX * kClusterSize,
+        clusterY * kClusterSize,
+        std::min(kClusterSize, mapWidth - clusterX * kClusterSize),
+        std::min(kClusterSize, mapHeight - clusterY * kClusterSize));
+  }
+  
+  inline int GetClusterIndexOfTile(int tileX, int tileY) const {
+    return (tileY / kClusterSize) * clustersX + (tileX / kClusterSize);
+  }
+  
+  
+  int mapWidth;
+  int mapHeight;
+  
+  /// Number of clusters in x and y direction.
+  int clustersX;
+  int clustersY;
+  
+  /// All clusters, indexed by [clusterY * clustersX + clusterX].
+  std::vector<Cluster> clusters;
+  
+  /// Whether any cluster is dirty.
+  bool anyClusterDirty = true;
+  
+  /// For each tile, the index of the node on this tile within its cluster's nodes
+  /// list, or -1 if the tile is not a node.
+  std::vector<int> nodeIndexAtTile;
+  
+  /// Buffers for ComputeLocalCosts().
+  std::vector<Fixed> localCost;
+  std::vector<std::pair<Fixed, int>> localOpenList;
+  
+  /// Generation-stamped node state for the abstract search in FindPath(),
+  /// indexed by tile index. Index mapWidth * mapHeight is used for the goal.
+  u32 searchGeneration = 0;
+  std::vector<u32> nodeGeneration;
+  std::vector<Fixed> nodeCost;
+  std::vector<int> nodeParent;
+  std::vector<std::pair<Fixed, int>> openList;
+};
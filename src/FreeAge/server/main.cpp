@@ -9,6 +9,7 @@
 
 #include <QApplication>
 #include <QByteArray>
+#include <QDir>
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QThread>
@@ -18,6 +19,7 @@
 #include "FreeAge/common/messages.hpp"
 #include "FreeAge/common/game_data.hpp"
 #include "FreeAge/server/game.hpp"
+#include "FreeAge/server/match_server.hpp"
 #include "FreeAge/server/match_setup.hpp"
 #include "FreeAge/server/settings.hpp"
 
@@ -52,14 +54,47 @@ int main(int argc, char** argv) {
   // Parse command line arguments.
   ServerSettings settings;
   settings.serverStartTime = Clock::now();
-  if (argc != 2) {
-    LOG(INFO) << "Usage: FreeAgeServer <host_token>";
+  int firstArg = 1;
+  if (argc >= 3 && argv[1] == std::string("--record-replays")) {
+    settings.replayDirectory = QString::fromLocal8Bit(argv[2]);
+    if (!QDir().mkpath(settings.replayDirectory)) {
+      LOG(ERROR) << "Failed to create the replay directory: " << argv[2];
+      return 1;
+    }
+    firstArg = 3;
+  }
+  int argCount = argc - firstArg;
+  if (argCount != 1 && !(argCount == 2 && argv[firstArg] == std::string("--multi-match"))) {
+    LOG(INFO) << "Usage: FreeAgeServer [--record-replays <directory>] <host_token>";
+    LOG(INFO) << "       FreeAgeServer [--record-replays <directory>] --multi-match <max_match_count>";
     return 1;
   }
-  if (argv[1] == std::string("--no-token")) {
+  
+  if (argCount == 2) {
+    // Host multiple matches in this process. They share the game data loaded above.
+    int maxMatchCount = atoi(argv[firstArg + 1]);
+    if (maxMatchCount < 1) {
+      LOG(ERROR) << "The maximum match count must be positive.";
+      return 1;
+    }
+    
+    std::shared_ptr<QTcpServer> server(new QTcpServer());
+    if (!server->listen(QHostAddress::Any, serverPort)) {
+      LOG(ERROR) << "Failed to start listening for connections.";
+      return 1;
+    }
+    
+    MatchServer matchServer(maxMatchCount, settings.replayDirectory);
+    matchServer.Run(server.get());
+    
+    LOG(INFO) << "Server: Exit";
+    return 0;
+  }
+  
+  if (argv[firstArg] == std::string("--no-token")) {
     settings.hostToken = "aaaaaa";
   } else {
-    settings.hostToken = argv[1];
+    settings.hostToken = argv[firstArg];
   }
   if (settings.hostToken.size() != hostTokenLength) {
     LOG(ERROR) << "The provided host token has an incorrect length. Required length: " << hostTokenLength << ", actual length: " << settings.hostToken.size();
@@ -83,57 +118,21 @@ int main(int argc, char** argv) {
   // The match has been started.
   LOG(INFO) << "Server: Match starting ...";
   
-  // Stop listening for new connections.
-  server->close();
-  
-  // Delete any pending connections.
+  // Delete any pending connections. The server keeps listening for connections
+  // of players that reconnect to the game after losing their connection.
   while (server->hasPendingConnections()) {
     delete server->nextPendingConnection();
   }
+  server->resumeAccepting();
   
-  // Drop all players in non-joined state, and convert others to in-game players.
+  // Convert the joined players to in-game players and notify them about the game start.
   std::vector<std::shared_ptr<PlayerInGame>> playersInGame;
-  for (const auto& player : playersInMatch) {
-    if (player->state == PlayerInMatch::State::Joined) {
-      std::shared_ptr<PlayerInGame> newPlayer(new PlayerInGame());
-      
-      newPlayer->index = playersInGame.size();
-      newPlayer->socket = player->socket;
-      newPlayer->unparsedBuffer = player->unparsedBuffer;
-      newPlayer->name = player->name;
-      newPlayer->playerColorIndex = player->playerColorIndex;
-      newPlayer->lastPingTime = player->lastPingTime;
-      
-      // TODO: Set the starting resources according to the map
-      newPlayer->resources.wood() = 200;
-      newPlayer->resources.food() = 200;
-      newPlayer->resources.gold() = 100;
-      newPlayer->resources.stone() = 200;
-      
-      newPlayer->lastResources = newPlayer->resources;
-      
-      playersInGame.emplace_back(newPlayer);
-    } else {
-      delete player->socket;
-    }
-  }
-  
-  // Notify all clients about the game start.
-  QByteArray msg = CreateStartGameBroadcastMessage();
-  for (const auto& player : playersInGame) {
-    player->socket->write(msg);
-  }
-  
-  // Reparent all client connections and delete the QTcpServer.
-  for (const auto& player : playersInGame) {
-    player->socket->setParent(nullptr);
-  }
-  server.reset();
+  CreatePlayersInGame(playersInMatch, &playersInGame);
   
   // Main loop for game loading and game play state
   LOG(INFO) << "Server: Entering game loop";
   Game game(&settings);
-  game.RunGameLoop(&playersInGame);
+  game.RunGameLoop(&playersInGame, server.get());
   
   // Clean up: delete the player sockets.
   for (const auto& player : playersInGame) {
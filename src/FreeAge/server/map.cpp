@@ -17,12 +17,22 @@
 
 ServerMap::ServerMap(int width, int height)
     : width(width),
-      height(height) {
+      height(height),
+      pathfindingGraph(width, height) {
   maxElevation = 7;  // TODO: Make configurable
   elevation = new int[(width + 1) * (height + 1)];
   
   occupiedForUnits = new bool[width * height];
-  occupiedForBuildings = new bool[width * height];
+  occupiedForBuildings.Resize(width, height);
+  unitFootprints.Resize(width, height);
+  unitFootprintCount.assign(width * height, 0);
+  
+  unitsOnTile.resize(width * height);
+  
+  maxUnitRadius = 0;
+  for (int type = 0; type < static_cast<int>(UnitType::NumUnits); ++ type) {
+    maxUnitRadius = Max(maxUnitRadius, GetUnitRadiusFixed(static_cast<UnitType>(type)));
+  }
   
   // Initialize the elevation to zero everywhere, and the occupancy to free.
   for (int y = 0; y <= height; ++ y) {
@@ -30,25 +40,20 @@ ServerMap::ServerMap(int width, int height)
       elevationAt(x, y) = 0;
       if (x < width && y < height) {
         occupiedForUnitsAt(x, y) = false;
-        occupiedForBuildingsAt(x, y) = false;
       }
     }
   }
 }
 
 ServerMap::~ServerMap() {
-  for (const auto& item : objects) {
-    delete item.second;
-  }
   delete[] elevation;
   delete[] occupiedForUnits;
-  delete[] occupiedForBuildings;
 }
 
 
 
 void ServerMap::GenerateRandomMap(int playerCount, int seed) {
-  srand(seed);
+  SeedRandomEngine(seed);
   
   // Generate town centers. They are placed along a rectangle that is inset from the map edges.
   constexpr int kDistanceToMapBorder = 12;
@@ -65,7 +70,7 @@ void ServerMap::GenerateRandomMap(int playerCount, int seed) {
   for (int player = 0; player < playerCount; ++ player) {
     int positionOnRectangle =
         ((player * rectangleEdgeLength / playerCount) +
-         (rand() % (2 * kPositionOnRectangleVariance + 1)) - kPositionOnRectangleVariance) % rectangleEdgeLength;
+         RandomInt(2 * kPositionOnRectangleVariance + 1) - kPositionOnRectangleVariance) % rectangleEdgeLength;
     
     if (positionOnRectangle < rectangleWidth) {
       townCenterLocations[player] = QPoint(kDistanceToMapBorder + positionOnRectangle, kDistanceToMapBorder);
@@ -81,8 +86,8 @@ void ServerMap::GenerateRandomMap(int playerCount, int seed) {
     }
     
     townCenterLocations[player] +=
-        QPoint((rand() % (2 * kPositionVariance + 1)) - kPositionVariance,
-               (rand() % (2 * kPositionVariance + 1)) - kPositionVariance);
+        QPoint(RandomInt(2 * kPositionVariance + 1) - kPositionVariance,
+               RandomInt(2 * kPositionVariance + 1) - kPositionVariance);
     
     townCenterCenters[player] = QPointF(
         townCenterLocations[player].x() + 0.5f * townCenterSize.width(),
@@ -94,8 +99,8 @@ void ServerMap::GenerateRandomMap(int playerCount, int seed) {
   auto getRandomLocation = [&](float minDistanceToTCs, int* tileX, int* tileY) {
     bool ok;
     for (int attempt = 0; attempt < 1000; ++ attempt) {
-      *tileX = rand() % width;
-      *tileY = rand() % height;
+      *tileX = RandomInt(width);
+      *tileY = RandomInt(height);
       ok = true;
       for (int i = 0; i < playerCount; ++ i) {
         float distanceX = townCenterCenters[i].x() - *tileX;
@@ -136,7 +141,7 @@ retryForest:  // TODO: Ugly implementation, improve this
       
       // Place the forest.
       // TODO: For now, we just place very simple circles.
-      int forestRadius = 4 + rand() % 2;
+      int forestRadius = 4 + RandomInt(2);
       
       int minX = std::max(0, tileX - forestRadius);
       int maxX = std::min(width - 1, tileX + forestRadius);
@@ -255,11 +260,7 @@ retryGold:  // TODO: Ugly implementation, improve this
       
       while (true) {
         // TODO: Prevent this from potentially being an endless loop
-        float radius = baseRadius + 3 * ((rand() % 10000) / 10000.f);
-        float angle = 2 * M_PI * ((rand() % 10000) / 10000.f);
-        QPoint spawnLoc(
-            townCenterCenters[player].x() + radius * sin(angle),
-            townCenterCenters[player].y() + radius * cos(angle));
+        QPoint spawnLoc = GetRandomPointAround(FixedPoint::FromQPointF(townCenterCenters[player]), Fixed(baseRadius), Fixed(3)).GetTile();
         if (spawnLoc.x() < 1 || spawnLoc.y() < 1 ||
             spawnLoc.x() >= width - 1 || spawnLoc.y() >= height - 1 ||
             occupiedForBuildingsAt(spawnLoc.x(), spawnLoc.y()) ||
@@ -283,7 +284,7 @@ retryGold:  // TODO: Ugly implementation, improve this
     int tileX;
     int tileY;
     if (getRandomLocation(kHillMinDistanceFromTCs, &tileX, &tileY)) {
-      int elevationValue = rand() % maxElevation;
+      int elevationValue = RandomInt(maxElevation);
       PlaceElevation(tileX, tileY, elevationValue);
     }
   }
@@ -291,18 +292,13 @@ retryGold:  // TODO: Ugly implementation, improve this
   // Generate villagers
   for (int player = 0; player < playerCount; ++ player) {
     for (int villager = 0; villager < 3; ++ villager) {
-      ServerUnit* newUnit = new ServerUnit(player, (rand() % 2 == 0) ? UnitType::FemaleVillager : UnitType::MaleVillager, QPointF(-1, -1));
+      UnitType villagerType = (RandomInt(2) == 0) ? UnitType::FemaleVillager : UnitType::MaleVillager;
       
       while (true) {
         // TODO: Prevent this from potentially being an endless loop
-        float radius = 4 + 2 * ((rand() % 10000) / 10000.f);
-        float angle = 2 * M_PI * ((rand() % 10000) / 10000.f);
-        QPointF spawnLoc(
-            townCenterCenters[player].x() + radius * sin(angle),
-            townCenterCenters[player].y() + radius * cos(angle));
-        if (!DoesUnitCollide(newUnit, spawnLoc)) {
-          newUnit->SetMapCoord(spawnLoc);
-          AddUnit(newUnit);
+        FixedPoint spawnLoc = GetRandomPointAround(FixedPoint::FromQPointF(townCenterCenters[player]), Fixed(4), Fixed(2));
+        if (!DoesUnitCollide(villagerType, spawnLoc)) {
+          AddUnit(player, villagerType, spawnLoc);
           break;
         }
       }
@@ -311,24 +307,25 @@ retryGold:  // TODO: Ugly implementation, improve this
   
   // Generate scouts
   for (int player = 0; player < playerCount; ++ player) {
-    ServerUnit* newUnit = new ServerUnit(player, UnitType::Scout, QPointF(-1, -1));
-    
     while (true) {
       // TODO: Prevent this from potentially being an endless loop
-      float radius = 6 + 2 * ((rand() % 10000) / 10000.f);
-      float angle = 2 * M_PI * ((rand() % 10000) / 10000.f);
-      QPointF spawnLoc(
-          townCenterCenters[player].x() + radius * sin(angle),
-          townCenterCenters[player].y() + radius * cos(angle));
-      if (!DoesUnitCollide(newUnit, spawnLoc)) {
-        newUnit->SetMapCoord(spawnLoc);
-        AddUnit(newUnit);
+      FixedPoint spawnLoc = GetRandomPointAround(FixedPoint::FromQPointF(townCenterCenters[player]), Fixed(6), Fixed(2));
+      if (!DoesUnitCollide(UnitType::Scout, spawnLoc)) {
+        AddUnit(player, UnitType::Scout, spawnLoc);
         break;
       }
     }
   }
 }
 
+FixedPoint ServerMap::GetRandomPointAround(const FixedPoint& center, const Fixed& minRadius, const Fixed& radiusRange) {
+  Fixed radius = minRadius + radiusRange * Fixed::FromFraction(RandomInt(10000), 10000);
+  Fixed sine;
+  Fixed cosine;
+  SinCos(Fixed::FromFraction(RandomInt(10000), 10000), &sine, &cosine);
+  return FixedPoint(center.x + radius * sine, center.y + radius * cosine);
+}
+
 void ServerMap::PlaceElevation(int tileX, int tileY, int elevationValue) {
   int currentMinElev = elevationValue;
   int currentMaxElev = elevationValue;
@@ -389,14 +386,14 @@ void ServerMap::PlaceElevation(int tileX, int tileY, int elevationValue) {
   }
 }
 
-bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, ServerUnit** collidingUnit) {
-  float radius = GetUnitRadius(unit->GetType());
-  
-  // Test collision with the map bounds, accounting for NaNs with the negation
-  if (!(mapCoord.x() >= radius &&
-        mapCoord.y() >= radius &&
-        mapCoord.x() < width - radius &&
-        mapCoord.y() < height - radius)) {
+bool ServerMap::DoesUnitCollide(UnitType type, const FixedPoint& mapCoord, ServerUnit* ignoredUnit, ServerUnit** collidingUnit) {
+  Fixed radius = GetUnitRadiusFixed(type);
+  
+  // Test collision with the map bounds
+  if (!(mapCoord.x >= radius &&
+        mapCoord.y >= radius &&
+        mapCoord.x < width - radius &&
+        mapCoord.y < height - radius)) {
     if (collidingUnit) {
       *collidingUnit = nullptr;
     }
@@ -404,11 +401,11 @@ bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, Serve
   }
   
   // Test collision with occupied space
-  float squaredRadius = radius * radius;
-  int minTileX = std::max<int>(0, mapCoord.x() - radius);
-  int minTileY = std::max<int>(0, mapCoord.y() - radius);
-  int maxTileX = std::min<int>(width - 1, mapCoord.x() + radius);
-  int maxTileY = std::min<int>(height - 1, mapCoord.y() + radius);
+  Fixed squaredRadius = radius * radius;
+  int minTileX = std::max<int>(0, (mapCoord.x - radius).Floor());
+  int minTileY = std::max<int>(0, (mapCoord.y - radius).Floor());
+  int maxTileX = std::min<int>(width - 1, (mapCoord.x + radius).Floor());
+  int maxTileY = std::min<int>(height - 1, (mapCoord.y + radius).Floor());
   for (int tileY = minTileY; tileY <= maxTileY; ++ tileY) {
     for (int tileX = minTileX; tileX <= maxTileX; ++ tileX) {
       if (!occupiedForUnitsAt(tileX, tileY)) {
@@ -416,13 +413,11 @@ bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, Serve
       }
       
       // Compute the point within the tile that is closest to the unit
-      QPointF closestPointInTile(
-          std::max<float>(tileX, std::min<float>(tileX + 1, mapCoord.x())),
-          std::max<float>(tileY, std::min<float>(tileY + 1, mapCoord.y())));
+      FixedPoint closestPointInTile(
+          Max(tileX, Min(tileX + 1, mapCoord.x)),
+          Max(tileY, Min(tileY + 1, mapCoord.y)));
       
-      QPointF offset = mapCoord - closestPointInTile;
-      float squaredDistance = offset.x() * offset.x() + offset.y() * offset.y();
-      if (squaredDistance < squaredRadius) {
+      if (SquaredDistance(mapCoord, closestPointInTile) < squaredRadius) {
         if (collidingUnit) {
           *collidingUnit = nullptr;
         }
@@ -431,49 +426,49 @@ bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, Serve
     }
   }
   
-  // Test collision with other units
-  // TODO: Use some spatial access structure to reduce the number of tests.
-  //       Probably store a list of units on each map tile.
-  for (const auto& item : objects) {
-    ServerObject* object = item.second;
-    if (object->isUnit() && object != unit) {
-      ServerUnit* otherUnit = AsUnit(object);
-      
-      float otherRadius = GetUnitRadius(otherUnit->GetType());
-      QPointF offset = otherUnit->GetMapCoord() - mapCoord;
-      float squaredDistance = offset.x() * offset.x() + offset.y() * offset.y();
-      if (squaredDistance < (radius + otherRadius) * (radius + otherRadius)) {
-        if (collidingUnit) {
-          *collidingUnit = otherUnit;
+  // Test collision with other units.
+  // Only units within the tiles that are closer than (radius + maxUnitRadius) can collide.
+  Fixed searchRadius = radius + maxUnitRadius;
+  ServerUnit* foundCollidingUnit = nullptr;
+  ForEachUnitInArea(
+      FixedPoint(mapCoord.x - searchRadius, mapCoord.y - searchRadius),
+      FixedPoint(mapCoord.x + searchRadius, mapCoord.y + searchRadius),
+      [&](ServerUnit* otherUnit) {
+        if (otherUnit == ignoredUnit) {
+          return true;
+        }
+        
+        Fixed otherRadius = GetUnitRadiusFixed(otherUnit->GetType());
+        if (SquaredDistance(otherUnit->GetMapCoord(), mapCoord) < (radius + otherRadius) * (radius + otherRadius)) {
+          foundCollidingUnit = otherUnit;
+          return false;
         }
         return true;
-      }
+      });
+  if (foundCollidingUnit) {
+    if (collidingUnit) {
+      *collidingUnit = foundCollidingUnit;
     }
+    return true;
   }
   
   return false;
 }
 
-ServerBuilding* ServerMap::AddBuilding(int player, BuildingType type, const QPoint& baseTile, float buildPercentage, u32* id, bool addOccupancy) {
-  ServerBuilding* newBuilding = new ServerBuilding(player, type, baseTile, buildPercentage);
-  int newId = AddBuilding(newBuilding, addOccupancy);
+ServerBuilding* ServerMap::AddBuilding(int player, BuildingType type, const QPoint& baseTile, Fixed buildPercentage, u32* id, bool addOccupancy) {
+  // Create the building in the object store
+  u32 newId;
+  ServerBuilding* newBuilding = objects.AddBuilding(player, type, baseTile, buildPercentage, &newId);
   if (id) {
     *id = newId;
   }
-  return newBuilding;
-}
-
-u32 ServerMap::AddBuilding(ServerBuilding* newBuilding, bool addOccupancy) {
-  // Insert into objects map
-  objects.insert(std::make_pair(nextObjectID, newBuilding));
-  ++ nextObjectID;
   
   // Mark the occupied tiles as such
   if (addOccupancy) {
     AddBuildingOccupancy(newBuilding);
   }
   
-  return nextObjectID - 1;
+  return newBuilding;
 }
 
 void ServerMap::AddBuildingOccupancy(ServerBuilding* building) {
@@ -484,36 +479,114 @@ void ServerMap::RemoveBuildingOccupancy(ServerBuilding* building) {
   SetBuildingOccupancy(building, false);
 }
 
-ServerUnit* ServerMap::AddUnit(int player, UnitType type, const QPointF& position, u32* id) {
-  ServerUnit* newUnit = new ServerUnit(player, type, position);
-  u32 newId = AddUnit(newUnit);
+ServerUnit* ServerMap::AddUnit(int player, UnitType type, const FixedPoint& position, u32* id) {
+  u32 newId;
+  ServerUnit* newUnit = objects.AddUnit(player, type, position, &newId);
   if (id) {
     *id = newId;
   }
+  
+  AddUnitToTile(newUnit, GetUnitTileIndex(newUnit->GetMapCoord()));
+  ChangeUnitFootprint(GetUnitFootprint(newUnit, newUnit->GetMapCoord()), 1);
+  
   return newUnit;
 }
 
-u32 ServerMap::AddUnit(ServerUnit* newUnit) {
-  objects.insert(std::make_pair(nextObjectID, newUnit));
-  ++ nextObjectID;
-  return nextObjectID - 1;
+void ServerMap::SetUnitMapCoord(ServerUnit* unit, const FixedPoint& mapCoord) {
+  int oldTileIndex = GetUnitTileIndex(unit->GetMapCoord());
+  int newTileIndex = GetUnitTileIndex(mapCoord);
+  QRect oldFootprint = GetUnitFootprint(unit, unit->GetMapCoord());
+  QRect newFootprint = GetUnitFootprint(unit, mapCoord);
+  
+  unit->SetMapCoord(mapCoord);
+  
+  if (oldTileIndex != newTileIndex) {
+    RemoveUnitFromTile(unit, oldTileIndex);
+    AddUnitToTile(unit, newTileIndex);
+  }
+  if (oldFootprint != newFootprint) {
+    ChangeUnitFootprint(oldFootprint, -1);
+    ChangeUnitFootprint(newFootprint, 1);
+  }
+}
+
+void ServerMap::RemoveObject(u32 objectId) {
+  ServerObject* object = objects.Find(objectId);
+  if (!object) {
+    LOG(ERROR) << "RemoveObject() called for an object ID that does not exist: " << objectId;
+    return;
+  }
+  
+  if (object->isUnit()) {
+    ServerUnit* unit = AsUnit(object);
+    RemoveUnitFromTile(unit, GetUnitTileIndex(unit->GetMapCoord()));
+    ChangeUnitFootprint(GetUnitFootprint(unit, unit->GetMapCoord()), -1);
+  }
+  
+  objects.Remove(objectId);
+}
+
+void ServerMap::AddUnitToTile(ServerUnit* unit, int tileIndex) {
+  unitsOnTile[tileIndex].push_back(unit);
+}
+
+void ServerMap::RemoveUnitFromTile(ServerUnit* unit, int tileIndex) {
+  std::vector<ServerUnit*>& tileUnits = unitsOnTile[tileIndex];
+  for (usize i = 0; i < tileUnits.size(); ++ i) {
+    if (tileUnits[i] == unit) {
+      tileUnits[i] = tileUnits.back();
+      tileUnits.pop_back();
+      return;
+    }
+  }
+  LOG(ERROR) << "RemoveUnitFromTile(): Did not find the unit in the tile's unit list.";
+}
+
+QRect ServerMap::GetUnitFootprint(ServerUnit* unit, const FixedPoint& mapCoord) const {
+  Fixed radius = GetUnitRadiusFixed(unit->GetType());
+  QRect footprint(
+      QPoint((mapCoord.x - radius).Floor(), (mapCoord.y - radius).Floor()),
+      QPoint((mapCoord.x + radius).Floor(), (mapCoord.y + radius).Floor()));
+  
+  // Units that have not been placed yet are outside of the map and do not have a footprint.
+  return footprint.intersected(QRect(0, 0, width, height));
+}
+
+void ServerMap::ChangeUnitFootprint(const QRect& footprint, int change) {
+  for (int y = footprint.top(); y <= footprint.bottom(); ++ y) {
+    for (int x = footprint.left(); x <= footprint.right(); ++ x) {
+      u16& count = unitFootprintCount[y * width + x];
+      count += change;
+      if (count == 0 || (change > 0 && count == 1)) {
+        unitFootprints.Set(x, y, count > 0);
+      }
+    }
+  }
+}
+
+std::shared_ptr<const OccupancySnapshot> ServerMap::GetOccupancySnapshot() {
+  if (!occupancySnapshot) {
+    std::shared_ptr<OccupancySnapshot> snapshot(new OccupancySnapshot());
+    snapshot->width = width;
+    snapshot->height = height;
+    snapshot->occupiedForUnits.assign(occupiedForUnits, occupiedForUnits + width * height);
+    occupancySnapshot = snapshot;
+  }
+  return occupancySnapshot;
 }
 
 void ServerMap::SetBuildingOccupancy(ServerBuilding* building, bool occupied) {
-  const QPoint& baseTile = building->GetBaseTile();
+  QPoint baseTile = building->GetBaseTile();
   QRect occupancyRect = GetBuildingOccupancy(building->GetType());
+  occupancySnapshot.reset();
+  pathfindingGraph.MarkAreaDirty(QRect(baseTile.x() + occupancyRect.x(), baseTile.y() + occupancyRect.y(), occupancyRect.width(), occupancyRect.height()));
   for (int y = baseTile.y() + occupancyRect.y(), endY = baseTile.y() + occupancyRect.y() + occupancyRect.height(); y < endY; ++ y) {
     for (int x = baseTile.x() + occupancyRect.x(), endX = baseTile.x() + occupancyRect.x() + occupancyRect.width(); x < endX; ++ x) {
       occupiedForUnitsAt(x, y) = occupied;
     }
   }
   
-  QSize buildingSize = GetBuildingSize(building->GetType());
-  for (int y = baseTile.y(), endY = baseTile.y() + buildingSize.height(); y < endY; ++ y) {
-    for (int x = baseTile.x(), endX = baseTile.x() + buildingSize.width(); x < endX; ++ x) {
-      occupiedForBuildingsAt(x, y) = occupied;
-    }
-  }
+  occupiedForBuildings.SetRect(QRect(baseTile, GetBuildingSize(building->GetType())), occupied);
 }
 
 bool ServerMap::SpawnBuildingClump(const QPoint& spawnLoc, int count, BuildingType type) {
@@ -527,7 +600,7 @@ bool ServerMap::SpawnBuildingClump(const QPoint& spawnLoc, int count, BuildingTy
     
     // Proceed to a random neighboring tile that is not occupied.
     bool foundFreeSpace = false;
-    int startDirection = rand() % 4;
+    int startDirection = RandomInt(4);
     for (int dirOffset = 0; dirOffset < 4; ++ dirOffset) {
       int testDirection = (startDirection + dirOffset) % 4;
       QPoint testLoc(
@@ -4,14 +4,25 @@
 
 #pragma once
 
-#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
 
 #include <QByteArray>
 #include <QPoint>
+#include <QPointF>
+#include <QRect>
 
 #include "FreeAge/common/building_types.hpp"
+#include "FreeAge/common/occupancy_bitmap.hpp"
 #include "FreeAge/common/unit_types.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+#include "FreeAge/server/flow_field.hpp"
+#include "FreeAge/server/hierarchical_pathfinding.hpp"
 #include "FreeAge/server/object.hpp"
+#include "FreeAge/server/object_store.hpp"
+#include "FreeAge/server/pathfinding.hpp"
 
 class ServerBuilding;
 class ServerUnit;
@@ -24,8 +35,23 @@ class ServerMap {
   
   ~ServerMap();
   
+  /// Generates the map content. This also seeds the map's random number generator
+  /// (see RandomInt()), such that the map and the following game are determined by the seed.
   void GenerateRandomMap(int playerCount, int seed);
   
+  /// Returns a pseudo-random integer in [0, count). All random decisions of the map generation
+  /// and of the game simulation must use this (rather than rand(), whose state is shared
+  /// among all matches running in the server process) such that replays are deterministic.
+  inline int RandomInt(int count) { return static_cast<int>(randomEngine() % static_cast<u32>(count)); }
+  
+  /// Seeds the random number generator of RandomInt(). This is done by GenerateRandomMap().
+  inline void SeedRandomEngine(int seed) { randomEngine.seed(seed); }
+  
+  /// Returns a pseudo-random point (using RandomInt()) at a distance in [minRadius, minRadius + radiusRange]
+  /// from the center. This is used for spawning units and resources around town centers. It only uses
+  /// fixed-point operations, such that the generated map is the same on all platforms.
+  FixedPoint GetRandomPointAround(const FixedPoint& center, const Fixed& minRadius, const Fixed& radiusRange);
+  
   /// Sets the given tile's elevation to the given value,
   /// while ensuring that the maximum slope of 1 is not exceeded
   /// (i.e., neighboring tiles may be modified as well).
@@ -33,24 +59,60 @@ class ServerMap {
   
   /// Adds a new building to the map and returns it. Optionally returns the new building's ID in id.
   /// Optionally calls AddBuildingOccupancy() on the building.
-  ServerBuilding* AddBuilding(int player, BuildingType type, const QPoint& baseTile, float buildPercentage, u32* id = nullptr, bool addOccupancy = true);
-  /// Adds the given building to the map and returns the ID that it received.
-  /// Optionally calls AddBuildingOccupancy() on the building.
-  u32 AddBuilding(ServerBuilding* newBuilding, bool addOccupancy = true);
+  ServerBuilding* AddBuilding(int player, BuildingType type, const QPoint& baseTile, Fixed buildPercentage, u32* id = nullptr, bool addOccupancy = true);
   
   void AddBuildingOccupancy(ServerBuilding* building);
   void RemoveBuildingOccupancy(ServerBuilding* building);
   
   /// Adds a new unit to the map and returns it. Optionally returns the new unit's ID in id.
-  ServerUnit* AddUnit(int player, UnitType type, const QPointF& position, u32* id = nullptr);
-  /// Adds the given unit to the map and returns the ID that it received.
-  u32 AddUnit(ServerUnit* newUnit);
+  ServerUnit* AddUnit(int player, UnitType type, const FixedPoint& position, u32* id = nullptr);
+  
+  /// Moves the given unit (which must have been added to the map) to the given mapCoord.
+  /// This must be used instead of ServerUnit::SetMapCoord() for all units on the map,
+  /// since it keeps the spatial index of units (unitsOnTile) up to date.
+  void SetUnitMapCoord(ServerUnit* unit, const FixedPoint& mapCoord);
+  
+  /// Removes the object with the given ID from the map and from the object store.
+  /// Notice that this does not remove any building occupancy.
+  void RemoveObject(u32 objectId);
   
   /// Tests whether the given unit could stand at the given mapCoord without
   /// colliding with other units or occupied space (buildings, etc.).
   /// If the function returns true and the unit would collide with another unit,
   /// returns that unit in "collidingUnit".
-  bool DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, ServerUnit** collidingUnit = nullptr);
+  inline bool DoesUnitCollide(ServerUnit* unit, const FixedPoint& mapCoord, ServerUnit** collidingUnit = nullptr) {
+    return DoesUnitCollide(unit->GetType(), mapCoord, unit, collidingUnit);
+  }
+  /// Variant of DoesUnitCollide() for a unit of the given type, which does not need to be on the map.
+  /// If ignoredUnit is non-null, collisions with it are not reported.
+  bool DoesUnitCollide(UnitType type, const FixedPoint& mapCoord, ServerUnit* ignoredUnit = nullptr, ServerUnit** collidingUnit = nullptr);
+  
+  /// Calls callback(ServerUnit*) for all units whose center might be within the given
+  /// map coordinate area. This includes all units whose center is actually within the area,
+  /// but may also include some units that are close to it; the caller must do the exact test.
+  /// The iteration stops early if the callback returns false. In this case, the function
+  /// returns false as well, otherwise it returns true.
+  template <typename Callback>
+  bool ForEachUnitInArea(const FixedPoint& minMapCoord, const FixedPoint& maxMapCoord, Callback callback) {
+    int minTileX = std::max(0, std::min(width - 1, minMapCoord.x.Floor()));
+    int minTileY = std::max(0, std::min(height - 1, minMapCoord.y.Floor()));
+    int maxTileX = std::max(0, std::min(width - 1, maxMapCoord.x.Floor()));
+    int maxTileY = std::max(0, std::min(height - 1, maxMapCoord.y.Floor()));
+    for (int tileY = minTileY; tileY <= maxTileY; ++ tileY) {
+      for (int tileX = minTileX; tileX <= maxTileX; ++ tileX) {
+        for (ServerUnit* unit : unitsOnTileAt(tileX, tileY)) {
+          if (!callback(unit)) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+  
+  /// Returns the largest radius of any unit type. Units interact with each other
+  /// (e.g., collide) only if they are at most twice this distance apart.
+  inline Fixed GetMaxUnitRadius() const { return maxUnitRadius; }
   
   /// Returns the elevation at the given tile corner.
   inline int& elevationAt(int cornerX, int cornerY) { return elevation[cornerY * (width + 1) + cornerX]; }
@@ -60,18 +122,53 @@ class ServerMap {
   inline bool& occupiedForUnitsAt(int tileX, int tileY) { return occupiedForUnits[tileY * width + tileX]; }
   inline const bool& occupiedForUnitsAt(int tileX, int tileY) const { return occupiedForUnits[tileY * width + tileX]; }
   
-  inline bool& occupiedForBuildingsAt(int tileX, int tileY) { return occupiedForBuildings[tileY * width + tileX]; }
-  inline const bool& occupiedForBuildingsAt(int tileX, int tileY) const { return occupiedForBuildings[tileY * width + tileX]; }
+  inline bool occupiedForBuildingsAt(int tileX, int tileY) const { return occupiedForBuildings.Get(tileX, tileY); }
+  
+  /// Returns whether any tile within the given rectangle is occupied for buildings.
+  inline bool IsAreaOccupiedForBuildings(const QRect& tileRect) const { return occupiedForBuildings.IsAnySetInRect(tileRect); }
   
-  inline std::unordered_map<u32, ServerObject*>& GetObjects() { return objects; }
-  inline const std::unordered_map<u32, ServerObject*>& GetObjects() const { return objects; }
+  /// Returns whether the footprint of any unit (the tiles overlapped by the bounding box
+  /// of its circle) overlaps the given tile rectangle. If this returns false, no unit
+  /// touches the rectangle. Otherwise, the caller must do the exact test.
+  inline bool IsAnyUnitFootprintInArea(const QRect& tileRect) const { return unitFootprints.IsAnySetInRect(tileRect); }
+  
+  inline ServerObjectStore& GetObjects() { return objects; }
+  inline const ServerObjectStore& GetObjects() const { return objects; }
   
   inline int GetWidth() const { return width; }
   inline int GetHeight() const { return height; }
   
+  inline PathfindingWorkspace* GetPathfindingWorkspace() { return &pathfindingWorkspace; }
+  inline HierarchicalPathfindingGraph* GetPathfindingGraph() { return &pathfindingGraph; }
+  
+  /// Returns an immutable copy of the current unit occupancy grid, which may be used
+  /// for path planning on other threads. The copy is cached until the occupancy changes.
+  std::shared_ptr<const OccupancySnapshot> GetOccupancySnapshot();
+  
+  inline FlowFieldCache* GetFlowFieldCache() { return &flowFieldCache; }
+  
  private:
   void SetBuildingOccupancy(ServerBuilding* building, bool occupied);
   
+  /// Returns the tile whose bucket in unitsOnTile stores units at the given mapCoord.
+  /// Coordinates outside of the map (which are used for units that have not been
+  /// placed yet) get clamped to the map area.
+  inline int GetUnitTileIndex(const FixedPoint& mapCoord) const {
+    int tileX = std::max(0, std::min(width - 1, mapCoord.x.Floor()));
+    int tileY = std::max(0, std::min(height - 1, mapCoord.y.Floor()));
+    return tileY * width + tileX;
+  }
+  
+  inline std::vector<ServerUnit*>& unitsOnTileAt(int tileX, int tileY) { return unitsOnTile[tileY * width + tileX]; }
+  
+  void AddUnitToTile(ServerUnit* unit, int tileIndex);
+  void RemoveUnitFromTile(ServerUnit* unit, int tileIndex);
+  
+  /// Returns the tiles overlapped by the bounding box of the unit's circle if it stands at the given mapCoord.
+  QRect GetUnitFootprint(ServerUnit* unit, const FixedPoint& mapCoord) const;
+  /// Adds (change = 1) or removes (change = -1) a unit footprint to / from unitFootprints.
+  void ChangeUnitFootprint(const QRect& footprint, int change);
+  
   bool SpawnBuildingClump(const QPoint& spawnLoc, int count, BuildingType type);
   
   
@@ -92,12 +189,26 @@ class ServerMap {
   /// is occupied for buildings, but only the top quarter is occupied for units.
   bool* occupiedForUnits;
   
-  /// 2D array storing whether each tile is occupied for buildings (for example,
-  /// by a building). The array size is width * height.
-  /// An element (x, y) has index: [y * width + x].
+  /// Stores whether each tile is occupied for buildings (for example, by a building).
   /// The difference to occupiedForUnits is the town center: All of its space
   /// is occupied for buildings, but only the top quarter is occupied for units.
-  bool* occupiedForBuildings;
+  OccupancyBitmap occupiedForBuildings;
+  
+  /// Stores whether each tile is overlapped by the footprint of any unit (see GetUnitFootprint()).
+  /// Kept up to date by AddUnit(), SetUnitMapCoord(), and RemoveObject().
+  OccupancyBitmap unitFootprints;
+  
+  /// For each tile, the number of unit footprints that overlap it. The array size is width * height.
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<u16> unitFootprintCount;
+  
+  /// Spatial index of the units on the map: For each tile, stores the list of units
+  /// whose center is on this tile. The array size is width * height.
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<std::vector<ServerUnit*>> unitsOnTile;
+  
+  /// Cached result of GetUnitRadiusFixed() maximized over all unit types.
+  Fixed maxUnitRadius;
   
   /// Width of the map in tiles.
   int width;
@@ -105,9 +216,22 @@ class ServerMap {
   /// Height of the map in tiles.
   int height;
   
-  /// The next ID that will be given to the next added building or unit.
-  u32 nextObjectID = 0;
+  /// All objects on the map. They are owned by the store, which also assigns their IDs.
+  ServerObjectStore objects;
+  
+  /// Persistent state for PlanUnitPath(), which is reused among calls.
+  PathfindingWorkspace pathfindingWorkspace;
+  
+  /// Abstract graph for planning long paths. This is kept up to date with the
+  /// unit occupancy (occupiedForUnits) by SetBuildingOccupancy().
+  HierarchicalPathfindingGraph pathfindingGraph;
+  
+  /// Cached result of GetOccupancySnapshot(). Reset by SetBuildingOccupancy().
+  std::shared_ptr<const OccupancySnapshot> occupancySnapshot;
+  
+  /// Flow fields for the goals of recent group move orders.
+  FlowFieldCache flowFieldCache;
   
-  /// Map of object ID -> ServerObject*. The pointer is owned by the map.
-  std::unordered_map<u32, ServerObject*> objects;
+  /// Random number generator for RandomInt(). Seeded by GenerateRandomMap().
+  std::mt19937 randomEngine;
 };
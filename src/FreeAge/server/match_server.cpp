@@ -0,0 +1,233 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/match_server.hpp"
+
+#include "FreeAge/common/event_loop.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/messages.hpp"
+
+/// The interval in seconds in which the server load is logged.
+constexpr double kLoadReportInterval = 10;
+
+MatchServer::GameThread::GameThread(const ServerSettings& settings, std::vector<std::shared_ptr<PlayerInGame>>&& playersInGame)
+    : settings(settings),
+      playersInGame(std::move(playersInGame)) {
+  for (const auto& player : this->playersInGame) {
+    player->socket->moveToThread(this);
+    sessionTokens.push_back(player->sessionToken);
+  }
+  game.reset(new Game(&this->settings));
+}
+
+bool MatchServer::GameThread::HasSessionToken(const QByteArray& sessionToken) const {
+  for (const QByteArray& token : sessionTokens) {
+    if (token == sessionToken) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MatchServer::GameThread::run() {
+  game->RunGameLoop(&playersInGame);
+  
+  // Delete the player sockets on this thread, which they belong to.
+  for (const auto& player : playersInGame) {
+    delete player->socket;
+  }
+}
+
+MatchServer::MatchServer(int maxMatchCount, const QString& replayDirectory)
+    : maxMatchCount(maxMatchCount),
+      replayDirectory(replayDirectory),
+      lastLoadReportTime(Clock::now()) {}
+
+MatchServer::~MatchServer() {
+  for (const auto& thread : gameThreads) {
+    thread->wait();
+  }
+}
+
+void MatchServer::Run(QTcpServer* server) {
+  LOG(INFO) << "Server: Hosting up to " << maxMatchCount << " matches";
+  
+  while (true) {
+    while (QTcpSocket* socket = server->nextPendingConnection()) {
+      LOG(INFO) << "Server: Got new connection";
+      newConnections.push_back(CreatePlayerInMatch(socket));
+    }
+    
+    AssignNewConnections();
+    UpdateLobbies();
+    RemoveFinishedGames();
+    
+    if (SecondsDuration(Clock::now() - lastLoadReportTime).count() >= kLoadReportInterval) {
+      ReportLoad();
+    }
+    
+    // Wait for new connections, client messages, or the next timeout check.
+    ProcessEventsUntil(Clock::now() + std::chrono::milliseconds(kMaxEventWaitMilliseconds));
+  }
+}
+
+void MatchServer::AssignNewConnections() {
+  for (auto it = newConnections.begin(); it != newConnections.end(); ) {
+    const std::shared_ptr<PlayerInMatch>& player = *it;
+    
+    player->unparsedBuffer.Append(player->socket->readAll());
+    QByteArray msg;
+    if (player->unparsedBuffer.TakeMessage(&msg)) {
+      if (!AssignConnection(player, msg)) {
+        delete player->socket;
+      }
+      it = newConnections.erase(it);
+      continue;
+    }
+    
+    // Time out connections which did not authorize themselves in time, or if the connection was lost.
+    if (player->socket->state() != QAbstractSocket::ConnectedState ||
+        MillisecondsDuration(Clock::now() - player->connectionTime).count() > kAuthorizeTimeout) {
+      delete player->socket;
+      it = newConnections.erase(it);
+      continue;
+    }
+    
+    ++ it;
+  }
+}
+
+bool MatchServer::AssignConnection(const std::shared_ptr<PlayerInMatch>& player, const QByteArray& msg) {
+  ClientToServerMessage msgType = static_cast<ClientToServerMessage>(msg.at(0));
+  if (msgType == ClientToServerMessage::Reconnect) {
+    return AssignReconnection(player, msg);
+  }
+  if (msgType != ClientToServerMessage::HostConnect &&
+      msgType != ClientToServerMessage::Connect) {
+    LOG(ERROR) << "Server: Received a message from a new connection that is not HostConnect, Connect, or Reconnect: " << static_cast<int>(msgType);
+    return false;
+  }
+  if (msg.size() < 3 + hostTokenLength) {
+    LOG(ERROR) << "Server: Received a too short HostConnect or Connect message";
+    return false;
+  }
+  QByteArray matchToken = msg.mid(3, hostTokenLength);
+  Lobby* lobby = FindLobby(matchToken);
+  
+  if (msgType == ClientToServerMessage::HostConnect) {
+    if (lobby) {
+      LOG(WARNING) << "Server: Received a HostConnect message for a match token that is already in use";
+      return false;
+    }
+    if (GetMatchCount() >= maxMatchCount) {
+      LOG(WARNING) << "Server: Rejecting a new match since the match limit (" << maxMatchCount << ") is reached";
+      return false;
+    }
+    
+    lobbies.emplace_back(new Lobby());
+    lobby = lobbies.back().get();
+    lobby->settings.serverStartTime = Clock::now();
+    lobby->settings.hostToken = matchToken;
+    lobby->settings.replayDirectory = replayDirectory;
+    lobby->playersInMatch.push_back(player);
+    if (!HandleHostConnect(msg, msg.size(), player.get(), lobby->playersInMatch, lobby->settings)) {
+      lobbies.pop_back();
+      return false;
+    }
+    LOG(INFO) << "Server: Opened a new match lobby";
+    return true;
+  }
+  
+  if (!lobby) {
+    LOG(WARNING) << "Server: Received a Connect message for an unknown match token";
+    return false;
+  }
+  if (lobby->settings.acceptingConnectionsPaused) {
+    LOG(INFO) << "Server: Rejecting a connection to a match that does not accept new players";
+    return false;
+  }
+  lobby->playersInMatch.push_back(player);
+  if (!HandleConnect(msg, msg.size(), player.get(), lobby->playersInMatch, lobby->settings)) {
+    lobby->playersInMatch.pop_back();
+    return false;
+  }
+  return true;
+}
+
+bool MatchServer::AssignReconnection(const std::shared_ptr<PlayerInMatch>& player, const QByteArray& msg) {
+  if (msg.size() < 3 + kSessionTokenLength) {
+    LOG(ERROR) << "Server: Received a too short Reconnect message";
+    return false;
+  }
+  QByteArray sessionToken = msg.mid(3, kSessionTokenLength);
+  
+  for (const auto& thread : gameThreads) {
+    if (thread->HasSessionToken(sessionToken)) {
+      // The game checks the token again and handles the reconnection on its thread.
+      return thread->GetGame()->AddReconnection(player->socket, msg);
+    }
+  }
+  
+  LOG(WARNING) << "Server: Received a Reconnect message with an unknown session token";
+  return false;
+}
+
+MatchServer::Lobby* MatchServer::FindLobby(const QByteArray& matchToken) {
+  for (const auto& lobby : lobbies) {
+    if (lobby->settings.hostToken == matchToken) {
+      return lobby.get();
+    }
+  }
+  return nullptr;
+}
+
+void MatchServer::UpdateLobbies() {
+  for (auto it = lobbies.begin(); it != lobbies.end(); ) {
+    Lobby* lobby = it->get();
+    MatchSetupState state = UpdateMatchSetup(nullptr, &lobby->playersInMatch, &lobby->settings);
+    
+    if (state == MatchSetupState::Running) {
+      ++ it;
+      continue;
+    }
+    
+    if (state == MatchSetupState::GameStarted) {
+      LOG(INFO) << "Server: Match starting ...";
+      std::vector<std::shared_ptr<PlayerInGame>> playersInGame;
+      CreatePlayersInGame(lobby->playersInMatch, &playersInGame);
+      
+      gameThreads.emplace_back(new GameThread(lobby->settings, std::move(playersInGame)));
+      gameThreads.back()->start();
+    } else {
+      LOG(INFO) << "Server: Match lobby closed by the host";
+      for (const auto& player : lobby->playersInMatch) {
+        delete player->socket;
+      }
+    }
+    it = lobbies.erase(it);
+  }
+}
+
+void MatchServer::RemoveFinishedGames() {
+  for (auto it = gameThreads.begin(); it != gameThreads.end(); ) {
+    if ((*it)->isFinished()) {
+      LOG(INFO) << "Server: Match finished";
+      it = gameThreads.erase(it);
+    } else {
+      ++ it;
+    }
+  }
+}
+
+void MatchServer::ReportLoad() {
+  int playersInLobbies = 0;
+  for (const auto& lobby : lobbies) {
+    playersInLobbies += lobby->playersInMatch.size();
+  }
+  
+  LOG(INFO) << "Server load: " << GetMatchCount() << " / " << maxMatchCount << " matches ("
+            << lobbies.size() << " lobbies with " << playersInLobbies << " connections, "
+            << gameThreads.size() << " running games), " << newConnections.size() << " unassigned connections";
+  lastLoadReportTime = Clock::now();
+}
@@ -0,0 +1,110 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <QByteArray>
+#include <QTcpServer>
+#include <QThread>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/game.hpp"
+#include "FreeAge/server/match_setup.hpp"
+#include "FreeAge/server/settings.hpp"
+
+/// Hosts multiple matches in a single server process, which all share the same
+/// listening port and the (immutable) game data.
+///
+/// Each match is identified by its match token. A HostConnect message with a token that is
+/// not in use yet opens a new match lobby (as long as the match limit is not reached), with
+/// the sender as the host. Connect messages join the lobby with the token given in the message.
+/// The match setup of all lobbies is handled on the thread that calls Run(). Once a match
+/// starts, its Game runs on its own thread, which takes over the player connections.
+/// Reconnect messages hand the connection over to the game with the given session token.
+class MatchServer {
+ public:
+  /// Creates a server that hosts at most maxMatchCount matches (lobbies and running games) at the same time.
+  /// If replayDirectory is not empty, a replay of each game gets recorded into this directory.
+  MatchServer(int maxMatchCount, const QString& replayDirectory);
+  
+  /// Waits for the running games to finish.
+  ~MatchServer();
+  
+  /// Accepts connections on the given server and runs the lobbies. This function does not return.
+  void Run(QTcpServer* server);
+  
+ private:
+  /// A match in the match setup phase.
+  struct Lobby {
+    ServerSettings settings;
+    std::vector<std::shared_ptr<PlayerInMatch>> playersInMatch;
+  };
+  
+  /// Runs the game of a started match.
+  class GameThread : public QThread {
+   public:
+    GameThread(const ServerSettings& settings, std::vector<std::shared_ptr<PlayerInGame>>&& playersInGame);
+    
+    /// Returns whether one of the game's players has the given session token.
+    bool HasSessionToken(const QByteArray& sessionToken) const;
+    
+    inline Game* GetGame() { return game.get(); }
+   
+   protected:
+    void run() override;
+   
+   private:
+    ServerSettings settings;
+    std::vector<std::shared_ptr<PlayerInGame>> playersInGame;
+    
+    /// The session tokens of the players. These are copied from playersInGame,
+    /// which may only be accessed by the game thread once it runs.
+    std::vector<QByteArray> sessionTokens;
+    
+    std::unique_ptr<Game> game;
+  };
+  
+  /// Assigns the new connections to lobbies based on the first message that they send.
+  void AssignNewConnections();
+  
+  /// Handles the first message of a new connection. Returns true if the connection got assigned to
+  /// a lobby, false if it should be dropped.
+  bool AssignConnection(const std::shared_ptr<PlayerInMatch>& player, const QByteArray& msg);
+  
+  /// Hands a connection with a Reconnect message over to the game that the player is in.
+  /// Returns true if the game took over the connection.
+  bool AssignReconnection(const std::shared_ptr<PlayerInMatch>& player, const QByteArray& msg);
+  
+  /// Returns the lobby with the given match token, or nullptr if there is none.
+  Lobby* FindLobby(const QByteArray& matchToken);
+  
+  /// Runs the match setup of all lobbies and starts the games of the matches that got started.
+  void UpdateLobbies();
+  
+  /// Removes the running games that have finished.
+  void RemoveFinishedGames();
+  
+  /// Logs the current load of the server.
+  void ReportLoad();
+  
+  inline int GetMatchCount() const { return lobbies.size() + gameThreads.size(); }
+  
+  
+  int maxMatchCount;
+  
+  QString replayDirectory;
+  
+  /// Connections that did not send their HostConnect or Connect message yet.
+  std::vector<std::shared_ptr<PlayerInMatch>> newConnections;
+  
+  std::vector<std::unique_ptr<Lobby>> lobbies;
+  
+  std::vector<std::unique_ptr<GameThread>> gameThreads;
+  
+  /// The time at which ReportLoad() was called the last time.
+  TimePoint lastLoadReportTime;
+};
@@ -4,11 +4,14 @@
 
 #include "FreeAge/server/match_setup.hpp"
 
+#include <random>
+
 #include <QApplication>
-#include <QThread>
 
+#include "FreeAge/common/event_loop.hpp"
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/common/messages.hpp"
+#include "FreeAge/server/game.hpp"
 
 // TODO (puzzlepaint): For some reason, this include needed to be after the Qt includes on my laptop
 // in order for CIDE not to show some errors. Compiling always worked. Check the reason for the errors.
@@ -170,7 +173,14 @@ bool HandleConnect(const QByteArray& msg, int len, PlayerInMatch* player, const
     return false;
   }
   
-  player->name = QString::fromUtf8(msg.mid(3, len - 3));
+  if (msg.length() < 3 + hostTokenLength || len < 3 + hostTokenLength) {
+    LOG(ERROR) << "Received a too short Connect message";
+    return false;
+  }
+  
+  // The match token at the start of the message only matters for servers that host multiple matches
+  // (see MatchServer), which use it to select the match before calling this function.
+  player->name = QString::fromUtf8(msg.mid(3 + hostTokenLength, len - (3 + hostTokenLength)));
   // Find the lowest free player color index
   int playerColorToTest = 0;
   for (; playerColorToTest < 999; ++ playerColorToTest) {
@@ -213,9 +223,9 @@ void HandleSettingsUpdate(const QByteArray& msg, const std::vector<std::shared_p
   }
   
   bool shouldAcceptingBePaused = !settings->allowNewConnections || isHostReady;
-  if (shouldAcceptingBePaused && !settings->acceptingConnectionsPaused) {
+  if (server && shouldAcceptingBePaused && !settings->acceptingConnectionsPaused) {
     server->pauseAccepting();
-  } else if (!shouldAcceptingBePaused && settings->acceptingConnectionsPaused) {
+  } else if (server && !shouldAcceptingBePaused && settings->acceptingConnectionsPaused) {
     server->resumeAccepting();
   }
   settings->acceptingConnectionsPaused = shouldAcceptingBePaused;
@@ -241,9 +251,9 @@ void HandleReadyUp(const QByteArray& msg, PlayerInMatch* player, const std::vect
   // If the ready state of the host changes, check whether accepting new connections needs to be paused/resumed
   if (player->isHost) {
     bool shouldAcceptingBePaused = !settings->allowNewConnections || isReady;
-    if (shouldAcceptingBePaused && !settings->acceptingConnectionsPaused) {
+    if (server && shouldAcceptingBePaused && !settings->acceptingConnectionsPaused) {
       server->pauseAccepting();
-    } else if (!shouldAcceptingBePaused && settings->acceptingConnectionsPaused) {
+    } else if (server && !shouldAcceptingBePaused && settings->acceptingConnectionsPaused) {
       server->resumeAccepting();
     }
     settings->acceptingConnectionsPaused = shouldAcceptingBePaused;
@@ -350,61 +360,120 @@ enum class ParseMessagesResult {
 };
 
 static ParseMessagesResult TryParseClientMessages(PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, QTcpServer* server, ServerSettings* settings) {
-  while (true) {
-    if (player->unparsedBuffer.size() < 3) {
-      return ParseMessagesResult::NoAction;
-    }
+  QByteArray msg;
+  while (player->unparsedBuffer.TakeMessage(&msg)) {
+    u16 msgLength = msg.size();
+    ClientToServerMessage msgType = static_cast<ClientToServerMessage>(msg.at(0));
     
-    char* data = player->unparsedBuffer.data();
-    u16 msgLength = mango::uload16(data + 1);
-    
-    if (player->unparsedBuffer.size() < msgLength) {
-      return ParseMessagesResult::NoAction;
+    switch (msgType) {
+    case ClientToServerMessage::HostConnect:
+      if (!HandleHostConnect(msg, msgLength, player, playersInMatch, *settings)) {
+        return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
+      }
+      break;
+    case ClientToServerMessage::Connect:
+      if (!HandleConnect(msg, msgLength, player, playersInMatch, *settings)) {
+        return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
+      }
+      break;
+    case ClientToServerMessage::SettingsUpdate:
+      HandleSettingsUpdate(msg, playersInMatch, server, settings);
+      break;
+    case ClientToServerMessage::ReadyUp:
+      HandleReadyUp(msg, player, playersInMatch, server, settings);
+      break;
+    case ClientToServerMessage::Chat:
+      HandleChat(msg, player, msgLength, playersInMatch);
+      break;
+    case ClientToServerMessage::Ping:
+      HandlePing(msg, player, *settings);
+      break;
+    case ClientToServerMessage::Leave:
+      HandleLeave(msg, player, playersInMatch);
+      return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
+    case ClientToServerMessage::StartGame:
+      HandleStartGame(msg, player, playersInMatch);
+      return ParseMessagesResult::GameStarted;
+    default:
+      LOG(ERROR) << "Received a message in the match setup phase that cannot be parsed in this phase: " << static_cast<int>(msgType);
+      break;
     }
+  }
+  
+  return ParseMessagesResult::NoAction;
+}
+
+std::shared_ptr<PlayerInMatch> CreatePlayerInMatch(QTcpSocket* socket) {
+  socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+  
+  std::shared_ptr<PlayerInMatch> newPlayer(new PlayerInMatch());
+  newPlayer->socket = socket;
+  newPlayer->isHost = false;
+  newPlayer->playerColorIndex = -1;
+  newPlayer->isReady = false;
+  newPlayer->connectionTime = Clock::now();
+  newPlayer->state = PlayerInMatch::State::Connected;
+  newPlayer->lastPingTime = Clock::now();
+  return newPlayer;
+}
+
+MatchSetupState UpdateMatchSetup(QTcpServer* server, std::vector<std::shared_ptr<PlayerInMatch>>* playersInMatch, ServerSettings* settings) {
+  for (auto it = playersInMatch->begin(); it != playersInMatch->end(); ) {
+    PlayerInMatch& player = **it;
     
-    if (msgLength < 3) {
-      LOG(ERROR) << "Received a too short message. The given message length is (should be at least 3): " << msgLength;
-    } else {
-      ClientToServerMessage msgType = static_cast<ClientToServerMessage>(data[0]);
+    // Read new data from the connection.
+    int prevSize = player.unparsedBuffer.size();
+    player.unparsedBuffer.Append(player.socket->readAll());
+    if (player.unparsedBuffer.size() > prevSize) {
+      ParseMessagesResult parseResult = TryParseClientMessages(&player, *playersInMatch, server, settings);
       
-      switch (msgType) {
-      case ClientToServerMessage::HostConnect:
-        if (!HandleHostConnect(player->unparsedBuffer, msgLength, player, playersInMatch, *settings)) {
-          return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
+      if (parseResult == ParseMessagesResult::GameStarted) {
+        return MatchSetupState::GameStarted;
+      } else if (parseResult == ParseMessagesResult::PlayerLeftOrShouldBeDisconnected) {
+        if (player.isHost) {
+          // The host left and the game has been aborted as a result.
+          return MatchSetupState::Aborted;
         }
-        break;
-      case ClientToServerMessage::Connect:
-        if (!HandleConnect(player->unparsedBuffer, msgLength, player, playersInMatch, *settings)) {
-          return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
+        delete player.socket;
+        it = playersInMatch->erase(it);
+        continue;
+      }
+    }
+    
+    // Time out connections which did not send pings in time, or if the connection was lost.
+    constexpr int kNoPingTimeout = 5000;
+    if (player.state == PlayerInMatch::State::Joined &&
+        (player.socket->state() != QAbstractSocket::ConnectedState ||
+         MillisecondsDuration(Clock::now() - player.lastPingTime).count() > kNoPingTimeout)) {
+      delete player.socket;
+      it = playersInMatch->erase(it);
+      
+      QByteArray playerListMsg =
+          CreatePlayerListMessage(*playersInMatch, nullptr, nullptr) +
+          CreateChatBroadcastMessage(std::numeric_limits<u16>::max(), QObject::tr("[The connection to %1 was lost.]"));
+      for (const auto& otherPlayer : *playersInMatch) {
+        if (otherPlayer->state == PlayerInMatch::State::Joined) {
+          SetPlayerListMessagePlayerIndex(&playerListMsg, otherPlayer.get(), *playersInMatch, nullptr, nullptr);
+          otherPlayer->socket->write(playerListMsg);
         }
-        break;
-      case ClientToServerMessage::SettingsUpdate:
-        HandleSettingsUpdate(player->unparsedBuffer, playersInMatch, server, settings);
-        break;
-      case ClientToServerMessage::ReadyUp:
-        HandleReadyUp(player->unparsedBuffer, player, playersInMatch, server, settings);
-        break;
-      case ClientToServerMessage::Chat:
-        HandleChat(player->unparsedBuffer, player, msgLength, playersInMatch);
-        break;
-      case ClientToServerMessage::Ping:
-        HandlePing(player->unparsedBuffer, player, *settings);
-        break;
-      case ClientToServerMessage::Leave:
-        HandleLeave(player->unparsedBuffer, player, playersInMatch);
-        return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
-      case ClientToServerMessage::StartGame:
-        HandleStartGame(player->unparsedBuffer, player, playersInMatch);
-        player->unparsedBuffer.remove(0, msgLength);
-        return ParseMessagesResult::GameStarted;
-      default:
-        LOG(ERROR) << "Received a message in the match setup phase that cannot be parsed in this phase: " << static_cast<int>(msgType);
-        break;
       }
+      
+      continue;
     }
     
-    player->unparsedBuffer.remove(0, msgLength);
+    // Time out connections which did not authorize themselves in time, or if the connection was lost.
+    if (player.state == PlayerInMatch::State::Connected &&
+        (player.socket->state() != QAbstractSocket::ConnectedState ||
+         MillisecondsDuration(Clock::now() - player.connectionTime).count() > kAuthorizeTimeout)) {
+      delete player.socket;
+      it = playersInMatch->erase(it);
+      continue;
+    }
+    
+    ++ it;
   }
+  
+  return MatchSetupState::Running;
 }
 
 bool RunMatchSetupLoop(QTcpServer* server, std::vector<std::shared_ptr<PlayerInMatch>>* playersInMatch, ServerSettings* settings) {
@@ -413,78 +482,68 @@ bool RunMatchSetupLoop(QTcpServer* server, std::vector<std::shared_ptr<PlayerInM
     while (QTcpSocket* socket = server->nextPendingConnection()) {
       // A new connection is available. The pointer to it does not need to be freed.
       LOG(INFO) << "Server: Got new connection";
-      
-      socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
-      
-      std::shared_ptr<PlayerInMatch> newPlayer(new PlayerInMatch());
-      newPlayer->socket = socket;
-      newPlayer->isHost = false;
-      newPlayer->playerColorIndex = -1;
-      newPlayer->isReady = false;
-      newPlayer->connectionTime = Clock::now();
-      newPlayer->state = PlayerInMatch::State::Connected;
-      newPlayer->lastPingTime = Clock::now();
-      playersInMatch->push_back(newPlayer);
+      playersInMatch->push_back(CreatePlayerInMatch(socket));
     }
     
     // Communicate with existing connections.
-    for (auto it = playersInMatch->begin(); it != playersInMatch->end(); ) {
-      PlayerInMatch& player = **it;
+    MatchSetupState state = UpdateMatchSetup(server, playersInMatch, settings);
+    if (state != MatchSetupState::Running) {
+      return state == MatchSetupState::GameStarted;
+    }
+    
+    // Wait for new connections, client messages, or the next timeout check.
+    ProcessEventsUntil(Clock::now() + std::chrono::milliseconds(kMaxEventWaitMilliseconds));
+  }
+}
+
+/// Creates a random session token, with which a player can reconnect to the game.
+static QByteArray CreateSessionToken() {
+  static std::random_device randomDevice;
+  std::uniform_int_distribution<int> distribution('a', 'z');
+  
+  QByteArray sessionToken(kSessionTokenLength, Qt::Initialization::Uninitialized);
+  for (int i = 0; i < kSessionTokenLength; ++ i) {
+    sessionToken[i] = distribution(randomDevice);
+  }
+  return sessionToken;
+}
+
+void CreatePlayersInGame(const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, std::vector<std::shared_ptr<PlayerInGame>>* playersInGame) {
+  // Drop all players in non-joined state, and convert others to in-game players.
+  for (const auto& player : playersInMatch) {
+    if (player->state == PlayerInMatch::State::Joined) {
+      std::shared_ptr<PlayerInGame> newPlayer(new PlayerInGame());
       
-      // Read new data from the connection.
-      int prevSize = player.unparsedBuffer.size();
-      player.unparsedBuffer += player.socket->readAll();
-      if (player.unparsedBuffer.size() > prevSize) {
-        ParseMessagesResult parseResult = TryParseClientMessages(&player, *playersInMatch, server, settings);
-        
-        if (parseResult == ParseMessagesResult::GameStarted) {
-          return true;
-        } else if (parseResult == ParseMessagesResult::PlayerLeftOrShouldBeDisconnected) {
-          if (player.isHost) {
-            // The host left and the game has been aborted as a result. Exit the server.
-            return false;
-          }
-          delete player.socket;
-          it = playersInMatch->erase(it);
-          continue;
-        }
-      }
+      newPlayer->index = playersInGame->size();
+      newPlayer->socket = player->socket;
+      newPlayer->unparsedBuffer = player->unparsedBuffer;
+      newPlayer->name = player->name;
+      newPlayer->playerColorIndex = player->playerColorIndex;
+      newPlayer->lastPingTime = player->lastPingTime;
+      newPlayer->sessionToken = CreateSessionToken();
       
-      // Time out connections which did not send pings in time, or if the connection was lost.
-      constexpr int kNoPingTimeout = 5000;
-      if (player.state == PlayerInMatch::State::Joined &&
-          (player.socket->state() != QAbstractSocket::ConnectedState ||
-           MillisecondsDuration(Clock::now() - player.lastPingTime).count() > kNoPingTimeout)) {
-        delete player.socket;
-        it = playersInMatch->erase(it);
-        
-        QByteArray playerListMsg =
-            CreatePlayerListMessage(*playersInMatch, nullptr, nullptr) +
-            CreateChatBroadcastMessage(std::numeric_limits<u16>::max(), QObject::tr("[The connection to %1 was lost.]"));
-        for (const auto& otherPlayer : *playersInMatch) {
-          if (otherPlayer->state == PlayerInMatch::State::Joined) {
-            SetPlayerListMessagePlayerIndex(&playerListMsg, otherPlayer.get(), *playersInMatch, nullptr, nullptr);
-            otherPlayer->socket->write(playerListMsg);
-          }
-        }
-        
-        continue;
-      }
+      // TODO: Set the starting resources according to the map
+      newPlayer->resources.wood() = 200;
+      newPlayer->resources.food() = 200;
+      newPlayer->resources.gold() = 100;
+      newPlayer->resources.stone() = 200;
       
-      // Time out connections which did not authorize themselves in time, or if the connection was lost.
-      constexpr int kAuthorizeTimeout = 2000;
-      if (player.state == PlayerInMatch::State::Connected &&
-          (player.socket->state() != QAbstractSocket::ConnectedState ||
-           MillisecondsDuration(Clock::now() - player.connectionTime).count() > kAuthorizeTimeout)) {
-        delete player.socket;
-        it = playersInMatch->erase(it);
-        continue;
-      }
+      newPlayer->lastResources = newPlayer->resources;
       
-      ++ it;
+      playersInGame->emplace_back(newPlayer);
+    } else {
+      delete player->socket;
     }
-    
-    qApp->processEvents(QEventLoop::AllEvents);
-    QThread::msleep(1);
+  }
+  
+  // Notify all clients about the game start.
+  QByteArray msg = CreateStartGameBroadcastMessage();
+  for (const auto& player : *playersInGame) {
+    player->socket->write(msg);
+  }
+  
+  // Reparent all client connections, such that they are independent of the QTcpServer.
+  for (const auto& player : *playersInGame) {
+    player->socket->setParent(nullptr);
   }
 }
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <QByteArray>
 #include <QString>
@@ -12,6 +13,7 @@
 #include <QTcpSocket>
 
 #include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/message_buffer.hpp"
 #include "FreeAge/server/settings.hpp"
 
 /// Represents a player who joined a match that has not started yet.
@@ -29,7 +31,7 @@ struct PlayerInMatch {
   
   /// Buffer for bytes that have been received from the client, but could not
   /// be parsed yet (because only a partial message was received so far).
-  QByteArray unparsedBuffer;
+  MessageBuffer unparsedBuffer;
   
   /// Whether this client can administrate the match.
   bool isHost;
@@ -54,8 +56,59 @@ struct PlayerInMatch {
   TimePoint lastPingTime;
 };
 
+struct PlayerInGame;
+
+/// Connections which did not authorize themselves within this time (in milliseconds) get dropped.
+constexpr int kAuthorizeTimeout = 2000;
+
+/// Creates a player for a new connection. The player still needs to authorize itself
+/// with a HostConnect or Connect message.
+std::shared_ptr<PlayerInMatch> CreatePlayerInMatch(QTcpSocket* socket);
+
+/// Handles a HostConnect message. Returns false if the connection should be dropped.
+bool HandleHostConnect(
+    const QByteArray& msg,
+    int len,
+    PlayerInMatch* player,
+    const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch,
+    const ServerSettings& settings);
+
+/// Handles a Connect message. Returns false if the connection should be dropped.
+bool HandleConnect(
+    const QByteArray& msg,
+    int len,
+    PlayerInMatch* player,
+    const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch,
+    const ServerSettings& settings);
+
+enum class MatchSetupState {
+  Running = 0,
+  GameStarted,
+  Aborted
+};
+
+/// Reads and handles the messages of all players in the match setup phase, and drops
+/// connections that timed out. This does not accept new connections.
+///
+/// The server is used to pause accepting new connections while the match does not allow them.
+/// It may be nullptr if the server is shared among multiple matches. In this case, the caller
+/// must check settings->acceptingConnectionsPaused when assigning new connections to the match.
+MatchSetupState UpdateMatchSetup(
+    QTcpServer* server,
+    std::vector<std::shared_ptr<PlayerInMatch>>* playersInMatch,
+    ServerSettings* settings);
+
+/// Runs the match setup phase for a server that hosts a single match.
 /// Returns true if the game has been started, false if the game has been aborted.
 bool RunMatchSetupLoop(
     QTcpServer* server,
     std::vector<std::shared_ptr<PlayerInMatch>>* playersInMatch,
     ServerSettings* settings);
+
+/// Converts the joined players of a started match to players in the game (appending them
+/// to playersInGame), and notifies them about the game start. Deletes the connections of the
+/// players that have not joined. The sockets of the players in the game are reparented
+/// to nullptr, such that they can be used independently of the QTcpServer.
+void CreatePlayersInGame(
+    const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch,
+    std::vector<std::shared_ptr<PlayerInGame>>* playersInGame);
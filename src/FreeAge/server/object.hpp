@@ -4,37 +4,98 @@
 
 #pragma once
 
-#include <cmath>
+#include <vector>
 
 #include "FreeAge/common/free_age.hpp"
 #include "FreeAge/common/object_types.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+
+/// Contiguous arrays of the object components that the simulation accesses most often.
+/// All arrays are indexed by the slot of the object in the ServerObjectStore, which owns them.
+struct ServerObjectComponents {
+  /// Grows all arrays by one slot.
+  inline void AddSlot() {
+    playerIndices.push_back(0);
+    objectTypes.push_back(0);
+    types.push_back(0);
+    mapCoords.emplace_back();
+    hps.emplace_back();
+  }
+  
+  std::vector<u8> playerIndices;
+  
+  /// The ObjectType of each object.
+  std::vector<u8> objectTypes;
+  
+  /// The UnitType or BuildingType of each object (depending on its ObjectType).
+  std::vector<u16> types;
+  
+  /// For units, their map coordinate. For buildings, their base tile.
+  std::vector<FixedPoint> mapCoords;
+  
+  /// Current hitpoints of each object.
+  /// For display on the client, those are rounded to the nearest integer.
+  std::vector<Fixed> hps;
+};
 
 /// Base class for game objects (buildings and units).
+///
+/// Objects are created by the ServerObjectStore. Their player index, type, map coordinate,
+/// and hitpoints are stored in the store's ServerObjectComponents; the accessors for these
+/// are views onto the object's slot in these arrays.
 class ServerObject {
  public:
-  inline ServerObject(ObjectType objectType, int playerIndex)
-      : playerIndex(playerIndex),
-        objectType(static_cast<int>(objectType)) {}
+  inline ServerObject(ServerObjectComponents* components, u32 slot)
+      : components(components),
+        slot(slot) {}
+  
+  inline bool isBuilding() const { return GetObjectType() == ObjectType::Building; }
+  inline bool isUnit() const { return GetObjectType() == ObjectType::Unit; }
+  inline ObjectType GetObjectType() const { return static_cast<ObjectType>(components->objectTypes[slot]); }
+  
+  inline int GetPlayerIndex() const { return components->playerIndices[slot]; }
   
-  inline bool isBuilding() const { return objectType == 0; }
-  inline bool isUnit() const { return objectType == 1; }
-  inline ObjectType GetObjectType() const { return static_cast<ObjectType>(objectType); }
+  inline u32 GetHP() const { return GetHPInternal().Round(); }
+  inline Fixed GetHPInternal() const { return components->hps[slot]; };
+  inline void SetHP(Fixed newHP) { components->hps[slot] = newHP; }
   
-  inline int GetPlayerIndex() const { return playerIndex; }
+  /// Returns whether the server has told the player with the given index about this object,
+  /// such that the player needs to receive updates about it. See Game::UpdateObjectVisibility().
+  inline bool IsObservedBy(int playerIndex) const { return observingPlayers & (1u << playerIndex); }
+  inline void SetObservedBy(int playerIndex, bool observed) {
+    if (observed) {
+      observingPlayers |= 1u << playerIndex;
+    } else {
+      observingPlayers &= ~(1u << playerIndex);
+    }
+  }
   
-  inline u32 GetHP() const { return std::round(hp); }
-  inline float GetHPInternalFloat() const { return hp; };
-  inline void SetHP(float newHP) { hp = newHP; }
+  /// Returns whether the object's line of sight is currently added to its player's ServerVisibility,
+  /// and with which radius. The radius is remembered such that exactly the same field of view gets removed again.
+  inline bool HasFieldOfView() const { return hasFieldOfView; }
+  inline float GetFieldOfViewRadius() const { return fieldOfViewRadius; }
+  inline void SetFieldOfView(float radius) { hasFieldOfView = true; fieldOfViewRadius = radius; }
+  inline void ClearFieldOfView() { hasFieldOfView = false; }
+  
+  /// Returns whether Game::DeleteObject() was called for the object. The object then stays
+  /// in the ServerObjectStore until the end of the current game step.
+  inline bool IsDeleted() const { return isDeleted; }
+  inline void SetDeleted() { isDeleted = true; }
+  
+ protected:
+  ServerObjectComponents* components;
+  u32 slot;
   
  private:
-  /// Current hitpoints of the object.
-  /// For display on the client, those are rounded to the nearest integer.
-  float hp;
+  /// Bitmask of the players that observe this object. Bit i corresponds to the player with index i.
+  u32 observingPlayers = 0;
   
-  u8 playerIndex;
+  /// See HasFieldOfView().
+  bool hasFieldOfView = false;
+  float fieldOfViewRadius = 0;
   
-  /// 0 for buildings, 1 for units.
-  u8 objectType;
+  /// See IsDeleted().
+  bool isDeleted = false;
 };
 
 /// Returns how the actor can interact with the target.
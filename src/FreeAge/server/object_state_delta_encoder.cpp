@@ -0,0 +1,80 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/object_state_delta_encoder.hpp"
+
+#include <algorithm>
+
+/// ObjectStateDelta messages get split up once their payload exceeds this size,
+/// which leaves enough space for another entry below the message size limit of 64 KB.
+constexpr int kMaxPayloadSize = 60000;
+
+void ObjectStateDeltaEncoder::SetMovement(u32 objectId, const QPointF& startPoint, const QPointF& speed, UnitAction action) {
+  Pending(objectId).SetMovement(startPoint, speed, action);
+}
+
+void ObjectStateDeltaEncoder::SetHP(u32 objectId, u32 hp) {
+  Pending(objectId).SetHP(hp);
+}
+
+void ObjectStateDeltaEncoder::SetBuildPercentage(u32 objectId, float percentage) {
+  Pending(objectId).SetBuildPercentage(percentage);
+}
+
+void ObjectStateDeltaEncoder::SetCarriedResources(u32 objectId, ResourceType type, u8 amount) {
+  Pending(objectId).SetCarriedResources(type, amount);
+}
+
+void ObjectStateDeltaEncoder::Forget(u32 objectId) {
+  pendingDeltas.erase(objectId);
+  sentStates.erase(objectId);
+}
+
+void ObjectStateDeltaEncoder::AppendMessages(QByteArray* messages) {
+  if (pendingDeltas.empty()) {
+    return;
+  }
+  
+  // Sort the entries by object ID, such that the ID differences are small.
+  sortedObjectIds.clear();
+  for (const auto& item : pendingDeltas) {
+    sortedObjectIds.push_back(item.first);
+  }
+  std::sort(sortedObjectIds.begin(), sortedObjectIds.end());
+  
+  payload.clear();
+  u32 previousObjectId = 0;
+  for (u32 objectId : sortedObjectIds) {
+    ObjectStateDelta& delta = pendingDeltas[objectId];
+    
+    // Drop the fields that did not change compared to the last sent state.
+    auto sentIt = sentStates.find(objectId);
+    if (sentIt != sentStates.end()) {
+      for (u8 field : {kObjectStateMovement, kObjectStateHP, kObjectStateBuildPercentage, kObjectStateCarriedResources}) {
+        if ((delta.fields & field) && (sentIt->second.fields & field) && delta.FieldEquals(field, sentIt->second)) {
+          delta.fields &= ~field;
+        }
+      }
+      if (delta.fields == 0) {
+        continue;
+      }
+      sentIt->second.Merge(delta);
+    } else {
+      sentStates[objectId] = delta;
+    }
+    
+    if (payload.size() > kMaxPayloadSize) {
+      *messages += CreateObjectStateDeltaMessage(payload);
+      payload.clear();
+      previousObjectId = 0;
+    }
+    AppendObjectStateDeltaEntry(objectId - previousObjectId, delta, &payload);
+    previousObjectId = objectId;
+  }
+  
+  if (!payload.isEmpty()) {
+    *messages += CreateObjectStateDeltaMessage(payload);
+  }
+  pendingDeltas.clear();
+}
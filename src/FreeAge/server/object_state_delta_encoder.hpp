@@ -0,0 +1,53 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include <QByteArray>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/messages.hpp"
+
+/// Collects the object state changes for one player during a game step, and creates
+/// the ObjectStateDelta messages for them at the end of the step.
+///
+/// Multiple changes to the same field of an object within a game step are coalesced,
+/// such that only the last value gets sent. In addition, the encoder remembers the last
+/// state that it sent for each object, and omits fields whose (quantized) value did not
+/// change. Since the messages are sent over TCP, which delivers them reliably and in order,
+/// the last sent state is the state that the client will have.
+class ObjectStateDeltaEncoder {
+ public:
+  void SetMovement(u32 objectId, const QPointF& startPoint, const QPointF& speed, UnitAction action);
+  void SetHP(u32 objectId, u32 hp);
+  void SetBuildPercentage(u32 objectId, float percentage);
+  void SetCarriedResources(u32 objectId, ResourceType type, u8 amount);
+  
+  /// Must be called when the player stops observing the object (because it died or left the view).
+  /// Drops any pending changes for it and forgets about the last sent state, such that all
+  /// fields get sent again if the object is observed again later.
+  void Forget(u32 objectId);
+  
+  /// Appends the ObjectStateDelta message(s) for the pending changes to the given buffer
+  /// and clears the pending changes. Appends nothing if there are no changes.
+  void AppendMessages(QByteArray* messages);
+  
+ private:
+  /// Returns the pending changes for the given object, creating an empty entry if there is none yet.
+  inline ObjectStateDelta& Pending(u32 objectId) { return pendingDeltas[objectId]; }
+  
+  
+  /// The changes that have been set during the current game step.
+  std::unordered_map<u32, ObjectStateDelta> pendingDeltas;
+  
+  /// The last state that has been sent for each object.
+  std::unordered_map<u32, ObjectStateDelta> sentStates;
+  
+  /// Buffers for AppendMessages(), cached to avoid re-allocations.
+  std::vector<u32> sortedObjectIds;
+  QByteArray payload;
+};
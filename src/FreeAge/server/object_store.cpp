@@ -0,0 +1,114 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/object_store.hpp"
+
+#include "FreeAge/common/logging.hpp"
+
+/// Number of distinct generation values (which use the bits of an ID above the slot bits).
+constexpr u32 kNumGenerations = 1u << (32 - ServerObjectStore::kSlotBits);
+
+ServerUnit* ServerObjectStore::AddUnit(int playerIndex, UnitType type, const FixedPoint& mapCoord, u32* id) {
+  u32 slot = AllocateSlot(ObjectType::Unit, playerIndex, static_cast<u16>(type), mapCoord);
+  
+  ServerUnit* unit;
+  if (!freeUnits.empty()) {
+    unit = freeUnits.back();
+    freeUnits.pop_back();
+    *unit = ServerUnit(&components, slot);
+  } else {
+    unitPool.emplace_back(&components, slot);
+    unit = &unitPool.back();
+  }
+  
+  slotObjects[slot] = unit;
+  slotDenseIndices[slot] = units.size();
+  units.push_back(unit);
+  unitIds.push_back(slotIds[slot]);
+  
+  *id = slotIds[slot];
+  return unit;
+}
+
+ServerBuilding* ServerObjectStore::AddBuilding(int playerIndex, BuildingType type, const QPoint& baseTile, Fixed buildPercentage, u32* id) {
+  u32 slot = AllocateSlot(ObjectType::Building, playerIndex, static_cast<u16>(type), FixedPoint(baseTile.x(), baseTile.y()));
+  
+  ServerBuilding* building;
+  if (!freeBuildings.empty()) {
+    building = freeBuildings.back();
+    freeBuildings.pop_back();
+    *building = ServerBuilding(&components, slot, buildPercentage);
+  } else {
+    buildingPool.emplace_back(&components, slot, buildPercentage);
+    building = &buildingPool.back();
+  }
+  
+  slotObjects[slot] = building;
+  slotDenseIndices[slot] = buildings.size();
+  buildings.push_back(building);
+  buildingIds.push_back(slotIds[slot]);
+  
+  *id = slotIds[slot];
+  return building;
+}
+
+bool ServerObjectStore::Remove(u32 id) {
+  ServerObject* object = Find(id);
+  if (!object) {
+    return false;
+  }
+  u32 slot = id & kSlotMask;
+  
+  // Remove the object from its dense array by moving the last element into its place.
+  // The object itself stays in its pool, and gets overwritten once its pool entry is reused.
+  u32 denseIndex = slotDenseIndices[slot];
+  if (object->isUnit()) {
+    units[denseIndex] = units.back();
+    unitIds[denseIndex] = unitIds.back();
+    slotDenseIndices[unitIds[denseIndex] & kSlotMask] = denseIndex;
+    units.pop_back();
+    unitIds.pop_back();
+    freeUnits.push_back(AsUnit(object));
+  } else {
+    buildings[denseIndex] = buildings.back();
+    buildingIds[denseIndex] = buildingIds.back();
+    slotDenseIndices[buildingIds[denseIndex] & kSlotMask] = denseIndex;
+    buildings.pop_back();
+    buildingIds.pop_back();
+    freeBuildings.push_back(AsBuilding(object));
+  }
+  
+  slotIds[slot] = kInvalidObjectId;
+  slotObjects[slot] = nullptr;
+  slotGenerations[slot] = (slotGenerations[slot] + 1) % kNumGenerations;
+  freeSlots.push_back(slot);
+  return true;
+}
+
+u32 ServerObjectStore::AllocateSlot(ObjectType objectType, int playerIndex, u16 type, const FixedPoint& mapCoord) {
+  u32 slot;
+  if (!freeSlots.empty()) {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    slot = slotIds.size();
+    // Slot index kSlotMask is never used, such that no ID can equal kInvalidObjectId.
+    if (slot >= kSlotMask) {
+      LOG(FATAL) << "ServerObjectStore: Maximum number of objects exceeded";
+    }
+    slotIds.push_back(kInvalidObjectId);
+    slotObjects.push_back(nullptr);
+    slotDenseIndices.push_back(0);
+    slotGenerations.push_back(0);
+    components.AddSlot();
+  }
+  
+  slotIds[slot] = (slotGenerations[slot] << kSlotBits) | slot;
+  components.playerIndices[slot] = playerIndex;
+  components.objectTypes[slot] = static_cast<u8>(objectType);
+  components.types[slot] = type;
+  components.mapCoords[slot] = mapCoord;
+  components.hps[slot] = 0;
+  return slot;
+}
@@ -0,0 +1,166 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <QPoint>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/object_types.hpp"
+#include "FreeAge/server/building.hpp"
+#include "FreeAge/server/object.hpp"
+#include "FreeAge/server/unit.hpp"
+
+/// Stores all game objects (buildings and units) on the server, and assigns their IDs.
+///
+/// Each object occupies a slot in the store. The object ID consists of the slot index
+/// (in the lower kSlotBits bits) and of a generation counter for the slot (in the remaining bits).
+/// Slots of removed objects are put on a free list and get reused for new objects, with the
+/// generation counter incremented, such that the IDs of removed objects do not refer
+/// to the new objects. This keeps the per-slot arrays dense and makes ID lookups simple
+/// array accesses.
+///
+/// The player index, type, map coordinate, and hitpoints of the objects are stored in
+/// contiguous per-slot arrays (see GetComponents()), which ServerUnit and ServerBuilding
+/// provide views onto. The remaining state of the objects is kept in pools of ServerUnit
+/// and ServerBuilding objects, whose entries get reused for new objects as well.
+///
+/// In addition, the store keeps contiguous arrays of all units and all buildings
+/// (with their IDs), which are used by code that iterates over all objects of one kind.
+/// The order of the objects in these arrays changes when objects are removed.
+class ServerObjectStore {
+ public:
+  static constexpr int kSlotBits = 20;
+  static constexpr u32 kSlotMask = (1u << kSlotBits) - 1;
+  
+  /// Creates a unit in the store. Returns the unit, and its ID in id.
+  ServerUnit* AddUnit(int playerIndex, UnitType type, const FixedPoint& mapCoord, u32* id);
+  
+  /// Creates a building in the store. Returns the building, and its ID in id.
+  ServerBuilding* AddBuilding(int playerIndex, BuildingType type, const QPoint& baseTile, Fixed buildPercentage, u32* id);
+  
+  /// Removes the object with the given ID from the store.
+  /// Returns false if there is no object with this ID.
+  bool Remove(u32 id);
+  
+  /// Returns the object with the given ID, or nullptr if there is no such object.
+  inline ServerObject* Find(u32 id) const {
+    u32 slot = id & kSlotMask;
+    if (slot >= slotIds.size() || slotIds[slot] != id) {
+      return nullptr;
+    }
+    return slotObjects[slot];
+  }
+  
+  inline bool Contains(u32 id) const { return Find(id) != nullptr; }
+  
+  /// Returns the number of objects in the store.
+  inline usize size() const { return units.size() + buildings.size(); }
+  
+  /// Returns all units. GetUnitIds()[i] is the ID of GetUnits()[i].
+  inline const std::vector<ServerUnit*>& GetUnits() const { return units; }
+  inline const std::vector<u32>& GetUnitIds() const { return unitIds; }
+  
+  /// Returns all buildings. GetBuildingIds()[i] is the ID of GetBuildings()[i].
+  inline const std::vector<ServerBuilding*>& GetBuildings() const { return buildings; }
+  inline const std::vector<u32>& GetBuildingIds() const { return buildingIds; }
+  
+  /// Returns the per-slot component arrays. The slot of an object is given by (id & kSlotMask).
+  inline const ServerObjectComponents& GetComponents() const { return components; }
+  
+  /// Calls callback(u32 id, ServerObject* object) for all objects, in slot order.
+  /// The callback must not add or remove objects.
+  template <typename Callback>
+  void ForEach(Callback callback) const {
+    for (usize slot = 0; slot < slotIds.size(); ++ slot) {
+      if (slotIds[slot] != kInvalidObjectId) {
+        callback(slotIds[slot], slotObjects[slot]);
+      }
+    }
+  }
+  
+  /// Calls callback(u32 id, ServerUnit* unit) for all units, in slot order. This scans the
+  /// contiguous arrays of IDs and object types, and only accesses the unit objects that are passed on.
+  /// The callback may add buildings, but must not add units or remove objects.
+  template <typename Callback>
+  void ForEachUnit(Callback callback) const {
+    ForEachOfType(ObjectType::Unit, [&](u32 id, ServerObject* object) { callback(id, AsUnit(object)); });
+  }
+  
+  /// Calls callback(u32 id, ServerBuilding* building) for all buildings, in slot order (see ForEachUnit()).
+  /// The callback may add units, but must not add buildings or remove objects.
+  template <typename Callback>
+  void ForEachBuilding(Callback callback) const {
+    ForEachOfType(ObjectType::Building, [&](u32 id, ServerObject* object) { callback(id, AsBuilding(object)); });
+  }
+  
+  /// Calls callback(u32 id) for all objects of the given player. This only scans the
+  /// contiguous array of player indices, without accessing the objects themselves.
+  /// The iteration stops early if the callback returns false. In this case, the function
+  /// returns false as well, otherwise it returns true.
+  template <typename Callback>
+  bool ForEachIdOfPlayer(int playerIndex, Callback callback) const {
+    for (usize slot = 0; slot < components.playerIndices.size(); ++ slot) {
+      if (components.playerIndices[slot] == playerIndex &&
+          slotIds[slot] != kInvalidObjectId &&
+          !callback(slotIds[slot])) {
+        return false;
+      }
+    }
+    return true;
+  }
+  
+ private:
+  /// Takes a free slot (or appends a new one), initializes its components, and assigns an ID to it.
+  /// Returns the slot.
+  u32 AllocateSlot(ObjectType objectType, int playerIndex, u16 type, const FixedPoint& mapCoord);
+  
+  template <typename Callback>
+  void ForEachOfType(ObjectType objectType, Callback callback) const {
+    // The slot count is re-read in each iteration, since the callback may add objects of the other type.
+    for (usize slot = 0; slot < slotIds.size(); ++ slot) {
+      if (components.objectTypes[slot] == static_cast<u8>(objectType) &&
+          slotIds[slot] != kInvalidObjectId) {
+        callback(slotIds[slot], slotObjects[slot]);
+      }
+    }
+  }
+  
+  
+  /// For each slot, the ID of the object in it, or kInvalidObjectId if the slot is free.
+  std::vector<u32> slotIds;
+  
+  /// For each slot, the object in it (stored in unitPool or buildingPool), or nullptr if the slot is free.
+  std::vector<ServerObject*> slotObjects;
+  
+  /// See GetComponents().
+  ServerObjectComponents components;
+  
+  /// For each slot, the index of its object in units / unitIds or buildings / buildingIds.
+  std::vector<u32> slotDenseIndices;
+  
+  /// For each slot, the generation counter that is used for the next object that gets this slot.
+  std::vector<u32> slotGenerations;
+  
+  /// Indices of the free slots.
+  std::vector<u32> freeSlots;
+  
+  std::vector<ServerUnit*> units;
+  std::vector<u32> unitIds;
+  
+  std::vector<ServerBuilding*> buildings;
+  std::vector<u32> buildingIds;
+  
+  /// Storage for the unit and building objects. std::deque does not move its elements
+  /// when growing, so the pointers to them stay valid.
+  std::deque<ServerUnit> unitPool;
+  std::deque<ServerBuilding> buildingPool;
+  
+  /// Entries of unitPool and buildingPool whose objects have been removed, and which get reused for new objects.
+  std::vector<ServerUnit*> freeUnits;
+  std::vector<ServerBuilding*> freeBuildings;
+};
@@ -0,0 +1,112 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/path_planner.hpp"
+
+#include <algorithm>
+
+#include "FreeAge/common/logging.hpp"
+
+PathPlanner::PathPlanner(int numWorkerThreads) {
+  workerThreads.reserve(numWorkerThreads);
+  for (int i = 0; i < numWorkerThreads; ++ i) {
+    workerThreads.emplace_back(&PathPlanner::WorkerThreadMain, this);
+  }
+}
+
+PathPlanner::~PathPlanner() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    exitWorkerThreads = true;
+    queue.clear();
+  }
+  queueCondition.notify_all();
+  
+  for (std::thread& thread : workerThreads) {
+    thread.join();
+  }
+}
+
+u32 PathPlanner::Submit(PathRequest&& request, u64 dueGameStep) {
+  u32 requestId = nextRequestId;
+  ++ nextRequestId;
+  if (nextRequestId == 0) {
+    nextRequestId = 1;
+  }
+  
+  jobs.emplace_back(new Job());
+  Job* job = jobs.back().get();
+  job->request = std::move(request);
+  job->request.requestId = requestId;
+  job->dueGameStep = dueGameStep;
+  
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(job);
+  }
+  queueCondition.notify_one();
+  
+  return requestId;
+}
+
+void PathPlanner::TakeResults(u64 gameStep, std::vector<PathResult>* results) {
+  results->clear();
+  
+  while (!jobs.empty() && jobs.front()->dueGameStep <= gameStep) {
+    Job* job = jobs.front().get();
+    
+    bool computeHere = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!job->started) {
+        // Since this is the oldest job and the queue is processed in order,
+        // it must be at the front of the queue.
+        if (queue.empty() || queue.front() != job) {
+          LOG(ERROR) << "PathPlanner: Unstarted job is not at the front of the queue";
+          queue.erase(std::remove(queue.begin(), queue.end(), job), queue.end());
+        } else {
+          queue.pop_front();
+        }
+        job->started = true;
+        computeHere = true;
+      } else {
+        doneCondition.wait(lock, [&]() { return job->done; });
+      }
+    }
+    
+    if (computeHere) {
+      ComputePath(job->request, &simulationThreadWorkspace, &job->result);
+    }
+    
+    results->push_back(std::move(job->result));
+    jobs.pop_front();
+  }
+}
+
+void PathPlanner::WorkerThreadMain() {
+  PathfindingWorkspace workspace;
+  
+  while (true) {
+    Job* job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      queueCondition.wait(lock, [&]() { return exitWorkerThreads || !queue.empty(); });
+      if (exitWorkerThreads) {
+        return;
+      }
+      
+      job = queue.front();
+      queue.pop_front();
+      job->started = true;
+    }
+    
+    ComputePath(job->request, &workspace, &job->result);
+    
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job->done = true;
+    }
+    doneCondition.notify_all();
+  }
+}
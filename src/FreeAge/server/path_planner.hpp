@@ -0,0 +1,86 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+/// Computes unit paths (see ComputePath()) on a pool of worker threads, such that
+/// path planning does not need to fit into the time budget of a single game step.
+///
+/// In order to keep the simulation deterministic, each request is submitted together with
+/// the game step at which its result is due. TakeResults() returns the results of all
+/// requests that are due at a given game step in the order in which they were submitted,
+/// regardless of when the worker threads actually finished them. If a due result is not
+/// ready yet, TakeResults() waits for it, or computes it on the calling thread if no worker
+/// thread has started on it yet.
+///
+/// Submit() and TakeResults() must only be called from the simulation thread.
+class PathPlanner {
+ public:
+  /// Starts the given number of worker threads. If this is zero, all paths get
+  /// computed by TakeResults() on the calling thread.
+  explicit PathPlanner(int numWorkerThreads);
+  
+  /// Exits the worker threads. Requests that have not been started yet are dropped.
+  ~PathPlanner();
+  
+  /// Queues the request for computation. Returns the request ID that was assigned
+  /// to the request (and that will be returned in PathResult::requestId). This is never 0.
+  u32 Submit(PathRequest&& request, u64 dueGameStep);
+  
+  /// Returns the results of all requests whose due game step is less than or equal
+  /// to the given one, in the order in which the requests were submitted.
+  void TakeResults(u64 gameStep, std::vector<PathResult>* results);
+  
+ private:
+  struct Job {
+    PathRequest request;
+    PathResult result;
+    u64 dueGameStep;
+    
+    /// Whether a thread has started to compute the result. Protected by the mutex.
+    bool started = false;
+    
+    /// Whether the result has been computed. Protected by the mutex.
+    bool done = false;
+  };
+  
+  void WorkerThreadMain();
+  
+  
+  /// All submitted jobs whose results have not been taken yet, in submission order.
+  /// Only accessed by the simulation thread.
+  std::deque<std::unique_ptr<Job>> jobs;
+  
+  /// Jobs that have not been started yet, in submission order. Protected by the mutex.
+  std::deque<Job*> queue;
+  
+  /// Set to true to make the worker threads exit. Protected by the mutex.
+  bool exitWorkerThreads = false;
+  
+  std::mutex mutex;
+  
+  /// Notified when a job is added to the queue, or when the worker threads should exit.
+  std::condition_variable queueCondition;
+  
+  /// Notified when a job is done.
+  std::condition_variable doneCondition;
+  
+  /// The ID that will be assigned to the next submitted request.
+  u32 nextRequestId = 1;
+  
+  /// Workspace for computing paths on the simulation thread.
+  PathfindingWorkspace simulationThreadWorkspace;
+  
+  std::vector<std::thread> workerThreads;
+};
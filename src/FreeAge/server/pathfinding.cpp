@@ -4,15 +4,15 @@
 
 #include "FreeAge/server/pathfinding.hpp"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
-#include <queue>
 
 #include <QImage>
 #include <QPoint>
 #include <QRect>
 
 #include "FreeAge/common/timing.hpp"
-#include "FreeAge/common/util.hpp"
 #include "FreeAge/server/building.hpp"
 #include "FreeAge/server/map.hpp"
 #include "FreeAge/server/unit.hpp"
@@ -20,30 +20,31 @@
 /// Tests whether the unit could walk from p0 to p1 (or vice versa) without colliding
 /// with a building. Notice that this function does not check whether the start and
 /// end points themselves are (fully) free, it only checks the space between them.
-static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, const QRect& openRect, ServerMap* map) {
+static bool IsPathFree(Fixed unitRadius, const FixedPoint& p0, const FixedPoint& p1, const QRect& openRect, const OccupancySnapshot& occupancy, PathfindingWorkspace* workspace) {
   // Obtain the points to the right and left of p0 and p1.
-  constexpr float kErrorEpsilon = 1e-3f;
+  constexpr Fixed kErrorEpsilon = Fixed::FromFraction(1, 1000);
   
-  QPointF p0ToP1 = p1 - p0;
-  QPointF right(
-      -p0ToP1.y(),
-      p0ToP1.x());
-  right *= (unitRadius + kErrorEpsilon) / std::max(1e-4f, Length(right));
+  FixedPoint p0ToP1 = p1 - p0;
+  FixedPoint right(
+      -p0ToP1.y,
+      p0ToP1.x);
+  right = right * ((unitRadius + kErrorEpsilon) / Max(Fixed::FromFraction(1, 10000), Length(right)));
   
-  QPointF p0Right = p0 + right;
-  QPointF p0Left = p0 - right;
-  QPointF p1Right = p1 + right;
-  QPointF p1Left = p1 - right;
+  FixedPoint p0Right = p0 + right;
+  FixedPoint p0Left = p0 - right;
+  FixedPoint p1Right = p1 + right;
+  FixedPoint p1Left = p1 - right;
   
   // Rasterize the polygon defined by all the points into the map grid.
   int minRow = std::numeric_limits<int>::max();
   int maxRow = 0;
-  std::vector<std::pair<int, int>> rowRanges(map->GetHeight(), std::make_pair(std::numeric_limits<int>::max(), 0));
+  std::vector<std::pair<int, int>>& rowRanges = workspace->rowRanges;
+  rowRanges.assign(occupancy.height, std::make_pair(std::numeric_limits<int>::max(), 0));
   
   auto rasterize = [&](int x, int y) {
     // For safety, clamp the coordinate to the map area.
-    x = std::max(0, std::min(map->GetWidth() - 1, x));
-    y = std::max(0, std::min(map->GetHeight() - 1, y));
+    x = std::max(0, std::min(occupancy.width - 1, x));
+    y = std::max(0, std::min(occupancy.height - 1, y));
     
     minRow = std::min(minRow, y);
     maxRow = std::max(maxRow, y);
@@ -53,30 +54,30 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
     rowRange.second = std::max(rowRange.second, x);
   };
   
-  auto rasterizeLine = [&](const QPointF& start, const QPointF& end) {
-    QPointF cur = start;
-    QPointF remaining = end - start;
+  auto rasterizeLine = [&](const FixedPoint& start, const FixedPoint& end) {
+    FixedPoint cur = start;
+    FixedPoint remaining = end - start;
     
-    int x = static_cast<int>(cur.x());
-    int y = static_cast<int>(cur.y());
+    int x = cur.x.Floor();
+    int y = cur.y.Floor();
     
-    int endX = static_cast<int>(end.x());
-    int endY = static_cast<int>(end.y());
+    int endX = end.x.Floor();
+    int endY = end.y.Floor();
     
-    int sx = (remaining.x() > 0) ? 1 : -1;
-    int sy = (remaining.y() > 0) ? 1 : -1;
+    int sx = (remaining.x > 0) ? 1 : -1;
+    int sy = (remaining.y > 0) ? 1 : -1;
     
     while (true) {
       rasterize(x, y);
       
-      float fx = cur.x() - x;
-      float fy = cur.y() - y;
+      Fixed fx = cur.x - x;
+      Fixed fy = cur.y - y;
       
-      float xToBorder = (sx > 0) ? (1 - fx) : fx;
-      float yToBorder = (sy > 0) ? (1 - fy) : fy;
+      Fixed xToBorder = (sx > 0) ? (1 - fx) : fx;
+      Fixed yToBorder = (sy > 0) ? (1 - fy) : fy;
       
-      if (fabs(remaining.x()) <= xToBorder &&
-          fabs(remaining.y()) <= yToBorder) {
+      if (remaining.x.Abs() <= xToBorder &&
+          remaining.y.Abs() <= yToBorder) {
         // The goal is in the current square.
         break;
       }
@@ -87,9 +88,16 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
         break;
       }
       
-      float diffX, diffY;
-      if (fabs(remaining.x()) / std::max<float>(1e-5f, fabs(remaining.y())) >
-          xToBorder / std::max(1e-5f, yToBorder)) {
+      // Compare the slope of the remaining line to the slope towards the next tile corner,
+      // i.e., |remaining.x| / |remaining.y| > xToBorder / yToBorder. This is done by
+      // cross-multiplying the raw values, which is exact.
+      bool goInXDirection =
+          remaining.y == Fixed() ||
+          remaining.x.Abs().GetRaw() * std::max<i64>(1, yToBorder.GetRaw()) >
+          xToBorder.GetRaw() * std::max<i64>(1, remaining.y.Abs().GetRaw());
+      
+      Fixed diffX, diffY;
+      if (goInXDirection) {
         // Go in x direction
         if (sx > 0) {
           // Go to the right.
@@ -98,7 +106,7 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
           // Go to the left.
           diffX = fx;
         }
-        diffY = remaining.y() * ((remaining.x() + diffX) / remaining.x() - 1);
+        diffY = Fixed::FromRaw(remaining.y.GetRaw() * diffX.GetRaw() / remaining.x.GetRaw());
         x += sx;
       } else {
         // Go in y direction
@@ -109,14 +117,14 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
           // Go to the top.
           diffY = fy;
         }
-        diffX = remaining.x() * ((remaining.y() + diffY) / remaining.y() - 1);
+        diffX = Fixed::FromRaw(remaining.x.GetRaw() * diffY.GetRaw() / remaining.y.GetRaw());
         y += sy;
       }
       
-      remaining.setX(remaining.x() + diffX);
-      remaining.setY(remaining.y() + diffY);
-      cur.setX(cur.x() - diffX);
-      cur.setY(cur.y() - diffY);
+      remaining.x += diffX;
+      remaining.y += diffY;
+      cur.x -= diffX;
+      cur.y -= diffY;
     }
   };
   
@@ -130,13 +138,13 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
   constexpr bool kDebugRasterization = false;
   constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathFree_debug.png";
   if (kDebugRasterization) {
-    QImage debugImage(map->GetWidth(), map->GetHeight(), QImage::Format_RGB32);
+    QImage debugImage(occupancy.width, occupancy.height, QImage::Format_RGB32);
     debugImage.fill(qRgb(255, 255, 255));
     
     for (int row = minRow; row <= maxRow; ++ row) {
       auto& rowRange = rowRanges[row];
       for (int col = rowRange.first; col <= rowRange.second; ++ col) {
-        if (map->occupiedForUnitsAt(col, row) && !openRect.contains(col, row, false)) {
+        if (occupancy.occupiedForUnitsAt(col, row) && !openRect.contains(col, row, false)) {
           debugImage.setPixelColor(col, row, qRgb(255, 0, 0));
         } else {
           debugImage.setPixelColor(col, row, qRgb(0, 255, 0));
@@ -154,7 +162,7 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
   for (int row = minRow; row <= maxRow; ++ row) {
     auto& rowRange = rowRanges[row];
     for (int col = rowRange.first; col <= rowRange.second; ++ col) {
-      if (map->occupiedForUnitsAt(col, row) && !openRect.contains(col, row, false)) {
+      if (occupancy.occupiedForUnitsAt(col, row) && !openRect.contains(col, row, false)) {
         return false;
       }
     }
@@ -163,179 +171,137 @@ static bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, c
   return true;
 }
 
-void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
-  constexpr bool kOutputPathfindingDebugMessages = false;
-  
-  Timer pathPlanningTimer;
-  
-  typedef float CostT;
-  
-  int mapWidth = map->GetWidth();
-  int mapHeight = map->GetHeight();
-  
-  // Determine the tile that the unit stands on. This will be the start tile.
-  QPoint start(
-      std::max(0, std::min(mapWidth - 1, static_cast<int>(unit->GetMapCoord().x()))),
-      std::max(0, std::min(mapHeight - 1, static_cast<int>(unit->GetMapCoord().y()))));
-  
-  // Determine the goal tiles and treat them as open even if they are occupied.
-  // This is done for the tiles taken up by the unit's target.
-  // This allows us to plan a path "into" the target.
-  QRect goalRect;
-  if (unit->GetTargetObjectId() != kInvalidObjectId) {
-    auto targetIt = map->GetObjects().find(unit->GetTargetObjectId());
-    if (targetIt != map->GetObjects().end()) {
-      ServerObject* targetObject = targetIt->second;
-      if (targetObject->isBuilding()) {
-        ServerBuilding* targetBuilding = AsBuilding(targetObject);
-        
-        const QPoint& baseTile = targetBuilding->GetBaseTile();
-        QSize buildingSize = GetBuildingSize(targetBuilding->GetType());
-        goalRect = QRect(baseTile, buildingSize);
-      }
-    }
-  }
-  if (goalRect.isNull()) {
-    goalRect = QRect(
-        std::max(0, std::min(mapWidth - 1, static_cast<int>(unit->GetMoveToTargetMapCoord().x()))),
-        std::max(0, std::min(mapHeight - 1, static_cast<int>(unit->GetMoveToTargetMapCoord().y()))),
-        1,
-        1);
+void PathfindingWorkspace::StartNewSearch(int mapWidth, int mapHeight) {
+  usize gridSize = mapWidth * mapHeight;
+  if (nodeGeneration.size() != gridSize) {
+    nodeGeneration.assign(gridSize, 0);
+    costSoFar.resize(gridSize);
+    cameFrom.resize(gridSize);
+    generation = 0;
   }
   
-  // Use A* to plan a path from the start to the goal tile.
-  // * Treat unit-occupied tiles as obstacles.
-  // * Treat tiles that are occupied by the unit's target building (if any) as free,
-  //   such that the algorithm can plan a path "into" the goal.
-  // * If the goal is not reachable, return the path that leads to the reachable
-  //   position that is closest to the goal.
-  struct Location {
-    QPoint loc;
-    float priority;
-    
-    inline Location(const QPoint& loc, float priority)
-        : loc(loc),
-          priority(priority) {}
-    
-    inline bool operator> (const Location& other) const {
-      return priority > other.priority;
-    }
-  };
+  ++ generation;
+  if (generation == 0) {
+    // The generation counter wrapped around. Reset all stamps such that stale
+    // state from 2^32 searches ago cannot be mistaken for current state.
+    std::fill(nodeGeneration.begin(), nodeGeneration.end(), 0);
+    generation = 1;
+  }
   
-  std::priority_queue<Location, std::vector<Location>, std::greater<Location>> priorityQueue;
-  
-  priorityQueue.emplace(start, 0.f);
-  
-  std::vector<CostT> costSoFar(mapWidth * mapHeight);
-  // TODO: Perhaps some potential overhead of this may be reduced by doing a memset() to zero instead,
-  //       using "negative zero" for the start node, and later comparing to "positive zero" as a special case using std::signbit()?
-  std::fill(std::begin(costSoFar), std::end(costSoFar), std::numeric_limits<float>::infinity());
-  costSoFar[start.x() + mapWidth * start.y()] = 0;
-  
-  // Directions are encoded as row-major indices of grid cells in a 4x4 grid,
-  // with (1, 1) being the origin of movement. A 3x3 grid would suffice,
-  // however, with a 4x4 grid, computations are faster. So, for example,
-  // the value 0 corresponds to cell (0, 0) in the grid, which has an offset of (-1, -1)
-  // from the movement origin. So, the movement came from (-1, -1).
-  // Second example: The value 4 corresponds to cell (0, 1) with movement (-1, 0).
-  // The value 5 corresponds to zero movement, this is used for the start and for initialization.
-  constexpr u8 cameFromUninitializedValue = 5;
-  std::vector<u8> cameFrom(mapWidth * mapHeight);
-  memset(cameFrom.data(), cameFromUninitializedValue, mapWidth * mapHeight);
-  
-  CostT smallestReachedHeuristicValue = std::numeric_limits<CostT>::max();
-  QPoint smallestReachedHeuristicTile(-1, -1);
-  
-  static int numNeighborsToCheckArray[11] = {
-    3,
-    7,
-    3,
-    0,  // no valid direction
-    7,
-    8,
-    7,
-    0,  // no valid direction
-    3,
-    7,
-    3,
-  };
-  static QPoint neighborsToCheckArray[11][8] = {
-    {QPoint(1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(1, 1)},
-    {QPoint(0, 1), /*occ. test*/ QPoint(1, -1), QPoint(1, 0), QPoint(1, 1), /*occ. test*/ QPoint(-1, -1), QPoint(-1, 0), QPoint(-1, 1)},
-    {QPoint(-1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(-1, 1)},
-    {},
-    {QPoint(1, 0), /*occ. test*/ QPoint(-1, -1), QPoint(0, -1), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(0, 1), QPoint(1, 1)},
-    {QPoint(0, -1), QPoint(-1, 0), QPoint(1, 0), QPoint(0, 1), QPoint(1, 1), QPoint(-1, -1), QPoint(1, -1), QPoint(-1, 1)},
-    {QPoint(-1, 0), /*occ. test*/ QPoint(1, -1), QPoint(0, -1), QPoint(-1, -1), /*occ. test*/ QPoint(1, 1), QPoint(0, 1), QPoint(-1, 1)},
-    {},
-    {QPoint(0, -1), QPoint(1, 0), /*dependent on previous being free*/ QPoint(1, -1)},
-    {QPoint(0, -1), /*occ. test*/ QPoint(1, 1), QPoint(1, 0), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(-1, 0), QPoint(-1, -1)},
-    {QPoint(-1, 0), QPoint(0, -1), /*dependent on previous being free*/ QPoint(-1, -1)},
-  };
-  // Here we encode that diagonal movements require the two adjacent tiles to be free.
-  static u8 neighborsRequireFreeTiles[11][8] = {
-    {0, 0, 0b11},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {0, 0, 0b11},
-    {},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {0, 0, 0, 0, 0b1100, 0b0011, 0b0101, 0b1010},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {},
-    {0, 0, 0b11},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {0, 0, 0b11},
-  };
+  openList.clear();
+}
+
+constexpr bool kOutputPathfindingDebugMessages = false;
+
+// Set this to true to have a debug image written to /tmp/FreeAge_pathfinding_debug.png.
+// Legend:
+// * Black: Occupied tiles.
+// * Dark green: open rect.
+// * White: Free tiles, never considered by pathfinding.
+// * Light red: Free tiles, considered by pathfinding.
+// * Light yellow: Free tiles, added to the priority queue as a neighbor but not directly considered.
+// * Green: Free tiles that are part of the final path.
+constexpr bool kOutputDebugImage = false;
+constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathfinding_debug.png";
+
+// Directions are encoded as row-major indices of grid cells in a 4x4 grid,
+// with (1, 1) being the origin of movement. A 3x3 grid would suffice,
+// however, with a 4x4 grid, computations are faster. So, for example,
+// the value 0 corresponds to cell (0, 0) in the grid, which has an offset of (-1, -1)
+// from the movement origin. So, the movement came from (-1, -1).
+// Second example: The value 4 corresponds to cell (0, 1) with movement (-1, 0).
+// The value 5 (PathfindingWorkspace::kCameFromUninitializedValue) corresponds to zero movement,
+// this is used for the start and for initialization.
+static int numNeighborsToCheckArray[11] = {
+  3,
+  7,
+  3,
+  0,  // no valid direction
+  7,
+  8,
+  7,
+  0,  // no valid direction
+  3,
+  7,
+  3,
+};
+static QPoint neighborsToCheckArray[11][8] = {
+  {QPoint(1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(1, 1)},
+  {QPoint(0, 1), /*occ. test*/ QPoint(1, -1), QPoint(1, 0), QPoint(1, 1), /*occ. test*/ QPoint(-1, -1), QPoint(-1, 0), QPoint(-1, 1)},
+  {QPoint(-1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(-1, 1)},
+  {},
+  {QPoint(1, 0), /*occ. test*/ QPoint(-1, -1), QPoint(0, -1), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(0, 1), QPoint(1, 1)},
+  {QPoint(0, -1), QPoint(-1, 0), QPoint(1, 0), QPoint(0, 1), QPoint(1, 1), QPoint(-1, -1), QPoint(1, -1), QPoint(-1, 1)},
+  {QPoint(-1, 0), /*occ. test*/ QPoint(1, -1), QPoint(0, -1), QPoint(-1, -1), /*occ. test*/ QPoint(1, 1), QPoint(0, 1), QPoint(-1, 1)},
+  {},
+  {QPoint(0, -1), QPoint(1, 0), /*dependent on previous being free*/ QPoint(1, -1)},
+  {QPoint(0, -1), /*occ. test*/ QPoint(1, 1), QPoint(1, 0), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(-1, 0), QPoint(-1, -1)},
+  {QPoint(-1, 0), QPoint(0, -1), /*dependent on previous being free*/ QPoint(-1, -1)},
+};
+// Here we encode that diagonal movements require the two adjacent tiles to be free.
+static u8 neighborsRequireFreeTiles[11][8] = {
+  {0, 0, 0b11},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {0, 0, 0b11},
+  {},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {0, 0, 0, 0, 0b1100, 0b0011, 0b0101, 0b1010},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {},
+  {0, 0, 0b11},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {0, 0, 0b11},
+};
+
+/// Uses A* to search for a path from the start tile to any tile within goalRect.
+/// * Treats unit-occupied tiles as obstacles.
+/// * Treats tiles within goalRect as free even if they are occupied,
+///   such that the algorithm can plan a path "into" a target building.
+///
+/// Returns the goal tile that was reached in reachedGoalTile, or (-1, -1) if the goal
+/// is not reachable. In the latter case, closestReachedTile returns the reachable tile that is
+/// closest to the goal, or (-1, -1) if there is no better tile than the start.
+/// The path can then be reconstructed from the workspace's cameFrom state.
+static void SearchPath(const QPoint& start, const QRect& goalRect, const OccupancySnapshot& occupancy, PathfindingWorkspace* workspace, QImage* debugImage, QPoint* reachedGoalTile, QPoint* closestReachedTile) {
+  typedef Fixed CostT;
+  typedef PathfindingWorkspace::Location Location;
+  
+  int mapWidth = occupancy.width;
+  int mapHeight = occupancy.height;
+  
+  // The per-tile state (cost so far and the direction that a tile was reached from)
+  // as well as the open list are kept in the persistent pathfinding workspace,
+  // such that they do not need to be allocated and initialized for each search.
+  workspace->StartNewSearch(mapWidth, mapHeight);
+  std::vector<Location>& openList = workspace->openList;
+  
+  workspace->SetNode(start.x() + mapWidth * start.y(), 0, PathfindingWorkspace::kCameFromUninitializedValue);
+  openList.emplace_back(start, Fixed());
+  
+  CostT smallestReachedHeuristicValue = Fixed::Max();
+  *closestReachedTile = QPoint(-1, -1);
   
   int debugConsideredNodesCount = 0;
   
-  // Set this to true to have a debug image written to /tmp/FreeAge_pathfinding_debug.png.
-  // Legend:
-  // * Black: Occupied tiles.
-  // * Dark green: open rect.
-  // * White: Free tiles, never considered by pathfinding.
-  // * Light red: Free tiles, considered by pathfinding.
-  // * Light yellow: Free tiles, added to the priority queue as a neighbor but not directly considered.
-  // * Green: Free tiles that are part of the final path.
-  constexpr bool kOutputDebugImage = false;
-  constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathfinding_debug.png";
-  QImage debugImage;
-  if (kOutputDebugImage) {
-    debugImage = QImage(mapWidth, mapHeight, QImage::Format_RGB32);
-    for (int y = 0; y < mapHeight; ++ y) {
-      for (int x = 0; x < mapWidth; ++ x) {
-        if (map->occupiedForUnitsAt(x, y)) {
-          debugImage.setPixel(x, y, qRgb(0, 0, 0));
-        } else {
-          debugImage.setPixel(x, y, qRgb(255, 255, 255));
-        }
-      }
-    }
-    for (int y = goalRect.y(); y < goalRect.bottom(); ++ y) {
-      for (int x = goalRect.x(); x < goalRect.right(); ++ x) {
-        debugImage.setPixel(x, y, qRgb(0, 100, 0));
-      }
-    }
-  }
-  
-  QPoint reachedGoalTile(-1, -1);
-  while (!priorityQueue.empty()) {
-    Location current = priorityQueue.top();
-    priorityQueue.pop();
+  *reachedGoalTile = QPoint(-1, -1);
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), std::greater<Location>());
+    Location current = openList.back();
+    openList.pop_back();
     
     ++ debugConsideredNodesCount;
     if (kOutputDebugImage) {
-      debugImage.setPixel(current.loc.x(), current.loc.y(), qRgb(255, 127, 127));
+      debugImage->setPixel(current.loc.x(), current.loc.y(), qRgb(255, 127, 127));
     }
     
     if (goalRect.contains(current.loc, false)) {
-      reachedGoalTile = current.loc;
+      *reachedGoalTile = current.loc;
       break;
     }
     
     int currentGridIndex = current.loc.x() + mapWidth * current.loc.y();
-    CostT currentCost = costSoFar[currentGridIndex];
-    int currentCameFrom = cameFrom[currentGridIndex];
+    CostT currentCost = workspace->GetCostSoFar(currentGridIndex);
+    int currentCameFrom = workspace->GetCameFrom(currentGridIndex);
     
     int numNeighborsToCheck = numNeighborsToCheckArray[currentCameFrom];
     QPoint* neighbors = neighborsToCheckArray[currentCameFrom];
@@ -371,7 +337,7 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
         continue;
       }
       // Skip neighbor if it is occupied.
-      if (map->occupiedForUnitsAt(nextTile.x(), nextTile.y()) && !goalRect.contains(nextTile, false)) {
+      if (occupancy.occupiedForUnitsAt(nextTile.x(), nextTile.y()) && !goalRect.contains(nextTile, false)) {
         // Continue while not skipping over possible neighbors depending on this as an occupancy check (since the check returned true).
         continue;
       }
@@ -386,14 +352,10 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
       }
       
       // Compute the cost to reach this neighbor from the start.
-      constexpr float sqrt2 = 1.41421356237310f;
-      CostT newCost = currentCost + ((neighborDir.manhattanLength() == 2) ? sqrt2 : 1);
+      CostT newCost = currentCost + ((neighborDir.manhattanLength() == 2) ? kFixedSqrt2 : Fixed(1));
       
       // If the cost is better than the best cost known so far, expand the path to this neighbor.
-      CostT* nextCostSoFar = &costSoFar[nextGridIndex];
-      if (newCost < *nextCostSoFar) {
-        *nextCostSoFar = newCost;
-        
+      if (newCost < workspace->GetCostSoFar(nextGridIndex)) {
         // Compute the "diagonal distance" as a heuristic for the remaining path length to the goal.
         // This is a distance metric on the grid while allowing diagonal movements.
         int goalX = std::max(goalRect.x(), std::min(goalRect.x() + goalRect.width() - 1, nextTile.x()));
@@ -402,20 +364,21 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
         int yDiff = std::abs(nextTile.y() - goalY);
         int minDiff = std::min(xDiff, yDiff);
         int maxDiff = std::max(xDiff, yDiff);
-        CostT heuristic = minDiff * sqrt2 + (maxDiff - minDiff) * 1;
+        CostT heuristic = minDiff * kFixedSqrt2 + (maxDiff - minDiff);
         
         // Remember the closest tile to the goal that we found. This becomes important
         // in case we cannot reach the goal at all.
         if (heuristic < smallestReachedHeuristicValue) {
           smallestReachedHeuristicValue = heuristic;
-          smallestReachedHeuristicTile = nextTile;
+          *closestReachedTile = nextTile;
         }
         
-        priorityQueue.emplace(nextTile, newCost + heuristic);
-        cameFrom[nextGridIndex] = ((-neighborDir.x()) + 1) + 4 * ((-neighborDir.y()) + 1);
+        openList.emplace_back(nextTile, newCost + heuristic);
+        std::push_heap(openList.begin(), openList.end(), std::greater<Location>());
+        workspace->SetNode(nextGridIndex, newCost, ((-neighborDir.x()) + 1) + 4 * ((-neighborDir.y()) + 1));
         
         if (kOutputDebugImage) {
-          debugImage.setPixel(nextTile.x(), nextTile.y(), qRgb(255, 255, 127));
+          debugImage->setPixel(nextTile.x(), nextTile.y(), qRgb(255, 255, 127));
         }
       }
     }
@@ -424,21 +387,149 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
   if (kOutputPathfindingDebugMessages) {
     LOG(1) << "Pathfinding: considered " << debugConsideredNodesCount << " nodes (max possible: " << (mapWidth * mapHeight) << ")";
   }
+}
+
+QRect GetPathGoalRect(ServerUnit* unit, ServerMap* map) {
+  // This is done for the tiles taken up by the unit's target.
+  // This allows us to plan a path "into" the target.
+  if (unit->GetTargetObjectId() != kInvalidObjectId) {
+    ServerObject* targetObject = map->GetObjects().Find(unit->GetTargetObjectId());
+    if (targetObject) {
+      if (targetObject->isBuilding()) {
+        ServerBuilding* targetBuilding = AsBuilding(targetObject);
+        
+        QPoint baseTile = targetBuilding->GetBaseTile();
+        QSize buildingSize = GetBuildingSize(targetBuilding->GetType());
+        return QRect(baseTile, buildingSize);
+      }
+    }
+  }
+  
+  return QRect(
+      std::max(0, std::min(map->GetWidth() - 1, unit->GetMoveToTargetMapCoord().x.Floor())),
+      std::max(0, std::min(map->GetHeight() - 1, unit->GetMoveToTargetMapCoord().y.Floor())),
+      1,
+      1);
+}
+
+void CreatePathRequest(ServerUnit* unit, ServerMap* map, bool continueWaypoints, PathRequest* request) {
+  int mapWidth = map->GetWidth();
+  int mapHeight = map->GetHeight();
+  
+  // Determine the tile that the unit stands on. This will be the start tile.
+  QPoint start(
+      std::max(0, std::min(mapWidth - 1, unit->GetMapCoord().x.Floor())),
+      std::max(0, std::min(mapHeight - 1, unit->GetMapCoord().y.Floor())));
+  
+  // Determine the goal tiles and treat them as open even if they are occupied.
+  QRect targetRect = GetPathGoalRect(unit, map);
+  
+  request->unitId = kInvalidObjectId;
+  request->requestId = 0;
+  request->unitRadius = GetUnitRadiusFixed(unit->GetType());
+  request->startMapCoord = unit->GetMapCoord();
+  request->startTile = start;
+  request->moveToTarget = unit->GetMoveToTargetMapCoord();
+  request->targetRect = targetRect;
+  request->goalRect = targetRect;
+  request->planToWaypoint = false;
+  request->occupancy = map->GetOccupancySnapshot();
+  
+  // If a flow field towards the goal is cached (since a group of units was ordered there),
+  // the path can be read off from it directly.
+  request->flowField = map->GetFlowFieldCache()->Find(targetRect, request->occupancy.get());
+  
+  // For long paths, plan on the hierarchical pathfinding graph first. Then, plan the
+  // tile-level path only up to the next waypoint on the hierarchical path. When the unit
+  // reaches the waypoint, PlanUnitPath() is called to plan the following segment.
+  std::vector<QPoint>& reverseWaypoints = request->reverseWaypoints;
+  reverseWaypoints.clear();
+  if (request->flowField) {
+    // The flow field covers the whole path, so no waypoints are needed.
+  } else if (continueWaypoints && unit->HasWaypoints()) {
+    reverseWaypoints = unit->GetWaypoints();
+  } else {
+    QPoint goal(
+        std::max(0, std::min(mapWidth - 1, unit->GetMoveToTargetMapCoord().x.Floor())),
+        std::max(0, std::min(mapHeight - 1, unit->GetMoveToTargetMapCoord().y.Floor())));
+    map->GetPathfindingGraph()->FindPath(map, start, goal, targetRect, &reverseWaypoints);
+  }
+  while (!reverseWaypoints.empty()) {
+    QPoint waypoint = reverseWaypoints.back();
+    reverseWaypoints.pop_back();
+    if (waypoint != start) {
+      request->goalRect = QRect(waypoint.x(), waypoint.y(), 1, 1);
+      request->planToWaypoint = true;
+      break;
+    }
+  }
+}
+
+/// Plans the path for ComputePath() with A*. If the next waypoint of a hierarchical path
+/// cannot be reached, falls back to planning a direct path to the goal, updating goalRect
+/// and planToWaypoint accordingly. Returns true if the goal was reached.
+static bool PlanPathWithAStar(const PathRequest& request, PathfindingWorkspace* workspace, QRect* goalRect, bool* planToWaypoint, PathResult* result) {
+  const OccupancySnapshot& occupancy = *request.occupancy;
+  int mapWidth = occupancy.width;
+  int mapHeight = occupancy.height;
+  const QPoint& start = request.startTile;
+  
+  QImage debugImage;
+  if (kOutputDebugImage) {
+    debugImage = QImage(mapWidth, mapHeight, QImage::Format_RGB32);
+    for (int y = 0; y < mapHeight; ++ y) {
+      for (int x = 0; x < mapWidth; ++ x) {
+        if (occupancy.occupiedForUnitsAt(x, y)) {
+          debugImage.setPixel(x, y, qRgb(0, 0, 0));
+        } else {
+          debugImage.setPixel(x, y, qRgb(255, 255, 255));
+        }
+      }
+    }
+    for (int y = goalRect->y(); y < goalRect->bottom(); ++ y) {
+      for (int x = goalRect->x(); x < goalRect->right(); ++ x) {
+        debugImage.setPixel(x, y, qRgb(0, 100, 0));
+      }
+    }
+  }
+  
+  // Use A* to plan a path from the start to the goal tile.
+  // If the goal is not reachable, return the path that leads to the reachable
+  // position that is closest to the goal.
+  QPoint reachedGoalTile;
+  QPoint closestReachedTile;
+  SearchPath(start, *goalRect, occupancy, workspace, &debugImage, &reachedGoalTile, &closestReachedTile);
+  
+  // If the next waypoint of a hierarchical path cannot be reached (e.g., since a building was placed
+  // on the way after the hierarchical path was planned), drop the remaining waypoints and plan
+  // a direct path to the goal instead.
+  if (*planToWaypoint && reachedGoalTile.x() < 0) {
+    if (kOutputPathfindingDebugMessages) {
+      LOG(1) << "Pathfinding: Waypoint not reachable; planning a direct path instead";
+    }
+    result->reverseWaypoints.clear();
+    *goalRect = request.targetRect;
+    *planToWaypoint = false;
+    SearchPath(start, *goalRect, occupancy, workspace, &debugImage, &reachedGoalTile, &closestReachedTile);
+  }
   
   // Did we find a path to the goal or only to some other tile that is close to the goal?
   QPoint targetTile;
   if (reachedGoalTile.x() < 0) {
     // No path to the goal was found. Go to the reachable node that is closest to the goal.
-    if (smallestReachedHeuristicTile.x() >= 0) {
+    if (closestReachedTile.x() >= 0) {
       if (kOutputPathfindingDebugMessages) {
         LOG(1) << "Pathfinding: Goal not reached; going as close as possible";
       }
-      targetTile = smallestReachedHeuristicTile;
+      targetTile = closestReachedTile;
     } else {
       if (kOutputPathfindingDebugMessages) {
         LOG(1) << "Pathfinding: Goal not reached and there is no better tile than the initial one. Stopping.";
       }
-      unit->StopMovement();
+      result->foundPath = false;
+      result->reversePath.clear();
+      result->reverseWaypoints.clear();
+      return false;
     }
   } else {
     if (kOutputPathfindingDebugMessages) {
@@ -446,19 +537,21 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
     }
     targetTile = reachedGoalTile;
   }
+  result->foundPath = true;
   
   // Reconstruct the path, tracking back from "targetTile" using "cameFrom".
   // We leave out the start tile since the unit is already within that tile.
-  std::vector<QPointF> reversePath;
+  std::vector<FixedPoint>& reversePath = result->reversePath;
+  reversePath.clear();
   QPoint currentTile = targetTile;
   while (currentTile != start) {
-    reversePath.push_back(QPointF(currentTile.x() + 0.5f, currentTile.y() + 0.5f));
+    reversePath.push_back(FixedPoint::TileCenter(currentTile));
     
     if (kOutputDebugImage) {
       debugImage.setPixel(currentTile.x(), currentTile.y(), qRgb(0, 255, 0));
     }
     
-    int cameFromDirection = cameFrom[currentTile.x() + mapWidth * currentTile.y()];
+    int cameFromDirection = workspace->GetCameFrom(currentTile.x() + mapWidth * currentTile.y());
     if (cameFromDirection >= 11 || numNeighborsToCheckArray[cameFromDirection] == 0 || cameFromDirection == 5) {
       LOG(ERROR) << "Erroneous value in cameFrom[] while reconstructing path: " << cameFromDirection;
       break;
@@ -477,13 +570,41 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
     debugImage.save(kDebugImagePath);
   }
   
+  return reachedGoalTile.x() >= 0;
+}
+
+void ComputePath(const PathRequest& request, PathfindingWorkspace* workspace, PathResult* result) {
+  Timer pathPlanningTimer;
+  
+  const OccupancySnapshot& occupancy = *request.occupancy;
+  
+  result->unitId = request.unitId;
+  result->requestId = request.requestId;
+  result->reverseWaypoints = request.reverseWaypoints;
+  
+  QRect goalRect = request.goalRect;
+  bool planToWaypoint = request.planToWaypoint;
+  std::vector<FixedPoint>& reversePath = result->reversePath;
+  
+  bool goalReached;
+  if (request.flowField && request.flowField->GetReversePath(request.startTile, &reversePath)) {
+    // The flow field towards the goal directly yields the path.
+    result->foundPath = true;
+    goalReached = true;
+  } else {
+    goalReached = PlanPathWithAStar(request, workspace, &goalRect, &planToWaypoint, result);
+    if (!result->foundPath) {
+      return;
+    }
+  }
+  
   // Replace the last point with the exact goal location (if we can reach the goal)
   // TODO: If we can't reach the goal, maybe append a point here that makes the unit walk into the obstacle?
-  if (reachedGoalTile.x() >= 0) {
+  if (!planToWaypoint && goalReached) {
     if (reversePath.empty()) {
-      reversePath.push_back(unit->GetMoveToTargetMapCoord());
+      reversePath.push_back(request.moveToTarget);
     } else if (goalRect.width() == 1 && goalRect.height() == 1) {
-      reversePath[0] = unit->GetMoveToTargetMapCoord();
+      reversePath[0] = request.moveToTarget;
     }
   }
   
@@ -492,12 +613,11 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
   }
   
   // Smooth the planned path by attempting to drop corners.
-  float unitRadius = GetUnitRadius(unit->GetType());
   for (usize i = 1; i < reversePath.size(); ++ i) {
-    const QPointF& p0 = (i == reversePath.size() - 1) ? unit->GetMapCoord() : reversePath[i + 1];
-    const QPointF& p1 = reversePath[i - 1];
+    const FixedPoint& p0 = (i == reversePath.size() - 1) ? request.startMapCoord : reversePath[i + 1];
+    const FixedPoint& p1 = reversePath[i - 1];
     
-    if (IsPathFree(unitRadius, p0, p1, goalRect, map)) {
+    if (IsPathFree(request.unitRadius, p0, p1, goalRect, occupancy, workspace)) {
       reversePath.erase(reversePath.begin() + i);
       -- i;
     }
@@ -507,13 +627,29 @@ void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
     LOG(1) << "Pathfinding: Smoothed path length is " << reversePath.size();
     LOG(1) << "Pathfinding: Took " << pathPlanningTimer.Stop(false) << " s" << (kOutputDebugImage ? " (not accurate since kOutputDebugImage is true!)" : "");
   }
+}
+
+void ApplyPathResult(const PathResult& result, ServerUnit* unit) {
+  if (!result.foundPath) {
+    unit->StopMovement();
+    return;
+  }
   
   // Assign the path to the unit.
-  unit->SetPath(reversePath);
+  unit->SetPath(result.reversePath);
+  unit->SetWaypoints(result.reverseWaypoints);
   
   // Start traversing the path:
   // Set the unit's movement direction to the first segment of the path.
-  QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
-  direction = direction / std::max(1e-4f, Length(direction));
-  unit->SetMovementDirection(direction);
+  unit->SetMovementDirection(Normalized(unit->GetNextPathTarget() - unit->GetMapCoord()));
+}
+
+void PlanUnitPath(ServerUnit* unit, ServerMap* map) {
+  PathRequest request;
+  CreatePathRequest(unit, map, /*continueWaypoints*/ true, &request);
+  
+  PathResult result;
+  ComputePath(request, map->GetPathfindingWorkspace(), &result);
+  
+  ApplyPathResult(result, unit);
 }
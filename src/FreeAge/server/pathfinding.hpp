@@ -4,7 +4,177 @@
 
 #pragma once
 
+#include <memory>
+#include <vector>
+
+#include <QPoint>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+#include "FreeAge/server/flow_field.hpp"
+
 class ServerMap;
 class ServerUnit;
 
+/// Immutable copy of the map's unit occupancy grid (see ServerMap::occupiedForUnitsAt()).
+/// Path planning on worker threads reads from such a snapshot, such that the simulation
+/// may modify the map's occupancy in the meantime.
+struct OccupancySnapshot {
+  inline bool occupiedForUnitsAt(int tileX, int tileY) const { return occupiedForUnits[tileY * width + tileX]; }
+  
+  int width;
+  int height;
+  
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<u8> occupiedForUnits;
+};
+
+/// Persistent state for PlanUnitPath(), which is reused among calls in order to
+/// avoid allocating and initializing a full map-sized grid for each call.
+///
+/// Instead of clearing the per-tile node state before each search, each tile
+/// stores the "generation" (i.e., the search) in which its state was last written.
+/// Starting a new search increments the current generation, which invalidates
+/// the state of all tiles at once. Thus, the cost of a search is proportional
+/// to the number of tiles that it actually visits.
+class PathfindingWorkspace {
+ public:
+  /// Directions are encoded as row-major indices of grid cells in a 4x4 grid,
+  /// with (1, 1) being the origin of movement (see PlanUnitPath()).
+  /// The value 5 corresponds to zero movement, this is used for the start and for initialization.
+  static constexpr u8 kCameFromUninitializedValue = 5;
+  
+  /// An entry in the open list.
+  struct Location {
+    QPoint loc;
+    Fixed priority;
+    
+    inline Location(const QPoint& loc, Fixed priority)
+        : loc(loc),
+          priority(priority) {}
+    
+    inline bool operator> (const Location& other) const {
+      return priority > other.priority;
+    }
+  };
+  
+  /// Prepares the workspace for a new search on a map with the given size.
+  /// This invalidates the state of all tiles.
+  void StartNewSearch(int mapWidth, int mapHeight);
+  
+  /// Returns the cost to reach the tile with the given index that was found
+  /// in the current search so far, or Fixed::Max() if the tile was not reached yet.
+  inline Fixed GetCostSoFar(int gridIndex) const {
+    return (nodeGeneration[gridIndex] == generation) ? costSoFar[gridIndex] : Fixed::Max();
+  }
+  
+  /// Returns the direction from which the tile with the given index was reached
+  /// in the current search, or kCameFromUninitializedValue if it was not reached yet.
+  inline u8 GetCameFrom(int gridIndex) const {
+    return (nodeGeneration[gridIndex] == generation) ? cameFrom[gridIndex] : kCameFromUninitializedValue;
+  }
+  
+  /// Sets the state of the tile with the given index for the current search.
+  inline void SetNode(int gridIndex, Fixed cost, u8 cameFromDirection) {
+    nodeGeneration[gridIndex] = generation;
+    costSoFar[gridIndex] = cost;
+    cameFrom[gridIndex] = cameFromDirection;
+  }
+  
+  /// The open list of the A* search, organized as a min-heap on the priority
+  /// (using std::push_heap() / std::pop_heap() with std::greater<Location>).
+  /// Cleared by StartNewSearch(), but its capacity is retained.
+  std::vector<Location> openList;
+  
+  /// Buffer for rasterizing the area swept by a unit in IsPathFree().
+  /// For each map row, stores the range of columns that is covered.
+  std::vector<std::pair<int, int>> rowRanges;
+  
+ private:
+  /// The generation of the current search. Tiles whose nodeGeneration differs
+  /// from this have not been reached in the current search.
+  u32 generation = 0;
+  
+  /// Per-tile state. An element (x, y) has index: [y * mapWidth + x].
+  std::vector<u32> nodeGeneration;
+  std::vector<Fixed> costSoFar;
+  std::vector<u8> cameFrom;
+};
+
+/// Input for planning a unit's path, created by CreatePathRequest().
+/// This contains everything that ComputePath() needs, such that the latter does not need
+/// to access the map or the unit (and can thus run on a worker thread).
+struct PathRequest {
+  /// The ID of the unit to plan the path for. Not used by ComputePath() itself.
+  u32 unitId;
+  
+  /// ID assigned by the PathPlanner, used to recognize outdated results. Not used by ComputePath() itself.
+  u32 requestId;
+  
+  Fixed unitRadius;
+  FixedPoint startMapCoord;
+  QPoint startTile;
+  
+  /// The unit's move-to target, and the tiles that are treated as free around it
+  /// (i.e., the tiles of the target building, if any).
+  FixedPoint moveToTarget;
+  QRect targetRect;
+  
+  /// The tiles that the path to plan should lead to. This is either targetRect,
+  /// or the next waypoint of a hierarchical path (if planToWaypoint is true).
+  QRect goalRect;
+  bool planToWaypoint;
+  
+  /// The remaining waypoints of the hierarchical path after goalRect, in reverse order.
+  std::vector<QPoint> reverseWaypoints;
+  
+  std::shared_ptr<const OccupancySnapshot> occupancy;
+  
+  /// Cached flow field towards targetRect, if available. In this case, the path is read off
+  /// from the flow field instead of being planned with A*.
+  std::shared_ptr<const FlowField> flowField;
+};
+
+/// Output of ComputePath().
+struct PathResult {
+  u32 unitId;
+  u32 requestId;
+  
+  /// If false, no tile that gets the unit closer to its goal was found, and the unit should stop.
+  bool foundPath;
+  
+  /// The planned path. The first entry is the last node in the path, thus "reverse".
+  std::vector<FixedPoint> reversePath;
+  
+  /// The remaining waypoints of the hierarchical path (see ServerUnit::HasWaypoints()).
+  std::vector<QPoint> reverseWaypoints;
+};
+
+/// Returns the tiles that the path of the unit towards its current move-to target or target
+/// object should lead to. For target buildings, these are all tiles of the building,
+/// which are treated as free, such that the path can lead "into" the building.
+QRect GetPathGoalRect(ServerUnit* unit, ServerMap* map);
+
+/// Prepares the planning of a path for the unit towards its current move-to target or target object.
+/// This must be called on the simulation thread.
+///
+/// For long distances, the path is first planned on the map's hierarchical pathfinding
+/// graph, and the tile-level path only leads to the next waypoint on that path
+/// (see ServerUnit::HasWaypoints()). If continueWaypoints is true and the unit has remaining
+/// waypoints, the request instead continues the unit's existing hierarchical path.
+void CreatePathRequest(ServerUnit* unit, ServerMap* map, bool continueWaypoints, PathRequest* request);
+
+/// Plans the tile-level path for the given request. This only accesses the request
+/// and the workspace, so it may run on any thread as long as the workspace is not shared.
+void ComputePath(const PathRequest& request, PathfindingWorkspace* workspace, PathResult* result);
+
+/// Assigns the planned path to the unit and starts moving along it.
+void ApplyPathResult(const PathResult& result, ServerUnit* unit);
+
+/// Plans a path for the unit towards its current move-to target or target object
+/// synchronously and assigns it to the unit. Uses the map's pathfinding workspace.
+/// If the unit has remaining waypoints of a hierarchical path, this plans the
+/// path to the next waypoint. Once the unit reaches it, this function needs to be
+/// called again to plan the next segment.
 void PlanUnitPath(ServerUnit* unit, ServerMap* map);
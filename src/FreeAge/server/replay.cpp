@@ -0,0 +1,212 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/replay.hpp"
+
+#include <mango/core/endian.hpp>
+
+#include "FreeAge/common/logging.hpp"
+
+/// Magic bytes at the start of every replay file.
+static const char kReplayMagic[8] = {'F', 'A', 'R', 'E', 'P', 'L', 'A', 'Y'};
+
+bool ReplayWriter::Open(const QString& path, const ReplayHeader& header) {
+  file.setFileName(path);
+  if (!file.open(QIODevice::WriteOnly)) {
+    LOG(ERROR) << "Failed to create the replay file: " << path.toStdString();
+    return false;
+  }
+  
+  buffer.clear();
+  buffer.append(kReplayMagic, sizeof(kReplayMagic));
+  
+  char fixedPart[4 + 2 + 4 + 8 + 1];
+  mango::ustore32(fixedPart + 0, kReplayFormatVersion);
+  mango::ustore16(fixedPart + 4, header.mapSize);
+  mango::ustore32(fixedPart + 6, header.mapSeed);
+  memcpy(fixedPart + 10, &header.gameBeginServerTime, 8);
+  fixedPart[18] = header.players.size();
+  buffer.append(fixedPart, sizeof(fixedPart));
+  
+  for (const ReplayHeader::Player& player : header.players) {
+    QByteArray name = player.name.toUtf8();
+    
+    char playerPart[1 + 2];
+    playerPart[0] = player.playerColorIndex;
+    mango::ustore16(playerPart + 1, name.size());
+    buffer.append(playerPart, sizeof(playerPart));
+    buffer.append(name);
+    
+    char resourcesPart[4 * 4];
+    mango::ustore32(resourcesPart + 0, player.initialResources.wood());
+    mango::ustore32(resourcesPart + 4, player.initialResources.food());
+    mango::ustore32(resourcesPart + 8, player.initialResources.gold());
+    mango::ustore32(resourcesPart + 12, player.initialResources.stone());
+    buffer.append(resourcesPart, sizeof(resourcesPart));
+  }
+  
+  Flush();
+  return true;
+}
+
+void ReplayWriter::WriteClientMessage(u32 gameStep, int playerIndex, const QByteArray& msg) {
+  AppendRecordHeader(ReplayRecordType::ClientMessage, gameStep, playerIndex);
+  buffer.append(msg);
+}
+
+void ReplayWriter::WritePlayerExit(u32 gameStep, int playerIndex, PlayerExitReason reason) {
+  AppendRecordHeader(ReplayRecordType::PlayerExit, gameStep, playerIndex);
+  buffer.append(static_cast<char>(reason));
+}
+
+void ReplayWriter::WriteStateChecksum(u32 gameStep, u64 checksum) {
+  AppendRecordHeader(ReplayRecordType::StateChecksum, gameStep, 0);
+  char checksumPart[8];
+  mango::ustore64(checksumPart, checksum);
+  buffer.append(checksumPart, sizeof(checksumPart));
+}
+
+void ReplayWriter::Flush() {
+  if (buffer.isEmpty() || !file.isOpen()) {
+    return;
+  }
+  if (file.write(buffer) != buffer.size()) {
+    LOG(ERROR) << "Failed to write to the replay file: " << file.fileName().toStdString();
+  }
+  file.flush();
+  buffer.clear();
+}
+
+void ReplayWriter::Close(u32 gameStep) {
+  if (!file.isOpen()) {
+    return;
+  }
+  AppendRecordHeader(ReplayRecordType::GameEnd, gameStep, 0);
+  Flush();
+  file.close();
+}
+
+void ReplayWriter::AppendRecordHeader(ReplayRecordType type, u32 gameStep, int playerIndex) {
+  char recordHeader[1 + 4 + 1];
+  recordHeader[0] = static_cast<char>(type);
+  mango::ustore32(recordHeader + 1, gameStep);
+  recordHeader[5] = playerIndex;
+  buffer.append(recordHeader, sizeof(recordHeader));
+}
+
+
+bool ReplayReader::Open(const QString& path) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    LOG(ERROR) << "Failed to open the replay file: " << path.toStdString();
+    return false;
+  }
+  data = file.readAll();
+  readOffset = 0;
+  gameEndRead = false;
+  
+  constexpr int kFixedHeaderSize = sizeof(kReplayMagic) + 4 + 2 + 4 + 8 + 1;
+  if (data.size() < kFixedHeaderSize ||
+      memcmp(data.data(), kReplayMagic, sizeof(kReplayMagic)) != 0) {
+    LOG(ERROR) << "Not a replay file: " << path.toStdString();
+    return false;
+  }
+  const char* fixedPart = data.data() + sizeof(kReplayMagic);
+  u32 formatVersion = mango::uload32(fixedPart + 0);
+  if (formatVersion != kReplayFormatVersion) {
+    LOG(ERROR) << "Unsupported replay format version: " << formatVersion << " (supported version: " << kReplayFormatVersion << ")";
+    return false;
+  }
+  header.mapSize = mango::uload16(fixedPart + 4);
+  header.mapSeed = mango::uload32(fixedPart + 6);
+  memcpy(&header.gameBeginServerTime, fixedPart + 10, 8);
+  int playerCount = static_cast<u8>(fixedPart[18]);
+  readOffset = kFixedHeaderSize;
+  
+  header.players.resize(playerCount);
+  for (ReplayHeader::Player& player : header.players) {
+    if (data.size() < readOffset + 3) {
+      LOG(ERROR) << "Truncated replay header";
+      return false;
+    }
+    player.playerColorIndex = static_cast<u8>(data[readOffset]);
+    int nameLength = mango::uload16(data.data() + readOffset + 1);
+    readOffset += 3;
+    
+    if (data.size() < readOffset + nameLength + 4 * 4) {
+      LOG(ERROR) << "Truncated replay header";
+      return false;
+    }
+    player.name = QString::fromUtf8(data.data() + readOffset, nameLength);
+    readOffset += nameLength;
+    
+    const char* resourcesPart = data.data() + readOffset;
+    player.initialResources = ResourceAmount(
+        mango::uload32(resourcesPart + 0),
+        mango::uload32(resourcesPart + 4),
+        mango::uload32(resourcesPart + 8),
+        mango::uload32(resourcesPart + 12));
+    readOffset += 4 * 4;
+  }
+  
+  return true;
+}
+
+bool ReplayReader::ReadRecord(ReplayRecord* record) {
+  if (gameEndRead) {
+    return false;
+  }
+  
+  constexpr int kRecordHeaderSize = 1 + 4 + 1;
+  if (data.size() < readOffset + kRecordHeaderSize) {
+    LOG(ERROR) << "The replay ends without a GameEnd record";
+    return false;
+  }
+  const char* recordHeader = data.data() + readOffset;
+  record->type = static_cast<ReplayRecordType>(recordHeader[0]);
+  record->gameStep = mango::uload32(recordHeader + 1);
+  record->playerIndex = recordHeader[5];
+  readOffset += kRecordHeaderSize;
+  
+  switch (record->type) {
+  case ReplayRecordType::ClientMessage: {
+    if (data.size() < readOffset + 3) {
+      LOG(ERROR) << "Truncated replay record";
+      return false;
+    }
+    u16 msgLength = mango::uload16(data.data() + readOffset + 1);
+    if (msgLength < 3 || data.size() < readOffset + msgLength) {
+      LOG(ERROR) << "Truncated or invalid replay record";
+      return false;
+    }
+    record->message = data.mid(readOffset, msgLength);
+    readOffset += msgLength;
+    break;
+  }
+  case ReplayRecordType::PlayerExit:
+    if (data.size() < readOffset + 1) {
+      LOG(ERROR) << "Truncated replay record";
+      return false;
+    }
+    record->exitReason = static_cast<PlayerExitReason>(data[readOffset]);
+    readOffset += 1;
+    break;
+  case ReplayRecordType::GameEnd:
+    gameEndRead = true;
+    break;
+  case ReplayRecordType::StateChecksum:
+    if (data.size() < readOffset + 8) {
+      LOG(ERROR) << "Truncated replay record";
+      return false;
+    }
+    record->stateChecksum = mango::uload64(data.data() + readOffset);
+    readOffset += 8;
+    break;
+  default:
+    LOG(ERROR) << "Invalid replay record type: " << static_cast<int>(record->type);
+    return false;
+  }
+  
+  return true;
+}
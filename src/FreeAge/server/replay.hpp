@@ -0,0 +1,138 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/resources.hpp"
+
+/// Version of the replay file format. Replays are only valid for the server version
+/// that recorded them, since they rely on the simulation being deterministic.
+constexpr u32 kReplayFormatVersion = 2;
+
+/// Types of the records in a replay file.
+enum class ReplayRecordType : u8 {
+  /// A client-to-server message with a player command (for example, ProduceUnit)
+  /// that was handled before simulating the record's game step.
+  ClientMessage = 0,
+  
+  /// The player left the game (by resigning or dropping) before simulating the record's game step.
+  /// Defeats are not recorded, since they follow from the simulation.
+  PlayerExit,
+  
+  /// The game ended before simulating the record's game step. This is the last record in the file.
+  GameEnd,
+  
+  /// The state checksum (see Game::GetStateChecksum()) before simulating the record's game step.
+  /// Used to detect whether playing back the replay diverges from the recorded game.
+  StateChecksum
+};
+
+/// The data at the start of a replay file, with which the game can be set up again.
+struct ReplayHeader {
+  struct Player {
+    QString name;
+    int playerColorIndex;
+    ResourceAmount initialResources;
+  };
+  
+  u16 mapSize;
+  int mapSeed;
+  
+  /// Server time at which the first game step was simulated. Since the server time
+  /// of each game step is computed from this, it is required to replay the game exactly.
+  double gameBeginServerTime;
+  
+  std::vector<Player> players;
+};
+
+/// A record in a replay file.
+struct ReplayRecord {
+  ReplayRecordType type;
+  
+  /// Index of the game step before which the record applies, counting from zero at the start of the game.
+  u32 gameStep;
+  
+  u8 playerIndex;
+  
+  /// For ClientMessage records, the message (including its header).
+  QByteArray message;
+  
+  /// For PlayerExit records, the reason for the exit.
+  PlayerExitReason exitReason;
+  
+  /// For StateChecksum records, the checksum.
+  u64 stateChecksum;
+};
+
+/// Records a game into a replay file.
+///
+/// Since the game simulation is deterministic, a replay only needs to store the
+/// game setup and the player commands together with the game steps at which they
+/// were handled. Replays can be played back with ReplayReader, for example by the
+/// server benchmark.
+///
+/// File format (all numbers are little-endian):
+/// - Header: "FAREPLAY", u32 format version, u16 map size, u32 map seed,
+///   f64 game begin server time, u8 player count, and for each player:
+///   u8 color index, u16 name length, UTF-8 name, u32 wood / food / gold / stone.
+/// - Records: u8 type, u32 game step, u8 player index, and depending on the type:
+///   the client-to-server message (ClientMessage), u8 exit reason (PlayerExit), nothing (GameEnd),
+///   or u64 state checksum (StateChecksum).
+class ReplayWriter {
+ public:
+  /// Creates the replay file and writes the header. Returns false on failure.
+  bool Open(const QString& path, const ReplayHeader& header);
+  
+  void WriteClientMessage(u32 gameStep, int playerIndex, const QByteArray& msg);
+  void WritePlayerExit(u32 gameStep, int playerIndex, PlayerExitReason reason);
+  void WriteStateChecksum(u32 gameStep, u64 checksum);
+  
+  /// Writes all records that were added since the last call to the file.
+  /// This is called once per game step, such that the replay is complete up to the last step
+  /// even if the server crashes.
+  void Flush();
+  
+  /// Writes the GameEnd record and closes the file.
+  void Close(u32 gameStep);
+  
+ private:
+  void AppendRecordHeader(ReplayRecordType type, u32 gameStep, int playerIndex);
+  
+  
+  QFile file;
+  
+  /// Records that were not written to the file yet.
+  QByteArray buffer;
+};
+
+/// Reads a replay file that was written by ReplayWriter.
+class ReplayReader {
+ public:
+  /// Reads the replay file and parses its header. Returns false on failure.
+  bool Open(const QString& path);
+  
+  /// Reads the next record. Returns false after the GameEnd record has been read, or on error.
+  bool ReadRecord(ReplayRecord* record);
+  
+  inline const ReplayHeader& GetHeader() const { return header; }
+  
+ private:
+  ReplayHeader header;
+  
+  /// The file content.
+  QByteArray data;
+  
+  /// Offset of the next record in data.
+  int readOffset;
+  
+  bool gameEndRead;
+};
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <QByteArray>
+#include <QString>
 
 #include "FreeAge/common/free_age.hpp"
 
@@ -27,4 +28,7 @@ struct ServerSettings {
   
   /// The map size chosen by the host.
   u16 mapSize = kDefaultMapSize;
+  
+  /// If not empty, a replay of the game is recorded into this directory (see ReplayWriter).
+  QString replayDirectory;
 };
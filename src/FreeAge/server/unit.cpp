@@ -6,35 +6,33 @@
 
 #include "FreeAge/server/building.hpp"
 
-ServerUnit::ServerUnit(int playerIndex, UnitType type, const QPointF& mapCoord)
-    : ServerObject(ObjectType::Unit, playerIndex),
-      type(type),
-      mapCoord(mapCoord),
+ServerUnit::ServerUnit(ServerObjectComponents* components, u32 slot)
+    : ServerObject(components, slot),
       currentAction(UnitAction::Idle) {
-  SetHP(GetUnitMaxHP(type));
+  SetHP(static_cast<int>(GetUnitMaxHP(GetType())));
 }
 
 void ServerUnit::SetTarget(u32 targetObjectId, ServerObject* targetObject, bool isManualTargeting) {
   InteractionType interaction = GetInteractionType(this, targetObject);
   
   if (interaction == InteractionType::Construct) {
-    type = IsMaleVillager(type) ? UnitType::MaleVillagerBuilder : UnitType::FemaleVillagerBuilder;
+    SetType(IsMaleVillager(GetType()) ? UnitType::MaleVillagerBuilder : UnitType::FemaleVillagerBuilder);
     SetTargetInternal(targetObjectId, targetObject, isManualTargeting);
     return;
   } else if (interaction == InteractionType::CollectBerries) {
-    type = IsMaleVillager(type) ? UnitType::MaleVillagerForager : UnitType::FemaleVillagerForager;
+    SetType(IsMaleVillager(GetType()) ? UnitType::MaleVillagerForager : UnitType::FemaleVillagerForager);
     SetTargetInternal(targetObjectId, targetObject, isManualTargeting);
     return;
   } else if (interaction == InteractionType::CollectWood) {
-    type = IsMaleVillager(type) ? UnitType::MaleVillagerLumberjack : UnitType::FemaleVillagerLumberjack;
+    SetType(IsMaleVillager(GetType()) ? UnitType::MaleVillagerLumberjack : UnitType::FemaleVillagerLumberjack);
     SetTargetInternal(targetObjectId, targetObject, isManualTargeting);
     return;
   } else if (interaction == InteractionType::CollectGold) {
-    type = IsMaleVillager(type) ? UnitType::MaleVillagerGoldMiner : UnitType::FemaleVillagerGoldMiner;
+    SetType(IsMaleVillager(GetType()) ? UnitType::MaleVillagerGoldMiner : UnitType::FemaleVillagerGoldMiner);
     SetTargetInternal(targetObjectId, targetObject, isManualTargeting);
     return;
   } else if (interaction == InteractionType::CollectStone) {
-    type = IsMaleVillager(type) ? UnitType::MaleVillagerStoneMiner : UnitType::FemaleVillagerStoneMiner;
+    SetType(IsMaleVillager(GetType()) ? UnitType::MaleVillagerStoneMiner : UnitType::FemaleVillagerStoneMiner);
     SetTargetInternal(targetObjectId, targetObject, isManualTargeting);
     return;
   } else if (interaction == InteractionType::DropOffResource) {
@@ -52,9 +50,11 @@ void ServerUnit::RemoveTarget() {
   targetObjectId = kInvalidObjectId;
 }
 
-void ServerUnit::SetMoveToTarget(const QPointF& mapCoord) {
+void ServerUnit::SetMoveToTarget(const FixedPoint& mapCoord) {
   // The path will be computed on the next game state update.
   hasPath = false;
+  reverseWaypoints.clear();
+  pendingPathRequestId = 0;
   
   moveToTarget = mapCoord;
   hasMoveToTarget = true;
@@ -66,11 +66,15 @@ void ServerUnit::SetMoveToTarget(const QPointF& mapCoord) {
 void ServerUnit::SetTargetInternal(u32 targetObjectId, ServerObject* targetObject, bool isManualTargeting) {
   // The path will be computed on the next game state update.
   hasPath = false;
+  reverseWaypoints.clear();
+  pendingPathRequestId = 0;
   
   if (targetObject->isBuilding()) {
     ServerBuilding* targetBuilding = AsBuilding(targetObject);
     QSize buildingSize = GetBuildingSize(targetBuilding->GetType());
-    moveToTarget = targetBuilding->GetBaseTile() + 0.5f * QPointF(buildingSize.width(), buildingSize.height());
+    moveToTarget = FixedPoint(
+        targetBuilding->GetBaseTile().x() + Fixed(buildingSize.width()) / 2,
+        targetBuilding->GetBaseTile().y() + Fixed(buildingSize.height()) / 2);
   } else if (targetObject->isUnit()) {
     ServerUnit* targetUnit = AsUnit(targetObject);
     moveToTarget = targetUnit->GetMapCoord();
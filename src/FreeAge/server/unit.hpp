@@ -4,26 +4,32 @@
 
 #pragma once
 
-#include <QPointF>
+#include <vector>
+
+#include <QPoint>
 
 #include "FreeAge/common/unit_types.hpp"
+#include "FreeAge/server/fixed_point.hpp"
 #include "FreeAge/server/object.hpp"
 
 /// Represents a unit on the server.
 class ServerUnit : public ServerObject {
  public:
-  ServerUnit(int playerIndex, UnitType type, const QPointF& mapCoord);
+  /// Creates the unit for the given slot of the ServerObjectStore, whose components must have been initialized already.
+  ServerUnit(ServerObjectComponents* components, u32 slot);
   
-  inline UnitType GetType() const { return type; }
+  inline UnitType GetType() const { return static_cast<UnitType>(components->types[slot]); }
   
-  inline const QPointF& GetMapCoord() const { return mapCoord; }
-  inline void SetMapCoord(const QPointF& mapCoord) { this->mapCoord = mapCoord; }
+  inline FixedPoint GetMapCoord() const { return components->mapCoords[slot]; }
+  /// Sets the unit's mapCoord. Use ServerMap::SetUnitMapCoord() instead,
+  /// which keeps the map's spatial index up to date.
+  inline void SetMapCoord(const FixedPoint& mapCoord) { components->mapCoords[slot] = mapCoord; }
   
   inline UnitAction GetCurrentAction() const { return currentAction; }
   inline void SetCurrentAction(UnitAction newAction) { currentAction = newAction; }
   
-  inline double GetCurrentActionStartTime() const { return currentActionStartTime; }
-  inline void SetCurrentActionStartTime(double time) { currentActionStartTime = time; }
+  inline u64 GetCurrentActionStartStep() const { return currentActionStartStep; }
+  inline void SetCurrentActionStartStep(u64 gameStepIndex) { currentActionStartStep = gameStepIndex; }
   
   /// Attempts to command the unit to interact with the given target object.
   /// If the unit cannot actually interact with that object, this call does nothing.
@@ -33,43 +39,63 @@ class ServerUnit : public ServerObject {
   inline u32 GetManuallyTargetedObjectId() const { return manuallyTargetedObjectId; }
   
   /// Commands the unit to move to the given mapCoord.
-  void SetMoveToTarget(const QPointF& mapCoord);
+  void SetMoveToTarget(const FixedPoint& mapCoord);
   inline bool HasMoveToTarget() const { return hasMoveToTarget; }
-  inline const QPointF& GetMoveToTargetMapCoord() const { return moveToTarget; }
+  inline const FixedPoint& GetMoveToTargetMapCoord() const { return moveToTarget; }
+  /// Changes the map coord of the current move-to target without invalidating the current path
+  /// (in contrast to SetMoveToTarget()). Used when re-planning the path to a moving target.
+  inline void UpdateMoveToTargetMapCoord(const FixedPoint& mapCoord) { moveToTarget = mapCoord; }
   
   // TODO: Accept more complex paths (rather than just a single target).
   inline bool HasPath() const { return hasPath; }
-  inline void SetPath(const std::vector<QPointF>& reversePath) { hasPath = true; this->reversePath = reversePath; }
+  inline void SetPath(const std::vector<FixedPoint>& reversePath) { hasPath = true; this->reversePath = reversePath; }
   inline void PauseMovement() { currentAction = UnitAction::Idle; }
-  inline void StopMovement() { currentAction = UnitAction::Idle; hasMoveToTarget = false; hasPath = false; currentMovementDirection = QPointF(0, 0); }
-  inline const QPointF& GetNextPathTarget() const { return reversePath.empty() ? moveToTarget : reversePath.back(); }
+  inline void StopMovement() { currentAction = UnitAction::Idle; hasMoveToTarget = false; hasPath = false; reverseWaypoints.clear(); pendingPathRequestId = 0; currentMovementDirection = FixedPoint(); }
+  inline const FixedPoint& GetNextPathTarget() const { return reversePath.empty() ? moveToTarget : reversePath.back(); }
   inline void PathSegmentCompleted() { reversePath.pop_back(); if (reversePath.empty()) { hasPath = false; } }
   
-  inline const QPointF& GetMovementDirection() const { return currentMovementDirection; }
-  inline void SetMovementDirection(const QPointF& direction) { currentMovementDirection = direction; }
+  /// Waypoints of a long path that was planned on the hierarchical pathfinding graph.
+  /// The (tile-level) path is only planned up to the next waypoint at a time.
+  inline bool HasWaypoints() const { return !reverseWaypoints.empty(); }
+  inline void SetWaypoints(const std::vector<QPoint>& reverseWaypoints) { this->reverseWaypoints = reverseWaypoints; }
+  inline const std::vector<QPoint>& GetWaypoints() const { return reverseWaypoints; }
+  inline void ClearWaypoints() { reverseWaypoints.clear(); }
+  
+  /// The ID of the asynchronous path request (see PathPlanner) whose result the unit waits for,
+  /// or 0 if it does not wait for a path. Giving the unit a new target resets this to 0,
+  /// such that the results of outdated requests get discarded.
+  inline bool IsWaitingForPath() const { return pendingPathRequestId != 0; }
+  inline u32 GetPendingPathRequestId() const { return pendingPathRequestId; }
+  inline void SetPendingPathRequestId(u32 requestId) { pendingPathRequestId = requestId; }
+  
+  inline const FixedPoint& GetMovementDirection() const { return currentMovementDirection; }
+  inline void SetMovementDirection(const FixedPoint& direction) { currentMovementDirection = direction; }
   
   inline ResourceType GetCarriedResourceType() const { return carriedResourceType; }
   inline void SetCarriedResourceType(ResourceType type) { carriedResourceType = type; }
   
-  inline int GetCarriedResourceAmount() const { return static_cast<int>(carriedResourceAmount); }
-  inline float GetCarriedResourceAmountInternalFloat() const { return carriedResourceAmount; }
-  inline void SetCarriedResourceAmount(float amount) { carriedResourceAmount = amount; }
+  inline int GetCarriedResourceAmount() const { return carriedResourceAmount.Floor(); }
+  inline Fixed GetCarriedResourceAmountInternal() const { return carriedResourceAmount; }
+  inline void SetCarriedResourceAmount(Fixed amount) { carriedResourceAmount = amount; }
+  
+  /// The tile at which the unit's field of view is centered, if HasFieldOfView().
+  inline const QPoint& GetFieldOfViewTile() const { return fieldOfViewTile; }
+  inline void SetFieldOfViewTile(const QPoint& tile) { fieldOfViewTile = tile; }
   
   // TODO: Load this from some database for each unit type
-  inline float GetMoveSpeed() const { return (type == UnitType::Scout) ? 2.f : 1.f; }
+  inline Fixed GetMoveSpeed() const { return (GetType() == UnitType::Scout) ? 2 : 1; }
   
  private:
   void SetTargetInternal(u32 targetObjectId, ServerObject* targetObject, bool isManualTargeting);
   
+  inline void SetType(UnitType type) { components->types[slot] = static_cast<u16>(type); }
   
-  UnitType type;
-  QPointF mapCoord;
   
   UnitAction currentAction;
   
-  /// The server time at which the current action started.
+  /// The index of the game step in which the current action started.
   /// Only used for actions where it matters (e.g., attacking).
-  double currentActionStartTime;
+  u64 currentActionStartStep = 0;
   
   /// The unit's target object (if any). Set to kInvalidObjectId if the unit does not have a target.
   u32 targetObjectId = kInvalidObjectId;
@@ -87,25 +113,40 @@ class ServerUnit : public ServerObject {
   
   /// The unit's map coord target (if any).
   bool hasMoveToTarget = false;
-  QPointF moveToTarget;
+  FixedPoint moveToTarget;
   
   /// Whether reversePath is valid. TODO: Could be dropped now; could represent not having a path as reversePath being empty
   bool hasPath = false;
   /// The currenly planned path to the unit's target. The first entry is the last node in the path, thus "reverse".
-  std::vector<QPointF> reversePath;
+  std::vector<FixedPoint> reversePath;
+  
+  /// The remaining waypoints of a hierarchically planned path, in reverse order
+  /// (i.e., the first entry is the last waypoint). See HasWaypoints().
+  std::vector<QPoint> reverseWaypoints;
+  
+  /// See IsWaitingForPath().
+  u32 pendingPathRequestId = 0;
   
   /// The current movement direction of the unit for the current linear segment of its planned path.
   /// This is in general the only movement-related piece of information that the clients know about.
   /// If this changes, the clients that see the unit need to be notified.
-  QPointF currentMovementDirection = QPointF(0, 0);
+  FixedPoint currentMovementDirection;
   
   /// Amount of resources carried (for villagers).
-  float carriedResourceAmount = 0;
+  Fixed carriedResourceAmount;
   
   // Type of resources carried (for villagers).
   ResourceType carriedResourceType = ResourceType::NumTypes;
+  
+  /// See GetFieldOfViewTile().
+  QPoint fieldOfViewTile;
 };
 
+/// Returns GetUnitRadius() as a fixed-point number, for use in the simulation.
+inline Fixed GetUnitRadiusFixed(UnitType type) {
+  return Fixed::FromFloat(GetUnitRadius(type));
+}
+
 /// Convenience function to cast a ServerUnit to a ServerObject.
 /// Before using this, you must ensure that object->isUnit().
 inline ServerUnit* AsUnit(ServerObject* object) {
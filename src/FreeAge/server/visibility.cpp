@@ -0,0 +1,60 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/visibility.hpp"
+
+#include <algorithm>
+
+ServerVisibility::ServerVisibility(int width, int height, int playerCount)
+    : width(width),
+      height(height) {
+  viewCount.resize(playerCount);
+  for (std::vector<u16>& playerViewCount : viewCount) {
+    playerViewCount.assign(width * height, 0);
+  }
+}
+
+void ServerVisibility::UpdateFieldOfView(int playerIndex, float centerMapCoordX, float centerMapCoordY, float radius, int change) {
+  // Use the same tile pattern as the client (see Map::UpdateFieldOfView() in the client).
+  float effectiveRadius = radius + 0.7f;
+  float effectiveRadiusSquared = effectiveRadius * effectiveRadius;
+  
+  int minX = std::max<int>(0, centerMapCoordX - effectiveRadius);
+  int minY = std::max<int>(0, centerMapCoordY - effectiveRadius);
+  int maxX = std::min<int>(width - 1, centerMapCoordX + effectiveRadius);
+  int maxY = std::min<int>(height - 1, centerMapCoordY + effectiveRadius);
+  
+  float centerMapCoordXMinusHalf = centerMapCoordX - 0.5f;
+  float centerMapCoordYMinusHalf = centerMapCoordY - 0.5f;
+  
+  std::vector<u16>& playerViewCount = viewCount[playerIndex];
+  for (int y = minY; y <= maxY; ++ y) {
+    u16* row = playerViewCount.data() + width * y;
+    for (int x = minX; x <= maxX; ++ x) {
+      float dx = x - centerMapCoordXMinusHalf;
+      float dy = y - centerMapCoordYMinusHalf;
+      
+      if (dx * dx + dy * dy <= effectiveRadiusSquared) {
+        row[x] += change;
+      }
+    }
+  }
+}
+
+bool ServerVisibility::IsAreaVisible(int playerIndex, const QRect& tileRect) const {
+  int minX = std::max(0, tileRect.x());
+  int minY = std::max(0, tileRect.y());
+  int maxX = std::min(width - 1, tileRect.x() + tileRect.width() - 1);
+  int maxY = std::min(height - 1, tileRect.y() + tileRect.height() - 1);
+  
+  const std::vector<u16>& playerViewCount = viewCount[playerIndex];
+  for (int y = minY; y <= maxY; ++ y) {
+    for (int x = minX; x <= maxX; ++ x) {
+      if (playerViewCount[y * width + x] > 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,44 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Tracks for each player which map tiles are currently within the line of sight of
+/// the player's objects. For each player and tile, this counts the number of objects
+/// that see the tile, such that objects can be added and removed independently.
+/// This mirrors the client's view count in Map::UpdateFieldOfView().
+class ServerVisibility {
+ public:
+  ServerVisibility(int width, int height, int playerCount);
+  
+  /// Adds (change = 1) or removes (change = -1) a field of view with the given center and radius
+  /// to the given player's visibility. Removals must use the same arguments as the corresponding addition.
+  void UpdateFieldOfView(int playerIndex, float centerMapCoordX, float centerMapCoordY, float radius, int change);
+  
+  /// Returns whether the given tile is currently seen by the given player.
+  /// Tiles outside of the map are not seen.
+  inline bool IsTileVisible(int playerIndex, int tileX, int tileY) const {
+    if (tileX < 0 || tileY < 0 || tileX >= width || tileY >= height) {
+      return false;
+    }
+    return viewCount[playerIndex][tileY * width + tileX] > 0;
+  }
+  
+  /// Returns whether any tile within the given rectangle is currently seen by the given player.
+  bool IsAreaVisible(int playerIndex, const QRect& tileRect) const;
+  
+ private:
+  int width;
+  int height;
+  
+  /// For each player, a 2D array storing the number of objects that see each tile.
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<std::vector<u16>> viewCount;
+};
@@ -2,12 +2,20 @@
 // This file is part of FreeAge, licensed under the new BSD license.
 // See the COPYING file in the project root for the license text.
 
+#include <algorithm>
+
 #include <gtest/gtest.h>
 #include <QApplication>
 
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/occupancy_bitmap.hpp"
 #include "FreeAge/common/player.hpp"
 #include "FreeAge/client/map.hpp"
+#include "FreeAge/client/projected_object_grid.hpp"
+#include "FreeAge/client/sprite.hpp"
+#include "FreeAge/client/sprite_decoding.hpp"
+#include "FreeAge/server/fixed_point.hpp"
+#include "FreeAge/server/map.hpp"
 
 int main(int argc, char** argv) {
   // Initialize loguru
@@ -81,6 +89,79 @@ TEST(Map, CoordinateConversion_HillyMap) {
   TestProjectedCoordToMapCoord(testMap);
 }
 
+/// Returns the sorted IDs of the objects that the grid returns for the given rect.
+static std::vector<u32> QueryObjectIds(const ProjectedObjectGrid& grid, const QRectF& rect) {
+  std::vector<std::pair<u32, ClientObject*>> objects;
+  grid.Query(rect, &objects);
+  std::vector<u32> ids;
+  for (const auto& item : objects) {
+    ids.push_back(item.first);
+  }
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+TEST(ProjectedObjectGrid, Operations) {
+  QRectF unusedSpriteBounds;
+  ClientObject small(ObjectType::Unit, 0, 1, unusedSpriteBounds);
+  ClientObject large(ObjectType::Building, 0, 1, unusedSpriteBounds);
+  ClientObject outside(ObjectType::Unit, 0, 1, unusedSpriteBounds);
+  
+  ProjectedObjectGrid grid;
+  grid.Reset(QRectF(-512, -512, 1024, 1024));
+  
+  grid.Insert(1, &small, QRectF(10, 10, 20, 20));
+  // Spans many cells, but must only be returned once.
+  grid.Insert(2, &large, QRectF(-400, -400, 800, 800));
+  // Outside of the grid's area, thus stored in the border cells.
+  grid.Insert(3, &outside, QRectF(2000, 2000, 10, 10));
+  EXPECT_EQ(3u, grid.GetNumObjects());
+  
+  EXPECT_EQ(std::vector<u32>({1, 2}), QueryObjectIds(grid, QRectF(0, 0, 100, 100)));
+  EXPECT_EQ(std::vector<u32>({2}), QueryObjectIds(grid, QRectF(-300, -300, 600, 100)));
+  EXPECT_EQ(std::vector<u32>({2, 3}), QueryObjectIds(grid, QRectF(300, 300, 2000, 2000)));
+  EXPECT_EQ(std::vector<u32>(), QueryObjectIds(grid, QRectF(-3000, 500, 10, 10)));
+  
+  // Move the small object within its cell, and then into another cell.
+  grid.Update(&small, QRectF(40, 40, 20, 20));
+  EXPECT_EQ(std::vector<u32>({2}), QueryObjectIds(grid, QRectF(0, 0, 5, 5)));
+  EXPECT_EQ(std::vector<u32>({1, 2}), QueryObjectIds(grid, QRectF(50, 50, 1, 1)));
+  grid.Update(&small, QRectF(450, 450, 20, 20));
+  EXPECT_EQ(std::vector<u32>({2}), QueryObjectIds(grid, QRectF(50, 50, 1, 1)));
+  EXPECT_EQ(std::vector<u32>({1}), QueryObjectIds(grid, QRectF(460, 460, 1, 1)));
+  
+  grid.Remove(&large);
+  EXPECT_EQ(2u, grid.GetNumObjects());
+  EXPECT_EQ(std::vector<u32>({1, 3}), QueryObjectIds(grid, QRectF(-1000, -1000, 4000, 4000)));
+  
+  grid.Clear();
+  EXPECT_EQ(0u, grid.GetNumObjects());
+  EXPECT_EQ(std::vector<u32>(), QueryObjectIds(grid, QRectF(-1000, -1000, 4000, 4000)));
+}
+
+TEST(OccupancyBitmap, Operations) {
+  OccupancyBitmap bitmap;
+  bitmap.Resize(130, 5);
+  EXPECT_FALSE(bitmap.IsAnySetInRect(QRect(0, 0, 130, 5)));
+  
+  // Spans all three words of a row.
+  bitmap.SetRect(QRect(60, 1, 70, 2), true);
+  EXPECT_TRUE(bitmap.Get(60, 1));
+  EXPECT_TRUE(bitmap.Get(129, 2));
+  EXPECT_FALSE(bitmap.Get(59, 1));
+  EXPECT_FALSE(bitmap.Get(60, 3));
+  EXPECT_TRUE(bitmap.IsAnySetInRect(QRect(128, 2, 10, 10)));
+  EXPECT_FALSE(bitmap.IsAnySetInRect(QRect(0, 0, 60, 5)));
+  
+  bitmap.SetRect(QRect(64, 1, 64, 2), false);
+  EXPECT_TRUE(bitmap.IsAnySetInRect(QRect(63, 1, 1, 1)));
+  EXPECT_FALSE(bitmap.IsAnySetInRect(QRect(64, 0, 64, 5)));
+  EXPECT_TRUE(bitmap.IsAnySetInRect(QRect(128, 1, 1, 1)));
+  
+  bitmap.Clear();
+  EXPECT_FALSE(bitmap.IsAnySetInRect(QRect(0, 0, 130, 5)));
+}
+
 TEST(PlayerStats, Operations) {
 
   PlayerStats stats;
@@ -101,6 +182,8 @@ TEST(PlayerStats, Operations) {
   EXPECT_EQ(stats.GetPopulationCount(), 2);
   EXPECT_EQ(stats.GetBuildingTypeCount(BuildingType::Barracks), 1);
   EXPECT_TRUE(stats.GetBuildingTypeExisted(BuildingType::Barracks));
+  EXPECT_EQ(stats.GetBuildingCount(), 4);
+  EXPECT_EQ(stats.GetUnitCount(), 2);
 
   stats.BuildingRemoved(BuildingType::House, true);
   stats.BuildingRemoved(BuildingType::Barracks, true);
@@ -111,5 +194,146 @@ TEST(PlayerStats, Operations) {
   EXPECT_EQ(stats.GetPopulationCount(), 1);
   EXPECT_EQ(stats.GetBuildingTypeCount(BuildingType::Barracks), 0);
   EXPECT_TRUE(stats.GetBuildingTypeExisted(BuildingType::Barracks));
+  EXPECT_EQ(stats.GetBuildingCount(), 2);
+  EXPECT_EQ(stats.GetUnitCount(), 1);
+  EXPECT_EQ(stats.GetObjectCount(), 3);
+
+}
+
+/// Decodes random SMX pixel data with the per-pixel reference functions in sprite.hpp
+/// and with the batch decoding functions (for all supported paths), and verifies that
+/// the results are bit-exact.
+static void TestBatchPixelDecoding(bool usesEightToFiveCompression) {
+  srand(0);
+  
+  constexpr int kNumPixels = 10000;
+  std::vector<u8> pixelData(5 * kNumPixels);
+  for (u8& value : pixelData) {
+    value = rand() % 256;
+  }
+  
+  // Use a palette that covers all 10-bit indices. Out-of-bounds indices are tested in BatchPixelDecoding_OutOfRange.
+  Palette palette(1024);
+  for (QRgb& color : palette) {
+    color = qRgba(rand() % 256, rand() % 256, rand() % 256, rand() % 256);
+  }
+  
+  // Split the pixels into runs with random lengths and random palette choices.
+  std::vector<int> runLengths;
+  std::vector<bool> runUsesPlayerColor;
+  for (int pixelCount = 0; pixelCount < kNumPixels; ) {
+    int runLength = std::min(kNumPixels - pixelCount, 1 + rand() % kMaxSMXPixelRunLength);
+    runLengths.push_back(runLength);
+    runUsesPlayerColor.push_back(rand() % 4 == 0);
+    pixelCount += runLength;
+  }
+  
+  std::vector<QRgb> expected(kNumPixels);
+  const u8* pixelPtr = pixelData.data();
+  int decompressionState = 0;
+  int pixel = 0;
+  for (usize run = 0; run < runLengths.size(); ++ run) {
+    const Palette* runPalette = runUsesPlayerColor[run] ? nullptr : &palette;
+    for (int i = 0; i < runLengths[run]; ++ i) {
+      expected[pixel] = usesEightToFiveCompression ?
+          DecompressNextPixel8To5(pixelPtr, decompressionState, runPalette, true) :
+          DecompressNextPixel4Plus1(pixelPtr, decompressionState, runPalette, true);
+      ++ pixel;
+    }
+  }
+  const u8* expectedEndPtr = pixelPtr;
+  
+  for (PixelDecodingPath path : {PixelDecodingPath::Scalar, PixelDecodingPath::SSE2, PixelDecodingPath::AVX2}) {
+    if (!IsPixelDecodingPathSupported(path)) {
+      LOG(INFO) << "Skipping unsupported pixel decoding path " << static_cast<int>(path);
+      continue;
+    }
+    
+    std::vector<QRgb> result(kNumPixels);
+    u16 runIndices[kMaxSMXPixelRunLength];
+    pixelPtr = pixelData.data();
+    decompressionState = 0;
+    pixel = 0;
+    for (usize run = 0; run < runLengths.size(); ++ run) {
+      if (usesEightToFiveCompression) {
+        UnpackPixels8To5(pixelPtr, decompressionState, runLengths[run], runIndices);
+      } else {
+        UnpackPixels4Plus1(pixelPtr, decompressionState, runLengths[run], runIndices);
+      }
+      if (runUsesPlayerColor[run]) {
+        ExpandPlayerColorPixels(runIndices, runLengths[run], result.data() + pixel, path);
+      } else {
+        ExpandPalettedPixels(runIndices, runLengths[run], palette.data(), palette.size(), result.data() + pixel, path);
+      }
+      pixel += runLengths[run];
+    }
+    
+    EXPECT_EQ(expectedEndPtr, pixelPtr) << "path: " << static_cast<int>(path);
+    for (int i = 0; i < kNumPixels; ++ i) {
+      EXPECT_EQ(expected[i], result[i]) << "path: " << static_cast<int>(path) << ", pixel: " << i;
+    }
+  }
+}
+
+TEST(Sprite, BatchPixelDecoding_8To5) {
+  TestBatchPixelDecoding(true);
+}
 
-}
\ No newline at end of file
+TEST(Sprite, BatchPixelDecoding_4Plus1) {
+  TestBatchPixelDecoding(false);
+}
+
+TEST(Sprite, BatchPixelDecoding_OutOfRange) {
+  Palette palette(16);
+  for (int i = 0; i < static_cast<int>(palette.size()); ++ i) {
+    palette[i] = qRgb(i, 2 * i, 3 * i);
+  }
+  
+  // The out-of-bounds indices are placed both in the vectorized part and in the remainder of the run.
+  const u16 indices[] = {0, 1, 2, 3, 4, 16, 5, 6, 7, 8, 9, 1023, 10, 17};
+  constexpr int kCount = sizeof(indices) / sizeof(indices[0]);
+  
+  for (PixelDecodingPath path : {PixelDecodingPath::Scalar, PixelDecodingPath::SSE2, PixelDecodingPath::AVX2}) {
+    if (!IsPixelDecodingPathSupported(path)) {
+      continue;
+    }
+    
+    QRgb result[kCount];
+    ExpandPalettedPixels(indices, kCount, palette.data(), palette.size(), result, path);
+    for (int i = 0; i < kCount; ++ i) {
+      QRgb expected = (indices[i] < palette.size()) ? palette[indices[i]] : qRgba(0, 0, 0, 0);
+      EXPECT_EQ(expected, result[i]) << "path: " << static_cast<int>(path) << ", index: " << indices[i];
+    }
+  }
+}
+
+TEST(FixedPoint, SinCos) {
+  for (i64 raw = -2 * Fixed::kOne; raw <= 2 * Fixed::kOne; raw += 37) {
+    Fixed sine;
+    Fixed cosine;
+    SinCos(Fixed::FromRaw(raw), &sine, &cosine);
+    double angle = 2 * M_PI * raw / static_cast<double>(Fixed::kOne);
+    EXPECT_NEAR(std::sin(angle), sine.ToDouble(), 1e-4) << "raw: " << raw;
+    EXPECT_NEAR(std::cos(angle), cosine.ToDouble(), 1e-4) << "raw: " << raw;
+  }
+}
+
+TEST(ServerMap, VillagerSpawnPositions) {
+  // The villager spawn positions must not depend on the platform (e.g., on its libm),
+  // since replays only store the map seed. The whole map generation cannot be tested here since
+  // it depends on the building sizes from the game data, so this tests the spawn position candidates
+  // that GenerateRandomMap() computes for the villagers around a town center.
+  ServerMap map(64, 64);
+  map.SeedRandomEngine(1234);
+  
+  FixedPoint townCenterCenter(Fixed(22), Fixed::FromFraction(41, 2));
+  const i64 expectedRaw[3][2] = {
+      {1247582, 1681999},
+      {1305291, 1667238},
+      {1561471, 1666989}};
+  for (int villager = 0; villager < 3; ++ villager) {
+    FixedPoint spawnLoc = map.GetRandomPointAround(townCenterCenter, Fixed(4), Fixed(2));
+    EXPECT_EQ(expectedRaw[villager][0], spawnLoc.x.GetRaw()) << "villager: " << villager;
+    EXPECT_EQ(expectedRaw[villager][1], spawnLoc.y.GetRaw()) << "villager: " << villager;
+  }
+}